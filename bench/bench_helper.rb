@@ -0,0 +1,149 @@
+$LOAD_PATH.unshift(File.expand_path('../../lib', __FILE__))
+$LOAD_PATH.unshift(File.expand_path('../../ext', __FILE__))
+$LOAD_PATH.uniq!
+
+require 'rubygems'
+require 'json'
+require 'zookeeper'
+
+# the spec suite's notion of where the test server lives (and whether we
+# spawn one), so `SPAWN_ZOOKEEPER=1` means the same thing here
+require File.expand_path('../../spec/support/10_spawn_zookeeper', __FILE__)
+
+module Zookeeper
+  module Bench
+    ROOT = '/zkbench'
+
+    def self.now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    # comma separated list from the environment, or the default
+    def self.env_list(name, default)
+      (v = ENV[name]) ? v.split(',').map(&:strip) : default
+    end
+
+    def self.env_ints(name, default)
+      env_list(name, default).map(&:to_i)
+    end
+
+    # runs the block with a server listening on Zookeeper.default_cnx_str,
+    # spawning one the way spec_helper.rb does if SPAWN_ZOOKEEPER is set
+    def self.with_server
+      return yield unless Zookeeper.spawn_zookeeper?
+
+      require 'zk-server'
+
+      ZK::Server.run do |c|
+        c.base_dir    = File.expand_path('../../.zkserver-bench', __FILE__)
+        c.client_port = Zookeeper.test_port
+        c.force_sync  = false
+        c.snap_count  = 1_000_000
+      end
+
+      begin
+        yield
+      ensure
+        ZK::Server.shutdown
+      end
+    end
+
+    # latencies (in seconds) of one scenario
+    class Samples
+      attr_reader :errors
+
+      def initialize
+        @latencies = []
+        @errors = 0
+        @mutex = Mutex.new
+      end
+
+      def record(latency, rc)
+        @mutex.synchronize do
+          @latencies << latency
+          @errors += 1 unless rc == Zookeeper::Constants::ZOK
+        end
+      end
+
+      def count
+        @latencies.length
+      end
+
+      # nearest-rank percentile, in milliseconds
+      def percentile(sorted, p)
+        return nil if sorted.empty?
+        sorted[((p / 100.0) * (sorted.length - 1)).round] * 1000.0
+      end
+
+      def to_hash(elapsed)
+        sorted = @latencies.sort
+
+        { :ops         => count,
+          :errors      => errors,
+          :elapsed_s   => elapsed.round(6),
+          :ops_per_sec => elapsed > 0 ? (count / elapsed).round(1) : nil,
+          :latency_ms  => {
+            :p50  => round(percentile(sorted, 50)),
+            :p99  => round(percentile(sorted, 99)),
+            :p999 => round(percentile(sorted, 99.9)),
+            :max  => round(sorted.last && sorted.last * 1000.0),
+          } }
+      end
+
+      private
+        def round(v)
+          v && v.round(4)
+        end
+    end
+
+    # results of a whole run, written out as JSON so runs on different
+    # commits can be diffed
+    class Report
+      # the block, if given, formats the progress line printed per result
+      def initialize(&formatter)
+        @results = []
+        @formatter = formatter || method(:format_line)
+      end
+
+      def <<(result)
+        @results << result
+        $stderr.puts(@formatter.call(result)) unless ENV['BENCH_QUIET']
+      end
+
+      def to_hash
+        { :commit    => git_commit,
+          :ruby      => "#{RUBY_ENGINE} #{RUBY_VERSION}p#{RUBY_PATCHLEVEL}",
+          :platform  => RUBY_PLATFORM,
+          :host      => Zookeeper.default_cnx_str,
+          :timestamp => Time.now.utc.strftime('%Y-%m-%dT%H:%M:%SZ'),
+          :results   => @results }
+      end
+
+      def write(path)
+        json = JSON.pretty_generate(to_hash)
+
+        if path.nil? or path == '-'
+          puts json
+        else
+          File.open(path, 'w') { |f| f.puts(json) }
+          $stderr.puts "wrote #{path}"
+        end
+      end
+
+      private
+        def git_commit
+          sha = `git -C "#{Zookeeper::ZOOKEEPER_ROOT}" rev-parse HEAD 2>/dev/null`.strip
+          sha.empty? ? nil : sha
+        rescue SystemCallError
+          nil
+        end
+
+        def format_line(r)
+          lat = r[:latency_ms]
+          "%-12s %-5s size=%-6s children=%-6s threads=%-3s %10.1f ops/s  p50=%.3fms p99=%.3fms p999=%.3fms%s" % [
+            r[:op], r[:mode], r[:payload_size], r[:children], r[:concurrency], r[:ops_per_sec] || 0,
+            lat[:p50] || 0, lat[:p99] || 0, lat[:p999] || 0, r[:errors] > 0 ? "  errors=#{r[:errors]}" : '']
+        end
+    end
+  end
+end
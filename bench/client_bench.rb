@@ -0,0 +1,254 @@
+# Throughput and latency of the client hot paths.
+#
+# Runs every combination of op, call mode, payload size, children count and
+# concurrency against one connection and reports ops/sec and p50/p99/p999
+# latency for each, as JSON.
+#
+#   rake bench                                  # spawn a server, write tmp/bench-*.json
+#   SPAWN_ZOOKEEPER= ruby bench/client_bench.rb # use the server on localhost:2181
+#
+# knobs (comma separated lists where it makes sense):
+#
+#   BENCH_OPS         get,set,create,delete,get_children,exists
+#   BENCH_MODES       sync,async,pipeline
+#   BENCH_SIZES       payload sizes in bytes (get/set/create)        0,1024,65536
+#   BENCH_CHILDREN    number of children (get_children)              10,1000
+#   BENCH_THREADS     caller threads sharing the connection          1,4,16
+#   BENCH_ITERATIONS  timed ops per scenario, across all threads     2000
+#   BENCH_WARMUP      untimed ops before each scenario               100
+#   BENCH_WINDOW      outstanding async (or pipelined) requests      64
+#                     per thread
+#   BENCH_OUTPUT      where to write the JSON, '-' for stdout
+#
+# sync calls go through CZookeeper#submit_and_block, async ones hand a
+# callback to the same entry points and measure submit-to-callback time,
+# pipelined ones are sent BENCH_WINDOW at a time through ClientMethods#pipeline
+# and measure flush-to-value time.
+
+require File.expand_path('../bench_helper', __FILE__)
+
+module Zookeeper
+  module Bench
+    class ClientBench
+      OPS = %w[get set create delete get_children exists]
+
+      MODES = %w[sync async pipeline]
+
+      # ops whose cost depends on the payload size
+      SIZED_OPS = %w[get set create]
+
+      attr_reader :report
+
+      def initialize(zk)
+        @zk         = zk
+        @report     = Report.new
+        @ops        = Bench.env_list('BENCH_OPS', OPS)
+        @modes      = Bench.env_list('BENCH_MODES', MODES)
+        @sizes      = Bench.env_ints('BENCH_SIZES', %w[0 1024 65536])
+        @children   = Bench.env_ints('BENCH_CHILDREN', %w[10 1000])
+        @threads    = Bench.env_ints('BENCH_THREADS', %w[1 4 16])
+        @iterations = Integer(ENV['BENCH_ITERATIONS'] || 2000)
+        @warmup     = Integer(ENV['BENCH_WARMUP'] || 100)
+        @window     = Integer(ENV['BENCH_WINDOW'] || 64)
+        @seq        = 0
+
+        unknown = @ops - OPS
+        raise ArgumentError, "unknown ops: #{unknown.join(', ')}" unless unknown.empty?
+
+        unknown = @modes - MODES
+        raise ArgumentError, "unknown modes: #{unknown.join(', ')}" unless unknown.empty?
+      end
+
+      def run
+        rm_rf(ROOT)
+        mkdir(ROOT)
+
+        @ops.each do |op|
+          sizes    = SIZED_OPS.include?(op) ? @sizes : [0]
+          children = (op == 'get_children') ? @children : [0]
+
+          @modes.each do |mode|
+            sizes.each do |size|
+              children.each do |nchildren|
+                @threads.each do |nthreads|
+                  @report << scenario(op, mode.to_sym, size, nchildren, nthreads)
+                end
+              end
+            end
+          end
+        end
+
+        report
+      ensure
+        rm_rf(ROOT)
+      end
+
+      private
+        def scenario(op, mode, size, nchildren, nthreads)
+          dir = "#{ROOT}/run-#{@seq += 1}"
+          mkdir(dir)
+
+          payload = 'x' * size
+          target  = prepare(op, dir, payload, nchildren, nthreads)
+
+          # warm up outside the timed section so connection setup, method
+          # caches etc. don't end up in the first scenario's numbers
+          drive(op, mode, dir, payload, target, 1, [@warmup, @iterations].min, 'w') if @warmup > 0 and op !~ /create|delete/
+
+          samples = Samples.new
+          started = Bench.now
+          drive(op, mode, dir, payload, target, nthreads, @iterations, 't', samples)
+          elapsed = Bench.now - started
+
+          { :op           => op,
+            :mode         => mode,
+            :payload_size => size,
+            :children     => nchildren,
+            :concurrency  => nthreads,
+          }.merge(samples.to_hash(elapsed))
+        ensure
+          rm_rf(dir)
+        end
+
+        # sets up what the op works on and returns the path it reads
+        def prepare(op, dir, payload, nchildren, nthreads)
+          case op
+          when 'get', 'set', 'exists'
+            create("#{dir}/node", payload)
+          when 'get_children'
+            create_children(dir, nchildren)
+            dir
+          when 'delete'
+            # one node per timed delete
+            create_children(dir, @iterations, 't')
+            dir
+          else
+            dir
+          end
+        end
+
+        # runs iterations ops spread over nthreads threads
+        def drive(op, mode, dir, payload, target, nthreads, iterations, prefix, samples = Samples.new)
+          per_thread = Array.new(nthreads) { |t| iterations / nthreads + (t < iterations % nthreads ? 1 : 0) }
+
+          threads = per_thread.each_with_index.map do |n, t|
+            Thread.new do
+              first = per_thread[0, t].inject(0, :+)
+              requests = (first...(first + n)).map { |i| request(op, dir, payload, target, "#{prefix}#{i}") }
+              __send__("run_#{mode}", requests, samples)
+            end
+          end
+
+          threads.each(&:join)
+          samples
+        end
+
+        # [method, options] for one op
+        def request(op, dir, payload, target, name)
+          case op
+          when 'get'          then [:get,          { :path => target }]
+          when 'exists'       then [:stat,         { :path => target }]
+          when 'set'          then [:set,          { :path => target, :data => payload }]
+          when 'get_children' then [:get_children, { :path => target }]
+          when 'create'       then [:create,       { :path => "#{dir}/#{name}", :data => payload }]
+          when 'delete'       then [:delete,       { :path => "#{dir}/#{name}" }]
+          end
+        end
+
+        def run_sync(requests, samples)
+          requests.each do |meth, opts|
+            t0 = Bench.now
+            rv = @zk.__send__(meth, opts)
+            samples.record(Bench.now - t0, rv[:rc])
+          end
+        end
+
+        # keeps up to @window requests outstanding
+        def run_async(requests, samples)
+          done = Queue.new
+          outstanding = 0
+
+          requests.each do |meth, opts|
+            if outstanding >= @window
+              samples.record(*done.pop)
+              outstanding -= 1
+            end
+
+            outstanding += 1 if submit_async(meth, opts, done, samples)
+          end
+
+          outstanding.times { samples.record(*done.pop) }
+        end
+
+        def run_pipeline(requests, samples)
+          requests.each_slice(@window) do |slice|
+            pipeline = @zk.pipeline
+            futures = slice.map { |meth, opts| pipeline.__send__(meth, opts) }
+
+            t0 = Bench.now
+            pipeline.flush!
+            futures.each { |f| samples.record(Bench.now - t0, f.value[:rc]) }
+          end
+        end
+
+        def submit_async(meth, opts, done, samples)
+          t0 = Bench.now
+          cb = lambda { |hash| done << [Bench.now - t0, hash[:rc]] }
+          rv = @zk.__send__(meth, opts.merge(:callback => cb))
+
+          return true if rv[:rc] == Zookeeper::Constants::ZOK
+
+          samples.record(Bench.now - t0, rv[:rc])
+          false
+        end
+
+        def create(path, data = '')
+          rc = @zk.create(:path => path, :data => data)[:rc]
+          raise "could not create #{path}: #{rc}" unless rc == Zookeeper::Constants::ZOK
+          path
+        end
+
+        def mkdir(path)
+          rc = @zk.create(:path => path)[:rc]
+          raise "could not create #{path}: #{rc}" unless [Zookeeper::Constants::ZOK, Zookeeper::Constants::ZNODEEXISTS].include?(rc)
+        end
+
+        # creates n children in transactions of up to 500, falling back to
+        # one create at a time where multi isn't available
+        def create_children(dir, n, prefix = 'c')
+          names = (0...n).map { |i| "#{dir}/#{prefix}#{i}" }
+
+          names.each_slice(500) do |slice|
+            rc = @zk.multi { |m| slice.each { |path| m.create(:path => path) } }[:rc]
+            next if rc == Zookeeper::Constants::ZOK
+            raise "could not create children of #{dir}: #{rc}" unless rc == Zookeeper::Constants::ZUNIMPLEMENTED
+
+            slice.each { |path| create(path) }
+          end
+        end
+
+        def rm_rf(path)
+          rv = @zk.get_children(:path => path)
+          return unless rv[:rc] == Zookeeper::Constants::ZOK
+
+          rv[:children].each { |child| rm_rf("#{path}/#{child}") }
+          @zk.delete(:path => path)
+        end
+    end
+  end
+end
+
+if $0 == __FILE__
+  output = ENV['BENCH_OUTPUT']
+
+  Zookeeper::Bench.with_server do
+    zk = Zookeeper.new(Zookeeper.default_cnx_str)
+
+    begin
+      raise "could not connect to #{Zookeeper.default_cnx_str}" unless zk.connected?
+      Zookeeper::Bench::ClientBench.new(zk).run.write(output)
+    ensure
+      zk.close
+    end
+  end
+end
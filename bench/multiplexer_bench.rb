@@ -0,0 +1,159 @@
+# Sessions and latency of forked workers with a session each, against the
+# same workers sharing one through a Zookeeper::Multiplexer.
+#
+# Forks BENCH_WORKERS processes the way a preforking server does. Each one
+# connects (the reopen after the fork, timed), waits for the others, then
+# makes BENCH_ITERATIONS sync gets of one node from BENCH_THREADS threads.
+# Reports the number of distinct sessions the workers ended up with, the
+# connect latency, and the gets' ops/sec and p50/p99/p999 latency, as JSON.
+#
+#   SPAWN_ZOOKEEPER=1 ruby bench/multiplexer_bench.rb
+#   SPAWN_ZOOKEEPER= ruby bench/multiplexer_bench.rb  # use the server on localhost:2181
+#
+# knobs (comma separated lists where it makes sense):
+#
+#   BENCH_MODES       direct,multiplexed
+#   BENCH_WORKERS     forked worker processes                 8,32
+#   BENCH_THREADS     caller threads in each worker           1,4
+#   BENCH_ITERATIONS  timed gets per worker                   1000
+#   BENCH_OUTPUT      where to write the JSON, '-' (the default) for stdout
+
+require File.expand_path('../bench_helper', __FILE__)
+require 'tmpdir'
+
+module Zookeeper
+  module Bench
+    class MultiplexerBench
+      MODES = %w[direct multiplexed]
+
+      PATH = "#{ROOT}-multiplexer"
+
+      def initialize(host)
+        @host       = host
+        @modes      = Bench.env_list('BENCH_MODES', MODES)
+        @workers    = Bench.env_ints('BENCH_WORKERS', %w[8 32])
+        @threads    = Bench.env_ints('BENCH_THREADS', %w[1 4])
+        @iterations = Integer(ENV['BENCH_ITERATIONS'] || 1000)
+        @socket     = File.join(Dir.tmpdir, "zkrb-bench-#{Process.pid}.sock")
+
+        @report = Report.new do |r|
+          lat = r[:latency_ms]
+          "%-12s workers=%-4s threads=%-3s sessions=%-4s connect p50=%.3fms p99=%.3fms  %10.1f gets/s  p50=%.3fms p99=%.3fms p999=%.3fms%s" % [
+            r[:mode], r[:workers], r[:threads], r[:sessions], r[:connect_ms][:p50] || 0, r[:connect_ms][:p99] || 0,
+            r[:ops_per_sec] || 0, lat[:p50] || 0, lat[:p99] || 0, lat[:p999] || 0, r[:errors] > 0 ? "  errors=#{r[:errors]}" : '']
+        end
+
+        unknown = @modes - MODES
+        raise ArgumentError, "unknown modes: #{unknown.join(', ')}" unless unknown.empty?
+      end
+
+      def run
+        mux = Multiplexer.spawn(@host, @socket) if @modes.include?('multiplexed')
+
+        @modes.each do |mode|
+          @workers.each do |nworkers|
+            @threads.each do |nthreads|
+              @report << scenario(mode, nworkers, nthreads)
+            end
+          end
+        end
+
+        @report
+      ensure
+        if mux
+          Process.kill(:TERM, mux)
+          Process.wait(mux)
+        end
+      end
+
+      private
+        def scenario(mode, nworkers, nthreads)
+          start_r, start_w = IO.pipe
+          pipes = Array.new(nworkers) { IO.pipe }
+
+          pids = pipes.map do |results_r, results_w|
+            fork do
+              start_w.close
+              pipes.each { |r, _| r.close }
+              worker(mode, nthreads, results_w, start_r)
+            end
+          end
+
+          start_r.close
+          pipes.each { |_, w| w.close }
+
+          # every worker has connected once its connect time comes in
+          sessions = []
+          connects = Samples.new
+          pipes.each do |results_r, _|
+            session_id, connect_s = Marshal.load(results_r)
+            sessions << session_id
+            connects.record(connect_s, Zookeeper::Constants::ZOK)
+          end
+
+          samples = Samples.new
+          started = Bench.now
+          start_w.close
+
+          pipes.each do |results_r, _|
+            Marshal.load(results_r).each { |latency, rc| samples.record(latency, rc) }
+          end
+
+          elapsed = Bench.now - started
+          pids.each { |pid| Process.wait(pid) }
+
+          { :mode       => mode,
+            :workers    => nworkers,
+            :threads    => nthreads,
+            :sessions   => sessions.compact.uniq.length,
+            :connect_ms => connects.to_hash(1)[:latency_ms],
+          }.merge(samples.to_hash(elapsed))
+        ensure
+          ([start_r, start_w] + pipes.flatten).each { |io| io.close unless io.closed? }
+        end
+
+        def worker(mode, nthreads, results, start)
+          t0 = Bench.now
+          opts = mode == 'multiplexed' ? { :multiplexer => @socket } : {}
+          zk = Zookeeper.new(@host, 10, nil, opts)
+          Marshal.dump([zk.session_id, Bench.now - t0], results)
+          results.flush
+
+          start.read    # EOF once every worker is connected
+
+          per_thread = Array.new(nthreads) { |t| @iterations / nthreads + (t < @iterations % nthreads ? 1 : 0) }
+          samples = per_thread.map do |n|
+            Thread.new do
+              Array.new(n) do
+                t = Bench.now
+                rc = zk.get(:path => PATH)[:rc]
+                [Bench.now - t, rc]
+              end
+            end
+          end.map(&:value).flatten(1)
+
+          Marshal.dump(samples, results)
+          results.flush
+          zk.close
+        ensure
+          exit!(0)
+        end
+    end
+  end
+end
+
+if $0 == __FILE__
+  Zookeeper::Bench.with_server do
+    zk = Zookeeper.new(Zookeeper.default_cnx_str)
+
+    begin
+      raise "could not connect to #{Zookeeper.default_cnx_str}" unless zk.connected?
+      zk.create(:path => Zookeeper::Bench::MultiplexerBench::PATH, :data => 'x' * 64)
+
+      Zookeeper::Bench::MultiplexerBench.new(Zookeeper.default_cnx_str).run.write(ENV['BENCH_OUTPUT'])
+    ensure
+      zk.delete(:path => Zookeeper::Bench::MultiplexerBench::PATH) rescue nil
+      zk.close
+    end
+  end
+end
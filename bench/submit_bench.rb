@@ -0,0 +1,98 @@
+# Per-call cost of handing an async request to zkc.
+#
+# Calls CZookeeper#zkrb_* straight from the benchmark thread, so none of the
+# continuation layer or event thread handoff ends up in the numbers: what's
+# left is the method call, argument checks, the calling context allocation
+# and the zkrb_call_zoo_a* -> zoo_a* submission. Completions are drained
+# between batches and not timed.
+#
+#   ruby bench/submit_bench.rb
+#
+#   SUBMIT_CALLS   timed submissions per op       100000
+#   SUBMIT_BATCH   submissions between drains     1000
+#   BENCH_OUTPUT   where to write the JSON, '-' (the default) for stdout
+
+require File.expand_path('../bench_helper', __FILE__)
+
+module Zookeeper
+  module Bench
+    class SubmitBench
+      PATH = "#{ROOT}-submit"
+
+      # name => lambda submitting one async request with the given req_id
+      OPS = {
+        'exists' => lambda { |czk, req_id| czk.zkrb_exists(req_id, PATH, true, false) },
+        'get'    => lambda { |czk, req_id| czk.zkrb_get(req_id, PATH, true, false) },
+        'set'    => lambda { |czk, req_id| czk.zkrb_set(req_id, PATH, 'x', true, -1) },
+      }
+
+      def initialize(czk, queue)
+        @czk    = czk
+        @queue  = queue
+        @calls  = Integer(ENV['SUBMIT_CALLS'] || 100_000)
+        @batch  = Integer(ENV['SUBMIT_BATCH'] || 1000)
+        @req_id = 1_000_000
+        @report = Report.new do |r|
+          "%-8s %8.0f ns/call  (batch p50=%.0f p99=%.0f ns/call)" % [r[:op], r[:ns_per_call], r[:batch_ns_per_call][:p50], r[:batch_ns_per_call][:p99]]
+        end
+      end
+
+      def run
+        OPS.each do |name, submit|
+          run_op(name, submit, [@batch, @calls].min)   # warm up
+
+          per_call = run_op(name, submit, @calls)
+
+          sorted = per_call.sort
+          @report << {
+            :op                => name,
+            :calls             => @calls,
+            :ns_per_call       => (per_call.inject(0.0, :+) / per_call.length).round(1),
+            :batch_ns_per_call => {
+              :p50 => sorted[(0.50 * (sorted.length - 1)).round].round(1),
+              :p99 => sorted[(0.99 * (sorted.length - 1)).round].round(1),
+            },
+          }
+        end
+
+        @report
+      end
+
+      private
+        # returns the ns per call of each batch
+        def run_op(name, submit, calls)
+          per_call = []
+
+          calls.step(1, -@batch) do |left|
+            n = [left, @batch].min
+
+            t0 = Bench.now
+            n.times { submit.call(@czk, @req_id += 1) }
+            per_call << (Bench.now - t0) * 1e9 / n
+
+            n.times { @queue.pop }
+          end
+
+          per_call
+        end
+    end
+  end
+end
+
+if $0 == __FILE__
+  Zookeeper::Bench.with_server do
+    queue = Zookeeper::Common::QueueWithPipe.new
+    czk   = Zookeeper::CZookeeper.new(Zookeeper.default_cnx_str, queue)
+
+    begin
+      czk.wait_until_connected(10)
+      raise "could not connect to #{Zookeeper.default_cnx_str}" unless czk.connected?
+
+      czk.create(0, Zookeeper::Bench::SubmitBench::PATH, '', nil, Zookeeper::ZOO_OPEN_ACL_UNSAFE, 0)
+      Zookeeper::Bench::SubmitBench.new(czk, queue).run.write(ENV['BENCH_OUTPUT'])
+    ensure
+      czk.delete(0, Zookeeper::Bench::SubmitBench::PATH, -1, nil) rescue nil
+      czk.close
+    end
+  end
+end
@@ -21,6 +21,9 @@ class CZookeeper
 
   DEFAULT_RECEIVE_TIMEOUT_MSEC = 10000
 
+  # max number of events taken from the C queue per call into the extension
+  EVENT_BATCH_SIZE = 256
+
   class GotNilEventException < StandardError; end
 
   attr_accessor :original_pid
@@ -36,7 +39,7 @@ class CZookeeper
   end
 
   # wrap these calls in our sync->async special sauce
-  %w[get set exists create delete get_acl set_acl get_children add_auth].each do |sym|
+  %w[get set exists create delete get_acl set_acl get_children add_auth multi get_tree].each do |sym|
     class_eval(<<-EOS, __FILE__, __LINE__+1)
       def #{sym}(*args)
         submit_and_block(:#{sym}, *args)
@@ -85,8 +88,18 @@ class CZookeeper
 
     @event_thread = nil
 
-    # hash of in-flight Continuation instances
-    @reg = Continuation::Registry.new
+    # hash of in-flight Continuation instances. :max_outstanding limits how
+    # many calls may be waiting to be sent or for their response at once,
+    # :backpressure says what happens to the ones over that.
+    # :coalesce_reads => false sends every sync read, even when an identical
+    # one is already waiting for its response
+    @reg = Continuation::Registry.new(
+      :max_outstanding => opts[:max_outstanding], :backpressure => opts[:backpressure],
+      :coalesce_reads => opts.fetch(:coalesce_reads, true))
+
+    # one watch per node and kind on the server, shared by the watched
+    # reads that ask for it while it's set
+    @watches = WatchMultiplexer.new
 
     log_level = ENV['ZKC_DEBUG'] ? ZOO_LOG_LEVEL_DEBUG : ZOO_LOG_LEVEL_ERROR
 
@@ -170,6 +183,37 @@ class CZookeeper
     @state_mutex.synchronize { @state }
   end
 
+  # returns a hash of counters for checking how well wakeups are being
+  # coalesced: +:submits+ sync calls needed only +:wake_writes+ writes to the
+  # self-pipe, the event loop ran +:loop_iterations+ times, +:pipe_wakeups+ of
+  # them because of those writes, and +:events+ completions were delivered.
+  # +:event_loop+ is +:epoll+ or +:select+ (pass +:event_loop => :select+ to
+  # the constructor to force the latter), +:epoll_ctls+ counts changes to the
+  # epoll registrations. When the extension was built with the IO thread
+  # (+CZookeeper::IO_THREAD+), +:io_iterations+ counts turns of its loop and
+  # +:io_wakeups+ those caused by submitted calls.
+  def wakeup_stats
+    zkrb_wakeup_stats.merge(:submits => @reg.submits, :wake_writes => @reg.wake_writes)
+  end
+
+  # returns a hash of counters for the request window: +:queued+ calls are
+  # waiting to be sent, +:in_flight+ waiting for their response, and
+  # +:outstanding+ is both (with a +:max_outstanding+ window, including the
+  # ones the event thread hasn't counted yet). +:blocked+ calls had to wait
+  # for room, +:rejected+ were turned away with RequestRejected, and
+  # +:timeouts+ gave up waiting for their response. +:coalesced+ reads
+  # weren't sent at all, they shared the response to an identical one.
+  def request_stats
+    @reg.stats
+  end
+
+  # the number of watchers on each node that has a watch set, by kind:
+  # +{ path => { :data => n, :child => n } }+. however many there are, the
+  # server has one watch of each kind per node.
+  def watch_subscribers
+    @watches.subscribers
+  end
+
   # this implementation is gross, but i don't really see another way of doing it
   # without more grossness
   #
@@ -199,6 +243,38 @@ class CZookeeper
     connected?
   end
 
+  # hands a batch of continuations to the event thread at once, waking it
+  # (at most) once for all of them. used by Pipeline#flush!
+  #
+  # @private
+  def submit_all(cntns)
+    return if cntns.empty?
+
+    # closed since the ops were queued: fail them the way the event thread
+    # fails whatever it's left holding when it exits
+    if @mutex.synchronize { unhealthy? }
+      cntns.each { |cntn| cntn.shutdown! }
+      return
+    end
+
+    admitted = []
+
+    cntns.each do |cntn|
+      if @reg.admit(cntn, false)
+        admitted << cntn
+        next
+      end
+
+      # no room: send what we have first, it may be what frees some up
+      wake_event_loop! if @reg.push_all(admitted)
+      admitted = []
+
+      @reg.admit(cntn) ? admitted << cntn : cntn.reject!
+    end
+
+    wake_event_loop! if @reg.push_all(admitted)
+  end
+
   private
     # This method is NOT SYNCHRONIZED!
     #
@@ -222,14 +298,17 @@ class CZookeeper
       end
 
       cnt = Continuation.new(meth, *args)
-      @reg.synchronize do |r|
-        if meth == :state
-          r.state_check << cnt
-        else
-          r.pending << cnt
-        end
+
+      # inside a Pipeline op the pipeline sends cnt, along with everything
+      # else it has queued, when the caller first wants one of the results
+      if pipeline = Pipeline.current
+        pipeline.defer(self, cnt)
+      elsif @reg.admit(cnt)
+        wake_event_loop! if @reg.push(cnt)
+      else
+        cnt.reject!
       end
-      wake_event_loop!
+
       cnt.value
     end
 
@@ -254,6 +333,7 @@ class CZookeeper
     # returns false if already running
     def start_event_thread
       return false if @event_thread
+      @reg.reopen!
       @event_thread = Thread.new(&method(:event_thread_body))
     end
 
@@ -277,12 +357,12 @@ class CZookeeper
 
       # this is the main loop
       while healthy?
-        if @reg.anything_to_do? && connected?
-          submit_pending_calls
-        end
+        submit_pending_calls if @reg.anything_to_do? or (!@reg.waiting.empty? and connected?)
 
-        zkrb_iterate_event_loop
+        # don't sleep past the next call's deadline
+        zkrb_iterate_event_loop(@reg.time_to_next_deadline)
         iterate_event_delivery
+        expire_overdue_calls
       end
 
       # ok, if we're exiting the event loop, and we still have a valid connection
@@ -292,21 +372,21 @@ class CZookeeper
         logger.debug { "we're in shutting down state, there are #{@reg.in_flight.length} in_flight completions" }
 
         until @reg.in_flight.empty? or @_closed or is_unrecoverable
-          zkrb_iterate_event_loop
+          zkrb_iterate_event_loop(@reg.time_to_next_deadline)
           iterate_event_delivery
+          expire_overdue_calls
           logger.debug { "there are #{@reg.in_flight} in_flight completions left" }
         end
 
         logger.debug { "finished completions" }
       end
 
-      # anything left over after all that gets the finger
-      remaining = @reg.next_batch + @reg.in_flight.values
+      # anything left over after all that gets the finger, as does anything
+      # submitted from now on
+      remaining = @reg.close!
 
       logger.debug { "there are #{remaining.length} completions to awaken" }
 
-      @reg.in_flight.clear
-
       while cb = remaining.shift
         cb.shutdown!
       end
@@ -319,13 +399,29 @@ class CZookeeper
     def submit_pending_calls
       calls = @reg.next_batch()
 
-      return if calls.empty?
+      # hang on to them (and keep an eye on their deadlines) until we are
+      unless connected?
+        calls.each { |cntn| @reg.wait_for_connection(cntn) }
+        return
+      end
+
+      calls = @reg.take_waiting + calls
 
       while cntn = calls.shift
+        next if @reg.join(cntn)               # an identical read is on its way, wait for that
+        @watches.prepare(cntn)                # if its watch is already set, it shares that one
         cntn.submit(self)                     # this delivers state check results (and does other stuff)
-        if req_id = cntn.req_id               # state checks will not have a req_id
-          @reg.in_flight[req_id] = cntn       # in_flight is only ever touched by us
-        end
+        @reg.sent(cntn)                       # state checks will not have a req_id
+        @watches.sent(cntn)
+      end
+    end
+
+    # fails the calls whose deadline has passed, a response that turns up
+    # later is dropped by iterate_event_delivery
+    def expire_overdue_calls
+      @reg.expire.each do |cntn|
+        logger.debug { "timing out #{cntn.meth} req_id #{cntn.req_id.inspect} after #{cntn.timeout}s" }
+        cntn.timeout!
       end
     end
 
@@ -333,10 +429,21 @@ class CZookeeper
       @pipe_write && !@pipe_write.closed? && @pipe_write.write('1')
     end
 
+    # the wakeup has already been drained, so whatever is left in the queue
+    # would wait for the next one: keep going until a batch comes up short
     def iterate_event_delivery
-      while hash = zkrb_get_next_event_st()
-        logger.debug { "##{__method__} got #{hash.inspect} " }
+      begin
+        events = zkrb_get_next_events_st(EVENT_BATCH_SIZE)
+        deliver_events(events) unless events.empty?
+      end while events.length == EVENT_BATCH_SIZE
+    end
+
+    def deliver_events(events)
+      logger.debug { "##{__method__} got #{events.length} events" }
 
+      for_dispatch = []
+
+      events.each do |hash|
         if (hash[:req_id] == ZKRB_GLOBAL_CB_REQ) && (hash[:type] == -1)
           ev_state = hash[:state]
 
@@ -348,7 +455,21 @@ class CZookeeper
           end
         end
 
-        cntn = @reg.in_flight.delete(hash[:req_id])
+        if hash.has_key?(:rc)
+          # the reads that were waiting for this one get the same response,
+          # and share its watch
+          followers = @reg.take_followers(hash[:req_id])
+          @watches.completed(hash[:req_id], hash[:rc], followers)
+          followers.each { |cntn| cntn.share(hash) unless cntn.done? }
+
+          # a sync call whose caller has already been told it timed out
+          next if @reg.abandoned?(hash[:req_id])
+        else
+          # the event for a watch goes to the reads sharing it too
+          fanout = @watches.fire(hash[:req_id], hash)
+        end
+
+        cntn = @reg.complete(hash[:req_id])
 
         if cntn and not cntn.user_callback?     # this is one of "our" continuations
           cntn.call(hash)                       # so we handle delivering it
@@ -357,8 +478,12 @@ class CZookeeper
 
         # otherwise, the event was a session event (ZKRB_GLOBAL_CB_REQ)
         # or a user-provided callback
-        @event_queue.push(hash)
+        for_dispatch << hash
+
+        fanout.each { |req_id| for_dispatch << hash.to_hash.merge(:req_id => req_id) } if fanout
       end
+
+      @event_queue.push_all(for_dispatch) unless for_dispatch.empty?
     end
 
     def event_thread_await_running
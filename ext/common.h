@@ -6,6 +6,14 @@
 //#define THREADED
 #undef THREADED    // we are linking against the zookeeper_st lib, this is crucial
 
+// with ZKRB_IO_THREAD (set by extconf.rb) the st lib is driven by a native
+// thread of ours instead of the ruby event thread, see zkrb_io.h. either way,
+// ZKRB_COMPLETIONS_OFF_GVL means completions don't run on a ruby thread, so
+// they have to queue plain C events instead of building ruby objects.
+#if defined(THREADED) || defined(ZKRB_IO_THREAD)
+#define ZKRB_COMPLETIONS_OFF_GVL 1
+#endif
+
 #ifndef RB_GC_GUARD_PTR
 #define RB_GC_GUARD_PTR(V) (V);
 #endif
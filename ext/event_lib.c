@@ -12,8 +12,9 @@ NOTE: be *very careful* in these functions, calling *ANY* ruby interpreter
 function when you're not in an interpreter thread can hork ruby, trigger a
 [BUG], corrupt the stack, kill your dog, knock up your daughter, etc. etc.
 
-NOTE: the above is only true when you're running in THREADED mode, in 
-single-threaded, everything is called on an interpreter thread.
+NOTE: the above is only true when completions run off the GVL (THREADED, or
+the st lib driven by the IO engine in zkrb_io.c, see ZKRB_COMPLETIONS_OFF_GVL
+in common.h). otherwise everything is called on an interpreter thread.
 
 
 slyphon@gmail.com
@@ -21,18 +22,21 @@ slyphon@gmail.com
 */
 
 #include "ruby.h"
+#include "ruby/util.h"
 #include "zookeeper/zookeeper.h"
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <fcntl.h>
 #include "common.h"
 #include "event_lib.h"
 #include "dbg.h"
 
-#ifndef THREADED
+#if !ZKRB_COMPLETIONS_OFF_GVL
 #define USE_XMALLOC
 #endif
 
@@ -40,24 +44,29 @@ slyphon@gmail.com
 
 int ZKRBDebugging;
 
-#if THREADED
-pthread_mutex_t zkrb_q_mutex = PTHREAD_MUTEX_INITIALIZER;
-#endif
+// the ring counters are only ever touched through these, so that builds where
+// completions run on another thread (zkc's own, or the IO engine's) get the
+// right ordering guarantees. otherwise they're plain loads and stores in all
+// but name.
+#define ZKRB_LOAD_ACQUIRE(ptr)       __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ZKRB_STORE_RELEASE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define ZKRB_CAS(ptr, expected, desired) \
+  __atomic_compare_exchange_n((ptr), (expected), (desired), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
 
-inline static int global_mutex_lock() {
+inline static int queue_mutex_lock(zkrb_queue_t *q) {
   int rv=0;
-#if THREADED
-  rv = pthread_mutex_lock(&zkrb_q_mutex);
-  if (rv != 0) log_err("global_mutex_lock error");
+#if ZKRB_COMPLETIONS_OFF_GVL
+  rv = pthread_mutex_lock(&q->mutex);
+  if (rv != 0) log_err("queue_mutex_lock error");
 #endif
   return rv;
 }
 
-inline static int global_mutex_unlock() {
+inline static int queue_mutex_unlock(zkrb_queue_t *q) {
   int rv=0;
-#if THREADED
-  rv = pthread_mutex_unlock(&zkrb_q_mutex);
-  if (rv != 0) log_err("global_mutex_unlock error");
+#if ZKRB_COMPLETIONS_OFF_GVL
+  rv = pthread_mutex_unlock(&q->mutex);
+  if (rv != 0) log_err("queue_mutex_unlock error");
 #endif
   return rv;
 }
@@ -65,6 +74,11 @@ inline static int global_mutex_unlock() {
 // we can use the ruby xmalloc/xfree that will raise errors
 // in the case of a failure to allocate memory, and can cycle
 // the garbage collector in some cases.
+//
+// not for anything allocated inside a zkc completion though: those run in
+// the middle of zookeeper_process, where raising would leave zkc's state
+// half updated. events, their payloads and the slab they come from use
+// plain malloc/free in every build.
 
 inline static void* zk_malloc(size_t size) {
 #ifdef USE_XMALLOC
@@ -74,6 +88,22 @@ inline static void* zk_malloc(size_t size) {
 #endif
 }
 
+inline static void* zk_calloc(size_t nmemb, size_t size) {
+#ifdef USE_XMALLOC
+  return xcalloc(nmemb, size);
+#else
+  return calloc(nmemb, size);
+#endif
+}
+
+inline static void* zk_realloc(void *ptr, size_t size) {
+#ifdef USE_XMALLOC
+  return xrealloc(ptr, size);
+#else
+  return realloc(ptr, size);
+#endif
+}
+
 inline static void zk_free(void *ptr) {
 #ifdef USE_XMALLOC
   xfree(ptr);
@@ -82,34 +112,110 @@ inline static void zk_free(void *ptr) {
 #endif
 }
 
-void zkrb_enqueue(zkrb_queue_t *q, zkrb_event_t *elt) {
-  if (q == NULL) {
-    zkrb_debug("zkrb_enqueue, queue ptr was NULL");
-    return;
+// try to claim a slot in the ring for elt. returns 0 if the ring is full.
+static int ring_push(zkrb_queue_t *q, zkrb_event_t *elt) {
+  unsigned long pos = ZKRB_LOAD_ACQUIRE(&q->tail);
+  zkrb_ring_slot_t *slot;
+
+  for (;;) {
+    slot = &q->slots[pos & q->mask];
+    long diff = (long)ZKRB_LOAD_ACQUIRE(&slot->seq) - (long)pos;
+
+    if (diff == 0) {
+      if (ZKRB_CAS(&q->tail, &pos, pos + 1)) break;   // pos is reloaded on failure
+    } else if (diff < 0) {
+      return 0;                                       // consumer hasn't caught up
+    } else {
+      pos = ZKRB_LOAD_ACQUIRE(&q->tail);              // another producer beat us
+    }
+  }
+
+  slot->event = elt;
+  ZKRB_STORE_RELEASE(&slot->seq, pos + 1);
+  return 1;
+}
+
+// the slot at the head of the ring, or NULL if nothing has been published there
+inline static zkrb_ring_slot_t *ring_head_slot(zkrb_queue_t *q) {
+  zkrb_ring_slot_t *slot = &q->slots[q->head & q->mask];
+  return (ZKRB_LOAD_ACQUIRE(&slot->seq) == q->head + 1) ? slot : NULL;
+}
+
+static zkrb_event_t *ring_pop(zkrb_queue_t *q) {
+  zkrb_ring_slot_t *slot = ring_head_slot(q);
+  zkrb_event_t *rv = NULL;
+
+  if (slot) {
+    rv = slot->event;
+    slot->event = NULL;
+    ZKRB_STORE_RELEASE(&slot->seq, q->head + q->mask + 1);
+    q->head++;
   }
 
-  if (q->tail == NULL) {
-    zkrb_debug("zkrb_enqeue, q->tail was NULL");
+  return rv;
+}
+
+static void overflow_push(zkrb_queue_t *q, zkrb_event_t *elt) {
+  zkrb_event_ll_t *node = malloc(sizeof(zkrb_event_ll_t));
+
+  if (!node) {
+    log_err("no memory for the overflow list, dropping an event for req_id %"PRId64, elt->req_id);
+    zkrb_event_free(elt);
     return;
   }
 
-  global_mutex_lock();
+  node->event = elt;
+  node->next = NULL;
+
+  if (q->overflow_tail) {
+    q->overflow_tail->next = node;
+  } else {
+    q->overflow_head = node;
+  }
+  q->overflow_tail = node;
+  q->overflow_count++;
+  ZKRB_STORE_RELEASE(&q->overflowed, 1);
+}
+
+static zkrb_event_t *overflow_pop(zkrb_queue_t *q) {
+  zkrb_event_ll_t *node = q->overflow_head;
+  zkrb_event_t *rv = NULL;
+
+  if (node) {
+    rv = node->event;
+    q->overflow_head = node->next;
+    if (q->overflow_head == NULL) {
+      q->overflow_tail = NULL;
+      ZKRB_STORE_RELEASE(&q->overflowed, 0);
+    }
+    free(node);
+  }
 
-  q->tail->event = elt;
-  q->tail->next = (zkrb_event_ll_t *)zk_malloc(sizeof(zkrb_event_ll_t));
-  q->tail = q->tail->next;
-  q->tail->event = NULL;
-  q->tail->next = NULL;
+  return rv;
+}
 
-  global_mutex_unlock();
+void zkrb_enqueue(zkrb_queue_t *q, zkrb_event_t *elt) {
+  if (q == NULL) {
+    zkrb_debug("zkrb_enqueue, queue ptr was NULL");
+    return;
+  }
 
-#if THREADED
-  ssize_t ret = write(q->pipe_write, "0", 1);   /* Wake up Ruby listener */
+  // once we've spilled, everything goes to the overflow list until the
+  // consumer has drained it, otherwise events would be delivered out of order
+  if (ZKRB_LOAD_ACQUIRE(&q->overflowed) || !ring_push(q, elt)) {
+    queue_mutex_lock(q);
 
-  if (ret < 0)
-    log_err("write to queue (%p) pipe failed!\n", q);
-#endif
+    if (q->overflowed || !ring_push(q, elt)) {
+      zkrb_debug("zkrb_enqueue, ring for queue (%p) is full, spilling event to overflow list", q);
+      overflow_push(q, elt);
+    }
 
+    queue_mutex_unlock(q);
+  }
+
+  __atomic_add_fetch(&q->enqueued, 1, __ATOMIC_RELAXED);
+
+  zkrb_signal(q);
 }
 
 // NOTE: the zkrb_event_t* returned *is* the same pointer that's part of the
@@ -119,92 +225,407 @@ void zkrb_enqueue(zkrb_queue_t *q, zkrb_event_t *elt) {
 //
 zkrb_event_t * zkrb_peek(zkrb_queue_t *q) {
   zkrb_event_t *event = NULL;
+  zkrb_ring_slot_t *slot;
 
   if (!q) return NULL;
 
-  global_mutex_lock();
-
-  if (q != NULL && q->head != NULL && q->head->event != NULL) {
-    event = q->head->event;
+  if ((slot = ring_head_slot(q)) != NULL) {
+    event = slot->event;
+  }
+  else if (ZKRB_LOAD_ACQUIRE(&q->overflowed)) {
+    queue_mutex_lock(q);
+    if (q->overflow_head) event = q->overflow_head->event;
+    queue_mutex_unlock(q);
   }
-
-  global_mutex_unlock();
 
   return event;
 }
 
-#define ZKRB_QUEUE_EMPTY(q) (q == NULL || q->head == NULL || q->head->event == NULL)
-
+// must only be called from the consumer side. need_lock may be 0 when the
+// caller knows no producer can be running (i.e. when tearing the queue down)
 zkrb_event_t* zkrb_dequeue(zkrb_queue_t *q, int need_lock) {
   zkrb_event_t *rv = NULL;
-  zkrb_event_ll_t *old_root = NULL;
-    
-  if (need_lock)
-    global_mutex_lock();
 
-  if (!ZKRB_QUEUE_EMPTY(q)) {
-    old_root = q->head;
-    q->head = q->head->next;
-    rv = old_root->event;
-  }
+  if (q == NULL) return NULL;
 
-  if (need_lock)
-    global_mutex_unlock();
+  // the ring always holds the older events, the overflow list is only
+  // looked at once the ring is empty
+  rv = ring_pop(q);
+
+  if (rv == NULL && ZKRB_LOAD_ACQUIRE(&q->overflowed)) {
+    if (need_lock)
+      queue_mutex_lock(q);
+
+    rv = overflow_pop(q);
+
+    if (need_lock)
+      queue_mutex_unlock(q);
+  }
 
-  zk_free(old_root);
   return rv;
 }
 
+// dequeues up to max events into events[], returning how many were taken.
+// like zkrb_dequeue this is consumer-side only, but the overflow list is
+// drained under a single acquisition of the queue's mutex
+int zkrb_dequeue_batch(zkrb_queue_t *q, zkrb_event_t **events, int max) {
+  int n = 0;
+  zkrb_event_t *ev;
+
+  if (q == NULL) return 0;
+
+  while (n < max && (ev = ring_pop(q)) != NULL) {
+    events[n++] = ev;
+  }
+
+  if (n < max && ZKRB_LOAD_ACQUIRE(&q->overflowed)) {
+    queue_mutex_lock(q);
+
+    while (n < max && (ev = overflow_pop(q)) != NULL) {
+      events[n++] = ev;
+    }
+
+    queue_mutex_unlock(q);
+  }
+
+  return n;
+}
+
+// wake the ruby listener, unless it has already been woken and hasn't yet
+// called zkrb_queue_drain_signal
 void zkrb_signal(zkrb_queue_t *q) {
   if (!q) return;
 
-  global_mutex_lock();
+#if ZKRB_COMPLETIONS_OFF_GVL
+  if (__atomic_exchange_n(&q->signalled, 1, __ATOMIC_ACQ_REL) == 0) {
+    __atomic_add_fetch(&q->wakeups, 1, __ATOMIC_RELAXED);
+
+    if (write(q->pipe_write, "0", 1) < 0)      /* Wake up Ruby listener */
+      log_err("zkrb_signal: write to queue (%p) pipe failed, could not wake", q);
+  }
+#endif
+}
+
+// consumer side of zkrb_signal: empty the pipe, *then* re-arm the flag. the
+// caller must check the queue again after this returns, anything enqueued
+// while the flag was still set did not write to the pipe.
+void zkrb_queue_drain_signal(zkrb_queue_t *q) {
+  if (!q) return;
+
+#if ZKRB_COMPLETIONS_OFF_GVL
+  char buf[64];
+  while (read(q->pipe_read, buf, sizeof(buf)) > 0) {}    // pipe_read is O_NONBLOCK
 
-#if THREADED
-  if (!write(q->pipe_write, "0", 1))      /* Wake up Ruby listener */
-    log_err("zkrb_signal: write to pipe failed, could not wake");
+  __atomic_store_n(&q->signalled, 0, __ATOMIC_RELEASE);
 #endif
+}
+
+#if !ZKRB_COMPLETIONS_OFF_GVL
+// direct delivery, see zkrb_queue_t.pending
+void zkrb_deliver(zkrb_queue_t *q, VALUE event) {
+  rb_ary_push(q->pending, event);
+  q->enqueued++;
+}
+
+// returns up to max delivered events (all of them if max < 0), oldest first
+VALUE zkrb_take_events(zkrb_queue_t *q, long max) {
+  zkrb_event_t *event;
+  VALUE rv;
+
+  // what zkrb_direct_deliver couldn't build in the completion
+  while ((event = zkrb_dequeue(q, 0)) != NULL) {
+    zkrb_deliver(q, zkrb_event_to_ruby(event));
+  }
 
-  global_mutex_unlock();
+  if (max < 0 || RARRAY_LEN(q->pending) <= max) {
+    rv = q->pending;
+    q->pending = rb_ary_new();
+    return rv;
+  }
+
+  rv = rb_ary_subseq(q->pending, 0, max);
+  rb_ary_replace(q->pending, rb_ary_subseq(q->pending, max, RARRAY_LEN(q->pending) - max));
+  return rv;
 }
 
-zkrb_event_ll_t *zkrb_event_ll_t_alloc(void) {
-  zkrb_event_ll_t *rv = zk_malloc(sizeof(zkrb_event_ll_t));
+// call once zookeeper_process has returned: re-raises whatever a direct
+// completion's rb_protect caught
+void zkrb_queue_reraise(zkrb_queue_t *q) {
+  int state = q->raised;
 
-  if (!rv) return NULL;
+  if (state) {
+    q->raised = 0;
+    rb_jump_tag(state);
+  }
+}
+#endif
 
-  rv->event = NULL;
-  rv->next = NULL;
+/*
+  an event block: the event itself, storage for whichever completion struct
+  its type needs, and (in the ZKRB_SLAB_EVENT_STAT class only) a Stat. the
+  event is the first member so that zkrb_event_free can get back to the block
+  it was carved from.
+*/
+typedef struct zkrb_event_block {
+  zkrb_event_t event;
+
+  union {
+    struct zkrb_data_completion         data;
+    struct zkrb_stat_completion         stat;
+    struct zkrb_string_completion       string;
+    struct zkrb_strings_completion      strings;
+    struct zkrb_strings_stat_completion strings_stat;
+    struct zkrb_acl_completion          acl;
+    struct zkrb_watcher_completion      watcher;
+    struct zkrb_multi_completion        multi;
+    struct zkrb_tree_completion         tree;
+  } completion;
+
+  zkrb_slab_t             *slab;      // NULL if this block was malloc'd directly
+  int                     size_class;
+  struct zkrb_event_block *next_free;
+
+  struct Stat             stat;       // only present in ZKRB_SLAB_EVENT_STAT blocks
+} zkrb_event_block_t;
+
+#define ZKRB_ALIGN8(n) (((n) + 7) & ~((size_t)7))
+
+static const size_t zkrb_slab_block_sizes[ZKRB_SLAB_NCLASSES] = {
+  ZKRB_ALIGN8(offsetof(zkrb_event_block_t, stat)),
+  ZKRB_ALIGN8(sizeof(zkrb_event_block_t))
+};
+
+inline static int slab_lock(zkrb_slab_t *slab) {
+  int rv=0;
+#if ZKRB_COMPLETIONS_OFF_GVL
+  rv = pthread_mutex_lock(&slab->mutex);
+  if (rv != 0) log_err("slab_lock error");
+#endif
+  return rv;
+}
 
+inline static int slab_unlock(zkrb_slab_t *slab) {
+  int rv=0;
+#if ZKRB_COMPLETIONS_OFF_GVL
+  rv = pthread_mutex_unlock(&slab->mutex);
+  if (rv != 0) log_err("slab_unlock error");
+#endif
   return rv;
 }
 
+static zkrb_slab_t *zkrb_slab_alloc(void) {
+  int i;
+  zkrb_slab_t *slab = malloc(sizeof(zkrb_slab_t));
+  if (!slab) return NULL;
+
+  memset(slab, 0, sizeof(zkrb_slab_t));
+
+  for (i = 0; i < ZKRB_SLAB_NCLASSES; i++) {
+    slab->classes[i].block_size = zkrb_slab_block_sizes[i];
+  }
+
+#if ZKRB_COMPLETIONS_OFF_GVL
+  pthread_mutex_init(&slab->mutex, NULL);
+#endif
+
+  return slab;
+}
+
+static void zkrb_slab_destroy(zkrb_slab_t *slab) {
+  struct zkrb_slab_chunk *chunk = slab->chunks, *next;
+
+  zkrb_debug("zkrb_slab_destroy, slab: %p, chunks: %lu", slab, slab->chunk_count);
+
+  while (chunk) {
+    next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+
+#if ZKRB_COMPLETIONS_OFF_GVL
+  pthread_mutex_destroy(&slab->mutex);
+#endif
+
+  free(slab);
+}
+
+inline static unsigned long slab_in_use(zkrb_slab_t *slab) {
+  unsigned long n = 0;
+  int i;
+  for (i = 0; i < ZKRB_SLAB_NCLASSES; i++) n += slab->classes[i].in_use;
+  return n;
+}
+
+// the owning queue is going away. events that are still alive keep the slab
+// around until the last of them is freed.
+static void zkrb_slab_release(zkrb_slab_t *slab) {
+  int destroy;
+
+  if (!slab) return;
+
+  slab_lock(slab);
+  slab->orphaned = 1;
+  destroy = (slab_in_use(slab) == 0);
+  slab_unlock(slab);
+
+  if (destroy) zkrb_slab_destroy(slab);
+}
+
+// must be called with the slab lock held
+static int slab_grow(zkrb_slab_t *slab, zkrb_slab_class_t *klass) {
+  size_t header = ZKRB_ALIGN8(sizeof(struct zkrb_slab_chunk));
+  struct zkrb_slab_chunk *chunk = malloc(header + klass->block_size * ZKRB_SLAB_CHUNK_BLOCKS);
+  char *p;
+  int i;
+
+  if (!chunk) return 0;
+
+  chunk->next = slab->chunks;
+  slab->chunks = chunk;
+  slab->chunk_count++;
+
+  p = ((char *)chunk) + header;
+
+  for (i = 0; i < ZKRB_SLAB_CHUNK_BLOCKS; i++, p += klass->block_size) {
+    ((zkrb_event_block_t *)p)->next_free = klass->free_list;
+    klass->free_list = p;
+  }
+
+  klass->capacity += ZKRB_SLAB_CHUNK_BLOCKS;
+  return 1;
+}
+
+static zkrb_event_block_t *zkrb_slab_get(zkrb_slab_t *slab, int size_class) {
+  zkrb_event_block_t *block = NULL;
+  zkrb_slab_class_t *klass;
+
+  if (!slab) {
+    if (!(block = malloc(zkrb_slab_block_sizes[size_class]))) return NULL;
+    block->slab = NULL;
+    block->size_class = size_class;
+    return block;
+  }
+
+  klass = &slab->classes[size_class];
+
+  slab_lock(slab);
+
+  if (klass->free_list || slab_grow(slab, klass)) {
+    block = klass->free_list;
+    klass->free_list = block->next_free;
+    klass->in_use++;
+    klass->allocs++;
+
+    block->slab = slab;
+    block->size_class = size_class;
+    block->next_free = NULL;
+  }
+
+  slab_unlock(slab);
+
+  return block;
+}
+
+static void zkrb_slab_put(zkrb_event_block_t *block) {
+  zkrb_slab_t *slab = block->slab;
+  zkrb_slab_class_t *klass;
+  int destroy;
+
+  if (!slab) {
+    free(block);
+    return;
+  }
+
+  klass = &slab->classes[block->size_class];
+
+  slab_lock(slab);
+
+  block->next_free = klass->free_list;
+  klass->free_list = block;
+  klass->in_use--;
+
+  destroy = slab->orphaned && (slab_in_use(slab) == 0);
+
+  slab_unlock(slab);
+
+  if (destroy) zkrb_slab_destroy(slab);
+}
+
+VALUE zkrb_slab_stats_to_ruby(zkrb_slab_t *slab) {
+  static const char *class_names[ZKRB_SLAB_NCLASSES] = { "event", "event_stat" };
+  VALUE hash = rb_hash_new();
+  zkrb_slab_class_t classes[ZKRB_SLAB_NCLASSES];
+  unsigned long chunk_count;
+  int i;
+
+  if (!slab) return hash;
+
+  // copy out under the lock, build ruby objects without it
+  slab_lock(slab);
+  memcpy(classes, slab->classes, sizeof(classes));
+  chunk_count = slab->chunk_count;
+  slab_unlock(slab);
+
+  for (i = 0; i < ZKRB_SLAB_NCLASSES; i++) {
+    VALUE h = rb_hash_new();
+    rb_hash_aset(h, GET_SYM("block_size"), ULONG2NUM(classes[i].block_size));
+    rb_hash_aset(h, GET_SYM("in_use"),     ULONG2NUM(classes[i].in_use));
+    rb_hash_aset(h, GET_SYM("free"),       ULONG2NUM(classes[i].capacity - classes[i].in_use));
+    rb_hash_aset(h, GET_SYM("capacity"),   ULONG2NUM(classes[i].capacity));
+    rb_hash_aset(h, GET_SYM("allocs"),     ULONG2NUM(classes[i].allocs));
+    rb_hash_aset(hash, GET_SYM(class_names[i]), h);
+  }
+
+  rb_hash_aset(hash, GET_SYM("chunks"), ULONG2NUM(chunk_count));
+
+  return hash;
+}
+
 zkrb_queue_t *zkrb_queue_alloc(void) {
   zkrb_queue_t *rq = NULL;
+  unsigned long i;
  
-#if THREADED
+#if ZKRB_COMPLETIONS_OFF_GVL
   int pfd[2];
   check(pipe(pfd) == 0, "creating the signal pipe failed");
 #endif
 
   rq = zk_malloc(sizeof(zkrb_queue_t));
   check_mem(rq);
+  memset(rq, 0, sizeof(zkrb_queue_t));
 
   rq->orig_pid = getpid();
 
-  rq->head = zkrb_event_ll_t_alloc();
-  check_mem(rq->head);
+  rq->slots = zk_malloc(ZKRB_QUEUE_CAPACITY * sizeof(zkrb_ring_slot_t));
+  check_mem(rq->slots);
+
+  rq->mask = ZKRB_QUEUE_CAPACITY - 1;
 
-  rq->tail = rq->head;
+  rq->slab = zkrb_slab_alloc();
+  check_mem(rq->slab);
 
-#if THREADED
+  for (i = 0; i < ZKRB_QUEUE_CAPACITY; i++) {
+    rq->slots[i].seq = i;
+    rq->slots[i].event = NULL;
+  }
+
+#if ZKRB_COMPLETIONS_OFF_GVL
+  pthread_mutex_init(&rq->mutex, NULL);
   rq->pipe_read = pfd[0];
   rq->pipe_write = pfd[1];
+
+  // so that zkrb_queue_drain_signal can empty it without blocking
+  fcntl(rq->pipe_read, F_SETFL, fcntl(rq->pipe_read, F_GETFL) | O_NONBLOCK);
+#else
+  // allocated last, nothing can trigger a GC between here and the caller
+  // storing the queue where its mark function will find it
+  rq->pending = rb_ary_new();
 #endif
 
   return rq;
 
 error:
+  if (rq) zk_free(rq->slots);
   zk_free(rq);
   return NULL;
 }
@@ -217,40 +638,108 @@ void zkrb_queue_free(zkrb_queue_t *queue) {
     zkrb_event_free(elt);
   }
 
-  zk_free(queue->head);
+  zk_free(queue->slots);
+  zkrb_slab_release(queue->slab);
 
-#if THREADED
+#if ZKRB_COMPLETIONS_OFF_GVL
+  pthread_mutex_destroy(&queue->mutex);
   close(queue->pipe_read);
   close(queue->pipe_write);
+#else
+  queue->pending = Qnil;
 #endif
 
   zk_free(queue);
 }
 
-zkrb_event_t *zkrb_event_alloc(void) {
-  zkrb_event_t *rv = zk_malloc(sizeof(zkrb_event_t));
-  return rv;
+/*
+  returns an event of the given type, carved out of the queue's slab, with its
+  completion struct pointer already aimed at storage inside the same block.
+  for types that carry a Stat, the completion's stat pointer is aimed at the
+  block's Stat; the callback NULLs it out if zkc didn't give us one.
+*/
+zkrb_event_t *zkrb_event_alloc(zkrb_queue_t *queue, int type) {
+  int size_class;
+  zkrb_event_block_t *block;
+  zkrb_event_t *event;
+
+  switch (type) {
+    case ZKRB_DATA:
+    case ZKRB_STAT:
+    case ZKRB_STRINGS_STAT:
+    case ZKRB_ACL:
+      size_class = ZKRB_SLAB_EVENT_STAT;
+      break;
+    default:
+      size_class = ZKRB_SLAB_EVENT;
+      break;
+  }
+
+  block = zkrb_slab_get(queue ? queue->slab : NULL, size_class);
+  if (!block) return NULL;
+
+  memset(&block->event, 0, sizeof(zkrb_event_t));
+  memset(&block->completion, 0, sizeof(block->completion));
+
+  event = &block->event;
+  event->type = type;
+
+  switch (type) {
+    case ZKRB_DATA:
+      event->completion.data_completion = &block->completion.data;
+      block->completion.data.stat = &block->stat;
+      break;
+    case ZKRB_STAT:
+      event->completion.stat_completion = &block->completion.stat;
+      block->completion.stat.stat = &block->stat;
+      break;
+    case ZKRB_STRING:
+      event->completion.string_completion = &block->completion.string;
+      break;
+    case ZKRB_STRINGS:
+      event->completion.strings_completion = &block->completion.strings;
+      break;
+    case ZKRB_STRINGS_STAT:
+      event->completion.strings_stat_completion = &block->completion.strings_stat;
+      block->completion.strings_stat.stat = &block->stat;
+      break;
+    case ZKRB_ACL:
+      event->completion.acl_completion = &block->completion.acl;
+      block->completion.acl.stat = &block->stat;
+      break;
+    case ZKRB_WATCHER:
+      event->completion.watcher_completion = &block->completion.watcher;
+      break;
+    case ZKRB_MULTI:
+      event->completion.multi_completion = &block->completion.multi;
+      break;
+    case ZKRB_TREE:
+      event->completion.tree_completion = &block->completion.tree;
+      break;
+    case ZKRB_VOID:
+    default:
+      event->completion.void_completion = NULL;
+      break;
+  }
+
+  return event;
 }
 
+// frees the variable-length payloads hanging off the event, then hands the
+// block (event, completion and Stat) back to its slab
 void zkrb_event_free(zkrb_event_t *event) {
   switch (event->type) {
     case ZKRB_DATA: {
       struct zkrb_data_completion *data_ctx = event->completion.data_completion;
-      zk_free(data_ctx->data);
-      zk_free(data_ctx->stat);
-      zk_free(data_ctx);
+      free(data_ctx->data);
       break;
     }
     case ZKRB_STAT: {
-      struct zkrb_stat_completion *stat_ctx = event->completion.stat_completion;
-      zk_free(stat_ctx->stat);
-      zk_free(stat_ctx);
       break;
     }
     case ZKRB_STRING: {
       struct zkrb_string_completion *string_ctx = event->completion.string_completion;
-      zk_free(string_ctx->value);
-      zk_free(string_ctx);
+      free(string_ctx->value);
       break;
     }
     case ZKRB_STRINGS: {
@@ -258,11 +747,10 @@ void zkrb_event_free(zkrb_event_t *event) {
       int k;
       if (strings_ctx->values) {
         for (k = 0; k < strings_ctx->values->count; ++k) {
-          zk_free(strings_ctx->values->data[k]);
+          free(strings_ctx->values->data[k]);
         }
-        zk_free(strings_ctx->values);
+        free(strings_ctx->values);
       }
-      zk_free(strings_ctx);
       break;
     }
     case ZKRB_STRINGS_STAT: {
@@ -270,29 +758,31 @@ void zkrb_event_free(zkrb_event_t *event) {
       int k;
       if (strings_stat_ctx->values) {
         for (k = 0; k < strings_stat_ctx->values->count; ++k) {
-          zk_free(strings_stat_ctx->values->data[k]);
+          free(strings_stat_ctx->values->data[k]);
         }
-        zk_free(strings_stat_ctx->values);
+        free(strings_stat_ctx->values);
       }
-
-      if (strings_stat_ctx->stat) zk_free(strings_stat_ctx->stat);
-      zk_free(strings_stat_ctx);
       break;
     }
     case ZKRB_ACL: {
       struct zkrb_acl_completion *acl_ctx = event->completion.acl_completion;
       if (acl_ctx->acl) {
         deallocate_ACL_vector(acl_ctx->acl);
-        zk_free(acl_ctx->acl);
+        free(acl_ctx->acl);
       }
-      zk_free(acl_ctx->stat);
-      zk_free(acl_ctx);
       break;
     }
     case ZKRB_WATCHER: {
       struct zkrb_watcher_completion *watcher_ctx = event->completion.watcher_completion;
-      zk_free(watcher_ctx->path);
-      zk_free(watcher_ctx);
+      free(watcher_ctx->path);
+      break;
+    }
+    case ZKRB_MULTI: {
+      zkrb_multi_free(event->completion.multi_completion->multi);
+      break;
+    }
+    case ZKRB_TREE: {
+      zkrb_tree_free(event->completion.tree_completion->tree);
       break;
     }
     case ZKRB_VOID: {
@@ -302,80 +792,495 @@ void zkrb_event_free(zkrb_event_t *event) {
       log_err("unrecognized event in event_free!");
   }
 
-  zk_free(event);
+  zkrb_slab_put((zkrb_event_block_t *) event);
 }
 
 /* this is called only from a method_get_latest_event, so the hash is
    allocated on the proper thread stack */
-VALUE zkrb_event_to_ruby(zkrb_event_t *event) {
-  VALUE hash = rb_hash_new();
+/*
+  Zookeeper::Event
 
-  if (!event) {
-    log_err("event was NULL in zkrb_event_to_ruby");
-    return hash;
+  the ruby face of a zkrb_event_t. rather than copying every field of the
+  event into a Hash up front, the object holds on to the event and only builds
+  the ruby value for a field the first time it's read. once every payload
+  field has been built the event is handed back to its slab.
+
+  for compatibility with code that expects the old event Hash, an Event
+  responds to the handful of Hash methods callbacks and the dispatch code use
+  ([], []=, fetch, has_key?, values_at, keys, to_hash, each). values stored
+  with []= are kept in a side hash and take precedence over the event's own.
+*/
+
+VALUE ZookeeperEvent = Qnil;
+
+typedef enum {
+  ZKRB_EV_REQ_ID = 0,
+  ZKRB_EV_RC,
+  ZKRB_EV_TYPE,
+  ZKRB_EV_STATE,
+  ZKRB_EV_PATH,
+  ZKRB_EV_DATA,
+  ZKRB_EV_STAT,
+  ZKRB_EV_STRING,
+  ZKRB_EV_STRINGS,
+  ZKRB_EV_ACL,
+  ZKRB_EV_RESULTS,
+  ZKRB_EV_NFIELDS
+} zkrb_event_field;
+
+// fields from ZKRB_EV_PATH on are materialized lazily and cached
+#define ZKRB_EV_FIRST_LAZY ZKRB_EV_PATH
+
+static const char *event_field_names[ZKRB_EV_NFIELDS] = {
+  "req_id", "rc", "type", "state", "path", "data", "stat", "string", "strings", "acl", "results"
+};
+
+static ID    event_field_ids[ZKRB_EV_NFIELDS];
+static VALUE event_field_syms[ZKRB_EV_NFIELDS];
+
+static VALUE sym_perms, sym_id, sym_scheme;
+
+// which fields each event type carries, in the order the old hash had them
+static unsigned int event_fields_for_type(int type) {
+#define F(f) (1u << (f))
+  switch (type) {
+    case ZKRB_DATA:         return F(ZKRB_EV_REQ_ID) | F(ZKRB_EV_RC) | F(ZKRB_EV_DATA) | F(ZKRB_EV_STAT);
+    case ZKRB_STAT:         return F(ZKRB_EV_REQ_ID) | F(ZKRB_EV_RC) | F(ZKRB_EV_STAT);
+    case ZKRB_STRING:       return F(ZKRB_EV_REQ_ID) | F(ZKRB_EV_RC) | F(ZKRB_EV_STRING);
+    case ZKRB_STRINGS:      return F(ZKRB_EV_REQ_ID) | F(ZKRB_EV_RC) | F(ZKRB_EV_STRINGS);
+    case ZKRB_STRINGS_STAT: return F(ZKRB_EV_REQ_ID) | F(ZKRB_EV_RC) | F(ZKRB_EV_STRINGS) | F(ZKRB_EV_STAT);
+    case ZKRB_ACL:          return F(ZKRB_EV_REQ_ID) | F(ZKRB_EV_RC) | F(ZKRB_EV_ACL) | F(ZKRB_EV_STAT);
+    case ZKRB_WATCHER:      return F(ZKRB_EV_REQ_ID) | F(ZKRB_EV_TYPE) | F(ZKRB_EV_STATE) | F(ZKRB_EV_PATH);
+    case ZKRB_MULTI:        return F(ZKRB_EV_REQ_ID) | F(ZKRB_EV_RC) | F(ZKRB_EV_RESULTS);
+    case ZKRB_TREE:         return F(ZKRB_EV_REQ_ID) | F(ZKRB_EV_RC) | F(ZKRB_EV_RESULTS);
+    case ZKRB_VOID:
+    default:                return F(ZKRB_EV_REQ_ID) | F(ZKRB_EV_RC);
   }
+#undef F
+}
 
-  rb_hash_aset(hash, GET_SYM("req_id"), LL2NUM(event->req_id));
-  if (event->type != ZKRB_WATCHER)
-    rb_hash_aset(hash, GET_SYM("rc"), INT2FIX(event->rc));
+#define EVENT_HAS_FIELD(obj, f) ((obj)->fields & (1u << (f)))
 
-  switch (event->type) {
-    case ZKRB_DATA: {
-      zkrb_debug("zkrb_event_to_ruby ZKRB_DATA");
-      struct zkrb_data_completion *data_ctx = event->completion.data_completion;
-      if (ZKRBDebugging) zkrb_print_stat(data_ctx->stat);
-      rb_hash_aset(hash, GET_SYM("data"), data_ctx->data ? rb_str_new(data_ctx->data, data_ctx->data_len) : Qnil);
-      rb_hash_aset(hash, GET_SYM("stat"), data_ctx->stat ? zkrb_stat_to_rarray(data_ctx->stat) : Qnil);
-      break;
+typedef struct {
+  zkrb_event_t  *event;       // NULL once all lazy fields are built
+  unsigned int  fields;       // bitmask of zkrb_event_field
+  int           event_type;
+
+  // copied out of the event up front, they're cheap
+  int64_t       req_id;
+  int           rc;
+  int           watch_type;
+  int           watch_state;
+
+  VALUE         cache[ZKRB_EV_NFIELDS];   // Qundef until built
+  VALUE         extras;                   // Qnil or a Hash of []= values
+} zkrb_event_obj_t;
+
+static void zkrb_event_obj_mark(void *p) {
+  zkrb_event_obj_t *obj = p;
+  int i;
+  for (i = ZKRB_EV_FIRST_LAZY; i < ZKRB_EV_NFIELDS; i++) {
+    if (obj->cache[i] != Qundef) rb_gc_mark(obj->cache[i]);
+  }
+  rb_gc_mark(obj->extras);
+}
+
+static void zkrb_event_obj_free(void *p) {
+  zkrb_event_obj_t *obj = p;
+  if (obj->event) zkrb_event_free(obj->event);
+  xfree(obj);
+}
+
+static size_t zkrb_event_obj_memsize(const void *p) {
+  return sizeof(zkrb_event_obj_t);
+}
+
+static const rb_data_type_t zkrb_event_data_type = {
+  "Zookeeper::Event",
+  { zkrb_event_obj_mark, zkrb_event_obj_free, zkrb_event_obj_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+#define FETCH_EVENT_OBJ(self, obj) \
+  zkrb_event_obj_t *obj; \
+  TypedData_Get_Struct((self), zkrb_event_obj_t, &zkrb_event_data_type, obj)
+
+// hands the event back to the slab once there's nothing left to build from it
+static void event_obj_maybe_release(zkrb_event_obj_t *obj) {
+  int i;
+
+  if (!obj->event) return;
+
+  for (i = ZKRB_EV_FIRST_LAZY; i < ZKRB_EV_NFIELDS; i++) {
+    if (EVENT_HAS_FIELD(obj, i) && obj->cache[i] == Qundef) return;
+  }
+
+  zkrb_event_free(obj->event);
+  obj->event = NULL;
+}
+
+static VALUE event_obj_build_field(zkrb_event_obj_t *obj, zkrb_event_field f) {
+  zkrb_event_t *event = obj->event;
+
+  switch (f) {
+    case ZKRB_EV_PATH: {
+      struct zkrb_watcher_completion *wc = event->completion.watcher_completion;
+      return wc->path ? rb_str_new2(wc->path) : Qnil;
     }
-    case ZKRB_STAT: {
-      zkrb_debug("zkrb_event_to_ruby ZKRB_STAT");
-      struct zkrb_stat_completion *stat_ctx = event->completion.stat_completion;
-      rb_hash_aset(hash, GET_SYM("stat"), stat_ctx->stat ? zkrb_stat_to_rarray(stat_ctx->stat) : Qnil);
-      break;
+    case ZKRB_EV_DATA: {
+      struct zkrb_data_completion *dc = event->completion.data_completion;
+      return dc->data ? rb_str_new(dc->data, dc->data_len) : Qnil;
     }
-    case ZKRB_STRING: {
-      zkrb_debug("zkrb_event_to_ruby ZKRB_STRING");
-      struct zkrb_string_completion *string_ctx = event->completion.string_completion;
-      rb_hash_aset(hash, GET_SYM("string"), string_ctx->value ? rb_str_new2(string_ctx->value) : Qnil);
-      break;
+    case ZKRB_EV_STAT: {
+      struct Stat *stat = NULL;
+      switch (obj->event_type) {
+        case ZKRB_DATA:         stat = event->completion.data_completion->stat; break;
+        case ZKRB_STAT:         stat = event->completion.stat_completion->stat; break;
+        case ZKRB_STRINGS_STAT: stat = event->completion.strings_stat_completion->stat; break;
+        case ZKRB_ACL:          stat = event->completion.acl_completion->stat; break;
+      }
+      if (ZKRBDebugging) zkrb_print_stat(stat);
+      return zkrb_stat_to_ruby(stat);
     }
-    case ZKRB_STRINGS: {
-      zkrb_debug("zkrb_event_to_ruby ZKRB_STRINGS");
-      struct zkrb_strings_completion *strings_ctx = event->completion.strings_completion;
-      rb_hash_aset(hash, GET_SYM("strings"), strings_ctx->values ? zkrb_string_vector_to_ruby(strings_ctx->values) : Qnil);
-      break;
+    case ZKRB_EV_STRING: {
+      struct zkrb_string_completion *sc = event->completion.string_completion;
+      return sc->value ? rb_str_new2(sc->value) : Qnil;
     }
-    case ZKRB_STRINGS_STAT: {
-      zkrb_debug("zkrb_event_to_ruby ZKRB_STRINGS_STAT");
-      struct zkrb_strings_stat_completion *strings_stat_ctx = event->completion.strings_stat_completion;
-      rb_hash_aset(hash, GET_SYM("strings"), strings_stat_ctx->values ? zkrb_string_vector_to_ruby(strings_stat_ctx->values) : Qnil);
-      rb_hash_aset(hash, GET_SYM("stat"), strings_stat_ctx->stat ? zkrb_stat_to_rarray(strings_stat_ctx->stat) : Qnil);
-      break;
+    case ZKRB_EV_STRINGS: {
+      struct String_vector *values = (obj->event_type == ZKRB_STRINGS_STAT)
+        ? event->completion.strings_stat_completion->values
+        : event->completion.strings_completion->values;
+      return values ? zkrb_children_to_ruby(values, event->flags) : Qnil;
     }
-    case ZKRB_ACL: {
-      zkrb_debug("zkrb_event_to_ruby ZKRB_ACL");
-      struct zkrb_acl_completion *acl_ctx = event->completion.acl_completion;
-      rb_hash_aset(hash, GET_SYM("acl"), acl_ctx->acl ? zkrb_acl_vector_to_ruby(acl_ctx->acl) : Qnil);
-      rb_hash_aset(hash, GET_SYM("stat"), acl_ctx->stat ? zkrb_stat_to_rarray(acl_ctx->stat) : Qnil);
-      break;
+    case ZKRB_EV_ACL: {
+      struct zkrb_acl_completion *ac = event->completion.acl_completion;
+      return ac->acl ? zkrb_acl_vector_to_ruby(ac->acl) : Qnil;
     }
-    case ZKRB_WATCHER: {
-      zkrb_debug("zkrb_event_to_ruby ZKRB_WATCHER");
-      struct zkrb_watcher_completion *watcher_ctx = event->completion.watcher_completion;
-      rb_hash_aset(hash, GET_SYM("type"), INT2FIX(watcher_ctx->type));
-      rb_hash_aset(hash, GET_SYM("state"), INT2FIX(watcher_ctx->state));
-      rb_hash_aset(hash, GET_SYM("path"), watcher_ctx->path ? rb_str_new2(watcher_ctx->path) : Qnil);
-      break;
+    case ZKRB_EV_RESULTS: {
+      if (obj->event_type == ZKRB_TREE) return zkrb_tree_results_to_ruby(event->completion.tree_completion->tree);
+      return zkrb_multi_results_to_ruby(event->completion.multi_completion->multi, obj->rc);
     }
-    case ZKRB_VOID:
     default:
-      break;
+      return Qnil;
   }
+}
 
+// the event's own value for field f, ignoring anything set with []=
+static VALUE event_obj_field(zkrb_event_obj_t *obj, zkrb_event_field f) {
+  if (!EVENT_HAS_FIELD(obj, f)) return Qnil;
+
+  switch (f) {
+    case ZKRB_EV_REQ_ID: return LL2NUM(obj->req_id);
+    case ZKRB_EV_RC:     return INT2FIX(obj->rc);
+    case ZKRB_EV_TYPE:   return INT2FIX(obj->watch_type);
+    case ZKRB_EV_STATE:  return INT2FIX(obj->watch_state);
+    default:
+      break;
+  }
+
+  if (obj->cache[f] == Qundef) {
+    obj->cache[f] = event_obj_build_field(obj, f);
+    event_obj_maybe_release(obj);
+  }
+
+  return obj->cache[f];
+}
+
+// maps a key to a field, or -1 if it isn't one of ours
+static int event_key_to_field(VALUE key) {
+  int i;
+  ID id;
+
+  if (!SYMBOL_P(key)) return -1;
+
+  id = SYM2ID(key);
+  for (i = 0; i < ZKRB_EV_NFIELDS; i++) {
+    if (event_field_ids[i] == id) return i;
+  }
+  return -1;
+}
+
+static int event_obj_has_key(zkrb_event_obj_t *obj, VALUE key) {
+  int f;
+
+  if (!NIL_P(obj->extras) && rb_hash_lookup2(obj->extras, key, Qundef) != Qundef)
+    return 1;
+
+  f = event_key_to_field(key);
+  return (f >= 0) && EVENT_HAS_FIELD(obj, f);
+}
+
+static VALUE event_obj_aref(zkrb_event_obj_t *obj, VALUE key) {
+  int f;
+
+  if (!NIL_P(obj->extras)) {
+    VALUE v = rb_hash_lookup2(obj->extras, key, Qundef);
+    if (v != Qundef) return v;
+  }
+
+  f = event_key_to_field(key);
+  return (f >= 0) ? event_obj_field(obj, f) : Qnil;
+}
+
+// only reachable through dup/clone, Event.new is undefined
+static VALUE event_alloc(VALUE klass) {
+  zkrb_event_obj_t *obj;
+  VALUE self = TypedData_Make_Struct(klass, zkrb_event_obj_t, &zkrb_event_data_type, obj);
+  int i;
+
+  obj->extras = Qnil;
+  for (i = 0; i < ZKRB_EV_NFIELDS; i++) obj->cache[i] = Qundef;
+
+  return self;
+}
+
+static VALUE event_obj_new(int type, int64_t req_id, int rc, zkrb_event_obj_t **objp) {
+  zkrb_event_obj_t *obj;
+  VALUE self;
+  int i;
+
+  self = TypedData_Make_Struct(ZookeeperEvent, zkrb_event_obj_t, &zkrb_event_data_type, obj);
+
+  obj->event      = NULL;
+  obj->event_type = type;
+  obj->fields     = event_fields_for_type(type);
+  obj->req_id     = req_id;
+  obj->rc         = rc;
+  obj->extras     = Qnil;
+
+  for (i = 0; i < ZKRB_EV_NFIELDS; i++) obj->cache[i] = Qundef;
+
+  *objp = obj;
+  return self;
+}
+
+struct event_obj_new_args {
+  zkrb_event_t *event;
+  zkrb_event_obj_t **objp;
+};
+
+static VALUE event_obj_new_protected(VALUE data) {
+  struct event_obj_new_args *args = (struct event_obj_new_args *)data;
+  return event_obj_new(args->event->type, args->event->req_id, args->event->rc, args->objp);
+}
+
+// takes ownership of event, which is freed along with the returned object
+VALUE zkrb_event_to_ruby(zkrb_event_t *event) {
+  zkrb_event_obj_t *obj = NULL;
+  struct event_obj_new_args args = { event, &obj };
+  VALUE self;
+  int state = 0;
+
+  if (!event) {
+    log_err("event was NULL in zkrb_event_to_ruby");
+    return Qnil;
+  }
+
+  // allocating the wrapper can raise, don't drop the event on the floor
+  self = rb_protect(event_obj_new_protected, (VALUE)&args, &state);
+
+  if (state) {
+    zkrb_event_free(event);
+    rb_jump_tag(state);
+  }
+
+  obj->event = event;
+
+  if (event->type == ZKRB_WATCHER) {
+    obj->watch_type  = event->completion.watcher_completion->type;
+    obj->watch_state = event->completion.watcher_completion->state;
+  }
+
+  // void completions and the like have nothing left to build
+  event_obj_maybe_release(obj);
+
+  return self;
+}
+
+static VALUE event_method_aref(VALUE self, VALUE key) {
+  FETCH_EVENT_OBJ(self, obj);
+  return event_obj_aref(obj, key);
+}
+
+static VALUE event_method_aset(VALUE self, VALUE key, VALUE val) {
+  FETCH_EVENT_OBJ(self, obj);
+  if (NIL_P(obj->extras)) obj->extras = rb_hash_new();
+  return rb_hash_aset(obj->extras, key, val);
+}
+
+static VALUE event_method_has_key(VALUE self, VALUE key) {
+  FETCH_EVENT_OBJ(self, obj);
+  return event_obj_has_key(obj, key) ? Qtrue : Qfalse;
+}
+
+static VALUE event_method_fetch(int argc, VALUE *argv, VALUE self) {
+  VALUE key, dflt;
+  FETCH_EVENT_OBJ(self, obj);
+
+  rb_scan_args(argc, argv, "11", &key, &dflt);
+
+  if (event_obj_has_key(obj, key)) return event_obj_aref(obj, key);
+  if (rb_block_given_p()) return rb_yield(key);
+  if (argc > 1) return dflt;
+
+  rb_raise(rb_eKeyError, "key not found: %"PRIsVALUE, rb_inspect(key));
+  return Qnil;
+}
+
+static VALUE event_method_values_at(int argc, VALUE *argv, VALUE self) {
+  VALUE ary = rb_ary_new2(argc);
+  int i;
+  FETCH_EVENT_OBJ(self, obj);
+
+  for (i = 0; i < argc; i++) {
+    rb_ary_push(ary, event_obj_aref(obj, argv[i]));
+  }
+  return ary;
+}
+
+static VALUE event_method_keys(VALUE self) {
+  VALUE keys = rb_ary_new();
+  int i;
+  FETCH_EVENT_OBJ(self, obj);
+
+  for (i = 0; i < ZKRB_EV_NFIELDS; i++) {
+    if (EVENT_HAS_FIELD(obj, i)) rb_ary_push(keys, event_field_syms[i]);
+  }
+
+  if (!NIL_P(obj->extras)) {
+    VALUE extra_keys = rb_funcall(obj->extras, rb_intern("keys"), 0);
+    long j;
+    for (j = 0; j < RARRAY_LEN(extra_keys); j++) {
+      VALUE k = rb_ary_entry(extra_keys, j);
+      int f = event_key_to_field(k);
+      if (f < 0 || !EVENT_HAS_FIELD(obj, f)) rb_ary_push(keys, k);
+    }
+  }
+
+  return keys;
+}
+
+// a new Hash with the same contents the old event hash would have had
+static VALUE event_method_to_hash(VALUE self) {
+  VALUE hash = rb_hash_new();
+  VALUE keys = event_method_keys(self);
+  long i;
+  FETCH_EVENT_OBJ(self, obj);
+
+  for (i = 0; i < RARRAY_LEN(keys); i++) {
+    VALUE k = rb_ary_entry(keys, i);
+    rb_hash_aset(hash, k, event_obj_aref(obj, k));
+  }
   return hash;
 }
 
+static VALUE event_method_each(VALUE self) {
+  RETURN_ENUMERATOR(self, 0, 0);
+  return rb_funcall_with_block(event_method_to_hash(self), rb_intern("each"), 0, 0, rb_block_proc());
+}
+
+static VALUE event_method_equal(VALUE self, VALUE other) {
+  if (self == other) return Qtrue;
+  if (!rb_respond_to(other, rb_intern("to_hash"))) return Qfalse;
+  return rb_equal(event_method_to_hash(self), rb_funcall(other, rb_intern("to_hash"), 0));
+}
+
+static VALUE event_method_inspect(VALUE self) {
+  return rb_sprintf("#<%"PRIsVALUE" %"PRIsVALUE">", rb_class_name(rb_obj_class(self)), rb_inspect(event_method_to_hash(self)));
+}
+
+static VALUE event_method_req_id(VALUE self)  { return event_method_aref(self, event_field_syms[ZKRB_EV_REQ_ID]); }
+static VALUE event_method_rc(VALUE self)      { return event_method_aref(self, event_field_syms[ZKRB_EV_RC]); }
+static VALUE event_method_type(VALUE self)    { return event_method_aref(self, event_field_syms[ZKRB_EV_TYPE]); }
+static VALUE event_method_state(VALUE self)   { return event_method_aref(self, event_field_syms[ZKRB_EV_STATE]); }
+static VALUE event_method_path(VALUE self)    { return event_method_aref(self, event_field_syms[ZKRB_EV_PATH]); }
+static VALUE event_method_data(VALUE self)    { return event_method_aref(self, event_field_syms[ZKRB_EV_DATA]); }
+static VALUE event_method_stat(VALUE self)    { return event_method_aref(self, event_field_syms[ZKRB_EV_STAT]); }
+static VALUE event_method_string(VALUE self)  { return event_method_aref(self, event_field_syms[ZKRB_EV_STRING]); }
+static VALUE event_method_strings(VALUE self) { return event_method_aref(self, event_field_syms[ZKRB_EV_STRINGS]); }
+static VALUE event_method_acl(VALUE self)     { return event_method_aref(self, event_field_syms[ZKRB_EV_ACL]); }
+static VALUE event_method_results(VALUE self) { return event_method_aref(self, event_field_syms[ZKRB_EV_RESULTS]); }
+
+static VALUE event_method_context(VALUE self) {
+  return event_method_aref(self, ID2SYM(rb_intern("context")));
+}
+
+// true for completions, false for watcher events
+static VALUE event_method_completion_p(VALUE self) {
+  FETCH_EVENT_OBJ(self, obj);
+  return EVENT_HAS_FIELD(obj, ZKRB_EV_RC) ? Qtrue : Qfalse;
+}
+
+// the C event can only have one owner, so build everything out of it first
+// and share the built values, the way Hash#dup would
+static VALUE event_method_initialize_copy(VALUE self, VALUE orig) {
+  int i;
+
+  if (self == orig) return self;
+
+  FETCH_EVENT_OBJ(self, obj);
+  FETCH_EVENT_OBJ(orig, other);
+
+  for (i = ZKRB_EV_FIRST_LAZY; i < ZKRB_EV_NFIELDS; i++) {
+    if (EVENT_HAS_FIELD(other, i)) event_obj_field(other, i);
+  }
+
+  memcpy(obj, other, sizeof(*obj));
+  obj->event  = NULL;
+  obj->extras = NIL_P(other->extras) ? Qnil : rb_hash_dup(other->extras);
+
+  return self;
+}
+
+void zkrb_define_event_class(VALUE mZookeeper) {
+  int i;
+
+  for (i = 0; i < ZKRB_EV_NFIELDS; i++) {
+    event_field_ids[i]  = rb_intern(event_field_names[i]);
+    event_field_syms[i] = ID2SYM(event_field_ids[i]);
+  }
+
+  sym_perms  = ID2SYM(rb_intern("perms"));
+  sym_id     = ID2SYM(rb_intern("id"));
+  sym_scheme = ID2SYM(rb_intern("scheme"));
+
+  ZookeeperEvent = rb_define_class_under(mZookeeper, "Event", rb_cObject);
+  rb_define_alloc_func(ZookeeperEvent, event_alloc);
+  rb_undef_method(CLASS_OF(ZookeeperEvent), "new");
+
+  rb_define_method(ZookeeperEvent, "initialize_copy", event_method_initialize_copy, 1);
+
+  rb_define_method(ZookeeperEvent, "req_id",  event_method_req_id,  0);
+  rb_define_method(ZookeeperEvent, "rc",      event_method_rc,      0);
+  rb_define_method(ZookeeperEvent, "type",    event_method_type,    0);
+  rb_define_method(ZookeeperEvent, "state",   event_method_state,   0);
+  rb_define_method(ZookeeperEvent, "path",    event_method_path,    0);
+  rb_define_method(ZookeeperEvent, "data",    event_method_data,    0);
+  rb_define_method(ZookeeperEvent, "stat",    event_method_stat,    0);
+  rb_define_method(ZookeeperEvent, "string",  event_method_string,  0);
+  rb_define_method(ZookeeperEvent, "strings", event_method_strings, 0);
+  rb_define_method(ZookeeperEvent, "acl",     event_method_acl,     0);
+  rb_define_method(ZookeeperEvent, "results", event_method_results, 0);
+  rb_define_method(ZookeeperEvent, "context", event_method_context, 0);
+  rb_define_method(ZookeeperEvent, "completion?", event_method_completion_p, 0);
+
+  // Hash compatibility
+  rb_define_method(ZookeeperEvent, "[]",        event_method_aref,      1);
+  rb_define_method(ZookeeperEvent, "[]=",       event_method_aset,      2);
+  rb_define_method(ZookeeperEvent, "fetch",     event_method_fetch,    -1);
+  rb_define_method(ZookeeperEvent, "has_key?",  event_method_has_key,   1);
+  rb_define_method(ZookeeperEvent, "key?",      event_method_has_key,   1);
+  rb_define_method(ZookeeperEvent, "include?",  event_method_has_key,   1);
+  rb_define_method(ZookeeperEvent, "values_at", event_method_values_at, -1);
+  rb_define_method(ZookeeperEvent, "keys",      event_method_keys,      0);
+  rb_define_method(ZookeeperEvent, "to_hash",   event_method_to_hash,   0);
+  rb_define_method(ZookeeperEvent, "to_h",      event_method_to_hash,   0);
+  rb_define_method(ZookeeperEvent, "each",      event_method_each,      0);
+  rb_define_method(ZookeeperEvent, "each_pair", event_method_each,      0);
+  rb_define_method(ZookeeperEvent, "==",        event_method_equal,     1);
+  rb_define_method(ZookeeperEvent, "inspect",   event_method_inspect,   0);
+}
+
 void zkrb_print_stat(const struct Stat *s) {
   if (s != NULL) {
     fprintf(stderr,  "stat {\n");
@@ -396,24 +1301,67 @@ void zkrb_print_stat(const struct Stat *s) {
   }
 }
 
-zkrb_calling_context *zkrb_calling_context_alloc(int64_t req_id, zkrb_queue_t *queue) {
+zkrb_calling_context *zkrb_calling_context_alloc(int64_t req_id, zkrb_queue_t *queue, int flags) {
   zkrb_calling_context *ctx = zk_malloc(sizeof(zkrb_calling_context));
   if (!ctx) return NULL;
 
   ctx->req_id = req_id;
   ctx->queue  = queue;
+  ctx->flags  = flags;
+  ctx->multi  = NULL;
 
   return ctx;
 }
 
 void zkrb_calling_context_free(zkrb_calling_context *ctx) {
+  if (ctx->multi) zkrb_multi_free(ctx->multi);
   zk_free(ctx);
 }
 
+zkrb_multi_t *zkrb_multi_alloc(int count) {
+  zkrb_multi_t *multi = zk_malloc(sizeof(zkrb_multi_t));
+  if (!multi) return NULL;
+
+  multi->count     = count;
+  multi->types     = zk_calloc(count, sizeof(int));
+  multi->results   = zk_calloc(count, sizeof(zoo_op_result_t));
+  multi->stats     = zk_calloc(count, sizeof(struct Stat));
+  multi->path_bufs = zk_calloc(count, sizeof(char *));
+
+  if (!multi->types || !multi->results || !multi->stats || !multi->path_bufs) {
+    zkrb_multi_free(multi);
+    return NULL;
+  }
+
+  return multi;
+}
+
+// the buffer zkc writes op k's created path into, freed with the multi
+char *zkrb_multi_path_buf(zkrb_multi_t *multi, int k, int len) {
+  return multi->path_bufs[k] = zk_calloc(1, len);
+}
+
+void zkrb_multi_free(zkrb_multi_t *multi) {
+  int k;
+
+  if (!multi) return;
+
+  if (multi->path_bufs) {
+    for (k = 0; k < multi->count; ++k) zk_free(multi->path_bufs[k]);
+  }
+
+  zk_free(multi->types);
+  zk_free(multi->results);
+  zk_free(multi->stats);
+  zk_free(multi->path_bufs);
+  zk_free(multi);
+}
+
 void zkrb_print_calling_context(zkrb_calling_context *ctx) {
   fprintf(stderr, "calling context (%p){\n", ctx);
   fprintf(stderr, "\treq_id = %"PRId64"\n", ctx->req_id);
   fprintf(stderr, "\tqueue  = %p\n", ctx->queue);
+  fprintf(stderr, "\tflags  = %d\n", ctx->flags);
   fprintf(stderr, "}\n");
 }
 
@@ -423,15 +1371,166 @@ void zkrb_print_calling_context(zkrb_calling_context *ctx) {
 
   The calling_ctx can be thought of as the outer shell that we discard in
   this macro after pulling out the gooey delicious center.
+
+  Without the IO engine the st lib's completions run on the ruby event
+  thread, so instead of copying zkc's data into a zkrb_event_t for the queue, they
+  build the final Zookeeper::Event on the spot (ZKH_SETUP_DIRECT and
+  zkrb_direct_deliver) and hand it to zkrb_deliver. zkc's buffers are only
+  valid for the duration of the callback, so every field is built eagerly.
 */
 
-#define ZKH_SETUP_EVENT(qptr, eptr) \
+#if ZKRB_COMPLETIONS_OFF_GVL
+
+// out of memory, the completion is dropped (a sync caller gets its
+// deadline). the context is freed along with a multi hanging off it.
+#define ZKH_SETUP_EVENT(qptr, eptr, etype) \
   zkrb_calling_context *ctx = (zkrb_calling_context *) calling_ctx; \
-  zkrb_event_t *eptr = zkrb_event_alloc();                          \
-  eptr->req_id = ctx->req_id;                                       \
   zkrb_queue_t *qptr = ctx->queue;                                  \
+  zkrb_event_t *eptr = zkrb_event_alloc(qptr, etype);               \
+  if (eptr == NULL) {                                               \
+    log_err("no memory for an event, dropping the completion for req_id %"PRId64, ctx->req_id); \
+    if (ctx->req_id != ZKRB_GLOBAL_REQ) zkrb_calling_context_free(ctx); \
+    return;                                                         \
+  }                                                                 \
+  eptr->req_id = ctx->req_id;                                       \
+  eptr->flags  = ctx->flags;                                        \
   if (eptr->req_id != ZKRB_GLOBAL_REQ) zk_free(ctx)
 
+// copies stat into the block-resident Stat the completion's pointer already
+// refers to, or clears the pointer if zkc didn't hand us one
+#define ZKH_COPY_STAT(dst, src) \
+  if ((src) != NULL) { memcpy((dst), (src), sizeof(struct Stat)); } else { (dst) = NULL; }
+
+#else
+
+// completions that zookeeper_close runs (with ZCLOSING) may be called while
+// the GC is finalizing the handle, so they must not allocate. nobody would
+// read them anyway.
+#define ZKH_SETUP_DIRECT(qptr, dptr, etype, rc)                     \
+  zkrb_calling_context *ctx = (zkrb_calling_context *) calling_ctx; \
+  zkrb_queue_t *qptr = ctx->queue;                                  \
+  zkrb_direct_t dptr;                                               \
+  memset(&dptr, 0, sizeof(dptr));                                   \
+  dptr.queue  = qptr;                                               \
+  dptr.type   = (etype);                                            \
+  dptr.req_id = ctx->req_id;                                        \
+  dptr.rc     = (rc);                                               \
+  dptr.flags  = ctx->flags;                                         \
+  if (dptr.req_id != ZKRB_GLOBAL_REQ) zk_free(ctx);                 \
+  if (qptr->closing) return
+
+// what a completion was handed, pointing into zkc's buffers
+typedef struct {
+  zkrb_queue_t                *queue;
+  int                         type;
+  int64_t                     req_id;
+  int                         rc;
+  int                         flags;
+  int                         watch_type;
+  int                         watch_state;
+  const char                  *path;
+  const char                  *value;
+  int                         value_len;
+  const struct Stat           *stat;
+  const struct String_vector  *strings;
+  struct ACL_vector           *acls;
+  zkrb_multi_t                *multi;
+} zkrb_direct_t;
+
+#define ZKH_SET_FIELD(optr, field, val) ((optr)->cache[(field)] = (val))
+
+static VALUE direct_build(VALUE arg) {
+  zkrb_direct_t *d = (zkrb_direct_t *)arg;
+  zkrb_event_obj_t *ev;
+  volatile VALUE ev_value = event_obj_new(d->type, d->req_id, d->rc, &ev);
+
+  switch (d->type) {
+    case ZKRB_WATCHER:
+      ev->watch_type  = d->watch_type;
+      ev->watch_state = d->watch_state;
+      ZKH_SET_FIELD(ev, ZKRB_EV_PATH, d->path ? rb_str_new2(d->path) : Qnil);
+      break;
+    case ZKRB_DATA:
+      ZKH_SET_FIELD(ev, ZKRB_EV_DATA, d->value ? rb_str_new(d->value, d->value_len) : Qnil);
+      ZKH_SET_FIELD(ev, ZKRB_EV_STAT, zkrb_stat_to_ruby(d->stat));
+      break;
+    case ZKRB_STAT:
+      ZKH_SET_FIELD(ev, ZKRB_EV_STAT, zkrb_stat_to_ruby(d->stat));
+      break;
+    case ZKRB_STRING:
+      ZKH_SET_FIELD(ev, ZKRB_EV_STRING, d->value ? rb_str_new2(d->value) : Qnil);
+      break;
+    case ZKRB_STRINGS:
+      ZKH_SET_FIELD(ev, ZKRB_EV_STRINGS, d->strings ? zkrb_children_to_ruby(d->strings, d->flags) : Qnil);
+      break;
+    case ZKRB_STRINGS_STAT:
+      ZKH_SET_FIELD(ev, ZKRB_EV_STRINGS, d->strings ? zkrb_children_to_ruby(d->strings, d->flags) : Qnil);
+      ZKH_SET_FIELD(ev, ZKRB_EV_STAT, zkrb_stat_to_ruby(d->stat));
+      break;
+    case ZKRB_ACL:
+      ZKH_SET_FIELD(ev, ZKRB_EV_ACL, d->acls ? zkrb_acl_vector_to_ruby(d->acls) : Qnil);
+      ZKH_SET_FIELD(ev, ZKRB_EV_STAT, zkrb_stat_to_ruby(d->stat));
+      break;
+    case ZKRB_MULTI:
+      ZKH_SET_FIELD(ev, ZKRB_EV_RESULTS, zkrb_multi_results_to_ruby(d->multi, d->rc));
+      break;
+  }
+
+  zkrb_deliver(d->queue, ev_value);
+  return Qnil;
+}
+
+/*
+  builds and delivers the event under rb_protect. if that raised, the
+  completion goes on the (otherwise unused) ring instead, as a bare event
+  carrying ZSYSTEMERROR, so its caller still hears about it, and the error
+  is logged. anything that isn't an error (a thread kill, an interrupt) is
+  kept on the queue and re-raised by zkrb_queue_reraise once
+  zookeeper_process has returned; until then every completion takes the
+  fallback path. zkrb_take_events moves the ring's events to pending.
+*/
+static void zkrb_direct_deliver(zkrb_direct_t *d) {
+  zkrb_queue_t *q = d->queue;
+  zkrb_event_t *event;
+  VALUE err;
+  int state = 0;
+
+  if (!q->raised) {
+    rb_protect(direct_build, (VALUE)d, &state);
+    if (!state) return;
+
+    err = rb_errinfo();
+
+    if (rb_obj_is_kind_of(err, rb_eStandardError) || rb_obj_is_kind_of(err, rb_eNoMemError)) {
+      log_err("building the event for req_id %"PRId64" raised %s, delivering ZSYSTEMERROR instead",
+          d->req_id, rb_obj_classname(err));
+      rb_set_errinfo(Qnil);
+    } else {
+      q->raised = state;    // a thread kill, an interrupt and the like
+    }
+  }
+
+  if (!(event = zkrb_event_alloc(q, d->type == ZKRB_WATCHER ? ZKRB_WATCHER : ZKRB_VOID))) {
+    log_err("no memory for an event, dropping the completion for req_id %"PRId64, d->req_id);
+    return;
+  }
+
+  event->req_id = d->req_id;
+  event->flags  = d->flags;
+
+  if (d->type == ZKRB_WATCHER) {
+    struct zkrb_watcher_completion *wc = event->completion.watcher_completion;
+    wc->type  = d->watch_type;
+    wc->state = d->watch_state;
+    wc->path  = d->path ? strdup(d->path) : NULL;
+  } else {
+    event->rc = ZSYSTEMERROR;
+  }
+
+  zkrb_enqueue(q, event);
+}
+#endif
+
 void zkrb_state_callback(
     zhandle_t *zh, int type, int state, const char *path, void *calling_ctx) {
 
@@ -439,27 +1538,46 @@ void zkrb_state_callback(
                     "type = %d, state = %d, path = %p, value = %s",
       type, state, (void *) path, path ? path : "NULL");
 
-  /* save callback context */
-  struct zkrb_watcher_completion *wc = zk_malloc(sizeof(struct zkrb_watcher_completion));
-  wc->type  = type;
-  wc->state = state;
-  wc->path  = strdup(path);
-
   // This is unfortunate copy-pasta from ZKH_SETUP_EVENT with one change: we
   // check type instead of the req_id to see if we need to free the ctx.
   zkrb_calling_context *ctx = (zkrb_calling_context *) calling_ctx;
-  zkrb_event_t *event = zkrb_event_alloc();
-  event->req_id = ctx->req_id;
   zkrb_queue_t *queue = ctx->queue;
+  int64_t req_id = ctx->req_id;
   if (type != ZOO_SESSION_EVENT) {
     zk_free(ctx);
     ctx = NULL;
   }
 
-  event->type = ZKRB_WATCHER;
-  event->completion.watcher_completion = wc;
+#if ZKRB_COMPLETIONS_OFF_GVL
+  zkrb_event_t *event = zkrb_event_alloc(queue, ZKRB_WATCHER);
+  if (event == NULL) {
+    log_err("no memory for an event, dropping the watch event for req_id %"PRId64, req_id);
+    return;
+  }
+
+  event->req_id = req_id;
+
+  /* save callback context */
+  struct zkrb_watcher_completion *wc = event->completion.watcher_completion;
+  wc->type  = type;
+  wc->state = state;
+  wc->path  = path ? strdup(path) : NULL;
 
   zkrb_enqueue(queue, event);
+#else
+  if (queue->closing) return;
+
+  zkrb_direct_t d;
+  memset(&d, 0, sizeof(d));
+  d.queue       = queue;
+  d.type        = ZKRB_WATCHER;
+  d.req_id      = req_id;
+  d.watch_type  = type;
+  d.watch_state = state;
+  d.path        = path;
+
+  zkrb_direct_deliver(&d);
+#endif
 }
 
 void zkrb_data_callback(
@@ -469,26 +1587,35 @@ void zkrb_data_callback(
                 "rc = %d (%s), value = %s, len = %d",
                 rc, zerror(rc), value ? value : "NULL", value_len);
 
+#if ZKRB_COMPLETIONS_OFF_GVL
+  ZKH_SETUP_EVENT(queue, event, ZKRB_DATA);
+  event->rc = rc;
+
   /* copy data completion */
-  struct zkrb_data_completion *dc = zk_malloc(sizeof(struct zkrb_data_completion));
+  struct zkrb_data_completion *dc = event->completion.data_completion;
   dc->data = NULL;
-  dc->stat = NULL;
   dc->data_len = 0;
 
   if (value != NULL) {
-    dc->data = zk_malloc(value_len);  // xmalloc may raise an exception, which means the above completion will leak
-    dc->data_len = value_len;
-    memcpy(dc->data, value, value_len);
+    if ((dc->data = malloc(value_len))) {
+      dc->data_len = value_len;
+      memcpy(dc->data, value, value_len);
+    } else {
+      log_err("no memory for the data of req_id %"PRId64, event->req_id);
+      event->rc = ZSYSTEMERROR;
+    }
   }
 
-  if (stat != NULL) { dc->stat = zk_malloc(sizeof(struct Stat)); memcpy(dc->stat, stat, sizeof(struct Stat)); }
-
-  ZKH_SETUP_EVENT(queue, event);
-  event->rc = rc;
-  event->type = ZKRB_DATA;
-  event->completion.data_completion = dc;
+  ZKH_COPY_STAT(dc->stat, stat);
 
   zkrb_enqueue(queue, event);
+#else
+  ZKH_SETUP_DIRECT(queue, d, ZKRB_DATA, rc);
+  d.value     = value;
+  d.value_len = value_len;
+  d.stat      = stat;
+  zkrb_direct_deliver(&d);
+#endif
 }
 
 void zkrb_stat_callback(
@@ -496,16 +1623,19 @@ void zkrb_stat_callback(
   zkrb_debug("ZOOKEEPER_C_STAT WATCHER "
                     "rc = %d (%s)", rc, zerror(rc));
 
-  struct zkrb_stat_completion *sc = zk_malloc(sizeof(struct zkrb_stat_completion));
-  sc->stat = NULL;
-  if (stat != NULL) { sc->stat = zk_malloc(sizeof(struct Stat)); memcpy(sc->stat, stat, sizeof(struct Stat)); }
-
-  ZKH_SETUP_EVENT(queue, event);
+#if ZKRB_COMPLETIONS_OFF_GVL
+  ZKH_SETUP_EVENT(queue, event, ZKRB_STAT);
   event->rc = rc;
-  event->type = ZKRB_STAT;
-  event->completion.stat_completion = sc;
+
+  struct zkrb_stat_completion *sc = event->completion.stat_completion;
+  ZKH_COPY_STAT(sc->stat, stat);
 
   zkrb_enqueue(queue, event);
+#else
+  ZKH_SETUP_DIRECT(queue, d, ZKRB_STAT, rc);
+  d.stat = stat;
+  zkrb_direct_deliver(&d);
+#endif
 }
 
 void zkrb_string_callback(
@@ -514,17 +1644,21 @@ void zkrb_string_callback(
   zkrb_debug("ZOOKEEPER_C_STRING WATCHER "
                     "rc = %d (%s)", rc, zerror(rc));
 
-  struct zkrb_string_completion *sc = zk_malloc(sizeof(struct zkrb_string_completion));
+#if ZKRB_COMPLETIONS_OFF_GVL
+  ZKH_SETUP_EVENT(queue, event, ZKRB_STRING);
+  event->rc = rc;
+
+  struct zkrb_string_completion *sc = event->completion.string_completion;
   sc->value = NULL;
   if (string)
     sc->value = strdup(string);
 
-  ZKH_SETUP_EVENT(queue, event);
-  event->rc = rc;
-  event->type = ZKRB_STRING;
-  event->completion.string_completion = sc;
-
   zkrb_enqueue(queue, event);
+#else
+  ZKH_SETUP_DIRECT(queue, d, ZKRB_STRING, rc);
+  d.value = string;
+  zkrb_direct_deliver(&d);
+#endif
 }
 
 void zkrb_strings_callback(
@@ -532,16 +1666,20 @@ void zkrb_strings_callback(
   zkrb_debug("ZOOKEEPER_C_STRINGS WATCHER "
                     "rc = %d (%s), calling_ctx = %p", rc, zerror(rc), calling_ctx);
 
+#if ZKRB_COMPLETIONS_OFF_GVL
+  ZKH_SETUP_EVENT(queue, event, ZKRB_STRINGS);
+  event->rc = rc;
+
   /* copy string vector */
-  struct zkrb_strings_completion *sc = zk_malloc(sizeof(struct zkrb_strings_completion));
+  struct zkrb_strings_completion *sc = event->completion.strings_completion;
   sc->values = (strings != NULL) ? zkrb_clone_string_vector(strings) : NULL;
 
-  ZKH_SETUP_EVENT(queue, event);
-  event->rc = rc;
-  event->type = ZKRB_STRINGS;
-  event->completion.strings_completion = sc;
-
   zkrb_enqueue(queue, event);
+#else
+  ZKH_SETUP_DIRECT(queue, d, ZKRB_STRINGS, rc);
+  d.strings = strings;
+  zkrb_direct_deliver(&d);
+#endif
 }
 
 void zkrb_strings_stat_callback(
@@ -549,115 +1687,500 @@ void zkrb_strings_stat_callback(
   zkrb_debug("ZOOKEEPER_C_STRINGS_STAT WATCHER "
                     "rc = %d (%s), calling_ctx = %p", rc, zerror(rc), calling_ctx);
 
-  struct zkrb_strings_stat_completion *sc = zk_malloc(sizeof(struct zkrb_strings_stat_completion));
-  sc->stat = NULL;
-  if (stat != NULL) { sc->stat = zk_malloc(sizeof(struct Stat)); memcpy(sc->stat, stat, sizeof(struct Stat)); }
+#if ZKRB_COMPLETIONS_OFF_GVL
+  ZKH_SETUP_EVENT(queue, event, ZKRB_STRINGS_STAT);
+  event->rc = rc;
+
+  struct zkrb_strings_stat_completion *sc = event->completion.strings_stat_completion;
+  ZKH_COPY_STAT(sc->stat, stat);
 
   sc->values = (strings != NULL) ? zkrb_clone_string_vector(strings) : NULL;
 
-  ZKH_SETUP_EVENT(queue, event);
-  event->rc = rc;
-  event->type = ZKRB_STRINGS_STAT;
-  event->completion.strings_stat_completion = sc;
-
   zkrb_enqueue(queue, event);
+#else
+  ZKH_SETUP_DIRECT(queue, d, ZKRB_STRINGS_STAT, rc);
+  d.strings = strings;
+  d.stat    = stat;
+  zkrb_direct_deliver(&d);
+#endif
 }
 
 void zkrb_void_callback(int rc, const void *calling_ctx) {
   zkrb_debug("ZOOKEEPER_C_VOID WATCHER "
                     "rc = %d (%s)", rc, zerror(rc));
 
-  ZKH_SETUP_EVENT(queue, event);
+#if ZKRB_COMPLETIONS_OFF_GVL
+  ZKH_SETUP_EVENT(queue, event, ZKRB_VOID);
   event->rc = rc;
-  event->type = ZKRB_VOID;
-  event->completion.void_completion = NULL;
 
   zkrb_enqueue(queue, event);
+#else
+  ZKH_SETUP_DIRECT(queue, d, ZKRB_VOID, rc);
+  zkrb_direct_deliver(&d);
+#endif
 }
 
 void zkrb_acl_callback(
     int rc, struct ACL_vector *acls, struct Stat *stat, const void *calling_ctx) {
   zkrb_debug("ZOOKEEPER_C_ACL WATCHER rc = %d (%s)", rc, zerror(rc));
 
-  struct zkrb_acl_completion *ac = zk_malloc(sizeof(struct zkrb_acl_completion));
+#if ZKRB_COMPLETIONS_OFF_GVL
+  ZKH_SETUP_EVENT(queue, event, ZKRB_ACL);
+  event->rc = rc;
+
+  struct zkrb_acl_completion *ac = event->completion.acl_completion;
   ac->acl = NULL;
-  ac->stat = NULL;
   if (acls != NULL) { ac->acl  = zkrb_clone_acl_vector(acls); }
-  if (stat != NULL) { ac->stat = zk_malloc(sizeof(struct Stat)); memcpy(ac->stat, stat, sizeof(struct Stat)); }
-
-  ZKH_SETUP_EVENT(queue, event);
-  event->rc = rc;
-  event->type = ZKRB_ACL;
-  event->completion.acl_completion = ac;
+  ZKH_COPY_STAT(ac->stat, stat);
 
   /* should be synchronized */
   zkrb_enqueue(queue, event);
+#else
+  ZKH_SETUP_DIRECT(queue, d, ZKRB_ACL, rc);
+  d.acls = acls;
+  d.stat = stat;
+  zkrb_direct_deliver(&d);
+#endif
 }
 
-VALUE zkrb_id_to_ruby(struct Id *id) {
-  VALUE hash = rb_hash_new();
-  rb_hash_aset(hash, GET_SYM("scheme"), rb_str_new2(id->scheme));
-  rb_hash_aset(hash, GET_SYM("id"), rb_str_new2(id->id));
-  return hash;
-}
-
-VALUE zkrb_acl_to_ruby(struct ACL *acl) {
-  VALUE hash = rb_hash_new();
-  rb_hash_aset(hash, GET_SYM("perms"), INT2NUM(acl->perms));
-  rb_hash_aset(hash, GET_SYM("id"), zkrb_id_to_ruby(&(acl->id)));
-  return hash;
-}
+void zkrb_multi_callback(
+    int rc, const void *calling_ctx) {
+  zkrb_debug("ZOOKEEPER_C_MULTI WATCHER rc = %d (%s)", rc, zerror(rc));
 
-// [wickman] TODO test zkrb_ruby_to_aclvector
-// [slyphon] TODO size checking on acl_ary (cast to int)
-struct ACL_vector * zkrb_ruby_to_aclvector(VALUE acl_ary) {
-  Check_Type(acl_ary, T_ARRAY);
+  zkrb_multi_t *multi = ((zkrb_calling_context *) calling_ctx)->multi;
 
-  struct ACL_vector *v = zk_malloc(sizeof(struct ACL_vector));
-  allocate_ACL_vector(v, (int)RARRAY_LEN(acl_ary));
+#if ZKRB_COMPLETIONS_OFF_GVL
+  ZKH_SETUP_EVENT(queue, event, ZKRB_MULTI);
+  event->rc = rc;
+  event->completion.multi_completion->multi = multi;    // freed with the event
 
-  int k;
-  for (k = 0; k < v->count; ++k) {
-    VALUE acl_val = rb_ary_entry(acl_ary, k);
-    v->data[k] = zkrb_ruby_to_acl(acl_val);
-  }
+  zkrb_enqueue(queue, event);
+#else
+  // not ZKH_SETUP_DIRECT, the multi has to be freed on the closing path too
+  zkrb_calling_context *ctx = (zkrb_calling_context *) calling_ctx;
+  zkrb_queue_t *queue = ctx->queue;
+  zkrb_direct_t d;
+
+  memset(&d, 0, sizeof(d));
+  d.queue  = queue;
+  d.type   = ZKRB_MULTI;
+  d.req_id = ctx->req_id;
+  d.rc     = rc;
+  d.multi  = multi;
+  zk_free(ctx);
 
-  return v;
+  if (!queue->closing) zkrb_direct_deliver(&d);
+  zkrb_multi_free(multi);
+#endif
 }
 
-// [wickman] TODO test zkrb_ruby_to_aclvector
-struct ACL zkrb_ruby_to_acl(VALUE rubyacl) {
-  struct ACL acl;
+/*
+  an Array with a Hash per op, in the order they were submitted:
 
-  VALUE perms  = rb_iv_get(rubyacl, "@perms");
-  VALUE rubyid = rb_iv_get(rubyacl, "@id");
-  acl.perms  = NUM2INT(perms);
-  acl.id = zkrb_ruby_to_id(rubyid);
+    { :type => ZOO_*_OP, :rc => Integer }
 
-  return acl;
-}
+  plus :path for a successful create and :stat for a successful set.
 
-// [wickman] TODO zkrb_ruby_to_id error checking? test
-struct Id zkrb_ruby_to_id(VALUE rubyid) {
-  struct Id id;
+  when the server rejects a transaction it reports the error of the op that
+  failed, ZOK for the ops before it and ZRUNTIMEINCONSISTENCY for the ones
+  after it. if the request never got an answer
+  (connection loss, session expiry, close) zkc leaves the per-op results
+  untouched, so every op gets the overall rc instead.
+*/
+VALUE zkrb_multi_results_to_ruby(const zkrb_multi_t *multi, int rc) {
+  VALUE ary;
+  int k, answered = (rc == ZOK);
 
-  VALUE scheme = rb_iv_get(rubyid, "@scheme");
-  VALUE ident  = rb_iv_get(rubyid, "@id");
+  if (!multi) return Qnil;
 
-  if (scheme != Qnil) {
-    id.scheme = zk_malloc(RSTRING_LEN(scheme) + 1);
-    strncpy(id.scheme, RSTRING_PTR(scheme), RSTRING_LEN(scheme));
-    id.scheme[RSTRING_LEN(scheme)] = '\0';
-  } else {
-    id.scheme = NULL;
+  for (k = 0; !answered && k < multi->count; ++k) {
+    if (multi->results[k].err != ZOK) answered = 1;
   }
 
-  if (ident != Qnil) {
-    id.id = zk_malloc(RSTRING_LEN(ident) + 1);
-    strncpy(id.id, RSTRING_PTR(ident), RSTRING_LEN(ident));
-    id.id[RSTRING_LEN(ident)] = '\0';
+  ary = rb_ary_new2(multi->count);
+
+  for (k = 0; k < multi->count; ++k) {
+    const zoo_op_result_t *result = &multi->results[k];
+    int err = answered ? result->err : rc;
+    VALUE hash = rb_hash_new();
+
+    rb_hash_aset(hash, event_field_syms[ZKRB_EV_TYPE], INT2FIX(multi->types[k]));
+    rb_hash_aset(hash, event_field_syms[ZKRB_EV_RC], INT2FIX(err));
+
+    if (rc == ZOK && err == ZOK) {
+      switch (multi->types[k]) {
+        case ZOO_CREATE_OP:
+          rb_hash_aset(hash, event_field_syms[ZKRB_EV_PATH], result->value ? rb_str_new2(result->value) : Qnil);
+          break;
+        case ZOO_SETDATA_OP:
+          rb_hash_aset(hash, event_field_syms[ZKRB_EV_STAT], zkrb_stat_to_ruby(result->stat));
+          break;
+      }
+    }
+
+    rb_ary_push(ary, hash);
+  }
+
+  return ary;
+}
+
+/*
+  the subtree walk behind CZookeeper#zkrb_get_tree.
+
+  instead of a round trip per node from ruby, the walk is driven from zkc's
+  completions: each node is read with zoo_aget (zoo_aexists if the caller
+  only wants the stats), and the ones that have
+  children (and aren't at max_depth) are listed with zoo_aget_children,
+  whose completion adds the children to the walk. a request goes out as
+  soon as another comes back, so there are up to 'concurrency' of them on
+  the wire the whole time. once the last one is back the whole tree goes to
+  the ruby side as a single ZKRB_TREE event.
+
+  all of it happens inside zkc's completions, so it's plain malloc/free,
+  and the ruby objects for the tree aren't built until the event is read:
+  it goes through the ring even when completions are otherwise delivered
+  directly (zkrb_take_events picks it up).
+
+  a node that's deleted between being listed and being read is left out,
+  any other error stops the walk. it's reported once the requests already
+  sent have come back.
+*/
+
+typedef struct {
+  zkrb_tree_t *tree;
+  int         index;
+} zkrb_tree_req_t;
+
+static void tree_data_callback(
+    int rc, const char *value, int value_len, const struct Stat *stat, const void *data);
+
+static void tree_stat_callback(
+    int rc, const struct Stat *stat, const void *data);
+
+static void tree_children_callback(
+    int rc, const struct String_vector *strings, const void *data);
+
+// appends parent/name (or just name, for the node the walk starts at)
+static int tree_add_node(zkrb_tree_t *tree, const char *parent, const char *name, int depth) {
+  zkrb_tree_node_t *node;
+  size_t plen = 0, nlen = strlen(name);
+
+  if (tree->count == tree->capacity) {
+    int capacity = tree->capacity ? tree->capacity * 2 : 64;
+    zkrb_tree_node_t *nodes = realloc(tree->nodes, capacity * sizeof(zkrb_tree_node_t));
+    if (!nodes) return ZSYSTEMERROR;
+
+    tree->nodes    = nodes;
+    tree->capacity = capacity;
+  }
+
+  node = &tree->nodes[tree->count];
+  memset(node, 0, sizeof(zkrb_tree_node_t));
+  node->depth = depth;
+
+  if (parent) {
+    plen = strlen(parent);
+    if (plen == 1) plen = 0;    // the children of "/"
+  }
+
+  if (!(node->path = malloc(plen + nlen + 2))) return ZSYSTEMERROR;
+
+  if (parent) {
+    memcpy(node->path, parent, plen);
+    node->path[plen++] = '/';
+  }
+  memcpy(node->path + plen, name, nlen + 1);
+
+  tree->count++;
+  return ZOK;
+}
+
+static int tree_send(zkrb_tree_t *tree, int index, int children) {
+  zkrb_tree_req_t *req = malloc(sizeof(zkrb_tree_req_t));
+  int rc;
+
+  if (!req) return ZSYSTEMERROR;
+
+  req->tree  = tree;
+  req->index = index;
+
+  if (children) {
+    rc = zoo_aget_children(tree->zh, tree->nodes[index].path, 0, tree_children_callback, req);
+  } else if (tree->stat_only) {
+    rc = zoo_aexists(tree->zh, tree->nodes[index].path, 0, tree_stat_callback, req);
   } else {
-    id.id = NULL;
+    rc = zoo_aget(tree->zh, tree->nodes[index].path, 0, tree_data_callback, req);
+  }
+
+  if (rc == ZOK) {
+    tree->outstanding++;
+  } else {
+    free(req);
+  }
+
+  return rc;
+}
+
+inline static void tree_fail(zkrb_tree_t *tree, int rc) {
+  if (tree->rc == ZOK) tree->rc = rc;
+}
+
+// hands the finished walk to the ruby side, it's freed along with the event
+static void tree_finish(zkrb_tree_t *tree) {
+  zkrb_queue_t *queue = tree->queue;
+
+  zkrb_debug("ZOOKEEPER_C_TREE req_id = %"PRId64", rc = %d (%s), nodes = %d",
+      tree->req_id, tree->rc, zerror(tree->rc), tree->count);
+
+  zkrb_event_t *event = zkrb_event_alloc(queue, ZKRB_TREE);
+  if (event == NULL) {
+    log_err("no memory for an event, dropping the get_tree result for req_id %"PRId64, tree->req_id);
+    zkrb_tree_free(tree);
+    return;
+  }
+
+  event->req_id = tree->req_id;
+  event->rc     = tree->rc;
+  event->completion.tree_completion->tree = tree;
+
+  zkrb_enqueue(queue, event);
+}
+
+// asks for the next nodes, as far as the window lets us, and finishes the
+// walk once there's nothing left to wait for
+static void tree_pump(zkrb_tree_t *tree) {
+  int rc;
+
+  while (tree->rc == ZOK && tree->next < tree->count && tree->outstanding < tree->concurrency) {
+    if ((rc = tree_send(tree, tree->next++, 0)) != ZOK) tree_fail(tree, rc);
+  }
+
+  if (tree->outstanding == 0) tree_finish(tree);
+}
+
+// what the data and stat completions have in common: value is NULL for
+// the latter
+static void tree_node_read(
+    const void *data, int rc, const char *value, int value_len, const struct Stat *stat) {
+
+  zkrb_tree_req_t *req = (zkrb_tree_req_t *) data;
+  zkrb_tree_t *tree = req->tree;
+  int index = req->index;
+  zkrb_tree_node_t *node = &tree->nodes[index];
+
+  free(req);
+  tree->outstanding--;
+
+  if (rc == ZOK) {
+    memcpy(&node->stat, stat, sizeof(struct Stat));
+
+    if (value != NULL && value_len >= 0) {
+      if ((node->data = malloc(value_len + 1))) {
+        memcpy(node->data, value, value_len);
+        node->data_len = value_len;
+      } else {
+        tree_fail(tree, ZSYSTEMERROR);
+      }
+    }
+
+    if (tree->rc == ZOK && stat->numChildren > 0 && (tree->max_depth < 0 || node->depth < tree->max_depth)) {
+      if ((rc = tree_send(tree, index, 1)) != ZOK) tree_fail(tree, rc);
+    }
+  } else if (rc == ZNONODE && index > 0) {
+    node->gone = 1;
+  } else {
+    tree_fail(tree, rc);
+  }
+
+  tree_pump(tree);
+}
+
+static void tree_data_callback(
+    int rc, const char *value, int value_len, const struct Stat *stat, const void *data) {
+  tree_node_read(data, rc, value, value_len, stat);
+}
+
+static void tree_stat_callback(
+    int rc, const struct Stat *stat, const void *data) {
+  tree_node_read(data, rc, NULL, -1, stat);
+}
+
+static void tree_children_callback(
+    int rc, const struct String_vector *strings, const void *data) {
+
+  zkrb_tree_req_t *req = (zkrb_tree_req_t *) data;
+  zkrb_tree_t *tree = req->tree;
+  int index = req->index, k;
+
+  free(req);
+  tree->outstanding--;
+
+  if (rc == ZOK) {
+    // the node's path is its own allocation, adding nodes doesn't move it
+    const char *parent = tree->nodes[index].path;
+    int depth = tree->nodes[index].depth + 1;
+
+    for (k = 0; strings && tree->rc == ZOK && k < strings->count; ++k) {
+      if ((rc = tree_add_node(tree, parent, strings->data[k], depth)) != ZOK) tree_fail(tree, rc);
+    }
+  } else if (rc != ZNONODE) {   // deleted since we read it, it has no children now
+    tree_fail(tree, rc);
+  }
+
+  tree_pump(tree);
+}
+
+/*
+  starts walking the subtree at path, max_depth levels deep (-1 for all of
+  them), without the nodes' data if stat_only is set. returns the rc of the
+  first request, if that's not ZOK nothing was sent and there will be no
+  event.
+*/
+int zkrb_tree_start(zhandle_t *zh, zkrb_queue_t *queue, int64_t req_id,
+                    const char *path, int max_depth, int concurrency, int stat_only) {
+  zkrb_tree_t *tree = calloc(1, sizeof(zkrb_tree_t));
+  int rc;
+
+  if (!tree) return ZSYSTEMERROR;
+
+  tree->zh          = zh;
+  tree->queue       = queue;
+  tree->req_id      = req_id;
+  tree->max_depth   = max_depth;
+  tree->concurrency = concurrency > 0 ? concurrency : 1;
+  tree->stat_only   = stat_only;
+  tree->rc          = ZOK;
+
+  if ((rc = tree_add_node(tree, NULL, path, 0)) == ZOK) {
+    tree->next = 1;
+    rc = tree_send(tree, 0, 0);
+  }
+
+  if (rc != ZOK) zkrb_tree_free(tree);
+  return rc;
+}
+
+void zkrb_tree_free(zkrb_tree_t *tree) {
+  int k;
+
+  if (!tree) return;
+
+  for (k = 0; k < tree->count; ++k) {
+    free(tree->nodes[k].path);
+    free(tree->nodes[k].data);
+  }
+
+  free(tree->nodes);
+  free(tree);
+}
+
+/*
+  an Array with a [path, data, stat] triple for each node of the subtree, in
+  breadth first order, starting with the node the walk started at. nil if
+  the walk failed.
+*/
+VALUE zkrb_tree_results_to_ruby(const zkrb_tree_t *tree) {
+  VALUE ary;
+  int k;
+
+  if (!tree || tree->rc != ZOK) return Qnil;
+
+  ary = rb_ary_new2(tree->count);
+
+  for (k = 0; k < tree->count; ++k) {
+    const zkrb_tree_node_t *node = &tree->nodes[k];
+    if (node->gone) continue;
+
+    rb_ary_push(ary, rb_ary_new3(3,
+          rb_str_new2(node->path),
+          node->data ? rb_str_new(node->data, node->data_len) : Qnil,
+          zkrb_stat_to_ruby(&node->stat)));
+  }
+
+  return ary;
+}
+
+VALUE zkrb_id_to_ruby(struct Id *id) {
+  VALUE hash = rb_hash_new();
+  rb_hash_aset(hash, sym_scheme, rb_str_new2(id->scheme));
+  rb_hash_aset(hash, sym_id, rb_str_new2(id->id));
+  return hash;
+}
+
+VALUE zkrb_acl_to_ruby(struct ACL *acl) {
+  VALUE hash = rb_hash_new();
+  rb_hash_aset(hash, sym_perms, INT2NUM(acl->perms));
+  rb_hash_aset(hash, sym_id, zkrb_id_to_ruby(&(acl->id)));
+  return hash;
+}
+
+// [wickman] TODO test zkrb_ruby_to_aclvector
+// [slyphon] TODO size checking on acl_ary (cast to int)
+//
+// the vector is freed with zkc's deallocate_ACL_vector, so it comes from plain
+// malloc, and everything that can raise is checked before it's allocated
+struct ACL_vector * zkrb_ruby_to_aclvector(VALUE acl_ary) {
+  Check_Type(acl_ary, T_ARRAY);
+
+  int k, count = (int)RARRAY_LEN(acl_ary);
+
+  for (k = 0; k < count; ++k) {
+    VALUE acl_val = rb_ary_entry(acl_ary, k);
+    VALUE rubyid  = rb_iv_get(acl_val, "@id");
+    VALUE scheme  = rb_iv_get(rubyid, "@scheme");
+    VALUE ident   = rb_iv_get(rubyid, "@id");
+
+    NUM2INT(rb_iv_get(acl_val, "@perms"));
+    if (!NIL_P(scheme)) Check_Type(scheme, T_STRING);
+    if (!NIL_P(ident))  Check_Type(ident, T_STRING);
+  }
+
+  struct ACL_vector *v = malloc(sizeof(struct ACL_vector));
+  if (v) allocate_ACL_vector(v, count);
+
+  if (!v || (count && !v->data)) {
+    free(v);
+    rb_raise(rb_eNoMemError, "could not allocate ACL vector of %d entries", count);
+  }
+
+  for (k = 0; k < v->count; ++k) {
+    VALUE acl_val = rb_ary_entry(acl_ary, k);
+    v->data[k] = zkrb_ruby_to_acl(acl_val);
+  }
+
+  return v;
+}
+
+// [wickman] TODO test zkrb_ruby_to_aclvector
+struct ACL zkrb_ruby_to_acl(VALUE rubyacl) {
+  struct ACL acl;
+
+  VALUE perms  = rb_iv_get(rubyacl, "@perms");
+  VALUE rubyid = rb_iv_get(rubyacl, "@id");
+  acl.perms  = NUM2INT(perms);
+  acl.id = zkrb_ruby_to_id(rubyid);
+
+  return acl;
+}
+
+// [wickman] TODO zkrb_ruby_to_id error checking? test
+struct Id zkrb_ruby_to_id(VALUE rubyid) {
+  struct Id id;
+
+  VALUE scheme = rb_iv_get(rubyid, "@scheme");
+  VALUE ident  = rb_iv_get(rubyid, "@id");
+
+  // freed by deallocate_ACL_vector too
+  id.scheme = NULL;
+  if (scheme != Qnil && (id.scheme = malloc(RSTRING_LEN(scheme) + 1))) {
+    strncpy(id.scheme, RSTRING_PTR(scheme), RSTRING_LEN(scheme));
+    id.scheme[RSTRING_LEN(scheme)] = '\0';
+  }
+
+  id.id = NULL;
+  if (ident != Qnil && (id.id = malloc(RSTRING_LEN(ident) + 1))) {
+    strncpy(id.id, RSTRING_PTR(ident), RSTRING_LEN(ident));
+    id.id[RSTRING_LEN(ident)] = '\0';
   }
 
   return id;
@@ -712,9 +2235,623 @@ VALUE zkrb_stat_to_rhash(const struct Stat *stat) {
   return ary;
 }
 
+/*
+  Zookeeper::Stat
+
+  holds a struct Stat by value, fields are only turned into ruby numbers when
+  they're read. comparison (by mzxid, then version) and equality work on the
+  struct directly, without allocating.
+*/
+
+VALUE ZookeeperStat = Qnil;
+
+typedef struct {
+  int           exists;
+  unsigned int  present;  // bitmask of the fields that were given, the rest read as nil
+  struct Stat   stat;
+} zkrb_stat_obj_t;
+
+// in the order of the array form (see zkrb_stat_to_rarray)
+static const struct {
+  const char  *name;
+  size_t      offset;
+  int         is64;
+} stat_fields[] = {
+  { "czxid",          offsetof(struct Stat, czxid),          1 },
+  { "mzxid",          offsetof(struct Stat, mzxid),          1 },
+  { "ctime",          offsetof(struct Stat, ctime),          1 },
+  { "mtime",          offsetof(struct Stat, mtime),          1 },
+  { "version",        offsetof(struct Stat, version),        0 },
+  { "cversion",       offsetof(struct Stat, cversion),       0 },
+  { "aversion",       offsetof(struct Stat, aversion),       0 },
+  { "ephemeralOwner", offsetof(struct Stat, ephemeralOwner), 1 },
+  { "dataLength",     offsetof(struct Stat, dataLength),     0 },
+  { "numChildren",    offsetof(struct Stat, numChildren),    0 },
+  { "pzxid",          offsetof(struct Stat, pzxid),          1 },
+};
+
+#define ZKRB_STAT_NFIELDS (sizeof(stat_fields) / sizeof(stat_fields[0]))
+#define ZKRB_STAT_ALL_FIELDS ((1u << ZKRB_STAT_NFIELDS) - 1)
+
+#define STAT_HAS_FIELD(obj, i) ((obj)->present & (1u << (i)))
+
+static VALUE stat_field_syms[ZKRB_STAT_NFIELDS];
+
+static const rb_data_type_t zkrb_stat_data_type = {
+  "Zookeeper::Stat",
+  { 0, RUBY_TYPED_DEFAULT_FREE, 0, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+#define FETCH_STAT_OBJ(self, obj) \
+  zkrb_stat_obj_t *obj; \
+  TypedData_Get_Struct((self), zkrb_stat_obj_t, &zkrb_stat_data_type, obj)
+
+#define IS_STAT(val) rb_typeddata_is_kind_of((val), &zkrb_stat_data_type)
+
+static int64_t stat_field_get(const struct Stat *stat, int i) {
+  const char *p = (const char *) stat + stat_fields[i].offset;
+  return stat_fields[i].is64 ? *(const int64_t *) p : *(const int32_t *) p;
+}
+
+// a nil or missing val leaves the field unset, like the old ruby Stat did
+static void stat_field_set(zkrb_stat_obj_t *obj, int i, VALUE val) {
+  char *p = (char *) &obj->stat + stat_fields[i].offset;
+
+  if (NIL_P(val) || val == Qundef) return;
+
+  if (stat_fields[i].is64)
+    *(int64_t *) p = NUM2LL(val);
+  else
+    *(int32_t *) p = NUM2INT(val);
+
+  obj->present |= 1u << i;
+}
+
+static VALUE stat_field_to_ruby(zkrb_stat_obj_t *obj, int i) {
+  if (!obj->exists || !STAT_HAS_FIELD(obj, i)) return Qnil;
+  return stat_fields[i].is64 ? LL2NUM(stat_field_get(&obj->stat, i)) : INT2FIX(stat_field_get(&obj->stat, i));
+}
+
+static VALUE stat_alloc(VALUE klass) {
+  zkrb_stat_obj_t *obj;
+  return TypedData_Make_Struct(klass, zkrb_stat_obj_t, &zkrb_stat_data_type, obj);
+}
+
+VALUE zkrb_stat_to_ruby(const struct Stat *stat) {
+  zkrb_stat_obj_t *obj;
+  VALUE self = TypedData_Make_Struct(ZookeeperStat, zkrb_stat_obj_t, &zkrb_stat_data_type, obj);
+
+  if (stat) {
+    obj->exists  = 1;
+    obj->present = ZKRB_STAT_ALL_FIELDS;
+    memcpy(&obj->stat, stat, sizeof(struct Stat));
+  }
+
+  return self;
+}
+
+// Stat.new(nil), Stat.new(array_of_11), Stat.new(hash) or Stat.new(stat)
+static VALUE stat_method_initialize(int argc, VALUE *argv, VALUE self) {
+  VALUE val;
+  unsigned int i;
+  FETCH_STAT_OBJ(self, obj);
+
+  rb_scan_args(argc, argv, "01", &val);
+
+  memset(obj, 0, sizeof(*obj));
+
+  if (NIL_P(val)) {
+    return self;
+  }
+  else if (IS_STAT(val)) {
+    FETCH_STAT_OBJ(val, other);
+    memcpy(obj, other, sizeof(*obj));
+  }
+  else if (RB_TYPE_P(val, T_ARRAY)) {
+    obj->exists = 1;
+    for (i = 0; i < ZKRB_STAT_NFIELDS; i++) {
+      stat_field_set(obj, i, rb_ary_entry(val, i));
+    }
+  }
+  else if (RB_TYPE_P(val, T_HASH)) {
+    obj->exists = 1;
+    for (i = 0; i < ZKRB_STAT_NFIELDS; i++) {
+      VALUE v = rb_hash_lookup2(val, stat_field_syms[i], Qundef);
+      if (v == Qundef) v = rb_hash_lookup(val, rb_sym2str(stat_field_syms[i]));
+      stat_field_set(obj, i, v);
+    }
+  }
+  else {
+    rb_raise(rb_eArgError, "expected nil, an Array, a Hash or a Zookeeper::Stat, got %"PRIsVALUE, rb_obj_class(val));
+  }
+
+  return self;
+}
+
+static VALUE stat_method_initialize_copy(VALUE self, VALUE orig) {
+  if (self == orig) return self;
+  FETCH_STAT_OBJ(self, obj);
+  FETCH_STAT_OBJ(orig, other);
+  memcpy(obj, other, sizeof(*obj));
+  return self;
+}
+
+// returns val if it's already a Stat, otherwise Stat.new(val)
+static VALUE stat_klass_method_from(VALUE klass, VALUE val) {
+  if (IS_STAT(val)) return val;
+  return rb_class_new_instance(1, &val, klass);
+}
+
+static VALUE stat_method_exists(VALUE self) {
+  FETCH_STAT_OBJ(self, obj);
+  return obj->exists ? Qtrue : Qfalse;
+}
+
+#define STAT_READER(idx, field) \
+  static VALUE stat_method_##field(VALUE self) { \
+    FETCH_STAT_OBJ(self, obj); \
+    return stat_field_to_ruby(obj, (idx)); \
+  }
+
+STAT_READER(0,  czxid)
+STAT_READER(1,  mzxid)
+STAT_READER(2,  ctime)
+STAT_READER(3,  mtime)
+STAT_READER(4,  version)
+STAT_READER(5,  cversion)
+STAT_READER(6,  aversion)
+STAT_READER(7,  ephemeralOwner)
+STAT_READER(8,  dataLength)
+STAT_READER(9,  numChildren)
+STAT_READER(10, pzxid)
+
+#undef STAT_READER
+
+// compares field i, falling back to tie when they're equal. as with arrays,
+// a field that's only set on one side makes the two incomparable
+static VALUE stat_field_cmp(zkrb_stat_obj_t *a, zkrb_stat_obj_t *b, int i, VALUE tie) {
+  int64_t x, y;
+
+  if (STAT_HAS_FIELD(a, i) != STAT_HAS_FIELD(b, i)) return Qnil;
+  if (!STAT_HAS_FIELD(a, i)) return tie;
+
+  x = stat_field_get(&a->stat, i);
+  y = stat_field_get(&b->stat, i);
+
+  return (x == y) ? tie : INT2FIX(x < y ? -1 : 1);
+}
+
+// stats of nodes that don't exist sort before those that do, otherwise by
+// mzxid and then version
+static VALUE stat_method_cmp(VALUE self, VALUE other) {
+  if (!IS_STAT(other)) return Qnil;
+
+  FETCH_STAT_OBJ(self, a);
+  FETCH_STAT_OBJ(other, b);
+
+  if (a->exists != b->exists) return INT2FIX(a->exists ? 1 : -1);
+  if (!a->exists) return INT2FIX(0);
+
+  return stat_field_cmp(a, b, 1, stat_field_cmp(a, b, 4, INT2FIX(0)));
+}
+
+static int stat_obj_equal(zkrb_stat_obj_t *a, zkrb_stat_obj_t *b) {
+  unsigned int i;
+
+  if (a->exists != b->exists) return 0;
+  if (!a->exists) return 1;
+  if (a->present != b->present) return 0;
+
+  for (i = 0; i < ZKRB_STAT_NFIELDS; i++) {
+    if (STAT_HAS_FIELD(a, i) && stat_field_get(&a->stat, i) != stat_field_get(&b->stat, i)) return 0;
+  }
+  return 1;
+}
+
+static VALUE stat_method_equal(VALUE self, VALUE other) {
+  if (self == other) return Qtrue;
+  if (!IS_STAT(other)) return Qfalse;
+
+  FETCH_STAT_OBJ(self, a);
+  FETCH_STAT_OBJ(other, b);
+
+  return stat_obj_equal(a, b) ? Qtrue : Qfalse;
+}
+
+static VALUE stat_method_hash(VALUE self) {
+  unsigned int i;
+  st_index_t h;
+  FETCH_STAT_OBJ(self, obj);
+
+  h = rb_hash_start((st_index_t) obj->exists);
+  if (obj->exists) {
+    h = rb_hash_uint(h, (st_index_t) obj->present);
+    for (i = 0; i < ZKRB_STAT_NFIELDS; i++) {
+      if (STAT_HAS_FIELD(obj, i)) h = rb_hash_uint(h, (st_index_t) stat_field_get(&obj->stat, i));
+    }
+  }
+  return ST2FIX(rb_hash_end(h));
+}
+
+// the array form Stat.new accepts, nil if the node doesn't exist
+static VALUE stat_method_to_a(VALUE self) {
+  VALUE ary;
+  unsigned int i;
+  FETCH_STAT_OBJ(self, obj);
+
+  if (!obj->exists) return Qnil;
+  if (obj->present == ZKRB_STAT_ALL_FIELDS) return zkrb_stat_to_rarray(&obj->stat);
+
+  ary = rb_ary_new_capa(ZKRB_STAT_NFIELDS);
+  for (i = 0; i < ZKRB_STAT_NFIELDS; i++) rb_ary_push(ary, stat_field_to_ruby(obj, i));
+  return ary;
+}
+
+static VALUE stat_method_to_hash(VALUE self) {
+  VALUE hash;
+  unsigned int i;
+  FETCH_STAT_OBJ(self, obj);
+
+  if (!obj->exists) return rb_hash_new();
+  if (obj->present == ZKRB_STAT_ALL_FIELDS) return zkrb_stat_to_rhash(&obj->stat);
+
+  hash = rb_hash_new();
+  for (i = 0; i < ZKRB_STAT_NFIELDS; i++) rb_hash_aset(hash, stat_field_syms[i], stat_field_to_ruby(obj, i));
+  return hash;
+}
+
+static VALUE stat_method_inspect(VALUE self) {
+  unsigned int i;
+  VALUE str;
+  FETCH_STAT_OBJ(self, obj);
+
+  str = rb_sprintf("#<%"PRIsVALUE" exists=%s", rb_class_name(rb_obj_class(self)), obj->exists ? "true" : "false");
+
+  if (obj->exists) {
+    for (i = 0; i < ZKRB_STAT_NFIELDS; i++) {
+      if (STAT_HAS_FIELD(obj, i))
+        rb_str_catf(str, " %s=%"PRId64, stat_fields[i].name, stat_field_get(&obj->stat, i));
+      else
+        rb_str_catf(str, " %s=nil", stat_fields[i].name);
+    }
+  }
+
+  rb_str_cat2(str, ">");
+  return str;
+}
+
+static VALUE stat_method_marshal_load(VALUE self, VALUE ary) {
+  return stat_method_initialize(1, &ary, self);
+}
+
+void zkrb_define_stat_class(VALUE mZookeeper) {
+  unsigned int i;
+
+  for (i = 0; i < ZKRB_STAT_NFIELDS; i++) {
+    stat_field_syms[i] = ID2SYM(rb_intern(stat_fields[i].name));
+  }
+
+  ZookeeperStat = rb_define_class_under(mZookeeper, "Stat", rb_cObject);
+  rb_define_alloc_func(ZookeeperStat, stat_alloc);
+  rb_include_module(ZookeeperStat, rb_mComparable);
+
+  rb_define_singleton_method(ZookeeperStat, "from", stat_klass_method_from, 1);
+
+  rb_define_method(ZookeeperStat, "initialize",      stat_method_initialize,     -1);
+  rb_define_method(ZookeeperStat, "initialize_copy", stat_method_initialize_copy, 1);
+
+  rb_define_method(ZookeeperStat, "exists",         stat_method_exists,         0);
+  rb_define_method(ZookeeperStat, "exists?",        stat_method_exists,         0);
+  rb_define_method(ZookeeperStat, "czxid",          stat_method_czxid,          0);
+  rb_define_method(ZookeeperStat, "mzxid",          stat_method_mzxid,          0);
+  rb_define_method(ZookeeperStat, "ctime",          stat_method_ctime,          0);
+  rb_define_method(ZookeeperStat, "mtime",          stat_method_mtime,          0);
+  rb_define_method(ZookeeperStat, "version",        stat_method_version,        0);
+  rb_define_method(ZookeeperStat, "cversion",       stat_method_cversion,       0);
+  rb_define_method(ZookeeperStat, "aversion",       stat_method_aversion,       0);
+  rb_define_method(ZookeeperStat, "ephemeralOwner", stat_method_ephemeralOwner, 0);
+  rb_define_method(ZookeeperStat, "dataLength",     stat_method_dataLength,     0);
+  rb_define_method(ZookeeperStat, "numChildren",    stat_method_numChildren,    0);
+  rb_define_method(ZookeeperStat, "pzxid",          stat_method_pzxid,          0);
+
+  rb_define_alias(ZookeeperStat, "ephemeral_owner", "ephemeralOwner");
+  rb_define_alias(ZookeeperStat, "num_children",    "numChildren");
+  rb_define_alias(ZookeeperStat, "data_length",     "dataLength");
+
+  rb_define_method(ZookeeperStat, "<=>",     stat_method_cmp,     1);
+  rb_define_method(ZookeeperStat, "==",      stat_method_equal,   1);
+  rb_define_method(ZookeeperStat, "eql?",    stat_method_equal,   1);
+  rb_define_method(ZookeeperStat, "hash",    stat_method_hash,    0);
+  rb_define_method(ZookeeperStat, "to_a",    stat_method_to_a,    0);
+  rb_define_method(ZookeeperStat, "to_hash", stat_method_to_hash, 0);
+  rb_define_method(ZookeeperStat, "inspect", stat_method_inspect, 0);
+
+  rb_define_method(ZookeeperStat, "marshal_dump", stat_method_to_a,         0);
+  rb_define_method(ZookeeperStat, "marshal_load", stat_method_marshal_load, 1);
+}
+
+/*
+  Zookeeper::Children
+
+  a read-only list of child names packed into one buffer (NUL terminated,
+  back to back) plus a table of offsets into it, so a get_children on a node
+  with tens of thousands of children costs two allocations instead of one
+  String per name. Strings are only created for the names that are actually
+  read. include?/index use a sorted index, built the first time it's needed.
+*/
+
+VALUE ZookeeperChildren = Qnil;
+
+typedef struct {
+  long      count;
+  uint32_t  *offsets;   // count entries, start of each name in buf
+  uint32_t  *sorted;    // NULL until needed: indices into offsets, by name
+  char      *buf;
+  size_t    buf_len;
+} zkrb_children_t;
+
+static void zkrb_children_free(void *p) {
+  zkrb_children_t *ch = p;
+  xfree(ch->offsets);
+  xfree(ch->sorted);
+  xfree(ch->buf);
+  xfree(ch);
+}
+
+static size_t zkrb_children_memsize(const void *p) {
+  const zkrb_children_t *ch = p;
+  return sizeof(*ch) + ch->buf_len + ch->count * sizeof(uint32_t) * (ch->sorted ? 2 : 1);
+}
+
+static const rb_data_type_t zkrb_children_data_type = {
+  "Zookeeper::Children",
+  { 0, zkrb_children_free, zkrb_children_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+#define FETCH_CHILDREN(self, ch) \
+  zkrb_children_t *ch; \
+  TypedData_Get_Struct((self), zkrb_children_t, &zkrb_children_data_type, ch)
+
+#define CHILD_NAME(ch, i) ((ch)->buf + (ch)->offsets[(i)])
+
+static VALUE children_str(zkrb_children_t *ch, long i) {
+  return rb_str_new2(CHILD_NAME(ch, i));
+}
+
+static int children_cmp(const void *a, const void *b, void *arg) {
+  zkrb_children_t *ch = arg;
+  return strcmp(CHILD_NAME(ch, *(const uint32_t *) a), CHILD_NAME(ch, *(const uint32_t *) b));
+}
+
+static void children_ensure_sorted(zkrb_children_t *ch) {
+  long i;
+
+  if (ch->sorted || ch->count == 0) return;
+
+  ch->sorted = ALLOC_N(uint32_t, ch->count);
+  for (i = 0; i < ch->count; i++) ch->sorted[i] = (uint32_t) i;
+
+  ruby_qsort(ch->sorted, ch->count, sizeof(uint32_t), children_cmp, ch);
+}
+
+// position of name in the original order, or -1
+static long children_find(zkrb_children_t *ch, VALUE name) {
+  long lo = 0, hi, mid;
+  const char *key;
+  int c;
+
+  if (!RB_TYPE_P(name, T_STRING) || ch->count == 0) return -1;
+
+  // names can't contain NUL, so a String with one can't match
+  key = RSTRING_PTR(name);
+  if ((long) strlen(key) != RSTRING_LEN(name)) return -1;
+
+  children_ensure_sorted(ch);
+
+  hi = ch->count - 1;
+  while (lo <= hi) {
+    mid = lo + (hi - lo) / 2;
+    c = strcmp(key, CHILD_NAME(ch, ch->sorted[mid]));
+    if (c == 0) return ch->sorted[mid];
+    if (c < 0) hi = mid - 1; else lo = mid + 1;
+  }
+
+  return -1;
+}
+
+static VALUE children_alloc(VALUE klass) {
+  zkrb_children_t *ch;
+  return TypedData_Make_Struct(klass, zkrb_children_t, &zkrb_children_data_type, ch);
+}
+
+// an Array of Strings, or a Zookeeper::Children if flags has ZKRB_CTX_PACKED
+VALUE zkrb_children_to_ruby(const struct String_vector *sv, int flags) {
+  zkrb_children_t *ch;
+  VALUE self;
+  size_t total = 0, len;
+  int32_t i;
+
+  if (!(flags & ZKRB_CTX_PACKED)) {
+    return zkrb_string_vector_to_ruby((struct String_vector *) sv);
+  }
+
+  for (i = 0; i < sv->count; i++) total += strlen(sv->data[i]) + 1;
+
+  if (total > UINT32_MAX) rb_raise(rb_eRangeError, "children names too large to pack (%zu bytes)", total);
+
+  self = TypedData_Make_Struct(ZookeeperChildren, zkrb_children_t, &zkrb_children_data_type, ch);
+
+  ch->offsets = ALLOC_N(uint32_t, sv->count > 0 ? sv->count : 1);
+  ch->buf     = ALLOC_N(char, total > 0 ? total : 1);
+  ch->buf_len = total;
+
+  total = 0;
+  for (i = 0; i < sv->count; i++) {
+    len = strlen(sv->data[i]) + 1;
+    memcpy(ch->buf + total, sv->data[i], len);
+    ch->offsets[i] = (uint32_t) total;
+    total += len;
+  }
+
+  // only set once the tables are filled in, so a GC in between sees a
+  // consistent (empty) list
+  ch->count = sv->count;
+
+  return rb_obj_freeze(self);
+}
+
+static VALUE children_method_size(VALUE self) {
+  FETCH_CHILDREN(self, ch);
+  return LONG2NUM(ch->count);
+}
+
+static VALUE children_enum_size(VALUE self, VALUE args, VALUE eobj) {
+  return children_method_size(self);
+}
+
+static VALUE children_method_each(VALUE self) {
+  long i;
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, children_enum_size);
+  FETCH_CHILDREN(self, ch);
+
+  for (i = 0; i < ch->count; i++) rb_yield(children_str(ch, i));
+  return self;
+}
+
+// like each, but in sorted order
+static VALUE children_method_each_sorted(VALUE self) {
+  long i;
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, children_enum_size);
+  FETCH_CHILDREN(self, ch);
+
+  children_ensure_sorted(ch);
+  for (i = 0; i < ch->count; i++) rb_yield(children_str(ch, ch->sorted[i]));
+  return self;
+}
+
+static VALUE children_method_aref(VALUE self, VALUE idx) {
+  long i = NUM2LONG(idx);
+  FETCH_CHILDREN(self, ch);
+
+  if (i < 0) i += ch->count;
+  if (i < 0 || i >= ch->count) return Qnil;
+  return children_str(ch, i);
+}
+
+static VALUE children_method_empty_p(VALUE self) {
+  FETCH_CHILDREN(self, ch);
+  return ch->count == 0 ? Qtrue : Qfalse;
+}
+
+// last or last(n), like Array's
+static VALUE children_method_last(int argc, VALUE *argv, VALUE self) {
+  long i, n;
+  VALUE ary;
+  FETCH_CHILDREN(self, ch);
+
+  if (rb_check_arity(argc, 0, 1) == 0) {
+    return ch->count > 0 ? children_str(ch, ch->count - 1) : Qnil;
+  }
+
+  n = NUM2LONG(argv[0]);
+  if (n < 0) rb_raise(rb_eArgError, "negative array size");
+  if (n > ch->count) n = ch->count;
+
+  ary = rb_ary_new2(n);
+  for (i = ch->count - n; i < ch->count; i++) rb_ary_push(ary, children_str(ch, i));
+  return ary;
+}
+
+static VALUE children_method_include(VALUE self, VALUE name) {
+  FETCH_CHILDREN(self, ch);
+  return children_find(ch, name) >= 0 ? Qtrue : Qfalse;
+}
+
+static VALUE children_method_index(VALUE self, VALUE name) {
+  long i;
+  FETCH_CHILDREN(self, ch);
+
+  i = children_find(ch, name);
+  return i >= 0 ? LONG2NUM(i) : Qnil;
+}
+
+static VALUE children_method_to_a(VALUE self) {
+  long i;
+  VALUE ary;
+  FETCH_CHILDREN(self, ch);
+
+  ary = rb_ary_new2(ch->count);
+  for (i = 0; i < ch->count; i++) rb_ary_push(ary, children_str(ch, i));
+  return ary;
+}
+
+static VALUE children_method_sort(VALUE self) {
+  long i;
+  VALUE ary;
+  FETCH_CHILDREN(self, ch);
+
+  if (rb_block_given_p())
+    return rb_funcall_with_block(children_method_to_a(self), rb_intern("sort!"), 0, 0, rb_block_proc());
+
+  children_ensure_sorted(ch);
+  ary = rb_ary_new2(ch->count);
+  for (i = 0; i < ch->count; i++) rb_ary_push(ary, children_str(ch, ch->sorted[i]));
+  return ary;
+}
+
+static VALUE children_method_equal(VALUE self, VALUE other) {
+  if (self == other) return Qtrue;
+
+  if (rb_typeddata_is_kind_of(other, &zkrb_children_data_type)) {
+    FETCH_CHILDREN(self, a);
+    FETCH_CHILDREN(other, b);
+    return (a->count == b->count && a->buf_len == b->buf_len &&
+            memcmp(a->buf, b->buf, a->buf_len) == 0) ? Qtrue : Qfalse;
+  }
+
+  if (RB_TYPE_P(other, T_ARRAY)) return rb_equal(children_method_to_a(self), other);
+
+  return Qfalse;
+}
+
+// the same as the Array of the same names, as == (and so eql?) says they're equal
+static VALUE children_method_hash(VALUE self) {
+  return rb_hash(children_method_to_a(self));
+}
+
+static VALUE children_method_inspect(VALUE self) {
+  return rb_sprintf("#<%"PRIsVALUE" %"PRIsVALUE">", rb_class_name(rb_obj_class(self)), rb_inspect(children_method_to_a(self)));
+}
+
+void zkrb_define_children_class(VALUE mZookeeper) {
+  ZookeeperChildren = rb_define_class_under(mZookeeper, "Children", rb_cObject);
+  rb_define_alloc_func(ZookeeperChildren, children_alloc);
+  rb_include_module(ZookeeperChildren, rb_mEnumerable);
+
+  rb_define_method(ZookeeperChildren, "size",        children_method_size,        0);
+  rb_define_method(ZookeeperChildren, "length",      children_method_size,        0);
+  rb_define_method(ZookeeperChildren, "empty?",      children_method_empty_p,     0);
+  rb_define_method(ZookeeperChildren, "each",        children_method_each,        0);
+  rb_define_method(ZookeeperChildren, "each_sorted", children_method_each_sorted, 0);
+  rb_define_method(ZookeeperChildren, "[]",          children_method_aref,        1);
+  rb_define_method(ZookeeperChildren, "last",        children_method_last,       -1);
+  rb_define_method(ZookeeperChildren, "include?",    children_method_include,     1);
+  rb_define_method(ZookeeperChildren, "member?",     children_method_include,     1);
+  rb_define_method(ZookeeperChildren, "index",       children_method_index,       1);
+  rb_define_method(ZookeeperChildren, "to_a",        children_method_to_a,        0);
+  rb_define_method(ZookeeperChildren, "to_ary",      children_method_to_a,        0);
+  rb_define_method(ZookeeperChildren, "sort",        children_method_sort,        0);
+  rb_define_method(ZookeeperChildren, "==",          children_method_equal,       1);
+  rb_define_method(ZookeeperChildren, "eql?",        children_method_equal,       1);
+  rb_define_method(ZookeeperChildren, "hash",        children_method_hash,        0);
+  rb_define_method(ZookeeperChildren, "inspect",     children_method_inspect,     0);
+}
+
 // [wickman] TODO test zkrb_clone_acl_vector
 struct ACL_vector * zkrb_clone_acl_vector(struct ACL_vector * src) {
-  struct ACL_vector * dst = zk_malloc(sizeof(struct ACL_vector));
+  struct ACL_vector * dst = malloc(sizeof(struct ACL_vector));
   allocate_ACL_vector(dst, src->count);
   int k;
   for (k = 0; k < src->count; ++k) {
@@ -728,7 +2865,7 @@ struct ACL_vector * zkrb_clone_acl_vector(struct ACL_vector * src) {
 
 // [wickman] TODO test zkrb_clone_string_vector
 struct String_vector * zkrb_clone_string_vector(const struct String_vector * src) {
-  struct String_vector * dst = zk_malloc(sizeof(struct String_vector));
+  struct String_vector * dst = malloc(sizeof(struct String_vector));
   allocate_String_vector(dst, src->count);
   int k;
   for (k = 0; k < src->count; ++k) {
@@ -2,11 +2,13 @@
 #define ZKRB_EVENT_LIB_H
 
 #include "ruby.h"
+#include "common.h"
 #include "zookeeper/zookeeper.h"
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #define ZK_TRUE 1
 #define ZK_FALSE 0
@@ -28,7 +30,6 @@
 #endif
 
 extern int ZKRBDebugging;
-extern pthread_mutex_t zkrb_q_mutex;
 
 struct zkrb_data_completion {
   char *data;
@@ -67,9 +68,37 @@ struct zkrb_watcher_completion {
   char *path;
 };
 
+/*
+  the buffers handed to zoo_amulti. zkc serializes the ops right away but
+  keeps pointers into 'results' (and, through them, into 'path_bufs' and
+  'stats') until the completion runs, so these live on the calling context
+  and are freed along with the event.
+*/
+typedef struct {
+  int             count;
+  int             *types;       // ZOO_*_OP of each op
+  zoo_op_result_t *results;
+  struct Stat     *stats;       // one per op, only set ops use theirs
+  char            **path_bufs;  // created path of each create op, NULL otherwise
+} zkrb_multi_t;
+
+struct zkrb_multi_completion {
+  zkrb_multi_t *multi;
+};
+
+struct zkrb_tree;   // a zkrb_tree_t, see below
+
+struct zkrb_tree_completion {
+  struct zkrb_tree *tree;
+};
+
+// zkrb_calling_context/zkrb_event_t flags
+#define ZKRB_CTX_PACKED 0x1   // deliver children as a Zookeeper::Children
+
 typedef struct {
   int64_t req_id;
   int rc;
+  int flags;
 
   enum {
     ZKRB_DATA         = 0,
@@ -79,7 +108,9 @@ typedef struct {
     ZKRB_STRINGS      = 4,
     ZKRB_STRINGS_STAT = 5,
     ZKRB_ACL          = 6,
-    ZKRB_WATCHER      = 7
+    ZKRB_WATCHER      = 7,
+    ZKRB_MULTI        = 8,
+    ZKRB_TREE         = 9
   } type;
   
   union {
@@ -91,6 +122,8 @@ typedef struct {
     struct zkrb_strings_stat_completion *strings_stat_completion;
     struct zkrb_acl_completion          *acl_completion;
     struct zkrb_watcher_completion      *watcher_completion;
+    struct zkrb_multi_completion        *multi_completion;
+    struct zkrb_tree_completion         *tree_completion;
   } completion;
 } zkrb_event_t;
 
@@ -101,35 +134,196 @@ struct zkrb_event_ll {
 
 typedef struct zkrb_event_ll zkrb_event_ll_t;
 
+/*
+  per-queue slab allocator for events.
+
+  an event, its completion struct and (for the completion types that carry
+  one) its Stat live in a single block carved out of a larger chunk. blocks
+  are sorted into size classes and recycled through per-class free lists by
+  zkrb_event_free, so the completion hot path doesn't touch the system
+  allocator except for variable-length payloads (data, paths, children).
+*/
+typedef enum {
+  ZKRB_SLAB_EVENT      = 0,     // event + completion
+  ZKRB_SLAB_EVENT_STAT = 1,     // event + completion + struct Stat
+  ZKRB_SLAB_NCLASSES   = 2
+} zkrb_slab_class_id;
+
+// number of blocks carved out of each chunk the slab grows by
+#define ZKRB_SLAB_CHUNK_BLOCKS 64
+
+struct zkrb_slab_chunk {
+  struct zkrb_slab_chunk *next;
+};
+
 typedef struct {
-  zkrb_event_ll_t *head;
-  zkrb_event_ll_t *tail;
-  int             pipe_read;
-  int             pipe_write;
-  pid_t           orig_pid;
+  size_t        block_size;
+  void          *free_list;
+  unsigned long in_use;       // blocks currently handed out
+  unsigned long capacity;     // blocks carved so far (in_use + free)
+  unsigned long allocs;       // total allocations served
+} zkrb_slab_class_t;
+
+typedef struct {
+  zkrb_slab_class_t       classes[ZKRB_SLAB_NCLASSES];
+  struct zkrb_slab_chunk  *chunks;
+  unsigned long           chunk_count;
+  int                     orphaned;   // owning queue is gone, free when in_use drops to 0
+#if ZKRB_COMPLETIONS_OFF_GVL
+  pthread_mutex_t         mutex;
+#endif
+} zkrb_slab_t;
+
+// number of slots in each queue's ring, must be a power of two. events that
+// arrive while the ring is full spill onto the queue's overflow list
+#ifndef ZKRB_QUEUE_CAPACITY
+#define ZKRB_QUEUE_CAPACITY 1024
+#endif
+
+#define ZKRB_CACHE_LINE 64
+
+typedef struct {
+  unsigned long seq;
+  zkrb_event_t  *event;
+} zkrb_ring_slot_t;
+
+/*
+  bounded multi-producer/single-consumer ring (after Vyukov's bounded queue).
+
+  producers claim a slot by advancing 'tail' with a CAS, the single consumer
+  (the ruby event thread) owns 'head'. the two counters live on separate cache
+  lines so that producers and the consumer don't false-share.
+
+  once the ring has filled up, producers append to the overflow list instead
+  (and keep doing so until the consumer has drained it) so that delivery
+  order is preserved.
+*/
+typedef struct {
+  unsigned long     head;
+  char              _pad0[ZKRB_CACHE_LINE - sizeof(unsigned long)];
+
+  unsigned long     tail;
+  char              _pad1[ZKRB_CACHE_LINE - sizeof(unsigned long)];
+
+  zkrb_ring_slot_t  *slots;
+  unsigned long     mask;
+
+  int               overflowed;
+  zkrb_event_ll_t   *overflow_head;
+  zkrb_event_ll_t   *overflow_tail;
+  unsigned long     overflow_count;   // events that did not fit in the ring
+
+#if ZKRB_COMPLETIONS_OFF_GVL
+  pthread_mutex_t   mutex;            // guards the overflow list only
+#endif
+
+  zkrb_slab_t       *slab;
+
+  // set by the producer that writes the wakeup byte, cleared by the consumer
+  // once it has drained the pipe, so there's at most one byte in flight no
+  // matter how many events are enqueued in the meantime
+  int               signalled;
+  unsigned long     enqueued;         // events pushed onto this queue
+  unsigned long     wakeups;          // bytes actually written to pipe_write
+
+  int               pipe_read;
+  int               pipe_write;
+  pid_t             orig_pid;
+
+  // set once zookeeper_close has been called on the handle that owns us,
+  // completions that run after that (with ZCLOSING) are dropped
+  int               closing;
+
+#if !ZKRB_COMPLETIONS_OFF_GVL
+  // without the IO engine the ring isn't used at all: completions run on
+  // the ruby event thread (inside zookeeper_process), so they build their
+  // Zookeeper::Event right away and append it here. the owning CZookeeper
+  // marks this array.
+  VALUE             pending;
+
+  // the tag of an exception a completion caught building its event, see
+  // zkrb_direct_deliver
+  int               raised;
+#endif
 } zkrb_queue_t;
 
+/*
+  a subtree walk (see zkrb_tree_start). every node found so far is kept in
+  'nodes', in the order it was found, which is breadth first: the walk asks
+  for the nodes from 'next' on as earlier requests complete, with at most
+  'concurrency' of them outstanding. the completions that come back add the
+  children of a node to the end of the list.
+
+  only touched by zkc's completions and the call that starts the walk, so
+  with the IO engine everything happens under its lock.
+*/
+typedef struct {
+  char        *path;
+  char        *data;        // NULL if the node has none
+  int         data_len;
+  int         depth;        // below the node the walk started at
+  int         gone;         // deleted before we could read it, not reported
+  struct Stat stat;
+} zkrb_tree_node_t;
+
+typedef struct zkrb_tree {
+  zhandle_t         *zh;
+  zkrb_queue_t      *queue;
+  int64_t           req_id;
+  int               max_depth;    // -1 for no limit
+  int               concurrency;
+  int               stat_only;    // zoo_aexists instead of zoo_aget, no data
+  int               outstanding;  // requests we're waiting on
+  int               next;         // first node we haven't asked for
+  int               count;
+  int               capacity;
+  int               rc;           // ZOK until the walk fails
+  zkrb_tree_node_t  *nodes;
+} zkrb_tree_t;
+
 zkrb_queue_t * zkrb_queue_alloc(void);
 void           zkrb_queue_free(zkrb_queue_t *queue);
-zkrb_event_t * zkrb_event_alloc(void);
+zkrb_event_t * zkrb_event_alloc(zkrb_queue_t *queue, int type);
 void           zkrb_event_free(zkrb_event_t *ptr);
 
+VALUE zkrb_slab_stats_to_ruby(zkrb_slab_t *slab);
+
 void                 zkrb_enqueue(zkrb_queue_t *queue, zkrb_event_t *elt);
 zkrb_event_t *       zkrb_peek(zkrb_queue_t *queue);
 zkrb_event_t *       zkrb_dequeue(zkrb_queue_t *queue, int need_lock);
+int                  zkrb_dequeue_batch(zkrb_queue_t *queue, zkrb_event_t **events, int max);
 void                 zkrb_signal(zkrb_queue_t *queue);
+void                 zkrb_queue_drain_signal(zkrb_queue_t *queue);
+
+#if !ZKRB_COMPLETIONS_OFF_GVL
+void                 zkrb_deliver(zkrb_queue_t *queue, VALUE event);
+VALUE                zkrb_take_events(zkrb_queue_t *queue, long max);
+void                 zkrb_queue_reraise(zkrb_queue_t *queue);
+#endif
 
 void zkrb_print_stat(const struct Stat *s);
 
 typedef struct {
   int64_t        req_id;
   zkrb_queue_t   *queue;
+  int            flags;     // ZKRB_CTX_*
+  zkrb_multi_t   *multi;    // only set for zoo_amulti calls
 } zkrb_calling_context;
 
 void zkrb_print_calling_context(zkrb_calling_context *ctx);
-zkrb_calling_context *zkrb_calling_context_alloc(int64_t req_id, zkrb_queue_t *queue);
+zkrb_calling_context *zkrb_calling_context_alloc(int64_t req_id, zkrb_queue_t *queue, int flags);
 void zkrb_calling_context_free(zkrb_calling_context *ctx);
 
+zkrb_multi_t *zkrb_multi_alloc(int count);
+char         *zkrb_multi_path_buf(zkrb_multi_t *multi, int k, int len);
+void          zkrb_multi_free(zkrb_multi_t *multi);
+VALUE         zkrb_multi_results_to_ruby(const zkrb_multi_t *multi, int rc);
+
+int   zkrb_tree_start(zhandle_t *zh, zkrb_queue_t *queue, int64_t req_id,
+                      const char *path, int max_depth, int concurrency, int stat_only);
+void  zkrb_tree_free(zkrb_tree_t *tree);
+VALUE zkrb_tree_results_to_ruby(const zkrb_tree_t *tree);
+
 /*
   default process completions that get queued into the ruby client event queue
 */
@@ -158,12 +352,26 @@ void zkrb_void_callback(
 void zkrb_acl_callback(
     int rc, struct ACL_vector *acls, struct Stat *stat, const void *calling_ctx);
 
-VALUE zkrb_event_to_ruby(zkrb_event_t *event);
+void zkrb_multi_callback(
+    int rc, const void *calling_ctx);
+
+extern VALUE ZookeeperEvent;
+void  zkrb_define_event_class(VALUE mZookeeper);
+
+extern VALUE ZookeeperStat;
+void  zkrb_define_stat_class(VALUE mZookeeper);
+
+extern VALUE ZookeeperChildren;
+void  zkrb_define_children_class(VALUE mZookeeper);
+
+VALUE zkrb_event_to_ruby(zkrb_event_t *event);    // takes ownership of event
 VALUE zkrb_acl_to_ruby(struct ACL *acl);
 VALUE zkrb_acl_vector_to_ruby(struct ACL_vector *acl_vector);
 VALUE zkrb_id_to_ruby(struct Id *id);
 VALUE zkrb_string_vector_to_ruby(struct String_vector *string_vector);
+VALUE zkrb_children_to_ruby(const struct String_vector *string_vector, int flags);
 VALUE zkrb_stat_to_rarray(const struct Stat *stat);
+VALUE zkrb_stat_to_ruby(const struct Stat *stat);   // a Zookeeper::Stat, non-existent if stat is NULL
 VALUE zkrb_stat_to_rhash(const struct Stat* stat);
 
 struct ACL_vector *    zkrb_ruby_to_aclvector(VALUE acl_ary);
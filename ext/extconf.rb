@@ -97,6 +97,28 @@ $LIBS << " -lzookeeper_st_gem -lm"
 
 have_func('rb_thread_blocking_region')
 have_func('rb_thread_fd_select')
+have_func('rb_wait_for_single_fd')
+have_header('sys/epoll.h')
+
+# the connection is serviced from a native thread of its own (see zkrb_io.h),
+# so the session is kept alive while something holds the GVL for longer than
+# the session timeout. completions then run off the GVL and are queued, the
+# direct delivery and zero-copy paths are only used by the
+# --without-io-thread build, which pings only from the ruby event thread.
+io_thread = with_config('io-thread')
+
+if io_thread != false
+  if have_func('pthread_atfork', 'pthread.h')
+    $CFLAGS << ' -DZKRB_IO_THREAD'
+  elsif io_thread
+    abort "--with-io-thread needs pthread_atfork(), which wasn't found"
+  else
+    $stderr.puts "*** no pthread_atfork(), building without the IO thread ***"
+  end
+end
+
+# hooks only the specs call, like CZookeeper.zkrb_hold_gvl
+$CFLAGS << ' -DZKRB_TEST_HOOKS' if ZK_DEV or ZK_DEBUG or ENV['ZKRB_TEST_HOOKS']
 
 $CFLAGS << ' -Wall' if ZK_DEV
 create_makefile 'zookeeper_c'
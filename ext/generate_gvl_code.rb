@@ -52,6 +52,19 @@ we want
     return args.rc;
   }
 
+that's only worth it for the calls that can actually block, though. with the
+single threaded lib every zoo_a* call (and zoo_add_auth, zoo_async...) just
+serializes the request onto the handle's send queue and returns, so giving up
+the GVL and taking it back around them is pure overhead. those take a
+completion, the sync calls (which wait for the response in the mt lib) don't,
+and for them we emit a direct call in the header instead:
+
+  static inline int zkrb_call_zoo_acreate(zhandle_t *zh, const char *path, const char *value,
+                int valuelen, const struct ACL_vector *acl, int flags,
+                string_completion_t completion, const void *data) {
+    return zoo_acreate(zh, path, value, valuelen, acl, flags, completion, data);
+  }
+
 =end
 
 REGEXP = /^ZOOAPI int (zoo_[^(]+)\(([^)]+)\);$/m
@@ -129,6 +142,34 @@ class WrapperFunction
   end
 end
 
+# the zkrb_call_zoo_* function for a call that doesn't block, defined
+# static inline in the header
+class DirectCallingFunction
+  include MemberNames
+
+  PREFIX = 'zkrb_call'
+
+  attr_reader :zoo_fn_name, :typed_args, :name
+
+  def initialize(zoo_fn_name, typed_args)
+    @zoo_fn_name, @typed_args = zoo_fn_name, typed_args
+    @name = "#{PREFIX}_#{zoo_fn_name}"
+  end
+
+  def fn_signature
+    @fn_signature ||= "static inline int #{name}(#{typed_args.join(', ')})"
+  end
+
+  def body
+    @body ||= <<-EOS
+// calls #{zoo_fn_name} directly, it never blocks
+#{fn_signature} {
+  return #{zoo_fn_name}(#{member_names.join(', ')});
+}
+    EOS
+  end
+end
+
 # the zkrb_call_zoo_* function
 class CallingFunction
   extend Forwardable
@@ -182,13 +223,24 @@ class CallingFunction
   end
 end
 
-class GeneratedCode < Struct.new(:structs, :wrapper_fns, :calling_fns)
+class GeneratedCode < Struct.new(:structs, :wrapper_fns, :calling_fns, :direct_fns)
   def initialize(*a)
     super
 
     self.structs     ||= []
     self.wrapper_fns ||= []
     self.calling_fns ||= []
+    self.direct_fns  ||= []
+  end
+
+  # calls that don't take a completion are the sync ones, which wait for the
+  # server's response (in the mt lib), plus a couple of getters that read a
+  # field of the handle
+  NON_BLOCKING_WITHOUT_COMPLETION = %w[zoo_state zoo_recv_timeout]
+
+  def self.blocking?(zoo_fn_name, typed_args)
+    return false if NON_BLOCKING_WITHOUT_COMPLETION.include?(zoo_fn_name)
+    typed_args.none? { |a| a =~ /_completion_t\b/ }
   end
 
   def self.from_zookeeper_h(text)
@@ -207,6 +259,11 @@ class GeneratedCode < Struct.new(:structs, :wrapper_fns, :calling_fns)
           typed_args[idx] = 'void_completion_t completion'
         end
 
+        unless blocking?(zoo_fn_name, typed_args)
+          code.direct_fns << DirectCallingFunction.new(zoo_fn_name, typed_args)
+          next
+        end
+
         struct = CallStruct.new(zoo_fn_name, typed_args)
         wrapper_fn = WrapperFunction.new(zoo_fn_name, struct)
         calling_fn = CallingFunction.new(zoo_fn_name, struct, wrapper_fn)
@@ -248,6 +305,13 @@ def render_header_file(code)
       fp.puts "#{cf.fn_signature};"
     end
 
+    fp.puts
+
+    code.direct_fns.each do |df|
+      fp.puts df.body
+      fp.puts
+    end
+
     fp.puts <<-EOS
 
 #endif /* ZKRB_WRAPPER_H */
@@ -264,6 +328,9 @@ def render_c_file(code)
 Autogenerated boilerplate wrappers around zoo_* function calls necessary for using
 rb_thread_blocking_region to release the GIL when calling native code.
 
+only the calls that can block are wrapped here, the rest are called directly
+(see zkrb_wrapper.h).
+
 generated by ext/#{File.basename(__FILE__)}
 
 */
@@ -84,6 +84,12 @@
 #define rb_thread_fd_select rb_thread_select
 #endif
 
+// the event loop waits on an epoll set (which ruby waits on in turn, as a
+// single fd) where we have both, and falls back to select() otherwise
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_RB_WAIT_FOR_SINGLE_FD)
+#define ZKRB_USE_EPOLL 1
+#endif
+
 #include "zookeeper/zookeeper.h"
 #include <errno.h>
 #include <stdio.h>
@@ -95,9 +101,15 @@
 #include <time.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/stat.h>
+
+#ifdef ZKRB_USE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #include "common.h"
 #include "event_lib.h"
+#include "zkrb_io.h"
 #include "zkrb_wrapper.h"
 #include "dbg.h"
 
@@ -115,6 +127,26 @@ struct zkrb_instance_data {
   zkrb_queue_t      *queue;
   long              object_id; // the ruby object this instance data is associated with
   pid_t             orig_pid;
+
+  // counters for zkrb_iterate_event_loop, see method_wakeup_stats
+  unsigned long     loop_iterations;
+  unsigned long     pipe_wakeups;
+  unsigned long     epoll_ctls;
+
+#ifdef ZKRB_USE_EPOLL
+  // the epoll set is only touched when zookeeper_interest hands back a
+  // different socket or interest mask than last time, see zkrb_epoll_watch
+  int               use_epoll;    // 0 if we're using select() after all
+  int               epfd;
+  int               ep_pipe_fd;   // the self-pipe, registered once, or -1
+  int               ep_fd;        // the zk socket as registered, or -1
+  ino_t             ep_ino;
+  int               ep_interest;
+#endif
+
+#ifdef ZKRB_IO_THREAD
+  zkrb_io_t         *io;
+#endif
 };
 
 typedef struct zkrb_instance_data zkrb_instance_data_t;
@@ -148,7 +180,10 @@ inline static const char* call_type_to_str(zkrb_call_type ct) {
 inline static void assert_valid_params(VALUE reqid, VALUE path) {
   switch (TYPE(reqid)) {
     case T_FIXNUM:
+      break;
     case T_BIGNUM:
+      // out of range raises here, not halfway through a submission
+      (void) NUM2LL(reqid);
       break;
     default:
       rb_raise(rb_eTypeError, "reqid must be Fixnum/Bignum");
@@ -183,7 +218,19 @@ inline static void raise_invalid_call_type_err(zkrb_call_type call_type) {
   FETCH_DATA_PTR(SELF, ZK); \
   zkrb_call_type CALL_TYPE = get_call_type(ASYNC, WATCH); \
 
-#define CTX_ALLOC(ZK,REQID) zkrb_calling_context_alloc(NUM2LL(REQID), ZK->queue)
+// every use of the handle from the ruby side goes through one of these. with
+// the IO engine they hold its lock around STMT, ZH_SUBMIT also has it look at
+// the handle again, as the request may still be waiting to be written out
+#ifdef ZKRB_IO_THREAD
+#define ZH_CALL(ZK, STMT)   do { zkrb_io_lock((ZK)->io); STMT; zkrb_io_unlock((ZK)->io); } while (0)
+#define ZH_SUBMIT(ZK, STMT) do { ZH_CALL(ZK, STMT); zkrb_io_wake((ZK)->io); } while (0)
+#else
+#define ZH_CALL(ZK, STMT)   do { STMT; } while (0)
+#define ZH_SUBMIT(ZK, STMT) do { STMT; } while (0)
+#endif
+
+#define CTX_ALLOC(ZK,REQID) zkrb_calling_context_alloc(NUM2LL(REQID), ZK->queue, 0)
+#define CTX_ALLOC_FLAGS(ZK,REQID,FLAGS) zkrb_calling_context_alloc(NUM2LL(REQID), ZK->queue, (FLAGS))
 
 static void hexbufify(char *dest, const char *src, int len) {
   int i=0;
@@ -210,6 +257,11 @@ static int destroy_zkrb_instance(zkrb_instance_data_t* zk) {
 
   if (zk->zh) {
     const void *ctx = zoo_get_context(zk->zh);
+
+#ifdef ZKRB_IO_THREAD
+    // from here on the handle is ours alone
+    zkrb_io_stop(zk->io);
+#endif
     /* Note that after zookeeper_close() returns, ZK handle is invalid */
     zkrb_debug("obj_id: %lx, calling zookeeper_close", zk->object_id);
 
@@ -222,6 +274,17 @@ static int destroy_zkrb_instance(zkrb_instance_data_t* zk) {
 
     }
 
+    if (zk->queue) zk->queue->closing = 1;
+
+#ifdef ZKRB_USE_EPOLL
+    // in a forked child this only drops the child's reference, the parent's
+    // registrations are left alone
+    if (zk->use_epoll) {
+      close(zk->epfd);
+      zk->use_epoll = 0;
+    }
+#endif
+
     rv = zookeeper_close(zk->zh);
 
     zkrb_debug("obj_id: %lx, zookeeper_close returned %d, calling context: %p", zk->object_id, rv, ctx);
@@ -230,6 +293,11 @@ static int destroy_zkrb_instance(zkrb_instance_data_t* zk) {
 
   zk->zh = NULL;
 
+#ifdef ZKRB_IO_THREAD
+  zkrb_io_free(zk->io);
+  zk->io = NULL;
+#endif
+
   if (zk->queue) {
     zkrb_debug("obj_id: %lx, freeing queue pointer: %p", zk->object_id, zk->queue);
     zkrb_queue_free(zk->queue);
@@ -244,9 +312,15 @@ static void free_zkrb_instance_data(zkrb_instance_data_t* ptr) {
   destroy_zkrb_instance(ptr);
 }
 
+static void mark_zkrb_instance_data(zkrb_instance_data_t* ptr) {
+#if !ZKRB_COMPLETIONS_OFF_GVL
+  if (ptr->queue) rb_gc_mark(ptr->queue->pending);
+#endif
+}
+
 VALUE alloc_zkrb_instance(VALUE klass) {
   zkrb_instance_data_t* zk = ZALLOC_N(zkrb_instance_data_t, 1);
-  return Data_Wrap_Struct(klass, NULL, free_zkrb_instance_data, zk);
+  return Data_Wrap_Struct(klass, mark_zkrb_instance_data, free_zkrb_instance_data, zk);
 }
 
 static void print_zkrb_instance_data(zkrb_instance_data_t* ptr) {
@@ -295,7 +369,7 @@ static VALUE method_zkrb_init(int argc, VALUE* argv, VALUE self) {
 
   volatile VALUE data;
   zkrb_instance_data_t *zk_local_ctx;
-  data = Data_Make_Struct(CZookeeper, zkrb_instance_data_t, 0, free_zkrb_instance_data, zk_local_ctx);
+  data = Data_Make_Struct(CZookeeper, zkrb_instance_data_t, mark_zkrb_instance_data, free_zkrb_instance_data, zk_local_ctx);
 
   // Look up :session_id and :session_passwd
   VALUE session_id = rb_hash_aref(options, ID2SYM(rb_intern("session_id")));
@@ -315,7 +389,7 @@ static VALUE method_zkrb_init(int argc, VALUE* argv, VALUE self) {
   zoo_deterministic_conn_order(0);
 
   zkrb_calling_context *ctx =
-    zkrb_calling_context_alloc(ZKRB_GLOBAL_REQ, zk_local_ctx->queue);
+    zkrb_calling_context_alloc(ZKRB_GLOBAL_REQ, zk_local_ctx->queue, 0);
 
   zk_local_ctx->object_id = FIX2LONG(rb_obj_id(self));
 
@@ -337,15 +411,47 @@ static VALUE method_zkrb_init(int argc, VALUE* argv, VALUE self) {
 
   zk_local_ctx->orig_pid = getpid();
 
+#ifdef ZKRB_IO_THREAD
+  zk_local_ctx->io = zkrb_io_alloc();
+
+  if (!zk_local_ctx->io || zkrb_io_start(zk_local_ctx->io, zk_local_ctx->zh) != 0) {
+    destroy_zkrb_instance(zk_local_ctx);
+    rb_raise(rb_eRuntimeError, "could not start the zookeeper IO thread");
+  }
+#endif
+
+#ifdef ZKRB_USE_EPOLL
+  // :event_loop => :select keeps the select() loop
+  VALUE event_loop = rb_hash_aref(options, ID2SYM(rb_intern("event_loop")));
+
+  if (event_loop != ID2SYM(rb_intern("select"))) {
+    zk_local_ctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (zk_local_ctx->epfd >= 0) {
+      zk_local_ctx->use_epoll   = 1;
+      zk_local_ctx->ep_pipe_fd  = -1;
+      zk_local_ctx->ep_fd       = -1;
+    } else {
+      log_warn("epoll_create failed, falling back to select()");
+    }
+  }
+#endif
+
   rb_iv_set(self, "@_data", data);
   rb_funcall(self, rb_intern("zkc_set_running_and_notify!"), 0);
 
   return Qnil;
 }
 
-static VALUE method_get_children(VALUE self, VALUE reqid, VALUE path, VALUE async, VALUE watch) {
+// an optional fifth argument asks for the children as a packed
+// Zookeeper::Children instead of an Array of Strings
+static VALUE method_get_children(int argc, VALUE *argv, VALUE self) {
+  VALUE reqid, path, async, watch, packed;
+  rb_scan_args(argc, argv, "41", &reqid, &path, &async, &watch, &packed);
+
   STANDARD_PREAMBLE(self, zk, reqid, path, async, watch, call_type);
 
+  int flags = RTEST(packed) ? ZKRB_CTX_PACKED : 0;
   VALUE output = Qnil;
   struct String_vector strings;
   struct Stat stat;
@@ -366,13 +472,13 @@ static VALUE method_get_children(VALUE self, VALUE reqid, VALUE path, VALUE asyn
 #endif
 
     case ASYNC:
-      rc = zkrb_call_zoo_aget_children2(
-              zk->zh, RSTRING_PTR(path), 0, zkrb_strings_stat_callback, CTX_ALLOC(zk, reqid));
+      ZH_SUBMIT(zk, rc = zkrb_call_zoo_aget_children2(
+              zk->zh, RSTRING_PTR(path), 0, zkrb_strings_stat_callback, CTX_ALLOC_FLAGS(zk, reqid, flags)));
       break;
 
     case ASYNC_WATCH:
-      rc = zkrb_call_zoo_awget_children2(
-              zk->zh, RSTRING_PTR(path), zkrb_state_callback, CTX_ALLOC(zk, reqid), zkrb_strings_stat_callback, CTX_ALLOC(zk, reqid));
+      ZH_SUBMIT(zk, rc = zkrb_call_zoo_awget_children2(
+              zk->zh, RSTRING_PTR(path), zkrb_state_callback, CTX_ALLOC(zk, reqid), zkrb_strings_stat_callback, CTX_ALLOC_FLAGS(zk, reqid, flags)));
       break;
 
     default:
@@ -383,8 +489,8 @@ static VALUE method_get_children(VALUE self, VALUE reqid, VALUE path, VALUE asyn
   output = rb_ary_new();
   rb_ary_push(output, INT2FIX(rc));
   if (IS_SYNC(call_type) && rc == ZOK) {
-    rb_ary_push(output, zkrb_string_vector_to_ruby(&strings));
-    rb_ary_push(output, zkrb_stat_to_rarray(&stat));
+    rb_ary_push(output, zkrb_children_to_ruby(&strings, flags));
+    rb_ary_push(output, zkrb_stat_to_ruby(&stat));
   }
   return output;
 }
@@ -409,11 +515,11 @@ static VALUE method_exists(VALUE self, VALUE reqid, VALUE path, VALUE async, VAL
 #endif
 
     case ASYNC:
-      rc = zkrb_call_zoo_aexists(zk->zh, RSTRING_PTR(path), 0, zkrb_stat_callback, CTX_ALLOC(zk, reqid));
+      ZH_SUBMIT(zk, rc = zkrb_call_zoo_aexists(zk->zh, RSTRING_PTR(path), 0, zkrb_stat_callback, CTX_ALLOC(zk, reqid)));
       break;
 
     case ASYNC_WATCH:
-      rc = zkrb_call_zoo_awexists(zk->zh, RSTRING_PTR(path), zkrb_state_callback, CTX_ALLOC(zk, reqid), zkrb_stat_callback, CTX_ALLOC(zk, reqid));
+      ZH_SUBMIT(zk, rc = zkrb_call_zoo_awexists(zk->zh, RSTRING_PTR(path), zkrb_state_callback, CTX_ALLOC(zk, reqid), zkrb_stat_callback, CTX_ALLOC(zk, reqid)));
       break;
 
     default:
@@ -424,7 +530,7 @@ static VALUE method_exists(VALUE self, VALUE reqid, VALUE path, VALUE async, VAL
   output = rb_ary_new();
   rb_ary_push(output, INT2FIX(rc));
   if (IS_SYNC(call_type) && rc == ZOK) {
-    rb_ary_push(output, zkrb_stat_to_rarray(&stat));
+    rb_ary_push(output, zkrb_stat_to_ruby(&stat));
   }
   return output;
 }
@@ -437,7 +543,7 @@ static VALUE method_sync(VALUE self, VALUE reqid, VALUE path) {
   assert_valid_params(reqid, path);
   FETCH_DATA_PTR(self, zk);
 
-  rc = zkrb_call_zoo_async(zk->zh, RSTRING_PTR(path), zkrb_string_callback, CTX_ALLOC(zk, reqid));
+  ZH_SUBMIT(zk, rc = zkrb_call_zoo_async(zk->zh, RSTRING_PTR(path), zkrb_string_callback, CTX_ALLOC(zk, reqid)));
 
   return INT2FIX(rc);
 }
@@ -450,7 +556,7 @@ static VALUE method_add_auth(VALUE self, VALUE reqid, VALUE scheme, VALUE cert)
 
   FETCH_DATA_PTR(self, zk);
 
-  rc = zkrb_call_zoo_add_auth(zk->zh, RSTRING_PTR(scheme), RSTRING_PTR(cert), RSTRING_LEN(cert), zkrb_void_callback, CTX_ALLOC(zk, reqid));
+  ZH_SUBMIT(zk, rc = zkrb_call_zoo_add_auth(zk->zh, RSTRING_PTR(scheme), RSTRING_PTR(cert), RSTRING_LEN(cert), zkrb_void_callback, CTX_ALLOC(zk, reqid)));
 
   return INT2FIX(rc);
 }
@@ -462,6 +568,7 @@ static VALUE method_create(VALUE self, VALUE reqid, VALUE path, VALUE data, VALU
 
   if (data != Qnil) Check_Type(data, T_STRING);
   Check_Type(flags, T_FIXNUM);
+  int create_flags = FIX2INT(flags);
   const char *data_ptr = (data == Qnil) ? NULL : RSTRING_PTR(data);
   ssize_t     data_len = (data == Qnil) ? -1   : RSTRING_LEN(data);
 
@@ -477,12 +584,12 @@ static VALUE method_create(VALUE self, VALUE reqid, VALUE path, VALUE data, VALU
 #ifdef THREADED
     case SYNC:
       // casting data_len to int is OK as you can only store 1MB in zookeeper
-      rc = zkrb_call_zoo_create(zk->zh, RSTRING_PTR(path), data_ptr, (int)data_len, aclptr, FIX2INT(flags), realpath, sizeof(realpath));
+      rc = zkrb_call_zoo_create(zk->zh, RSTRING_PTR(path), data_ptr, (int)data_len, aclptr, create_flags, realpath, sizeof(realpath));
       break;
 #endif
 
     case ASYNC:
-      rc = zkrb_call_zoo_acreate(zk->zh, RSTRING_PTR(path), data_ptr, (int)data_len, aclptr, FIX2INT(flags), zkrb_string_callback, CTX_ALLOC(zk, reqid));
+      ZH_SUBMIT(zk, rc = zkrb_call_zoo_acreate(zk->zh, RSTRING_PTR(path), data_ptr, (int)data_len, aclptr, create_flags, zkrb_string_callback, CTX_ALLOC(zk, reqid)));
       break;
 
     default:
@@ -508,18 +615,19 @@ static VALUE method_create(VALUE self, VALUE reqid, VALUE path, VALUE data, VALU
 static VALUE method_delete(VALUE self, VALUE reqid, VALUE path, VALUE version, VALUE async) {
   STANDARD_PREAMBLE(self, zk, reqid, path, async, Qfalse, call_type);
   Check_Type(version, T_FIXNUM);
+  int zversion = FIX2INT(version);
 
   int rc = 0;
   switch (call_type) {
 
 #ifdef THREADED
     case SYNC:
-      rc = zkrb_call_zoo_delete(zk->zh, RSTRING_PTR(path), FIX2INT(version));
+      rc = zkrb_call_zoo_delete(zk->zh, RSTRING_PTR(path), zversion);
       break;
 #endif
 
     case ASYNC:
-      rc = zkrb_call_zoo_adelete(zk->zh, RSTRING_PTR(path), FIX2INT(version), zkrb_void_callback, CTX_ALLOC(zk, reqid));
+      ZH_SUBMIT(zk, rc = zkrb_call_zoo_adelete(zk->zh, RSTRING_PTR(path), zversion, zkrb_void_callback, CTX_ALLOC(zk, reqid)));
       break;
 
     default:
@@ -562,13 +670,13 @@ static VALUE method_get(VALUE self, VALUE reqid, VALUE path, VALUE async, VALUE
 #endif
 
     case ASYNC:
-      rc = zkrb_call_zoo_aget(zk->zh, RSTRING_PTR(path), 0, zkrb_data_callback, CTX_ALLOC(zk, reqid));
+      ZH_SUBMIT(zk, rc = zkrb_call_zoo_aget(zk->zh, RSTRING_PTR(path), 0, zkrb_data_callback, CTX_ALLOC(zk, reqid)));
       break;
 
     case ASYNC_WATCH:
       // first ctx is a watch, second is the async callback
-      rc = zkrb_call_zoo_awget(
-            zk->zh, RSTRING_PTR(path), zkrb_state_callback, CTX_ALLOC(zk, reqid), zkrb_data_callback, CTX_ALLOC(zk, reqid));
+      ZH_SUBMIT(zk, rc = zkrb_call_zoo_awget(
+            zk->zh, RSTRING_PTR(path), zkrb_state_callback, CTX_ALLOC(zk, reqid), zkrb_data_callback, CTX_ALLOC(zk, reqid)));
       break;
 
     default:
@@ -584,7 +692,7 @@ static VALUE method_get(VALUE self, VALUE reqid, VALUE path, VALUE async, VALUE
       rb_ary_push(output, Qnil);        /* No data associated with path */
     else
       rb_ary_push(output, rb_str_new(data, data_len));
-    rb_ary_push(output, zkrb_stat_to_rarray(&stat));
+    rb_ary_push(output, zkrb_stat_to_ruby(&stat));
   }
 
 cleanup:
@@ -600,6 +708,7 @@ static VALUE method_set(VALUE self, VALUE reqid, VALUE path, VALUE data, VALUE a
   struct Stat stat;
 
   if (data != Qnil) Check_Type(data, T_STRING);
+  int zversion = FIX2INT(version);
 
   const char *data_ptr = (data == Qnil) ? NULL : RSTRING_PTR(data);
   ssize_t     data_len = (data == Qnil) ? -1   : RSTRING_LEN(data);
@@ -609,13 +718,13 @@ static VALUE method_set(VALUE self, VALUE reqid, VALUE path, VALUE data, VALUE a
 
 #ifdef THREADED
     case SYNC:
-      rc = zkrb_call_zoo_set2(zk->zh, RSTRING_PTR(path), data_ptr, (int)data_len, FIX2INT(version), &stat);
+      rc = zkrb_call_zoo_set2(zk->zh, RSTRING_PTR(path), data_ptr, (int)data_len, zversion, &stat);
       break;
 #endif
 
     case ASYNC:
-      rc = zkrb_call_zoo_aset(
-            zk->zh, RSTRING_PTR(path), data_ptr, (int)data_len, FIX2INT(version), zkrb_stat_callback, CTX_ALLOC(zk, reqid));
+      ZH_SUBMIT(zk, rc = zkrb_call_zoo_aset(
+            zk->zh, RSTRING_PTR(path), data_ptr, (int)data_len, zversion, zkrb_stat_callback, CTX_ALLOC(zk, reqid)));
       break;
 
     default:
@@ -626,7 +735,7 @@ static VALUE method_set(VALUE self, VALUE reqid, VALUE path, VALUE data, VALUE a
   output = rb_ary_new();
   rb_ary_push(output, INT2FIX(rc));
   if (IS_SYNC(call_type) && rc == ZOK) {
-    rb_ary_push(output, zkrb_stat_to_rarray(&stat));
+    rb_ary_push(output, zkrb_stat_to_ruby(&stat));
   }
   return output;
 }
@@ -634,6 +743,7 @@ static VALUE method_set(VALUE self, VALUE reqid, VALUE path, VALUE data, VALUE a
 static VALUE method_set_acl(VALUE self, VALUE reqid, VALUE path, VALUE acls, VALUE async, VALUE version) {
   STANDARD_PREAMBLE(self, zk, reqid, path, async, Qfalse, call_type);
 
+  int zversion = FIX2INT(version);
   struct ACL_vector * aclptr = zkrb_ruby_to_aclvector(acls);
 
   int rc=ZOK, invalid_call_type=0;
@@ -641,12 +751,12 @@ static VALUE method_set_acl(VALUE self, VALUE reqid, VALUE path, VALUE acls, VAL
 
 #ifdef THREADED
     case SYNC:
-      rc = zkrb_call_zoo_set_acl(zk->zh, RSTRING_PTR(path), FIX2INT(version), aclptr);
+      rc = zkrb_call_zoo_set_acl(zk->zh, RSTRING_PTR(path), zversion, aclptr);
       break;
 #endif
 
     case ASYNC:
-      rc = zkrb_call_zoo_aset_acl(zk->zh, RSTRING_PTR(path), FIX2INT(version), aclptr, zkrb_void_callback, CTX_ALLOC(zk, reqid));
+      ZH_SUBMIT(zk, rc = zkrb_call_zoo_aset_acl(zk->zh, RSTRING_PTR(path), zversion, aclptr, zkrb_void_callback, CTX_ALLOC(zk, reqid)));
       break;
 
     default:
@@ -679,7 +789,7 @@ static VALUE method_get_acl(VALUE self, VALUE reqid, VALUE path, VALUE async) {
 #endif
 
     case ASYNC:
-      rc = zkrb_call_zoo_aget_acl(zk->zh, RSTRING_PTR(path), zkrb_acl_callback, CTX_ALLOC(zk, reqid));
+      ZH_SUBMIT(zk, rc = zkrb_call_zoo_aget_acl(zk->zh, RSTRING_PTR(path), zkrb_acl_callback, CTX_ALLOC(zk, reqid)));
       break;
 
     default:
@@ -691,12 +801,234 @@ static VALUE method_get_acl(VALUE self, VALUE reqid, VALUE path, VALUE async) {
   rb_ary_push(output, INT2FIX(rc));
   if (IS_SYNC(call_type) && rc == ZOK) {
     rb_ary_push(output, zkrb_acl_vector_to_ruby(&acls));
-    rb_ary_push(output, zkrb_stat_to_rarray(&stat));
+    rb_ary_push(output, zkrb_stat_to_ruby(&stat));
     deallocate_ACL_vector(&acls);
   }
   return output;
 }
 
+// raises unless op is one of the op arrays Zookeeper::Multi builds:
+//
+//   [ZOO_CREATE_OP,  path, data, acls, flags]
+//   [ZOO_DELETE_OP,  path, version]
+//   [ZOO_SETDATA_OP, path, data, version]
+//   [ZOO_CHECK_OP,   path, version]
+//
+// everything is checked before anything is allocated for the call
+static void assert_valid_multi_op(VALUE op) {
+  Check_Type(op, T_ARRAY);
+  if (RARRAY_LEN(op) < 3) rb_raise(rb_eArgError, "malformed multi op: %"PRIsVALUE, rb_inspect(op));
+
+  VALUE type = rb_ary_entry(op, 0);
+  Check_Type(type, T_FIXNUM);
+  Check_Type(rb_ary_entry(op, 1), T_STRING);
+
+  switch (FIX2INT(type)) {
+    case ZOO_CREATE_OP:
+      if (RARRAY_LEN(op) != 5) break;
+      if (!NIL_P(rb_ary_entry(op, 2))) Check_Type(rb_ary_entry(op, 2), T_STRING);
+      Check_Type(rb_ary_entry(op, 3), T_ARRAY);
+      Check_Type(rb_ary_entry(op, 4), T_FIXNUM);
+      return;
+    case ZOO_DELETE_OP:
+    case ZOO_CHECK_OP:
+      if (RARRAY_LEN(op) != 3) break;
+      Check_Type(rb_ary_entry(op, 2), T_FIXNUM);
+      return;
+    case ZOO_SETDATA_OP:
+      if (RARRAY_LEN(op) != 4) break;
+      if (!NIL_P(rb_ary_entry(op, 2))) Check_Type(rb_ary_entry(op, 2), T_STRING);
+      Check_Type(rb_ary_entry(op, 3), T_FIXNUM);
+      return;
+  }
+
+  rb_raise(rb_eArgError, "malformed multi op: %"PRIsVALUE, rb_inspect(op));
+}
+
+// room for the sequence suffix and, as 3.4.5 doesn't strip it from the
+// results of a multi, the chroot
+#define MULTI_PATH_SLACK 1024
+
+// everything method_multi allocates, so that it can all be released in one
+// place whether or not converting the ops raised
+struct multi_call {
+  zkrb_instance_data_t *zk;
+  VALUE reqid;
+  VALUE ops;
+  zkrb_call_type call_type;
+  int count;
+
+  zkrb_multi_t *multi;          // NULL once it's been handed to a context
+  struct ACL_vector **acls;
+  zoo_op_t *zops;
+};
+
+static VALUE multi_call_body(VALUE data) {
+  struct multi_call *m = (struct multi_call *)data;
+  zkrb_instance_data_t *zk = m->zk;
+  int count = m->count;
+  int k, rc = ZOK;
+
+  // creates that pass the same acls array (bulk loads mostly do) share one
+  // converted ACL_vector, owned by the first of them
+  VALUE last_acl = Qundef;
+  struct ACL_vector *last_aclptr = NULL;
+
+  // zkc serializes the ops (and so the paths, data and acls, which stay
+  // referenced by the ops array) during the call, but writes into the multi's
+  // buffers when the response arrives
+  m->multi = zkrb_multi_alloc(count);
+  m->acls  = calloc(count ? count : 1, sizeof(struct ACL_vector *));
+  m->zops  = calloc(count ? count : 1, sizeof(zoo_op_t));
+
+  if (!m->multi || !m->acls || !m->zops)
+    rb_raise(rb_eNoMemError, "could not allocate multi of %d ops", count);
+
+  zkrb_multi_t *multi = m->multi;
+
+  for (k = 0; k < count; ++k) {
+    VALUE op         = rb_ary_entry(m->ops, k);
+    VALUE path       = rb_ary_entry(op, 1);
+    const char *data = NULL;
+    int data_len     = -1;
+
+    multi->types[k] = FIX2INT(rb_ary_entry(op, 0));
+
+    if (multi->types[k] == ZOO_CREATE_OP || multi->types[k] == ZOO_SETDATA_OP) {
+      VALUE rdata = rb_ary_entry(op, 2);
+      if (!NIL_P(rdata)) {
+        data = RSTRING_PTR(rdata);
+        data_len = (int) RSTRING_LEN(rdata);
+      }
+    }
+
+    switch (multi->types[k]) {
+      case ZOO_CREATE_OP: {
+        int buf_len = (int) RSTRING_LEN(path) + MULTI_PATH_SLACK;
+        int flags = FIX2INT(rb_ary_entry(op, 4));
+
+        if (rb_ary_entry(op, 3) != last_acl) {
+          last_acl = rb_ary_entry(op, 3);
+          last_aclptr = m->acls[k] = zkrb_ruby_to_aclvector(last_acl);
+        }
+        if (!zkrb_multi_path_buf(multi, k, buf_len))
+          rb_raise(rb_eNoMemError, "could not allocate multi of %d ops", count);
+
+        zoo_create_op_init(&m->zops[k], RSTRING_PTR(path), data, data_len, last_aclptr,
+            flags, multi->path_bufs[k], buf_len);
+        break;
+      }
+      case ZOO_DELETE_OP:
+        zoo_delete_op_init(&m->zops[k], RSTRING_PTR(path), FIX2INT(rb_ary_entry(op, 2)));
+        break;
+      case ZOO_SETDATA_OP:
+        zoo_set_op_init(&m->zops[k], RSTRING_PTR(path), data, data_len, FIX2INT(rb_ary_entry(op, 3)), &multi->stats[k]);
+        break;
+      case ZOO_CHECK_OP:
+        zoo_check_op_init(&m->zops[k], RSTRING_PTR(path), FIX2INT(rb_ary_entry(op, 2)));
+        break;
+    }
+  }
+
+  switch (m->call_type) {
+
+#ifdef THREADED
+    case SYNC:
+      rc = zkrb_call_zoo_multi(zk->zh, count, m->zops, multi->results);
+      break;
+#endif
+
+    case ASYNC: {
+      // the context owns the multi from here on, zkrb_multi_callback frees it
+      zkrb_calling_context *ctx = CTX_ALLOC(zk, m->reqid);
+      ctx->multi = multi;
+      m->multi = NULL;
+
+      ZH_SUBMIT(zk, rc = zkrb_call_zoo_amulti(zk->zh, count, m->zops, ctx->multi->results, zkrb_multi_callback, ctx));
+
+      // the completion won't run
+      if (rc != ZOK) zkrb_calling_context_free(ctx);
+      break;
+    }
+
+    default:
+      raise_invalid_call_type_err(m->call_type);
+      break;
+  }
+
+  VALUE output = rb_ary_new();
+  rb_ary_push(output, INT2FIX(rc));
+
+  if (IS_SYNC(m->call_type) && m->multi) {
+    rb_ary_push(output, zkrb_multi_results_to_ruby(m->multi, rc));
+  }
+
+  return output;
+}
+
+static VALUE multi_call_release(VALUE data) {
+  struct multi_call *m = (struct multi_call *)data;
+  int k;
+
+  if (m->acls) {
+    for (k = 0; k < m->count; ++k) {
+      if (m->acls[k]) {
+        deallocate_ACL_vector(m->acls[k]);
+        free(m->acls[k]);
+      }
+    }
+  }
+
+  free(m->acls);
+  free(m->zops);
+  zkrb_multi_free(m->multi);
+
+  return Qnil;
+}
+
+static VALUE method_multi(VALUE self, VALUE reqid, VALUE ops, VALUE async) {
+  FETCH_DATA_PTR(self, zk);
+  struct multi_call m;
+  int k;
+
+  Check_Type(ops, T_ARRAY);
+
+  m.zk        = zk;
+  m.reqid     = reqid;
+  m.ops       = ops;
+  m.call_type = get_call_type(async, Qfalse);
+  m.count     = (int) RARRAY_LEN(ops);
+  m.multi     = NULL;
+  m.acls      = NULL;
+  m.zops      = NULL;
+
+  for (k = 0; k < m.count; ++k) assert_valid_multi_op(rb_ary_entry(ops, k));
+
+  return rb_ensure(multi_call_body, (VALUE)&m, multi_call_release, (VALUE)&m);
+}
+
+// walks the subtree at path from zkc's completions, see zkrb_tree_start.
+// only async: the whole tree comes back as one event with the walk's req_id
+static VALUE method_get_tree(VALUE self, VALUE reqid, VALUE path, VALUE async, VALUE depth, VALUE concurrency, VALUE with_data) {
+  STANDARD_PREAMBLE(self, zk, reqid, path, async, Qfalse, call_type);
+
+  int max_depth = NIL_P(depth) ? -1 : NUM2INT(depth);
+  int window = NUM2INT(concurrency);
+  int rc = ZOK;
+
+  switch (call_type) {
+    case ASYNC:
+      ZH_SUBMIT(zk, rc = zkrb_tree_start(zk->zh, zk->queue, NUM2LL(reqid), RSTRING_PTR(path), max_depth, window, !RTEST(with_data)));
+      break;
+
+    default:
+      raise_invalid_call_type_err(call_type);
+      break;
+  }
+
+  return rb_ary_new3(1, INT2FIX(rc));
+}
+
 #define is_running(self) RTEST(rb_iv_get(self, "@_running"))
 #define is_closed(self) RTEST(rb_iv_get(self, "@_closed"))
 #define is_shutting_down(self) RTEST(rb_iv_get(self, "@_shutting_down"))
@@ -705,9 +1037,15 @@ static VALUE method_zkrb_get_next_event(VALUE self, VALUE blocking) {
   // dbg.h
   check_debug(!is_closed(self), "we are closed, not trying to get event");
 
-  char buf[64];
   FETCH_DATA_PTR(self, zk);
 
+#if !ZKRB_COMPLETIONS_OFF_GVL
+  // completions are only run by zkrb_iterate_event_loop, there is nothing
+  // to block for here. get_tree results and the events zkrb_direct_deliver
+  // couldn't build are still in the ring, zkrb_take_events moves them over
+  return rb_ary_shift(zkrb_take_events(zk->queue, 1));
+#endif
+
   for (;;) {
     check_debug(!is_closed(self), "we're closed in the middle of method_zkrb_get_next_event, bailing");
 
@@ -722,36 +1060,28 @@ static VALUE method_zkrb_get_next_event(VALUE self, VALUE blocking) {
         check_debug(!is_shutting_down(self), "method_zkrb_get_next_event, we're shutting down, don't enter blocking section");
 
         int fd = zk->queue->pipe_read;
-        ssize_t bytes_read = 0;
 
         // wait for an fd to become readable, opposite of rb_thread_fd_writable
         rb_thread_wait_fd(fd);
 
-        // clear all bytes here, we'll catch all the events on subsequent calls
-        // (until we run out of events)
-        bytes_read = read(fd, buf, sizeof(buf));
-
-        if (bytes_read == -1) {
-          rb_raise(rb_eRuntimeError, "read failed: %d", errno);
-        }
+        // clear the pipe and re-arm the queue's signal, we'll catch all the
+        // events on subsequent calls (until we run out of events)
+        zkrb_queue_drain_signal(zk->queue);
 
-        zkrb_debug_inst(self, "read %zd bytes from the queue (%p)'s pipe", bytes_read, zk->queue);
+        zkrb_debug_inst(self, "drained the queue (%p)'s pipe", zk->queue);
 
         continue;
       }
     }
 
-    VALUE hash = zkrb_event_to_ruby(event);
-    zkrb_event_free(event);
-    return hash;
+    return zkrb_event_to_ruby(event);
   }
 
   error:
     return Qnil;
 }
 
-// the single threaded version of this call. will go away when we do direct
-// event delivery (soon)
+// the single threaded version of this call
 static VALUE method_zkrb_get_next_event_st(VALUE self) {
   volatile VALUE rval = Qnil;
 
@@ -762,25 +1092,103 @@ static VALUE method_zkrb_get_next_event_st(VALUE self) {
 
   FETCH_DATA_PTR(self, zk);
 
+#if !ZKRB_COMPLETIONS_OFF_GVL
+  return rb_ary_shift(zkrb_take_events(zk->queue, 1));
+#endif
+
   zkrb_event_t *event = zkrb_dequeue(zk->queue, 0);
 
   if (event != NULL) {
     rval = zkrb_event_to_ruby(event);
-    zkrb_event_free(event);
-
-#if THREADED
-    int fd = zk->queue->pipe_read;
 
+#if ZKRB_COMPLETIONS_OFF_GVL && !defined(ZKRB_IO_THREAD)
     // we don't care in this case. this is just until i can remove the self
     // pipe from the queue
-    char b[128];
-    while(read(fd, b, sizeof(b)) == sizeof(b)){}
+    zkrb_queue_drain_signal(zk->queue);
 #endif
   }
 
   return rval;
 }
 
+// batch version of zkrb_get_next_event_st: returns an array of up to max
+// event hashes (all of them if max is nil), empty if there's nothing queued
+#define ZKRB_EVENT_BATCH 64
+
+struct events_batch {
+  zkrb_queue_t *queue;
+  VALUE rval;
+  long max;
+  long total;
+  zkrb_event_t *events[ZKRB_EVENT_BATCH];
+  int n;  // events dequeued into the current batch
+  int i;  // how many of those have been handed to ruby
+};
+
+static VALUE events_batch_convert(VALUE data) {
+  struct events_batch *b = (struct events_batch *)data;
+  VALUE ev;
+
+  while (b->total < b->max) {
+    b->i = 0;
+    b->n = zkrb_dequeue_batch(b->queue, b->events, (b->max - b->total) < ZKRB_EVENT_BATCH ? (int)(b->max - b->total) : ZKRB_EVENT_BATCH);
+    if (b->n == 0) break;
+
+    while (b->i < b->n) {
+      // zkrb_event_to_ruby owns the event from here on, even if it raises
+      ev = zkrb_event_to_ruby(b->events[b->i++]);
+      rb_ary_push(b->rval, ev);
+    }
+
+    b->total += b->n;
+  }
+
+  return b->rval;
+}
+
+// if a conversion raised, the rest of the batch is already off the queue
+static VALUE events_batch_release(VALUE data) {
+  struct events_batch *b = (struct events_batch *)data;
+
+  while (b->i < b->n) zkrb_event_free(b->events[b->i++]);
+
+  return Qnil;
+}
+
+static VALUE method_zkrb_get_next_events_st(VALUE self, VALUE max_events) {
+  volatile VALUE rval = rb_ary_new();
+  long max = NIL_P(max_events) ? LONG_MAX : NUM2LONG(max_events);
+  struct events_batch b;
+
+  if (is_closed(self)) {
+    zkrb_debug("we are closed, not gonna try to get events");
+    return rval;
+  }
+
+  FETCH_DATA_PTR(self, zk);
+
+#if !ZKRB_COMPLETIONS_OFF_GVL
+  return zkrb_take_events(zk->queue, NIL_P(max_events) ? -1 : max);
+#endif
+
+  b.queue = zk->queue;
+  b.rval  = rval;
+  b.max   = max;
+  b.total = 0;
+  b.n     = 0;
+  b.i     = 0;
+
+  rb_ensure(events_batch_convert, (VALUE)&b, events_batch_release, (VALUE)&b);
+
+  // with the IO engine the event loop waits on the queue's pipe and drains
+  // it before events are fetched, doing it here too could eat a signal
+#if ZKRB_COMPLETIONS_OFF_GVL && !defined(ZKRB_IO_THREAD)
+  if (b.total > 0) zkrb_queue_drain_signal(zk->queue);
+#endif
+
+  return rval;
+}
+
 inline static int get_self_pipe_read_fd(VALUE self) {
   rb_io_t *fptr;
   VALUE pipe_read = rb_iv_get(self, "@pipe_read");
@@ -799,16 +1207,201 @@ inline static int get_self_pipe_read_fd(VALUE self) {
 #endif
 }
 
-static VALUE method_zkrb_iterate_event_loop(VALUE self) {
+// empties the self-pipe after a wakeup. the ruby side only writes when it
+// isn't already waiting for us to wake, so there's rarely more than a byte or
+// two here; the caller has been told it's readable, so this won't block.
+static void zkrb_drain_self_pipe(zkrb_instance_data_t *zk, int pipe_r_fd) {
+  char b[64];
+
+  if (read(pipe_r_fd, b, sizeof(b)) < 0) {
+    rb_raise(rb_eRuntimeError, "read from pipe failed: %s", clean_errno());
+  }
+
+  zk->pipe_wakeups++;
+}
+
+// what the event loop waits for besides the self-pipe. with the IO engine
+// that's the completion queue's pipe (the engine has the socket, and signals
+// the pipe when it has queued something), otherwise it's whatever the handle
+// wants.
+static int zkrb_loop_interest(zkrb_instance_data_t *zk, int *fd, int *interest, struct timeval *tv) {
+#ifdef ZKRB_IO_THREAD
+  *fd = zk->queue->pipe_read;
+  *interest = ZOOKEEPER_READ;
+  tv->tv_sec = 1;
+  tv->tv_usec = 0;
+  return ZOK;
+#else
+  return zookeeper_interest(zk->zh, fd, interest, tv);
+#endif
+}
+
+// ...and what to do once it's ready. the queue is drained by the caller's
+// next zkrb_get_next_events, all that's left to do here is re-arm the signal.
+static int zkrb_loop_process(zkrb_instance_data_t *zk, int events) {
+#ifdef ZKRB_IO_THREAD
+  if (events & ZOOKEEPER_READ) zkrb_queue_drain_signal(zk->queue);
+  return ZOK;
+#else
+  int rc = zookeeper_process(zk->zh, events);
+  zkrb_queue_reraise(zk->queue);
+  return rc;
+#endif
+}
+
+// max_wait (seconds, negative for no limit) caps how long one turn of the
+// loop may wait, so the ruby side gets control back by its next deadline
+static void zkrb_clamp_wait(struct timeval *tv, double max) {
+  double cur;
+
+  if (max < 0) return;
+
+  cur = tv->tv_sec + tv->tv_usec / 1000000.0;
+
+  if (max < cur) {
+    tv->tv_sec  = (time_t) max;
+    tv->tv_usec = (suseconds_t) ((max - (double) tv->tv_sec) * 1000000.0);
+  }
+}
+
+#ifdef ZKRB_USE_EPOLL
+// brings the registration of the zk socket in line with what
+// zookeeper_interest asked for. zkc closes its socket on disconnect (which
+// drops it from the set) and the new one usually gets the same fd number, so
+// the inode tells us whether it's still the socket we registered.
+static void zkrb_epoll_watch(zkrb_instance_data_t *zk, int fd, int interest) {
+  struct epoll_event ev;
+  struct stat st;
+  ino_t ino = 0;
+
+  interest &= (ZOOKEEPER_READ | ZOOKEEPER_WRITE);
+
+  // like select() with the fd in neither set, nothing to wait for. (epoll
+  // reports hangups whatever the mask, which would just spin the loop.)
+  if (interest == 0) fd = -1;
+
+  if (fd != -1 && fstat(fd, &st) == 0) ino = st.st_ino;
+
+  if (fd == zk->ep_fd && ino == zk->ep_ino && interest == zk->ep_interest) return;
+
+  memset(&ev, 0, sizeof(ev));
+
+  if (zk->ep_fd != -1 && (fd != zk->ep_fd || ino != zk->ep_ino)) {
+    // fails harmlessly if closing the old socket already took it out
+    epoll_ctl(zk->epfd, EPOLL_CTL_DEL, zk->ep_fd, &ev);
+    zk->epoll_ctls++;
+    zk->ep_fd = -1;
+  }
+
+  if (fd != -1) {
+    int op = (fd == zk->ep_fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    ev.events  = ((interest & ZOOKEEPER_READ)  ? EPOLLIN  : 0) |
+                 ((interest & ZOOKEEPER_WRITE) ? EPOLLOUT : 0);
+    ev.data.fd = fd;
+
+    if (epoll_ctl(zk->epfd, op, fd, &ev) < 0) {
+      op = (op == EPOLL_CTL_MOD) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+
+      if (epoll_ctl(zk->epfd, op, fd, &ev) < 0) {
+        log_err("epoll_ctl failed: fd=%d interest=%d", fd, interest);
+        fd = -1;
+      }
+    }
+
+    zk->epoll_ctls++;
+  }
+
+  zk->ep_fd       = fd;
+  zk->ep_ino      = ino;
+  zk->ep_interest = (fd == -1) ? 0 : interest;
+}
+
+// one turn of the event loop on the epoll set. ruby waits for the epoll fd
+// itself to become readable (without the GVL, and interruptibly), then we
+// collect what's ready without blocking.
+static VALUE zkrb_epoll_iterate_event_loop(VALUE self, zkrb_instance_data_t *zk, double max_wait) {
+  struct epoll_event evs[2];
+  struct timeval tv;
+  int fd = -1, interest = 0, events = 0, rc = 0, irc = 0, prc = 0, n = 0, i;
+
+  if (zk->ep_pipe_fd == -1) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = EPOLLIN;
+    ev.data.fd = get_self_pipe_read_fd(self);
+
+    if (epoll_ctl(zk->epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0) {
+      rb_raise(rb_eRuntimeError, "could not add the self-pipe to the epoll set: %s", clean_errno());
+    }
+
+    zk->ep_pipe_fd = ev.data.fd;
+    zk->epoll_ctls++;
+  }
+
+  irc = zkrb_loop_interest(zk, &fd, &interest, &tv);
+  zkrb_clamp_wait(&tv, max_wait);
+
+  zkrb_epoll_watch(zk, fd, interest);
+
+  rc = rb_wait_for_single_fd(zk->epfd, RB_WAITFD_IN, &tv);
+
+  if (rc > 0) {
+    n = epoll_wait(zk->epfd, evs, 2, 0);
+
+    for (i = 0; i < n; i++) {
+      if (evs[i].data.fd == zk->ep_pipe_fd) {
+        zkrb_drain_self_pipe(zk, zk->ep_pipe_fd);
+      } else if (evs[i].data.fd == zk->ep_fd) {
+        // select() reports a socket with an error as ready for whatever we
+        // were waiting for, so do the same and let zookeeper_process find out
+        if (evs[i].events & (EPOLLERR | EPOLLHUP)) events |= zk->ep_interest;
+        if (evs[i].events & EPOLLIN)  events |= ZOOKEEPER_READ;
+        if (evs[i].events & EPOLLOUT) events |= ZOOKEEPER_WRITE;
+      }
+    }
+  }
+  else if (rc < 0) {
+    log_err("waiting on the epoll set failed: rc=%d interest=%d fd=%d irc=%d timeout=%f",
+      rc, interest, fd, irc, tv.tv_sec + (tv.tv_usec/ 1000.0 / 1000.0));
+  }
+
+  prc = zkrb_loop_process(zk, events);
+  zk->loop_iterations++;
+
+  if (rc == 0) {
+    zkrb_debug("timed out waiting for descriptor to be ready. prc=%d interest=%d fd=%d irc=%d",
+      prc, interest, fd, irc);
+  }
+
+  return INT2FIX(prc);
+}
+#endif
+
+// takes an optional limit on how long to wait, in seconds
+static VALUE method_zkrb_iterate_event_loop(int argc, VALUE *argv, VALUE self) {
+  VALUE max_wait_arg = Qnil;
+  rb_scan_args(argc, argv, "01", &max_wait_arg);
+
+  double max_wait = NIL_P(max_wait_arg) ? -1 : NUM2DBL(max_wait_arg);
+  if (max_wait < 0 && !NIL_P(max_wait_arg)) max_wait = 0;
+
   FETCH_DATA_PTR(self, zk);
 
+#ifdef ZKRB_USE_EPOLL
+  // a forked child shares the parent's epoll set, it mustn't touch it
+  if (zk->use_epoll && !we_are_forked(zk)) return zkrb_epoll_iterate_event_loop(self, zk, max_wait);
+#endif
+
   rb_fdset_t rfds, wfds, efds;
   rb_fd_init(&rfds); rb_fd_init(&wfds); rb_fd_init(&efds);
 
   int fd = 0, interest = 0, events = 0, rc = 0, maxfd = 0, irc = 0, prc = 0;
   struct timeval tv;
 
-  irc = zookeeper_interest(zk->zh, &fd, &interest, &tv);
+  irc = zkrb_loop_interest(zk, &fd, &interest, &tv);
+  zkrb_clamp_wait(&tv, max_wait);
 
   if (fd != -1) {
     if (interest & ZOOKEEPER_READ) {
@@ -844,12 +1437,7 @@ static VALUE method_zkrb_iterate_event_loop(VALUE self) {
 
     // we got woken up by the self-pipe
     if (rb_fd_isset(pipe_r_fd, &rfds)) {
-      // one event has awoken us, so we clear one event from the pipe
-      char b[1];
-
-      if (read(pipe_r_fd, b, 1) < 0) {
-        rb_raise(rb_eRuntimeError, "read from pipe failed: %s", clean_errno());
-      }
+      zkrb_drain_self_pipe(zk, pipe_r_fd);
     }
   }
   else if (rc == 0) {
@@ -861,7 +1449,8 @@ static VALUE method_zkrb_iterate_event_loop(VALUE self) {
       rc, interest, fd, pipe_r_fd, maxfd, irc, tv.tv_sec + (tv.tv_usec/ 1000.0 / 1000.0));
   }
 
-  prc = zookeeper_process(zk->zh, events);
+  prc = zkrb_loop_process(zk, events);
+  zk->loop_iterations++;
 
   if (rc == 0) {
     zkrb_debug("timed out waiting for descriptor to be ready. prc=%d interest=%d fd=%d pipe_r_fd=%d maxfd=%d irc=%d timeout=%f",
@@ -878,10 +1467,60 @@ static VALUE method_has_events(VALUE self) {
   VALUE rb_event;
   FETCH_DATA_PTR(self, zk);
 
+#if ZKRB_COMPLETIONS_OFF_GVL
   rb_event = zkrb_peek(zk->queue) != NULL ? Qtrue : Qfalse;
+#else
+  rb_event = (RARRAY_LEN(zk->queue->pending) > 0 || zkrb_peek(zk->queue) != NULL) ? Qtrue : Qfalse;
+#endif
   return rb_event;
 }
 
+// C side of CZookeeper#wakeup_stats
+static VALUE method_zkrb_wakeup_stats(VALUE self) {
+  FETCH_DATA_PTR(self, zk);
+
+  VALUE hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("loop_iterations")), ULONG2NUM(zk->loop_iterations));
+  rb_hash_aset(hash, ID2SYM(rb_intern("pipe_wakeups")),    ULONG2NUM(zk->pipe_wakeups));
+  rb_hash_aset(hash, ID2SYM(rb_intern("events")),          ULONG2NUM(zk->queue->enqueued));
+  rb_hash_aset(hash, ID2SYM(rb_intern("queue_wakeups")),   ULONG2NUM(zk->queue->wakeups));
+  rb_hash_aset(hash, ID2SYM(rb_intern("epoll_ctls")),      ULONG2NUM(zk->epoll_ctls));
+
+#ifdef ZKRB_USE_EPOLL
+  rb_hash_aset(hash, ID2SYM(rb_intern("event_loop")), ID2SYM(rb_intern(zk->use_epoll ? "epoll" : "select")));
+#else
+  rb_hash_aset(hash, ID2SYM(rb_intern("event_loop")), ID2SYM(rb_intern("select")));
+#endif
+
+#ifdef ZKRB_IO_THREAD
+  rb_hash_aset(hash, ID2SYM(rb_intern("io_iterations")), ULONG2NUM(zk->io->iterations));
+  rb_hash_aset(hash, ID2SYM(rb_intern("io_wakeups")),    ULONG2NUM(zk->io->wakeups));
+#endif
+  return hash;
+}
+
+#ifdef ZKRB_TEST_HOOKS
+// sleeps for the given number of seconds *without* releasing the GVL, the
+// way a misbehaving C extension or a long GC pause would. for the specs.
+static VALUE klass_method_zkrb_hold_gvl(VALUE klass, VALUE seconds) {
+  double secs = NUM2DBL(seconds);
+  struct timespec ts, rem;
+
+  ts.tv_sec  = (time_t) secs;
+  ts.tv_nsec = (long) ((secs - (double) ts.tv_sec) * 1e9);
+
+  while (nanosleep(&ts, &rem) < 0 && errno == EINTR) ts = rem;
+
+  return Qnil;
+}
+#endif
+
+// occupancy of the event slab backing this handle's queue, see event_lib.h
+static VALUE method_event_slab_stats(VALUE self) {
+  FETCH_DATA_PTR(self, zk);
+  return zkrb_slab_stats_to_ruby(zk->queue->slab);
+}
+
 static VALUE method_zoo_set_log_level(VALUE self, VALUE level) {
   Check_Type(level, T_FIXNUM);
   zoo_set_debug_level(FIX2INT(level));
@@ -914,27 +1553,36 @@ static VALUE method_deterministic_conn_order(VALUE self, VALUE yn) {
 }
 
 static VALUE method_is_unrecoverable(VALUE self) {
+  int rc;
   FETCH_DATA_PTR(self, zk);
-  return is_unrecoverable(zk->zh) == ZINVALIDSTATE ? Qtrue : Qfalse;
+  ZH_CALL(zk, rc = is_unrecoverable(zk->zh));
+  return rc == ZINVALIDSTATE ? Qtrue : Qfalse;
 }
 
 static VALUE method_zkrb_state(VALUE self) {
+  int state;
   FETCH_DATA_PTR(self, zk);
-  return INT2NUM(zoo_state(zk->zh));
+  ZH_CALL(zk, state = zoo_state(zk->zh));
+  return INT2NUM(state);
 }
 
 static VALUE method_recv_timeout(VALUE self) {
+  int timeout;
   FETCH_DATA_PTR(self, zk);
-  return INT2NUM(zoo_recv_timeout(zk->zh));
+  ZH_CALL(zk, timeout = zoo_recv_timeout(zk->zh));
+  return INT2NUM(timeout);
 }
 
 // returns a CZookeeper::ClientId object with the values set for session_id and passwd
 static VALUE method_client_id(VALUE self) {
+  clientid_t cid;
   FETCH_DATA_PTR(self, zk);
-  const clientid_t *cid = zoo_client_id(zk->zh);
 
-  VALUE session_id = LL2NUM(cid->client_id);
-  VALUE passwd = rb_str_new(cid->passwd, 16);
+  // a copy, the engine may be replacing it as we speak (new session)
+  ZH_CALL(zk, cid = *zoo_client_id(zk->zh));
+
+  VALUE session_id = LL2NUM(cid.client_id);
+  VALUE passwd = rb_str_new(cid.passwd, 16);
 
   VALUE client_id_obj = rb_class_new_instance(0, RARRAY_PTR(rb_ary_new()), ZookeeperClientId);
 
@@ -960,8 +1608,11 @@ static VALUE method_connected_host(VALUE self) {
 
   struct sockaddr addr;
   socklen_t addr_len = sizeof(addr);
+  struct sockaddr *connected;
+
+  ZH_CALL(zk, connected = zookeeper_get_connected_host(zk->zh, &addr, &addr_len));
 
-  if (zookeeper_get_connected_host(zk->zh, &addr, &addr_len) != NULL) {
+  if (connected != NULL) {
     char buf[255];
     char addrstr[128];
     void *inaddr;
@@ -1001,7 +1652,7 @@ static void zkrb_define_methods(void) {
   // the number after the method name should be actual arity of C function - 1
   DEFINE_METHOD(zkrb_init, -1);
 
-  rb_define_method(CZookeeper, "zkrb_get_children", method_get_children,  4);
+  rb_define_method(CZookeeper, "zkrb_get_children", method_get_children, -1);
   rb_define_method(CZookeeper, "zkrb_exists",       method_exists,        4);
   rb_define_method(CZookeeper, "zkrb_create",       method_create,        6);
   rb_define_method(CZookeeper, "zkrb_delete",       method_delete,        4);
@@ -1010,6 +1661,8 @@ static void zkrb_define_methods(void) {
   rb_define_method(CZookeeper, "zkrb_set_acl",      method_set_acl,       5);
   rb_define_method(CZookeeper, "zkrb_get_acl",      method_get_acl,       3);
   rb_define_method(CZookeeper, "zkrb_add_auth",     method_add_auth,      3);
+  rb_define_method(CZookeeper, "zkrb_multi",        method_multi,         3);
+  rb_define_method(CZookeeper, "zkrb_get_tree",     method_get_tree,      6);
 
   rb_define_singleton_method(CZookeeper, "zoo_set_log_level", method_zoo_set_log_level, 1);
 
@@ -1020,19 +1673,32 @@ static void zkrb_define_methods(void) {
   DEFINE_METHOD(recv_timeout, 0);
   DEFINE_METHOD(zkrb_state, 0);
   DEFINE_METHOD(sync, 2);
-  DEFINE_METHOD(zkrb_iterate_event_loop, 0);
+  DEFINE_METHOD(zkrb_iterate_event_loop, -1);
   DEFINE_METHOD(zkrb_get_next_event_st, 0);
   DEFINE_METHOD(connected_host, 0);
 
   // methods for the ruby-side event manager
   DEFINE_METHOD(zkrb_get_next_event, 1);
   DEFINE_METHOD(zkrb_get_next_event_st, 0);
+  DEFINE_METHOD(zkrb_get_next_events_st, 1);
   DEFINE_METHOD(has_events, 0);
+  DEFINE_METHOD(event_slab_stats, 0);
+  DEFINE_METHOD(zkrb_wakeup_stats, 0);
 
   // Make these class methods?
   DEFINE_METHOD(zerror, 1);
 
   rb_define_singleton_method(CZookeeper, "set_zkrb_debug_level", klass_method_zkrb_set_debug_level, 1);
+#ifdef ZKRB_TEST_HOOKS
+  rb_define_singleton_method(CZookeeper, "zkrb_hold_gvl", klass_method_zkrb_hold_gvl, 1);
+#endif
+
+  // whether the connection is serviced by the IO engine (see zkrb_io.h)
+#ifdef ZKRB_IO_THREAD
+  rb_define_const(CZookeeper, "IO_THREAD", Qtrue);
+#else
+  rb_define_const(CZookeeper, "IO_THREAD", Qfalse);
+#endif
 
   rb_attr(CZookeeper, rb_intern("selectable_io"), 1, 0, Qtrue);
 
@@ -1070,6 +1736,10 @@ void Init_zookeeper_c() {
   rb_define_alloc_func(CZookeeper, alloc_zkrb_instance);
   zkrb_define_methods();
 
+  zkrb_define_event_class(mZookeeper);
+  zkrb_define_stat_class(mZookeeper);
+  zkrb_define_children_class(mZookeeper);
+
   ZookeeperClientId = rb_define_class_under(CZookeeper, "ClientId", rb_cObject);
   rb_define_method(ZookeeperClientId, "initialize", zkrb_client_id_method_initialize, 0);
   rb_define_attr(ZookeeperClientId, "session_id", 1, 1);
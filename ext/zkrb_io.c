@@ -0,0 +1,262 @@
+/* the GVL-independent IO engine, see zkrb_io.h */
+
+#include "ruby.h"
+#include "common.h"
+#include "zkrb_io.h"
+
+#ifdef ZKRB_IO_THREAD
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "event_lib.h"
+#include "dbg.h"
+
+// how long the engine waits when the handle is beyond saving and
+// zookeeper_interest has nothing for it to wait on
+#define ZKRB_IO_IDLE_MSEC 1000
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static zkrb_io_t *registry = NULL;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+// prepare: quiesce every engine by taking its lock, after taking the
+// registry's so the set of engines can't change underneath us
+static void zkrb_io_atfork_prepare(void) {
+  zkrb_io_t *io;
+
+  pthread_mutex_lock(&registry_lock);
+
+  for (io = registry; io; io = io->next) {
+    pthread_mutex_lock(&io->lock);
+  }
+}
+
+static void zkrb_io_atfork_parent(void) {
+  zkrb_io_t *io;
+
+  for (io = registry; io; io = io->next) {
+    pthread_mutex_unlock(&io->lock);
+  }
+
+  pthread_mutex_unlock(&registry_lock);
+}
+
+// the engines' threads are gone in the child, the locks were all taken by
+// this (the forking) thread, so they can simply be released
+static void zkrb_io_atfork_child(void) {
+  zkrb_io_t *io;
+
+  for (io = registry; io; io = io->next) {
+    io->wake_pending = 0;
+    pthread_mutex_unlock(&io->lock);
+  }
+
+  pthread_mutex_unlock(&registry_lock);
+}
+
+static void zkrb_io_install_atfork(void) {
+  pthread_atfork(zkrb_io_atfork_prepare, zkrb_io_atfork_parent, zkrb_io_atfork_child);
+}
+
+zkrb_io_t *zkrb_io_alloc(void) {
+  zkrb_io_t *io;
+  int pfd[2];
+
+  pthread_once(&atfork_once, zkrb_io_install_atfork);
+
+  if (pipe(pfd) != 0) {
+    log_err("zkrb_io_alloc: creating the wake pipe failed");
+    return NULL;
+  }
+
+  io = calloc(1, sizeof(zkrb_io_t));
+  if (!io) {
+    close(pfd[0]);
+    close(pfd[1]);
+    return NULL;
+  }
+
+  pthread_mutex_init(&io->lock, NULL);
+
+  io->wake_read  = pfd[0];
+  io->wake_write = pfd[1];
+  io->orig_pid   = getpid();
+
+  fcntl(io->wake_read,  F_SETFL, fcntl(io->wake_read, F_GETFL) | O_NONBLOCK);
+  fcntl(io->wake_read,  F_SETFD, FD_CLOEXEC);
+  fcntl(io->wake_write, F_SETFD, FD_CLOEXEC);
+
+  pthread_mutex_lock(&registry_lock);
+  io->next = registry;
+  if (registry) registry->prev = io;
+  registry = io;
+  pthread_mutex_unlock(&registry_lock);
+
+  return io;
+}
+
+void zkrb_io_lock(zkrb_io_t *io) {
+  if (pthread_mutex_lock(&io->lock) != 0) log_err("zkrb_io_lock error");
+}
+
+void zkrb_io_unlock(zkrb_io_t *io) {
+  if (pthread_mutex_unlock(&io->lock) != 0) log_err("zkrb_io_unlock error");
+}
+
+void zkrb_io_wake(zkrb_io_t *io) {
+  if (!io || !io->started) return;
+
+  if (__atomic_exchange_n(&io->wake_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    if (write(io->wake_write, "0", 1) < 0) {
+      log_err("zkrb_io_wake: write to the wake pipe failed");
+    }
+  }
+}
+
+// empty the wake pipe, *then* re-arm, same dance as zkrb_queue_drain_signal
+static void zkrb_io_drain_wake(zkrb_io_t *io) {
+  char buf[64];
+  while (read(io->wake_read, buf, sizeof(buf)) > 0) {}
+  __atomic_store_n(&io->wake_pending, 0, __ATOMIC_RELEASE);
+}
+
+static void *zkrb_io_thread_body(void *arg) {
+  zkrb_io_t *io = (zkrb_io_t *) arg;
+  struct pollfd fds[2];
+  struct timeval tv;
+  int fd, interest, events, irc, timeout, nfds, rc;
+
+  for (;;) {
+    fd = -1;
+    interest = 0;
+    events = 0;
+
+    zkrb_io_lock(io);
+
+    if (io->stop) {
+      zkrb_io_unlock(io);
+      break;
+    }
+
+    irc = zookeeper_interest(io->zh, &fd, &interest, &tv);
+
+    zkrb_io_unlock(io);
+
+    if (irc == ZINVALIDSTATE || fd == -1) {
+      // expired/auth failed (nothing will ever be ready again), or between
+      // connections, in which case tv says when to try the next one
+      timeout = (irc == ZINVALIDSTATE) ? ZKRB_IO_IDLE_MSEC : (int)(tv.tv_sec * 1000 + tv.tv_usec / 1000);
+    } else {
+      timeout = (int)(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+    }
+
+    fds[0].fd      = io->wake_read;
+    fds[0].events  = POLLIN;
+    fds[0].revents = 0;
+    nfds = 1;
+
+    if (fd != -1 && irc != ZINVALIDSTATE) {
+      fds[1].fd      = fd;
+      fds[1].events  = ((interest & ZOOKEEPER_READ) ? POLLIN : 0) | ((interest & ZOOKEEPER_WRITE) ? POLLOUT : 0);
+      fds[1].revents = 0;
+      nfds = 2;
+    }
+
+    rc = poll(fds, nfds, timeout < 0 ? 0 : timeout);
+
+    if (rc < 0 && errno != EINTR) {
+      log_err("zkrb_io_thread_body: poll failed, fd=%d interest=%d", fd, interest);
+    }
+
+    if (rc > 0) {
+      if (fds[0].revents & POLLIN) {
+        zkrb_io_drain_wake(io);
+        io->wakeups++;
+      }
+
+      if (nfds == 2) {
+        // like select(), a socket with an error counts as ready for whatever
+        // we were waiting on, zookeeper_process will find out what happened
+        if (fds[1].revents & (POLLERR | POLLHUP | POLLNVAL)) events |= interest;
+        if (fds[1].revents & POLLIN)  events |= ZOOKEEPER_READ;
+        if (fds[1].revents & POLLOUT) events |= ZOOKEEPER_WRITE;
+      }
+    }
+
+    if (irc == ZINVALIDSTATE) continue;
+
+    zkrb_io_lock(io);
+
+    if (!io->stop) {
+      zookeeper_process(io->zh, events);
+      io->iterations++;
+    }
+
+    zkrb_io_unlock(io);
+  }
+
+  return NULL;
+}
+
+int zkrb_io_start(zkrb_io_t *io, zhandle_t *zh) {
+  int rc;
+
+  io->zh = zh;
+  io->stop = 0;
+
+  rc = pthread_create(&io->thread, NULL, zkrb_io_thread_body, io);
+
+  if (rc != 0) {
+    errno = rc;
+    log_err("zkrb_io_start: pthread_create failed");
+    return rc;
+  }
+
+  io->started = 1;
+  return 0;
+}
+
+// asks the thread to exit and waits for it. in a forked child there's no
+// thread to wait for.
+void zkrb_io_stop(zkrb_io_t *io) {
+  if (!io || !io->started) return;
+
+  zkrb_io_lock(io);
+  io->stop = 1;
+  zkrb_io_unlock(io);
+
+  io->started = 0;
+
+  if (io->orig_pid != getpid()) return;
+
+  if (write(io->wake_write, "0", 1) < 0) {
+    log_err("zkrb_io_stop: write to the wake pipe failed");
+  }
+
+  pthread_join(io->thread, NULL);
+}
+
+void zkrb_io_free(zkrb_io_t *io) {
+  if (!io) return;
+
+  zkrb_io_stop(io);
+
+  pthread_mutex_lock(&registry_lock);
+  if (io->prev) io->prev->next = io->next;
+  if (io->next) io->next->prev = io->prev;
+  if (registry == io) registry = io->next;
+  pthread_mutex_unlock(&registry_lock);
+
+  close(io->wake_read);
+  close(io->wake_write);
+  pthread_mutex_destroy(&io->lock);
+  free(io);
+}
+
+#endif /* ZKRB_IO_THREAD */
+
+// vim:sts=2:sw=2:et
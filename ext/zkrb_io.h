@@ -0,0 +1,61 @@
+#ifndef ZKRB_IO_H
+#define ZKRB_IO_H
+
+#include "common.h"
+
+#ifdef ZKRB_IO_THREAD
+
+#include "zookeeper/zookeeper.h"
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+  the IO engine: a native thread per handle that runs the zookeeper_interest /
+  poll / zookeeper_process loop, so pings go out and responses come in no
+  matter what the ruby side is doing (a long GC, a C extension sitting on the
+  GVL, ...). it never touches the ruby VM. completions run on it and are
+  queued for the ruby event thread, see ZKRB_COMPLETIONS_OFF_GVL.
+
+  the st lib isn't thread safe, so every use of the handle, from either side,
+  happens with the engine's lock held (zkrb_io_lock/zkrb_io_unlock). the
+  engine only holds it around zookeeper_interest and zookeeper_process, never
+  while it waits.
+
+  fork: a pthread_atfork prepare handler takes the lock of every engine, so
+  fork() never happens while one is in the middle of the handle, and the
+  parent handler gives them back. the engines aren't running in the child
+  (threads don't survive fork); the child just gets usable locks back, and
+  the handle is torn down by the usual forked-close path.
+*/
+typedef struct zkrb_io {
+  zhandle_t           *zh;
+  pthread_mutex_t     lock;
+  pthread_t           thread;
+  int                 started;        // thread was created and hasn't been joined
+  int                 stop;           // set (with the lock held) to ask the thread to exit
+  int                 wake_pending;   // a byte is on its way down the wake pipe
+  int                 wake_read;
+  int                 wake_write;
+  pid_t               orig_pid;
+
+  unsigned long       iterations;     // turns of the IO loop
+  unsigned long       wakeups;        // of those, ones woken by zkrb_io_wake
+
+  struct zkrb_io      *prev, *next;   // every live engine, for the fork handlers
+} zkrb_io_t;
+
+zkrb_io_t *zkrb_io_alloc(void);
+int        zkrb_io_start(zkrb_io_t *io, zhandle_t *zh);
+void       zkrb_io_stop(zkrb_io_t *io);
+void       zkrb_io_free(zkrb_io_t *io);
+
+void       zkrb_io_lock(zkrb_io_t *io);
+void       zkrb_io_unlock(zkrb_io_t *io);
+
+// tells the engine to look at the handle again, e.g. because a request was
+// queued that it may need to wait for the socket to become writable for
+void       zkrb_io_wake(zkrb_io_t *io);
+
+#endif /* ZKRB_IO_THREAD */
+
+#endif /* ZKRB_IO_H */
@@ -3,6 +3,9 @@
 Autogenerated boilerplate wrappers around zoo_* function calls necessary for using
 rb_thread_blocking_region to release the GIL when calling native code.
 
+only the calls that can block are wrapped here, the rest are called directly
+(see zkrb_wrapper.h).
+
 generated by ext/generate_gvl_code.rb
 
 */
@@ -13,422 +16,6 @@ generated by ext/generate_gvl_code.rb
 #include <stdio.h>
 #include <stdlib.h>
 
-static VALUE zkrb_gvl_zoo_recv_timeout(void *data) {
-  zkrb_zoo_recv_timeout_args_t *a = (zkrb_zoo_recv_timeout_args_t *)data;
-  a->rc = zoo_recv_timeout(a->zh);
-  return Qnil;
-}
-
-// wrapper that calls zoo_recv_timeout via zkrb_gvl_zoo_recv_timeout inside rb_thread_blocking_region
-int zkrb_call_zoo_recv_timeout(zhandle_t *zh) {
-  zkrb_zoo_recv_timeout_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_recv_timeout, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_state(void *data) {
-  zkrb_zoo_state_args_t *a = (zkrb_zoo_state_args_t *)data;
-  a->rc = zoo_state(a->zh);
-  return Qnil;
-}
-
-// wrapper that calls zoo_state via zkrb_gvl_zoo_state inside rb_thread_blocking_region
-int zkrb_call_zoo_state(zhandle_t *zh) {
-  zkrb_zoo_state_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_state, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_acreate(void *data) {
-  zkrb_zoo_acreate_args_t *a = (zkrb_zoo_acreate_args_t *)data;
-  a->rc = zoo_acreate(a->zh, a->path, a->value, a->valuelen, a->acl, a->flags, a->completion, a->data);
-  return Qnil;
-}
-
-// wrapper that calls zoo_acreate via zkrb_gvl_zoo_acreate inside rb_thread_blocking_region
-int zkrb_call_zoo_acreate(zhandle_t *zh, const char *path, const char *value, int valuelen, const struct ACL_vector *acl, int flags, string_completion_t completion, const void *data) {
-  zkrb_zoo_acreate_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh,
-    .path = path,
-    .value = value,
-    .valuelen = valuelen,
-    .acl = acl,
-    .flags = flags,
-    .completion = completion,
-    .data = data
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_acreate, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_adelete(void *data) {
-  zkrb_zoo_adelete_args_t *a = (zkrb_zoo_adelete_args_t *)data;
-  a->rc = zoo_adelete(a->zh, a->path, a->version, a->completion, a->data);
-  return Qnil;
-}
-
-// wrapper that calls zoo_adelete via zkrb_gvl_zoo_adelete inside rb_thread_blocking_region
-int zkrb_call_zoo_adelete(zhandle_t *zh, const char *path, int version, void_completion_t completion, const void *data) {
-  zkrb_zoo_adelete_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh,
-    .path = path,
-    .version = version,
-    .completion = completion,
-    .data = data
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_adelete, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_aexists(void *data) {
-  zkrb_zoo_aexists_args_t *a = (zkrb_zoo_aexists_args_t *)data;
-  a->rc = zoo_aexists(a->zh, a->path, a->watch, a->completion, a->data);
-  return Qnil;
-}
-
-// wrapper that calls zoo_aexists via zkrb_gvl_zoo_aexists inside rb_thread_blocking_region
-int zkrb_call_zoo_aexists(zhandle_t *zh, const char *path, int watch, stat_completion_t completion, const void *data) {
-  zkrb_zoo_aexists_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh,
-    .path = path,
-    .watch = watch,
-    .completion = completion,
-    .data = data
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_aexists, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_awexists(void *data) {
-  zkrb_zoo_awexists_args_t *a = (zkrb_zoo_awexists_args_t *)data;
-  a->rc = zoo_awexists(a->zh, a->path, a->watcher, a->watcherCtx, a->completion, a->data);
-  return Qnil;
-}
-
-// wrapper that calls zoo_awexists via zkrb_gvl_zoo_awexists inside rb_thread_blocking_region
-int zkrb_call_zoo_awexists(zhandle_t *zh, const char *path, watcher_fn watcher, void* watcherCtx, stat_completion_t completion, const void *data) {
-  zkrb_zoo_awexists_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh,
-    .path = path,
-    .watcher = watcher,
-    .watcherCtx = watcherCtx,
-    .completion = completion,
-    .data = data
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_awexists, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_aget(void *data) {
-  zkrb_zoo_aget_args_t *a = (zkrb_zoo_aget_args_t *)data;
-  a->rc = zoo_aget(a->zh, a->path, a->watch, a->completion, a->data);
-  return Qnil;
-}
-
-// wrapper that calls zoo_aget via zkrb_gvl_zoo_aget inside rb_thread_blocking_region
-int zkrb_call_zoo_aget(zhandle_t *zh, const char *path, int watch, data_completion_t completion, const void *data) {
-  zkrb_zoo_aget_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh,
-    .path = path,
-    .watch = watch,
-    .completion = completion,
-    .data = data
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_aget, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_awget(void *data) {
-  zkrb_zoo_awget_args_t *a = (zkrb_zoo_awget_args_t *)data;
-  a->rc = zoo_awget(a->zh, a->path, a->watcher, a->watcherCtx, a->completion, a->data);
-  return Qnil;
-}
-
-// wrapper that calls zoo_awget via zkrb_gvl_zoo_awget inside rb_thread_blocking_region
-int zkrb_call_zoo_awget(zhandle_t *zh, const char *path, watcher_fn watcher, void* watcherCtx, data_completion_t completion, const void *data) {
-  zkrb_zoo_awget_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh,
-    .path = path,
-    .watcher = watcher,
-    .watcherCtx = watcherCtx,
-    .completion = completion,
-    .data = data
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_awget, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_aset(void *data) {
-  zkrb_zoo_aset_args_t *a = (zkrb_zoo_aset_args_t *)data;
-  a->rc = zoo_aset(a->zh, a->path, a->buffer, a->buflen, a->version, a->completion, a->data);
-  return Qnil;
-}
-
-// wrapper that calls zoo_aset via zkrb_gvl_zoo_aset inside rb_thread_blocking_region
-int zkrb_call_zoo_aset(zhandle_t *zh, const char *path, const char *buffer, int buflen, int version, stat_completion_t completion, const void *data) {
-  zkrb_zoo_aset_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh,
-    .path = path,
-    .buffer = buffer,
-    .buflen = buflen,
-    .version = version,
-    .completion = completion,
-    .data = data
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_aset, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_aget_children(void *data) {
-  zkrb_zoo_aget_children_args_t *a = (zkrb_zoo_aget_children_args_t *)data;
-  a->rc = zoo_aget_children(a->zh, a->path, a->watch, a->completion, a->data);
-  return Qnil;
-}
-
-// wrapper that calls zoo_aget_children via zkrb_gvl_zoo_aget_children inside rb_thread_blocking_region
-int zkrb_call_zoo_aget_children(zhandle_t *zh, const char *path, int watch, strings_completion_t completion, const void *data) {
-  zkrb_zoo_aget_children_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh,
-    .path = path,
-    .watch = watch,
-    .completion = completion,
-    .data = data
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_aget_children, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_awget_children(void *data) {
-  zkrb_zoo_awget_children_args_t *a = (zkrb_zoo_awget_children_args_t *)data;
-  a->rc = zoo_awget_children(a->zh, a->path, a->watcher, a->watcherCtx, a->completion, a->data);
-  return Qnil;
-}
-
-// wrapper that calls zoo_awget_children via zkrb_gvl_zoo_awget_children inside rb_thread_blocking_region
-int zkrb_call_zoo_awget_children(zhandle_t *zh, const char *path, watcher_fn watcher, void* watcherCtx, strings_completion_t completion, const void *data) {
-  zkrb_zoo_awget_children_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh,
-    .path = path,
-    .watcher = watcher,
-    .watcherCtx = watcherCtx,
-    .completion = completion,
-    .data = data
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_awget_children, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_aget_children2(void *data) {
-  zkrb_zoo_aget_children2_args_t *a = (zkrb_zoo_aget_children2_args_t *)data;
-  a->rc = zoo_aget_children2(a->zh, a->path, a->watch, a->completion, a->data);
-  return Qnil;
-}
-
-// wrapper that calls zoo_aget_children2 via zkrb_gvl_zoo_aget_children2 inside rb_thread_blocking_region
-int zkrb_call_zoo_aget_children2(zhandle_t *zh, const char *path, int watch, strings_stat_completion_t completion, const void *data) {
-  zkrb_zoo_aget_children2_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh,
-    .path = path,
-    .watch = watch,
-    .completion = completion,
-    .data = data
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_aget_children2, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_awget_children2(void *data) {
-  zkrb_zoo_awget_children2_args_t *a = (zkrb_zoo_awget_children2_args_t *)data;
-  a->rc = zoo_awget_children2(a->zh, a->path, a->watcher, a->watcherCtx, a->completion, a->data);
-  return Qnil;
-}
-
-// wrapper that calls zoo_awget_children2 via zkrb_gvl_zoo_awget_children2 inside rb_thread_blocking_region
-int zkrb_call_zoo_awget_children2(zhandle_t *zh, const char *path, watcher_fn watcher, void* watcherCtx, strings_stat_completion_t completion, const void *data) {
-  zkrb_zoo_awget_children2_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh,
-    .path = path,
-    .watcher = watcher,
-    .watcherCtx = watcherCtx,
-    .completion = completion,
-    .data = data
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_awget_children2, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_async(void *data) {
-  zkrb_zoo_async_args_t *a = (zkrb_zoo_async_args_t *)data;
-  a->rc = zoo_async(a->zh, a->path, a->completion, a->data);
-  return Qnil;
-}
-
-// wrapper that calls zoo_async via zkrb_gvl_zoo_async inside rb_thread_blocking_region
-int zkrb_call_zoo_async(zhandle_t *zh, const char *path, string_completion_t completion, const void *data) {
-  zkrb_zoo_async_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh,
-    .path = path,
-    .completion = completion,
-    .data = data
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_async, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_aget_acl(void *data) {
-  zkrb_zoo_aget_acl_args_t *a = (zkrb_zoo_aget_acl_args_t *)data;
-  a->rc = zoo_aget_acl(a->zh, a->path, a->completion, a->data);
-  return Qnil;
-}
-
-// wrapper that calls zoo_aget_acl via zkrb_gvl_zoo_aget_acl inside rb_thread_blocking_region
-int zkrb_call_zoo_aget_acl(zhandle_t *zh, const char *path, acl_completion_t completion, const void *data) {
-  zkrb_zoo_aget_acl_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh,
-    .path = path,
-    .completion = completion,
-    .data = data
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_aget_acl, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_aset_acl(void *data) {
-  zkrb_zoo_aset_acl_args_t *a = (zkrb_zoo_aset_acl_args_t *)data;
-  a->rc = zoo_aset_acl(a->zh, a->path, a->version, a->acl, a->completion, a->data);
-  return Qnil;
-}
-
-// wrapper that calls zoo_aset_acl via zkrb_gvl_zoo_aset_acl inside rb_thread_blocking_region
-int zkrb_call_zoo_aset_acl(zhandle_t *zh, const char *path, int version, struct ACL_vector *acl, void_completion_t completion, const void *data) {
-  zkrb_zoo_aset_acl_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh,
-    .path = path,
-    .version = version,
-    .acl = acl,
-    .completion = completion,
-    .data = data
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_aset_acl, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_amulti(void *data) {
-  zkrb_zoo_amulti_args_t *a = (zkrb_zoo_amulti_args_t *)data;
-  a->rc = zoo_amulti(a->zh, a->count, a->ops, a->results, a->completion, a->data);
-  return Qnil;
-}
-
-// wrapper that calls zoo_amulti via zkrb_gvl_zoo_amulti inside rb_thread_blocking_region
-int zkrb_call_zoo_amulti(zhandle_t *zh, int count, const zoo_op_t *ops, zoo_op_result_t *results, void_completion_t completion, const void *data) {
-  zkrb_zoo_amulti_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh,
-    .count = count,
-    .ops = ops,
-    .results = results,
-    .completion = completion,
-    .data = data
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_amulti, (void *)&args);
-
-  return args.rc;
-}
-
-
-static VALUE zkrb_gvl_zoo_add_auth(void *data) {
-  zkrb_zoo_add_auth_args_t *a = (zkrb_zoo_add_auth_args_t *)data;
-  a->rc = zoo_add_auth(a->zh, a->scheme, a->cert, a->certLen, a->completion, a->data);
-  return Qnil;
-}
-
-// wrapper that calls zoo_add_auth via zkrb_gvl_zoo_add_auth inside rb_thread_blocking_region
-int zkrb_call_zoo_add_auth(zhandle_t *zh, const char* scheme, const char* cert, int certLen, void_completion_t completion, const void *data) {
-  zkrb_zoo_add_auth_args_t args = {
-    .rc = ZKRB_FAIL,
-    .zh = zh,
-    .scheme = scheme,
-    .cert = cert,
-    .certLen = certLen,
-    .completion = completion,
-    .data = data
-  };
-
-  zkrb_thread_blocking_region(zkrb_gvl_zoo_add_auth, (void *)&args);
-
-  return args.rc;
-}
-
-
 static VALUE zkrb_gvl_zoo_create(void *data) {
   zkrb_zoo_create_args_t *a = (zkrb_zoo_create_args_t *)data;
   a->rc = zoo_create(a->zh, a->path, a->value, a->valuelen, a->acl, a->flags, a->path_buffer, a->path_buffer_len);
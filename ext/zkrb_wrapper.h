@@ -13,170 +13,6 @@
 
 #define ZKRB_FAIL -1
 
-typedef struct {
-  zhandle_t *zh;
-  int rc;
-} zkrb_zoo_recv_timeout_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  int rc;
-} zkrb_zoo_state_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  const char *path;
-  const char *value;
-  int valuelen;
-  const struct ACL_vector *acl;
-  int flags;
-  string_completion_t completion;
-  const void *data;
-  int rc;
-} zkrb_zoo_acreate_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  const char *path;
-  int version;
-  void_completion_t completion;
-  const void *data;
-  int rc;
-} zkrb_zoo_adelete_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  const char *path;
-  int watch;
-  stat_completion_t completion;
-  const void *data;
-  int rc;
-} zkrb_zoo_aexists_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  const char *path;
-  watcher_fn watcher;
-  void* watcherCtx;
-  stat_completion_t completion;
-  const void *data;
-  int rc;
-} zkrb_zoo_awexists_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  const char *path;
-  int watch;
-  data_completion_t completion;
-  const void *data;
-  int rc;
-} zkrb_zoo_aget_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  const char *path;
-  watcher_fn watcher;
-  void* watcherCtx;
-  data_completion_t completion;
-  const void *data;
-  int rc;
-} zkrb_zoo_awget_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  const char *path;
-  const char *buffer;
-  int buflen;
-  int version;
-  stat_completion_t completion;
-  const void *data;
-  int rc;
-} zkrb_zoo_aset_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  const char *path;
-  int watch;
-  strings_completion_t completion;
-  const void *data;
-  int rc;
-} zkrb_zoo_aget_children_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  const char *path;
-  watcher_fn watcher;
-  void* watcherCtx;
-  strings_completion_t completion;
-  const void *data;
-  int rc;
-} zkrb_zoo_awget_children_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  const char *path;
-  int watch;
-  strings_stat_completion_t completion;
-  const void *data;
-  int rc;
-} zkrb_zoo_aget_children2_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  const char *path;
-  watcher_fn watcher;
-  void* watcherCtx;
-  strings_stat_completion_t completion;
-  const void *data;
-  int rc;
-} zkrb_zoo_awget_children2_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  const char *path;
-  string_completion_t completion;
-  const void *data;
-  int rc;
-} zkrb_zoo_async_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  const char *path;
-  acl_completion_t completion;
-  const void *data;
-  int rc;
-} zkrb_zoo_aget_acl_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  const char *path;
-  int version;
-  struct ACL_vector *acl;
-  void_completion_t completion;
-  const void *data;
-  int rc;
-} zkrb_zoo_aset_acl_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  int count;
-  const zoo_op_t *ops;
-  zoo_op_result_t *results;
-  void_completion_t completion;
-  const void *data;
-  int rc;
-} zkrb_zoo_amulti_args_t;
-
-typedef struct {
-  zhandle_t *zh;
-  const char* scheme;
-  const char* cert;
-  int certLen;
-  void_completion_t completion;
-  const void *data;
-  int rc;
-} zkrb_zoo_add_auth_args_t;
-
 typedef struct {
   zhandle_t *zh;
   const char *path;
@@ -313,24 +149,6 @@ typedef struct {
   int rc;
 } zkrb_zoo_multi_args_t;
 
-int zkrb_call_zoo_recv_timeout(zhandle_t *zh);
-int zkrb_call_zoo_state(zhandle_t *zh);
-int zkrb_call_zoo_acreate(zhandle_t *zh, const char *path, const char *value, int valuelen, const struct ACL_vector *acl, int flags, string_completion_t completion, const void *data);
-int zkrb_call_zoo_adelete(zhandle_t *zh, const char *path, int version, void_completion_t completion, const void *data);
-int zkrb_call_zoo_aexists(zhandle_t *zh, const char *path, int watch, stat_completion_t completion, const void *data);
-int zkrb_call_zoo_awexists(zhandle_t *zh, const char *path, watcher_fn watcher, void* watcherCtx, stat_completion_t completion, const void *data);
-int zkrb_call_zoo_aget(zhandle_t *zh, const char *path, int watch, data_completion_t completion, const void *data);
-int zkrb_call_zoo_awget(zhandle_t *zh, const char *path, watcher_fn watcher, void* watcherCtx, data_completion_t completion, const void *data);
-int zkrb_call_zoo_aset(zhandle_t *zh, const char *path, const char *buffer, int buflen, int version, stat_completion_t completion, const void *data);
-int zkrb_call_zoo_aget_children(zhandle_t *zh, const char *path, int watch, strings_completion_t completion, const void *data);
-int zkrb_call_zoo_awget_children(zhandle_t *zh, const char *path, watcher_fn watcher, void* watcherCtx, strings_completion_t completion, const void *data);
-int zkrb_call_zoo_aget_children2(zhandle_t *zh, const char *path, int watch, strings_stat_completion_t completion, const void *data);
-int zkrb_call_zoo_awget_children2(zhandle_t *zh, const char *path, watcher_fn watcher, void* watcherCtx, strings_stat_completion_t completion, const void *data);
-int zkrb_call_zoo_async(zhandle_t *zh, const char *path, string_completion_t completion, const void *data);
-int zkrb_call_zoo_aget_acl(zhandle_t *zh, const char *path, acl_completion_t completion, const void *data);
-int zkrb_call_zoo_aset_acl(zhandle_t *zh, const char *path, int version, struct ACL_vector *acl, void_completion_t completion, const void *data);
-int zkrb_call_zoo_amulti(zhandle_t *zh, int count, const zoo_op_t *ops, zoo_op_result_t *results, void_completion_t completion, const void *data);
-int zkrb_call_zoo_add_auth(zhandle_t *zh, const char* scheme, const char* cert, int certLen, void_completion_t completion, const void *data);
 int zkrb_call_zoo_create(zhandle_t *zh, const char *path, const char *value, int valuelen, const struct ACL_vector *acl, int flags, char *path_buffer, int path_buffer_len);
 int zkrb_call_zoo_delete(zhandle_t *zh, const char *path, int version);
 int zkrb_call_zoo_exists(zhandle_t *zh, const char *path, int watch, struct Stat *stat);
@@ -347,4 +165,95 @@ int zkrb_call_zoo_get_acl(zhandle_t *zh, const char *path, struct ACL_vector *ac
 int zkrb_call_zoo_set_acl(zhandle_t *zh, const char *path, int version, const struct ACL_vector *acl);
 int zkrb_call_zoo_multi(zhandle_t *zh, int count, const zoo_op_t *ops, zoo_op_result_t *results);
 
+// calls zoo_recv_timeout directly, it never blocks
+static inline int zkrb_call_zoo_recv_timeout(zhandle_t *zh) {
+  return zoo_recv_timeout(zh);
+}
+
+// calls zoo_state directly, it never blocks
+static inline int zkrb_call_zoo_state(zhandle_t *zh) {
+  return zoo_state(zh);
+}
+
+// calls zoo_acreate directly, it never blocks
+static inline int zkrb_call_zoo_acreate(zhandle_t *zh, const char *path, const char *value, int valuelen, const struct ACL_vector *acl, int flags, string_completion_t completion, const void *data) {
+  return zoo_acreate(zh, path, value, valuelen, acl, flags, completion, data);
+}
+
+// calls zoo_adelete directly, it never blocks
+static inline int zkrb_call_zoo_adelete(zhandle_t *zh, const char *path, int version, void_completion_t completion, const void *data) {
+  return zoo_adelete(zh, path, version, completion, data);
+}
+
+// calls zoo_aexists directly, it never blocks
+static inline int zkrb_call_zoo_aexists(zhandle_t *zh, const char *path, int watch, stat_completion_t completion, const void *data) {
+  return zoo_aexists(zh, path, watch, completion, data);
+}
+
+// calls zoo_awexists directly, it never blocks
+static inline int zkrb_call_zoo_awexists(zhandle_t *zh, const char *path, watcher_fn watcher, void* watcherCtx, stat_completion_t completion, const void *data) {
+  return zoo_awexists(zh, path, watcher, watcherCtx, completion, data);
+}
+
+// calls zoo_aget directly, it never blocks
+static inline int zkrb_call_zoo_aget(zhandle_t *zh, const char *path, int watch, data_completion_t completion, const void *data) {
+  return zoo_aget(zh, path, watch, completion, data);
+}
+
+// calls zoo_awget directly, it never blocks
+static inline int zkrb_call_zoo_awget(zhandle_t *zh, const char *path, watcher_fn watcher, void* watcherCtx, data_completion_t completion, const void *data) {
+  return zoo_awget(zh, path, watcher, watcherCtx, completion, data);
+}
+
+// calls zoo_aset directly, it never blocks
+static inline int zkrb_call_zoo_aset(zhandle_t *zh, const char *path, const char *buffer, int buflen, int version, stat_completion_t completion, const void *data) {
+  return zoo_aset(zh, path, buffer, buflen, version, completion, data);
+}
+
+// calls zoo_aget_children directly, it never blocks
+static inline int zkrb_call_zoo_aget_children(zhandle_t *zh, const char *path, int watch, strings_completion_t completion, const void *data) {
+  return zoo_aget_children(zh, path, watch, completion, data);
+}
+
+// calls zoo_awget_children directly, it never blocks
+static inline int zkrb_call_zoo_awget_children(zhandle_t *zh, const char *path, watcher_fn watcher, void* watcherCtx, strings_completion_t completion, const void *data) {
+  return zoo_awget_children(zh, path, watcher, watcherCtx, completion, data);
+}
+
+// calls zoo_aget_children2 directly, it never blocks
+static inline int zkrb_call_zoo_aget_children2(zhandle_t *zh, const char *path, int watch, strings_stat_completion_t completion, const void *data) {
+  return zoo_aget_children2(zh, path, watch, completion, data);
+}
+
+// calls zoo_awget_children2 directly, it never blocks
+static inline int zkrb_call_zoo_awget_children2(zhandle_t *zh, const char *path, watcher_fn watcher, void* watcherCtx, strings_stat_completion_t completion, const void *data) {
+  return zoo_awget_children2(zh, path, watcher, watcherCtx, completion, data);
+}
+
+// calls zoo_async directly, it never blocks
+static inline int zkrb_call_zoo_async(zhandle_t *zh, const char *path, string_completion_t completion, const void *data) {
+  return zoo_async(zh, path, completion, data);
+}
+
+// calls zoo_aget_acl directly, it never blocks
+static inline int zkrb_call_zoo_aget_acl(zhandle_t *zh, const char *path, acl_completion_t completion, const void *data) {
+  return zoo_aget_acl(zh, path, completion, data);
+}
+
+// calls zoo_aset_acl directly, it never blocks
+static inline int zkrb_call_zoo_aset_acl(zhandle_t *zh, const char *path, int version, struct ACL_vector *acl, void_completion_t completion, const void *data) {
+  return zoo_aset_acl(zh, path, version, acl, completion, data);
+}
+
+// calls zoo_amulti directly, it never blocks
+static inline int zkrb_call_zoo_amulti(zhandle_t *zh, int count, const zoo_op_t *ops, zoo_op_result_t *results, void_completion_t completion, const void *data) {
+  return zoo_amulti(zh, count, ops, results, completion, data);
+}
+
+// calls zoo_add_auth directly, it never blocks
+static inline int zkrb_call_zoo_add_auth(zhandle_t *zh, const char* scheme, const char* cert, int certLen, void_completion_t completion, const void *data) {
+  return zoo_add_auth(zh, scheme, cert, certLen, completion, data);
+}
+
+
 #endif /* ZKRB_WRAPPER_H */
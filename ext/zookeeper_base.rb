@@ -28,7 +28,7 @@ class ZookeeperBase
 
   def_delegators :czk, :get_children, :exists, :delete, :get, :set,
     :set_acl, :get_acl, :client_id, :sync, :add_auth, :wait_until_connected,
-    :connected_host
+    :connected_host, :request_stats, :watch_subscribers, :get_tree
 
   def self.threadsafe_inquisitor(*syms)
     syms.each do |sym|
@@ -69,7 +69,11 @@ class ZookeeperBase
 
     @mutex.synchronize do
       @czk.close if @czk
-      @czk = CZookeeper.new(@host, @event_queue, opts)
+      @czk = if @multiplexer
+        Multiplexer::Connection.new(@multiplexer, @host, @event_queue, opts)
+      else
+        CZookeeper.new(@host, @event_queue, opts)
+      end
 
       # flushes all outstanding watcher reqs.
       @req_registry.clear_watchers!
@@ -94,6 +98,10 @@ class ZookeeperBase
 
     @dispatcher = @czk = nil
 
+    # the socket of a Multiplexer to make our calls through, instead of
+    # opening a session of our own
+    @multiplexer = opts[:multiplexer]
+
     update_pid!
     reopen_after_fork!
     
@@ -158,6 +166,12 @@ class ZookeeperBase
     [rc, @req_registry.strip_chroot_from(new_path)]
   end
 
+  # same as above, for the paths of the nodes a multi created
+  def multi(*args)
+    rc, results = czk.multi(*args)
+    [rc, @req_registry.strip_chroot_from_results(results)]
+  end
+
   def set_debug_level(int)
     warn "DEPRECATION WARNING: #{self.class.name}#set_debug_level, it has moved to the class level and will be removed in a future release"
     self.class.set_debug_level(int)
@@ -268,6 +268,16 @@ class JavaBase
     # IGNORED IN JRUBY
   end
 
+  # calls go straight to the java client, there's no window to report on
+  def request_stats
+    {}
+  end
+
+  # the java client keeps its own watches, they aren't shared here
+  def watch_subscribers
+    {}
+  end
+
   def set_debug_level(*a)
     # IGNORED IN JRUBY
   end
@@ -303,7 +313,8 @@ class JavaBase
     end
   end
 
-  def get_children(req_id, path, callback, watcher)
+  # packed children are only implemented by the C extension, we always return an Array
+  def get_children(req_id, path, callback, watcher, packed=false)
     handle_keeper_exception do
       watch_cb = watcher ? create_watcher(req_id, path) : false
 
@@ -407,6 +418,51 @@ class JavaBase
     end
   end
 
+  # there's no native walk here, the nodes are read one at a time. the
+  # concurrency is ignored.
+  def get_tree(req_id, path, callback, depth, concurrency, with_data)
+    handle_keeper_exception do
+      nodes = []
+      queue = [[path, 0]]
+
+      until queue.empty?
+        node_path, level = queue.shift
+        stat = JZKD::Stat.new
+
+        begin
+          if with_data
+            value = jzk.getData(node_path, false, stat)
+          else
+            stat = jzk.exists(node_path, false) or raise JZK::KeeperException::NoNodeException.new(node_path)
+            value = nil
+          end
+        rescue JZK::KeeperException::NoNodeException
+          raise if nodes.empty?   # only the one we started at is an error
+          next
+        end
+
+        nodes << [node_path, (String.from_java_bytes(value) unless value.nil?), stat.to_hash]
+        next if stat.numChildren == 0 or (depth and level >= depth)
+
+        children = begin
+          jzk.getChildren(node_path, false).to_a
+        rescue JZK::KeeperException::NoNodeException
+          []
+        end
+
+        prefix = (node_path == '/') ? '' : node_path
+        children.each { |name| queue << ["#{prefix}/#{name}", level + 1] }
+      end
+
+      [Code::Ok, nodes]
+    end
+  end
+
+  # the bundled 3.3 client jar has no multi
+  def multi(req_id, ops, callback)
+    [ZUNIMPLEMENTED, nil]
+  end
+
   def assert_open
     # XXX don't know how to check for valid session state!
     raise NotConnected unless connected?
@@ -38,16 +38,27 @@ Zookeeper.require_lib(
   'zookeeper/acls',
   'zookeeper/constants',
   'zookeeper/exceptions',
+  'zookeeper/timer_wheel',
   'zookeeper/continuation',
   'zookeeper/common',
   'zookeeper/request_registry',
   'zookeeper/callbacks',
   'zookeeper/stat',
+  'zookeeper/multi',
+  'zookeeper/future',
+  'zookeeper/pipeline',
+  'zookeeper/tree_deleter',
+  'zookeeper/bulk_loader',
+  'zookeeper/snapshot',
+  'zookeeper/read_cache',
+  'zookeeper/watch_multiplexer',
+  'zookeeper/multiplexer',
   'zookeeper/client_methods'
 )
 
 # ok, now we construct the client
 Zookeeper.require_lib 'zookeeper/client'
+Zookeeper.require_lib 'zookeeper/pool'
 
 module Zookeeper
   include Constants
@@ -80,6 +91,12 @@ module Zookeeper
     Kernel.warn(warning) if deprecation_warnings?
   end
 
+  # read a snapshot written by ClientMethods#export_tree from file (a file
+  # name or an IO), see Snapshot
+  def self.load_snapshot(file)
+    Snapshot.load(file)
+  end
+
   # for expert use only. set the underlying debug level for the C layer, has no
   # effect in java
   #
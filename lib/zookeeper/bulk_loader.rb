@@ -0,0 +1,238 @@
+module Zookeeper
+  # @private
+  #
+  # Does the work of ClientMethods#bulk_load.
+  #
+  # Records are read from the source as they're needed, a round's worth at
+  # a time, and turned into creates. The parents of a node that haven't been
+  # seen yet (and aren't the root) are created ahead of it, empty, the way
+  # mkdir -p would. Creates go out in multis of :batch_size, or one by one
+  # if that's 1, through a Pipeline :concurrency at a time. The server
+  # applies a session's requests in order, so a parent is always there by
+  # the time its children are created.
+  #
+  # A node that's already there is left alone if it's a parent we made up,
+  # and otherwise skipped or overwritten with a set, as :on_exists says.
+  # Since a multi that fails isn't applied at all, the rest of it is sent
+  # again, and so are the creates that found their parent missing because
+  # it was in a failed multi ahead of them. A round that gets nowhere ends
+  # the load, as does any other error.
+  #
+  # JRuby has no multi, there every node is created on its own.
+  class BulkLoader
+    include Constants
+
+    DEFAULT_BATCH_SIZE  = 1     # creates per multi, 1 for no multis
+    DEFAULT_CONCURRENCY = 64    # requests in flight
+
+    ON_EXISTS = [:skip, :overwrite].freeze
+
+    # what's known about a node to be written. implicit ones are parents
+    # nobody asked for, op is :create or (to overwrite) :set
+    Node = Struct.new(:op, :path, :data, :acl, :flags, :implicit)
+
+    def initialize(zk, source, opts = {}, &progress)
+      @zk          = zk
+      @records     = records_of(source)
+      @batch_size  = opts[:batch_size]  || DEFAULT_BATCH_SIZE
+      @concurrency = opts[:concurrency] || DEFAULT_CONCURRENCY
+      @on_exists   = opts[:on_exists]   || :skip
+      @timeout     = opts[:timeout]
+      @progress    = progress
+
+      [[:batch_size, @batch_size], [:concurrency, @concurrency]].each do |name, v|
+        unless v.kind_of?(Integer) and v > 0
+          raise Zookeeper::Exceptions::BadArguments, "#{name.inspect} must be a positive Integer, not #{v.inspect}"
+        end
+      end
+
+      unless ON_EXISTS.include?(@on_exists)
+        raise Zookeeper::Exceptions::BadArguments, ":on_exists must be one of #{ON_EXISTS.inspect}, not #{@on_exists.inspect}"
+      end
+
+      @known   = {}   # paths that exist or will by the time they're needed
+      @acls    = {}   # one Array per distinct acl, so the driver converts it once per multi
+      @records_read = @created = @parents = @skipped = @overwritten = 0
+    end
+
+    # returns { :rc, :records, :created, :parents, :skipped, :overwritten, :elapsed, :rate }
+    def run
+      @started = Continuation.now
+      queue = []
+
+      loop do
+        fill(queue, @batch_size * @concurrency)
+        break if queue.empty?
+
+        window = queue.shift(@batch_size * @concurrency).each_slice(@batch_size).to_a
+        results = @zk.pipeline { |p| window.each { |batch| send_batch(p, batch) } }
+
+        retry_nodes = []
+        moved = false
+
+        window.zip(results).each do |batch, rv|
+          rc = rv[:rc]
+
+          if rc == ZOK
+            batch.each { |node| written(node) }
+            moved = true
+          elsif rc == ZUNIMPLEMENTED and batch.length > 1
+            @batch_size = 1     # no multi, create them one at a time
+            retry_nodes.concat(batch)
+            moved = true
+          elsif rc == ZNODEEXISTS
+            retry_nodes.concat(resolve_exists(batch, rv))
+            moved = true
+          elsif rc == ZNONODE
+            retry_nodes.concat(batch)
+          else
+            return finish(rc)
+          end
+        end
+
+        @progress.call(progress) if @progress
+
+        return finish(ZNONODE) unless moved
+        queue = retry_nodes + queue
+      end
+
+      finish(ZOK)
+    end
+
+    def progress
+      elapsed = Continuation.now - @started
+
+      { :records     => @records_read,
+        :created     => @created,
+        :parents     => @parents,
+        :skipped     => @skipped,
+        :overwritten => @overwritten,
+        :elapsed     => elapsed,
+        :rate        => elapsed > 0 ? (@created + @overwritten) / elapsed : 0.0 }
+    end
+
+    private
+      # IO is read a line at a time, anything else with #each
+      def records_of(source)
+        if source.respond_to?(:each_line)
+          source.each_line
+        elsif source.respond_to?(:each)
+          source.each
+        else
+          raise Zookeeper::Exceptions::BadArguments, "can't read records from #{source.class}"
+        end
+      end
+
+      # reads records until there are at least n nodes queued, or there are
+      # no more records
+      def fill(queue, n)
+        while queue.length < n
+          begin
+            record = @records.next
+          rescue StopIteration
+            return
+          end
+
+          next unless node = node_for(record)
+          @records_read += 1
+
+          parents_of(node.path).each do |parent|
+            next if @known[parent]
+            @known[parent] = true
+            queue << Node.new(:create, parent, nil, ZOO_OPEN_ACL_UNSAFE, 0, true)
+          end
+
+          # a sequential node's real name is only known once it's created
+          @known[node.path] = true if node.flags & ZOO_SEQUENCE == 0
+          queue << node
+        end
+      end
+
+      # a record is a Hash (the options #create takes), an Array of
+      # [path, data, acl, flags], or a line of "path" or "path<TAB>data".
+      # nil for a blank line, which isn't a record
+      def node_for(record)
+        case record
+        when Hash
+          flags = record[:flags] || 0
+          flags |= ZOO_EPHEMERAL if record[:ephemeral]
+          flags |= ZOO_SEQUENCE if record[:sequence]
+          path, data, acl = record[:path], record[:data], record[:acl]
+        when Array
+          path, data, acl, flags = record
+        when String
+          return nil if record.strip.empty?
+          path, data = record.chomp.split("\t", 2)
+        else
+          raise Zookeeper::Exceptions::BadArguments, "don't know what to make of the record #{record.inspect}"
+        end
+
+        unless path.kind_of?(String) and path.start_with?('/') and path != '/'
+          raise Zookeeper::Exceptions::BadArguments, "bad path #{path.inspect} in the record #{record.inspect}"
+        end
+
+        acl = acl ? (@acls[acl] ||= acl) : ZOO_OPEN_ACL_UNSAFE
+        Node.new(:create, path, data, acl, flags || 0, false)
+      end
+
+      # '/a/b/c' => ['/a', '/a/b']
+      def parents_of(path)
+        parts = path.split('/')[1...-1]
+        parts.each_index.map { |i| '/' + parts[0..i].join('/') }
+      end
+
+      def send_batch(pipeline, batch)
+        if batch.length == 1
+          node = batch.first
+
+          if node.op == :set
+            pipeline.set(:path => node.path, :data => node.data, :timeout => @timeout)
+          else
+            pipeline.create(create_options(node).merge(:timeout => @timeout))
+          end
+        else
+          ops = batch.map { |node| node.op == :set ? [:set, { :path => node.path, :data => node.data }] : [:create, create_options(node)] }
+          pipeline.multi(:ops => ops, :timeout => @timeout)
+        end
+      end
+
+      def create_options(node)
+        { :path      => node.path,
+          :data      => node.data,
+          :acl       => node.acl,
+          :ephemeral => node.flags & ZOO_EPHEMERAL != 0,
+          :sequence  => node.flags & ZOO_SEQUENCE != 0 }
+      end
+
+      def written(node)
+        if node.op == :set
+          @overwritten += 1
+        elsif node.implicit
+          @parents += 1
+        else
+          @created += 1
+        end
+      end
+
+      # the batch failed because a node was there already. returns what's
+      # left to send: the batch without that node, or with a set for it
+      def resolve_exists(batch, rv)
+        i = rv[:results] ? rv[:results].index { |result| result.rc == ZNODEEXISTS } : 0
+        node = batch[i]
+        rest = batch.dup
+
+        if node.implicit or @on_exists == :skip
+          @skipped += 1 unless node.implicit
+          rest.delete_at(i)
+        else
+          rest[i] = Node.new(:set, node.path, node.data)
+        end
+
+        rest
+      end
+
+      def finish(rc)
+        progress.merge(:rc => rc)
+      end
+  end
+end
@@ -104,5 +104,14 @@ module Callbacks
       @return_code, @acl, @stat, @context = hash[:rc], hash[:acl], hash[:stat], hash[:context]
     end
   end
+
+  class MultiCallback < Base
+    ## amulti
+    attr_reader :return_code, :results
+
+    def initialize_context(hash)
+      @return_code, @results, @context = hash[:rc], hash[:results], hash[:context]
+    end
+  end
 end
 end
@@ -5,27 +5,36 @@ module ClientMethods
   include ACLs
   include Logger
 
+  # how many requests #get_tree has outstanding, unless it's told otherwise
+  DEFAULT_TREE_CONCURRENCY = 64
+
   # @req_registry is set up in the platform-specific base classes
   def_delegators :@req_registry, :setup_call
   private :setup_call
 
   def reopen(timeout=10, watcher=nil, opts = {})
     warn "WARN: ZookeeperBase#reopen watcher argument is now ignored" if watcher
+    @read_cache.flush if @read_cache    # a new session has none of our watches
     super
   end
 
+  # pass :read_cache => true (or a Hash with :max_entries and/or :max_bytes)
+  # to keep the results of sync reads until a watch says they've changed,
+  # see #read_cache_stats
   def initialize(host, timeout=10, watcher=nil, opts = {})
+    @read_cache = ReadCache.new(opts[:read_cache]) if opts[:read_cache]
     super
   end
 
   def add_auth(options = {})
     assert_open
     assert_keys(options, 
-                :supported => [:scheme, :cert],
+                :supported => [:scheme, :cert, :timeout],
                 :required  => [:scheme, :cert])
+    assert_valid_timeout!(options[:timeout])
 
     req_id = setup_call(:add_auth, options)
-    rc = super(req_id, options[:scheme], options[:cert])
+    rc = with_call_timeout(options) { super(req_id, options[:scheme], options[:cert]) }
 
     { :req_id => req_id, :rc => rc }
   end
@@ -33,63 +42,80 @@ module ClientMethods
   def get(options = {})
     assert_open
     assert_keys(options,
-                :supported  => [:path, :watcher, :watcher_context, :callback, :callback_context],
+                :supported  => [:path, :watcher, :watcher_context, :callback, :callback_context, :timeout],
                 :required   => [:path])
+    assert_valid_timeout!(options[:timeout])
 
-    req_id = setup_call(:get, options)
-    rc, value, stat = super(req_id, options[:path], options[:callback], options[:watcher])
+    cached_read(:get, options) do |opts|
+      req_id = setup_call(:get, opts)
+      rc, value, stat = with_call_timeout(opts) { super(req_id, opts[:path], opts[:callback], opts[:watcher]) }
 
-    rv = { :req_id => req_id, :rc => rc }
-    options[:callback] ? rv : rv.merge(:data => value, :stat => Stat.new(stat))
+      rv = { :req_id => req_id, :rc => rc }
+      opts[:callback] ? rv : rv.merge(:data => value, :stat => Stat.from(stat))
+    end
   end
 
   def set(options = {})
     assert_open
     assert_keys(options,
-                :supported  => [:path, :data, :version, :callback, :callback_context],
+                :supported  => [:path, :data, :version, :callback, :callback_context, :timeout],
                 :required   => [:path])
+    assert_valid_timeout!(options[:timeout])
 
     assert_valid_data_size!(options[:data])
     options[:version] ||= -1
 
     req_id = setup_call(:set, options)
-    rc, stat = super(req_id, options[:path], options[:data], options[:callback], options[:version])
+    rc, stat = invalidating(options[:path]) do
+      with_call_timeout(options) { super(req_id, options[:path], options[:data], options[:callback], options[:version]) }
+    end
 
     rv = { :req_id => req_id, :rc => rc }
-    options[:callback] ? rv : rv.merge(:stat => Stat.new(stat))
+    options[:callback] ? rv : rv.merge(:stat => Stat.from(stat))
   end
 
+  # pass :packed => true to get the children back as a read-only
+  # Zookeeper::Children (one buffer for all the names, Strings are only
+  # created for the names you read) instead of an Array. this helps with nodes
+  # that have very many children. JRuby always returns an Array.
   def get_children(options = {})
     assert_open
     assert_keys(options,
-                :supported => [:path, :callback, :callback_context, :watcher, :watcher_context],
+                :supported => [:path, :callback, :callback_context, :watcher, :watcher_context, :packed, :timeout],
                 :required  => [:path])
+    assert_valid_timeout!(options[:timeout])
 
-    req_id = setup_call(:get_children, options)
-    rc, children, stat = super(req_id, options[:path], options[:callback], options[:watcher])
+    cached_read(:get_children, options) do |opts|
+      req_id = setup_call(:get_children, opts)
+      rc, children, stat = with_call_timeout(opts) { super(req_id, opts[:path], opts[:callback], opts[:watcher], !!opts[:packed]) }
 
-    rv = { :req_id => req_id, :rc => rc }
-    options[:callback] ? rv : rv.merge(:children => children, :stat => Stat.new(stat))
+      rv = { :req_id => req_id, :rc => rc }
+      opts[:callback] ? rv : rv.merge(:children => children, :stat => Stat.from(stat))
+    end
   end
 
   def stat(options = {})
     assert_open
     assert_keys(options,
-                :supported  => [:path, :callback, :callback_context, :watcher, :watcher_context],
+                :supported  => [:path, :callback, :callback_context, :watcher, :watcher_context, :timeout],
                 :required   => [:path])
+    assert_valid_timeout!(options[:timeout])
 
-    req_id = setup_call(:stat, options)
-    rc, stat = exists(req_id, options[:path], options[:callback], options[:watcher])
+    cached_read(:stat, options) do |opts|
+      req_id = setup_call(:stat, opts)
+      rc, stat = with_call_timeout(opts) { exists(req_id, opts[:path], opts[:callback], opts[:watcher]) }
 
-    rv = { :req_id => req_id, :rc => rc }
-    options[:callback] ? rv : rv.merge(:stat => Stat.new(stat))
+      rv = { :req_id => req_id, :rc => rc }
+      opts[:callback] ? rv : rv.merge(:stat => Stat.from(stat))
+    end
   end
 
   def create(options = {})
     assert_open
     assert_keys(options,
-                :supported  => [:path, :data, :acl, :ephemeral, :sequence, :callback, :callback_context],
+                :supported  => [:path, :data, :acl, :ephemeral, :sequence, :callback, :callback_context, :timeout],
                 :required   => [:path])
+    assert_valid_timeout!(options[:timeout])
 
     assert_valid_data_size!(options[:data])
 
@@ -100,7 +126,9 @@ module ClientMethods
     options[:acl] ||= ZOO_OPEN_ACL_UNSAFE
 
     req_id = setup_call(:create, options)
-    rc, newpath = super(req_id, options[:path], options[:data], options[:callback], options[:acl], flags)
+    rc, newpath = invalidating(options[:path], parent_path(options[:path])) do
+      with_call_timeout(options) { super(req_id, options[:path], options[:data], options[:callback], options[:acl], flags) }
+    end
 
     rv = { :req_id => req_id, :rc => rc }
     options[:callback] ? rv : rv.merge(:path => newpath)
@@ -109,17 +137,63 @@ module ClientMethods
   def delete(options = {})
     assert_open
     assert_keys(options,
-                :supported  => [:path, :version, :callback, :callback_context],
+                :supported  => [:path, :version, :callback, :callback_context, :timeout],
                 :required   => [:path])
+    assert_valid_timeout!(options[:timeout])
 
     options[:version] ||= -1
 
     req_id = setup_call(:delete, options)
-    rc = super(req_id, options[:path], options[:version], options[:callback])
+    rc = invalidating(options[:path], parent_path(options[:path])) do
+      with_call_timeout(options) { super(req_id, options[:path], options[:version], options[:callback]) }
+    end
 
     { :req_id => req_id, :rc => rc }
   end
 
+  # apply a number of writes atomically, either all of them succeed or none
+  # of them are applied.
+  #
+  # the ops are given as a Zookeeper::Multi (or a list of [op, options]
+  # pairs, see Multi.from), or built by a block that receives a new one:
+  #
+  #   zk.multi do |m|
+  #     m.create(:path => '/a', :data => 'a')
+  #     m.set(:path => '/b', :data => 'b', :version => 1)
+  #   end
+  #
+  # the result has a Multi::Result per op under :results. :rc is ZOK if all
+  # ops were applied, otherwise the error of the op that failed (see
+  # Multi::Result for the others).
+  #
+  # not supported by JRuby, which returns ZUNIMPLEMENTED.
+  #
+  def multi(options = {})
+    assert_open
+    assert_keys(options,
+                :supported  => [:ops, :callback, :callback_context, :timeout])
+    assert_valid_timeout!(options[:timeout])
+
+    ops = options[:ops] ? Multi.from(options[:ops]) : Multi.new { |m| yield m if block_given? }
+
+    # every op's node, and the parent of the ones that add or remove one
+    paths = ops.ops.flat_map do |type, path, *_|
+      case type
+      when ZOO_CREATE_OP, ZOO_DELETE_OP then [path, parent_path(path)]
+      when ZOO_SETDATA_OP               then [path]
+      else []
+      end
+    end
+
+    req_id = setup_call(:multi, options)
+    rc, results = invalidating(*paths) do
+      with_call_timeout(options) { super(req_id, ops.ops, options[:callback]) }
+    end
+
+    rv = { :req_id => req_id, :rc => rc }
+    options[:callback] ? rv : rv.merge(:results => Multi::Result.from(results))
+  end
+
   # this method is *only* asynchronous
   #
   # @note There is a discrepancy between the zkc and java versions. zkc takes
@@ -142,12 +216,15 @@ module ClientMethods
   def set_acl(options = {})
     assert_open
     assert_keys(options,
-                :supported  => [:path, :acl, :version, :callback, :callback_context],
+                :supported  => [:path, :acl, :version, :callback, :callback_context, :timeout],
                 :required   => [:path, :acl])
+    assert_valid_timeout!(options[:timeout])
     options[:version] ||= -1
 
     req_id = setup_call(:set_acl, options)
-    rc = super(req_id, options[:path], options[:acl], options[:callback], options[:version])
+    rc = invalidating(options[:path]) do
+      with_call_timeout(options) { super(req_id, options[:path], options[:acl], options[:callback], options[:version]) }
+    end
 
     { :req_id => req_id, :rc => rc }
   end
@@ -155,14 +232,197 @@ module ClientMethods
   def get_acl(options = {})
     assert_open
     assert_keys(options,
-                :supported  => [:path, :callback, :callback_context],
+                :supported  => [:path, :callback, :callback_context, :timeout],
                 :required   => [:path])
+    assert_valid_timeout!(options[:timeout])
 
     req_id = setup_call(:get_acl, options)
-    rc, acls, stat = super(req_id, options[:path], options[:callback])
+    rc, acls, stat = with_call_timeout(options) { super(req_id, options[:path], options[:callback]) }
+
+    rv = { :req_id => req_id, :rc => rc }
+    options[:callback] ? rv : rv.merge(:acl => acls, :stat => Stat.from(stat))
+  end
+
+  # the subtree at :path, read with up to :concurrency requests (64 by
+  # default) outstanding at a time instead of one round trip per node.
+  # :depth limits how many levels below :path are read (nil for all).
+  # :data => false reads only the stats, every node's data is nil.
+  #
+  # :tree is the subtree as nested Hashes:
+  #
+  #   { :data => String, :stat => Stat, :children => { name => {...} } }
+  #
+  # with a block, each node's path, data and stat are yielded instead,
+  # breadth first starting with :path, and there's no :tree.
+  #
+  # a node deleted while the walk is under way is left out, a node created
+  # may or may not be in. :rc is ZNONODE if :path doesn't exist, and any
+  # other error stops the walk. only sync, and JRuby reads one node at a time.
+  #
+  def get_tree(options = {})
+    assert_open
+    assert_keys(options,
+                :supported  => [:path, :depth, :concurrency, :data, :timeout],
+                :required   => [:path])
+    assert_valid_timeout!(options[:timeout])
+
+    depth       = options[:depth]
+    concurrency = options.fetch(:concurrency, DEFAULT_TREE_CONCURRENCY)
+
+    unless depth.nil? or (depth.kind_of?(Integer) and depth >= 0)
+      raise Zookeeper::Exceptions::BadArguments, ":depth must be nil or an Integer >= 0, not #{depth.inspect}"
+    end
+
+    unless concurrency.kind_of?(Integer) and concurrency > 0
+      raise Zookeeper::Exceptions::BadArguments, ":concurrency must be a positive Integer, not #{concurrency.inspect}"
+    end
+
+    req_id = setup_call(:get_tree, options)
+    rc, nodes = with_call_timeout(options) do
+      super(req_id, options[:path], nil, depth, concurrency, options.fetch(:data, true))
+    end
 
     rv = { :req_id => req_id, :rc => rc }
-    options[:callback] ? rv : rv.merge(:acl => acls, :stat => Stat.new(stat))
+    return rv unless rc == ZOK
+
+    if block_given?
+      nodes.each { |path, data, stat| yield path, data, Stat.from(stat) }
+      return rv
+    end
+
+    tree = {}
+    nodes.each do |path, data, stat|
+      node = { :data => data, :stat => Stat.from(stat), :children => {} }
+
+      if tree.empty?
+        tree[path] = node
+      elsif parent = tree[parent_path(path)]
+        parent[:children][File.basename(path)] = node
+        tree[path] = node
+      end
+    end
+
+    rv.merge(:tree => tree[options[:path]])
+  end
+
+  # writes the subtree at :path, read with #get_tree, to :file (a file name
+  # or an IO) as a Snapshot that Zookeeper.load_snapshot can read back
+  # without a connection. a file name is written to a temporary file that's
+  # renamed over it once it's complete.
+  #
+  # pass the previous Snapshot of the same subtree as :since and only the
+  # stats are walked: the data of nodes whose mzxid hasn't changed is taken
+  # from it, and only the others are read, :concurrency at a time.
+  #
+  #   { :req_id, :rc, :nodes, :fetched, :bytes }
+  #
+  # :fetched is the number of nodes whose data was read from the server.
+  #
+  def export_tree(options = {})
+    assert_open
+    assert_keys(options,
+                :supported  => [:path, :file, :since, :concurrency, :timeout],
+                :required   => [:path, :file])
+    assert_valid_timeout!(options[:timeout])
+
+    since = options[:since]
+    walk  = { :path => options[:path], :data => since.nil?, :timeout => options[:timeout] }
+    walk[:concurrency] = options[:concurrency] if options[:concurrency]
+
+    nodes = []
+    rv = get_tree(walk) { |path, data, stat| nodes << [path, data, stat] }
+    return rv.merge(:nodes => 0, :fetched => 0, :bytes => 0) unless rv[:rc] == ZOK
+
+    fetched = nodes.length
+    if since
+      nodes, fetched, rc = refresh_snapshot_nodes(since, nodes, options)
+      return rv.merge(:rc => rc, :nodes => 0, :fetched => fetched, :bytes => 0) unless rc == ZOK
+    end
+
+    bytes = write_snapshot(options[:file], options[:path], nodes)
+    rv.merge(:nodes => nodes.length, :fetched => fetched, :bytes => bytes)
+  end
+
+  # deletes :path and everything below it, deepest nodes first, in multis
+  # of up to :batch_size (500) deletes with :concurrency (8) of them in
+  # flight. nodes that are deleted by someone else in the meantime are
+  # skipped, and if nodes are added the subtree is walked again, up to
+  # :max_passes (5) times.
+  #
+  # the block, if given, is called with the progress so far after every
+  # round of multis. the result is the final progress plus :rc, which is
+  # ZNONODE if :path didn't exist and ZNOTEMPTY if nodes kept being added:
+  #
+  #   { :rc, :found, :deleted, :vanished, :passes, :elapsed, :rate }
+  #
+  # :rate is nodes deleted per second.
+  #
+  def delete_tree(options = {}, &block)
+    assert_open
+    assert_keys(options,
+                :supported  => [:path, :batch_size, :concurrency, :max_passes, :timeout],
+                :required   => [:path])
+    assert_valid_timeout!(options[:timeout])
+
+    if options[:path] == '/'
+      raise Zookeeper::Exceptions::BadArguments, "the root node can't be deleted"
+    end
+
+    TreeDeleter.new(self, options[:path], options, &block).run
+  end
+
+  # creates the nodes read from source, which can be anything with #each
+  # (an Array, an Enumerator) or an IO. each record is a Hash of the
+  # options #create takes, an Array of [path, data, acl, flags], or a line
+  # of "path" or "path<TAB>data" (an IO's lines are read that way).
+  #
+  # missing parents are created first, empty. the creates are sent
+  # :concurrency (64) at a time, in multis of :batch_size if it's more than
+  # the default of 1. :on_exists says what to do with a node that's already
+  # there: :skip it (the default) or :overwrite its data (not its acl).
+  #
+  # the block, if given, is called with the progress so far after every
+  # round of requests. the result is the final progress plus :rc:
+  #
+  #   { :rc, :records, :created, :parents, :skipped, :overwritten, :elapsed, :rate }
+  #
+  # :parents counts the parents created, :rate is nodes written per second.
+  # records after the one that stopped a load with an error aren't read.
+  #
+  def bulk_load(source, options = {}, &block)
+    assert_open
+    assert_keys(options,
+                :supported  => [:batch_size, :concurrency, :on_exists, :timeout],
+                :required   => [])
+    assert_valid_timeout!(options[:timeout])
+
+    BulkLoader.new(self, source, options, &block).run
+  end
+
+  # Sends several requests together and waits for all of them, so their
+  # round trips overlap instead of adding up. Each op on the yielded
+  # {Pipeline} takes the same options as the method of the same name here
+  # and returns a {Future} for what that method would have returned.
+  #
+  # With a block, the queued requests are sent when the block returns and
+  # the return value is the Array of their results, in order:
+  #
+  #   data, stat = zk.pipeline do |p|
+  #     p.get(:path => '/config')
+  #     p.stat(:path => '/leader')
+  #   end
+  #
+  # Without one, the Pipeline is returned and requests are sent by
+  # Pipeline#flush!, Pipeline#wait_all, or the first Future#value.
+  #
+  def pipeline
+    assert_open
+
+    pipeline = Pipeline.new(self)
+    return pipeline unless block_given?
+
+    yield pipeline
+    pipeline.wait_all
   end
 
   # close this client and any underlying connections
@@ -221,6 +481,43 @@ module ClientMethods
     super
   end
 
+  # counters for the calls this connection has waiting to be sent and
+  # waiting for a response. pass :max_outstanding => n to the constructor
+  # to allow no more than n of those at once, and :backpressure to say what
+  # happens to callers over that: :block (the default) until there's room,
+  # :fail with a RequestRejected right away, or a number of seconds to wait
+  # before failing. JRuby has no such limit, and returns no counters.
+  #
+  # sync get, stat and get_children calls made while an identical one (same
+  # path, same watch or no watch) is waiting for its response aren't sent,
+  # they get a copy of that response, and the watch events of any watch it
+  # set. they're counted in :coalesced. pass :coalesce_reads => false to the
+  # constructor to always send them.
+  def request_stats
+    super
+  end
+
+  # watched get, stat and get_children calls made while the server already
+  # has the same kind of watch (data or child) set on the node for this
+  # client don't set another one, they share it: its event is delivered to
+  # every one of their watchers. returns how many watchers there are on each
+  # node with a watch set, +{ path => { :data => n, :child => n } }+. Empty
+  # under JRuby.
+  def watch_subscribers
+    super
+  end
+
+  # counters for the read cache (see #initialize): +:hits+ were answered
+  # without asking the server, +:misses+ weren't, +:invalidations+ results
+  # were dropped because a watch fired or this client wrote to the node,
+  # +:evictions+ to stay within +:max_entries+ and +:max_bytes+, and the
+  # whole cache was dropped +:flushes+ times because the connection was lost.
+  # Only sync reads without a :watcher go through the cache. Empty if
+  # there's no cache.
+  def read_cache_stats
+    @read_cache ? @read_cache.stats : {}
+  end
+
   # stop all underlying threads in preparation for a fork()
   def pause_before_fork_in_parent
     super
@@ -248,6 +545,108 @@ protected
     super
   end
 
+  # the :timeout option of the synchronous calls is how many seconds to wait
+  # for the server's answer before giving up with a ContinuationTimeoutError
+  # (the default is Continuation::OPERATION_TIMEOUT). it doesn't apply to
+  # calls given a :callback, and JRuby ignores it.
+  def assert_valid_timeout!(timeout)
+    return if timeout.nil? or (timeout.kind_of?(Numeric) and timeout > 0)
+    raise Zookeeper::Exceptions::BadArguments, ":timeout must be a positive number of seconds, not #{timeout.inspect}"
+  end
+
+  # runs the block (the call into the driver) with the deadline asked for by
+  # options[:timeout], see Continuation.with_timeout
+  def with_call_timeout(options, &block)
+    Continuation.with_timeout(options[:timeout], &block)
+  end
+
+  # runs the read in the block, given the options to send it with, unless
+  # the read cache has its result. the cache only takes sync reads that
+  # aren't setting a watch of their own.
+  def cached_read(meth, options)
+    return yield(options) if @read_cache.nil? or options[:callback] or options[:watcher]
+
+    key = [meth, options[:path], !!options[:packed]]
+
+    if rv = @read_cache.lookup(key)
+      return rv.merge(:req_id => setup_call(meth, {}))
+    end
+
+    token, unwatched = @read_cache.begin_fetch(key)
+    reads = []
+
+    # the result is only kept once the other watch on the path is set as
+    # well. the read that sets it goes out first, the server answers in
+    # order, so nothing can change in between unnoticed.
+    if other = (unwatched - [ReadCache::WATCH_OF[meth]]).first
+      other_meth = ReadCache::WATCH_READS[other]
+
+      companion = Pipeline.new(self)
+      future = companion.__send__(other_meth, :path => options[:path], :watcher => @read_cache.watcher, :timeout => options[:timeout])
+      companion.flush!
+    end
+
+    watch = unwatched.include?(ReadCache::WATCH_OF[meth])
+    rv = yield(watch ? options.merge(:watcher => @read_cache.watcher) : options)
+    reads << [meth, rv[:rc]] if watch
+
+    if future
+      other_rv = future.value rescue nil
+      reads << [other_meth, other_rv[:rc]] if other_rv
+    end
+
+    @read_cache.store(key, token, reads, rv)
+    rv
+  end
+
+  # runs the write in the block, then drops what the read cache has for the
+  # paths it touches. the watches would see to that too, but not before this
+  # caller's next read.
+  def invalidating(*paths)
+    yield
+  ensure
+    paths.each { |path| @read_cache.invalidate(path) } if @read_cache
+  end
+
+  # the nodes of a stat-only walk with their data, from snapshot where the
+  # mzxid is the one it has and read again where it isn't. returns the
+  # nodes, how many were read and the rc.
+  def refresh_snapshot_nodes(snapshot, nodes, options)
+    known = {}
+    snapshot.each { |path, data, stat| known[path] = [stat.mzxid, data] }
+
+    stale, fresh = nodes.partition { |path, _, stat| (known[path] || []).first != stat.mzxid }
+    fresh.map! { |path, _, stat| [path, known[path].last, stat] }
+
+    stale.each_slice(options[:concurrency] || DEFAULT_TREE_CONCURRENCY) do |window|
+      results = pipeline { |p| window.each { |path, _, _| p.get(:path => path, :timeout => options[:timeout]) } }
+
+      window.zip(results).each do |(path, _, _), rv|
+        next if rv[:rc] == ZNONODE    # deleted since the walk
+        return [fresh, stale.length, rv[:rc]] unless rv[:rc] == ZOK
+        fresh << [path, rv[:data], rv[:stat]]
+      end
+    end
+
+    [fresh, stale.length, ZOK]
+  end
+
+  # Snapshot.write to an IO, or to a file name by way of a temporary file
+  def write_snapshot(file, root, nodes)
+    return Snapshot.write(file, root, nodes) if file.respond_to?(:write)
+
+    tmp = "#{file}.#{Process.pid}.tmp"
+    bytes = File.open(tmp, 'wb') { |f| Snapshot.write(f, root, nodes) }
+    File.rename(tmp, file)
+    bytes
+  ensure
+    File.unlink(tmp) if tmp and File.exist?(tmp)
+  end
+
+  def parent_path(path)
+    File.dirname(path) if path.kind_of?(String)
+  end
+
   def assert_valid_data_size!(data)
     return if data.nil?
 
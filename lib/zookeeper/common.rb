@@ -67,9 +67,13 @@ private
     
     is_completion = hash.has_key?(:rc)
     
-    hash[:stat] = Zookeeper::Stat.new(hash[:stat]) if hash.has_key?(:stat)
+    hash[:stat] = Zookeeper::Stat.from(hash[:stat]) if hash.has_key?(:stat)
     hash[:acl] = hash[:acl].map { |acl| Zookeeper::ACLs::ACL.new(acl) } if hash[:acl]
+    hash[:results] = Zookeeper::Multi::Result.from(hash[:results]) if hash[:results]
     
+    # a watch event: whatever the read cache has for the node is stale
+    @read_cache.event(hash) if @read_cache and not is_completion
+
     callback_context = @req_registry.get_context_for(hash)
 
     if callback_context
@@ -111,7 +115,7 @@ private
   end
 
   def prettify_event(hash)
-    hash.dup.tap do |h|
+    hash.to_hash.dup.tap do |h|
       # pretty up the event display
       h[:type]    = Zookeeper::Constants::EVENT_TYPE_NAMES.fetch(h[:type]) if h[:type]
       h[:state]   = Zookeeper::Constants::STATE_NAMES.fetch(h[:state]) if h[:state]
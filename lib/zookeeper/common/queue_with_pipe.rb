@@ -41,6 +41,17 @@ module Common
       end
     end
 
+    # pushes all of objs under one acquisition of the lock
+    def push_all(objs)
+      @mutex.lock
+      begin
+        @array.concat(objs)
+        @cond.broadcast
+      ensure
+        @mutex.unlock rescue nil
+      end
+    end
+
     def pop(non_blocking=false)
       rval = nil
 
@@ -22,6 +22,12 @@ module Constants
   ZOO_SESSION_EVENT      = -1
   ZOO_NOTWATCHING_EVENT  = -2
 
+  # multi op types
+  ZOO_CREATE_OP  = 1
+  ZOO_DELETE_OP  = 2
+  ZOO_SETDATA_OP = 5
+  ZOO_CHECK_OP   = 13
+
   # only used by the C extension
   ZOO_LOG_LEVEL_ERROR = 1
   ZOO_LOG_LEVEL_WARN  = 2
@@ -93,5 +99,12 @@ module Constants
   def state_by_value(v)
     (name = STATE_NAMES[v]) ?  "ZOO_#{name.upcase}_STATE" : ''
   end
+
+  # does a read that asked for a watch and got rc leave the watch set. exists
+  # (stat, on the client) sets its watch even when there's no node, the other
+  # reads only when there is
+  def watch_set?(meth, rc)
+    rc == ZOK or ((meth == :exists or meth == :stat) and rc == ZNONODE)
+  end
 end
 end
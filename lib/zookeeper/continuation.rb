@@ -6,22 +6,171 @@ module Zookeeper
     include Constants
     include Logger
 
+    # the default for calls that aren't given a :timeout
     OPERATION_TIMEOUT = 30 # seconds
 
+    # the clock deadlines are kept on
+    def self.now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    # the :timeout for the continuations created by the current fiber, see
+    # Continuation.with_timeout
+    def self.current_timeout
+      Thread.current[:zookeeper_call_timeout]
+    end
+
+    # runs the block with continuations created in it given a deadline of
+    # seconds from their creation, instead of OPERATION_TIMEOUT. used by
+    # ClientMethods for the :timeout option.
+    def self.with_timeout(seconds)
+      return yield if seconds.nil?
+
+      prev = Thread.current[:zookeeper_call_timeout]
+      Thread.current[:zookeeper_call_timeout] = seconds
+
+      begin
+        yield
+      ensure
+        Thread.current[:zookeeper_call_timeout] = prev
+      end
+    end
+
     # for keeping track of which continuations are pending, and which ones have
     # been submitted and are awaiting a repsonse
     # 
     # `state_check` are high-priority checks that query the connection about
     # its current state, they always run before other continuations
     #
+    # the deadlines of the continuations the event thread has taken off the
+    # pending lists (submitted ones in `in_flight`, ones waiting for the
+    # connection in `waiting`) are kept in one TimerWheel, and #expire times
+    # out all the overdue ones at once. `in_flight`, `waiting` and the wheel
+    # belong to the event thread and aren't synchronized.
+    #
+    # with a :max_outstanding window, callers have to be let in (#admit)
+    # before pushing, and the event thread lets the next one in when a
+    # continuation it's been tracking is done with (#release).
+    #
+    # identical sync reads (see Continuation#flight_key) are coalesced: the
+    # first is sent, and the ones that come along before its response does
+    # #join it instead of going to the server themselves. they share its
+    # response (#take_followers), and the watch it set (see
+    # WatchMultiplexer#completed). a write being sent ends all the flights,
+    # so a read never gets an answer older than a write sent before it.
+    #
     class Registry < Struct.new(:pending, :state_check, :in_flight)
       extend Forwardable
 
       def_delegators :@mutex, :lock, :unlock
 
-      def initialize
+      # number of continuations pushed, and how many of those pushes needed
+      # to wake the event thread. see CZookeeper#wakeup_stats
+      attr_reader :submits, :wake_writes
+
+      # number of continuations timed out by #expire
+      attr_reader :timeouts
+
+      # taken off the pending lists while we weren't connected, cntn => true
+      attr_reader :waiting
+
+      # number of reads that were answered with another call's response
+      # instead of being sent, see #join
+      attr_reader :coalesced
+
+      # the window: how many continuations may be pushed and not yet done
+      # with (nil for no limit), and what #admit does when that many are:
+      # :block until one is, :fail straight away, or wait at most that many
+      # seconds
+      attr_reader :max_outstanding, :backpressure
+
+      BACKPRESSURE_POLICIES = [:block, :fail].freeze
+
+      def initialize(opts = {})
         super([], [], {})
         @mutex = Mutex.new
+        @wake_pending = false
+        @closed = false
+        @submits = @wake_writes = @timeouts = 0
+
+        @max_outstanding = opts[:max_outstanding]
+        @backpressure    = opts[:backpressure] || :block
+        @coalesce_reads  = opts.fetch(:coalesce_reads, true)
+
+        unless @max_outstanding.nil? or (@max_outstanding.kind_of?(Integer) and @max_outstanding > 0)
+          raise ArgumentError, ":max_outstanding must be a positive Integer, not #{@max_outstanding.inspect}"
+        end
+
+        unless BACKPRESSURE_POLICIES.include?(@backpressure) or (@backpressure.kind_of?(Numeric) and @backpressure >= 0)
+          raise ArgumentError, ":backpressure must be :block, :fail or a number of seconds, not #{@backpressure.inspect}"
+        end
+
+        @outstanding = 0          # admitted and not released, only counted with a window
+        @rejected = @blocked = 0
+        @window_cond = ConditionVariable.new
+
+        @timers = TimerWheel.new
+        @waiting = {}
+
+        # req_ids of timed out requests whose responses are still to come
+        @abandoned = {}
+
+        @coalesced = 0
+        @flights   = {}   # flight_key => req_id of the read sent for it
+        @followers = {}   # that req_id => the continuations that joined it
+        @following = 0    # size of all those lists
+      end
+
+      # adds cntn to the appropriate list. returns true if the caller should
+      # wake the event thread, which is only the case for the first push
+      # after the last #next_batch: the thread hasn't picked up the earlier
+      # ones yet, so a wakeup is already on its way.
+      #
+      # once the event thread has gone (#close!) there's nobody to pick cntn
+      # up, so it's shut down instead.
+      #
+      # this method is synchronized
+      def push(cntn)
+        @mutex.lock
+        begin
+          if @closed
+            cntn.shutdown!
+            return false
+          end
+
+          (cntn.meth == :state ? state_check : pending) << cntn
+          @submits += 1
+
+          return false if @wake_pending
+          @wake_writes += 1
+          @wake_pending = true
+        ensure
+          @mutex.unlock rescue nil
+        end
+      end
+
+      # like #push, for several continuations under one lock
+      #
+      # this method is synchronized
+      def push_all(cntns)
+        return false if cntns.empty?
+
+        @mutex.lock
+        begin
+          if @closed
+            cntns.each { |cntn| cntn.shutdown! }
+            return false
+          end
+
+          cntns.each { |cntn| (cntn.meth == :state ? state_check : pending) << cntn }
+          @submits += cntns.length
+
+          return false if @wake_pending
+          @wake_writes += 1
+          @wake_pending = true
+        ensure
+          @mutex.unlock rescue nil
+        end
       end
 
       def synchronize
@@ -43,11 +192,243 @@ module Zookeeper
       def next_batch()
         @mutex.lock
         begin
+          @wake_pending = false
           state_check.slice!(0, state_check.length) + pending.slice!(0,pending.length)
         ensure
           @mutex.unlock rescue nil
         end
       end
+
+      # called by the event thread on its way out: returns everything it
+      # hasn't finished with, and has any further #push shut its continuation
+      # down. #reopen! undoes it for the next event thread.
+      #
+      # this method is synchronized
+      def close!
+        @mutex.lock
+        begin
+          @closed = true
+          @wake_pending = false
+          @outstanding = 0
+          @window_cond.broadcast
+
+          rv = state_check.slice!(0, state_check.length) + pending.slice!(0, pending.length) +
+            @waiting.keys + in_flight.values + @followers.values.flatten
+
+          @waiting.clear
+          in_flight.clear
+          @abandoned.clear
+          @timers.clear
+          @flights.clear
+          @followers.clear
+          @following = 0
+
+          rv
+        ensure
+          @mutex.unlock rescue nil
+        end
+      end
+
+      # this method is synchronized
+      def reopen!
+        @mutex.synchronize { @closed = false }
+      end
+
+      # asks for a place in the window for cntn, waiting for one as the
+      # :backpressure policy says (unless wait is false). returns false if
+      # cntn has to be turned away.
+      #
+      # this method is synchronized
+      def admit(cntn, wait = true)
+        return true unless @max_outstanding
+
+        @mutex.lock
+        begin
+          if @outstanding >= @max_outstanding and not @closed
+            if !wait or @backpressure == :fail
+              @rejected += 1 if wait
+              return false
+            end
+
+            @blocked += 1
+            deadline = Continuation.now + @backpressure if @backpressure.kind_of?(Numeric)
+
+            while @outstanding >= @max_outstanding and not @closed
+              if deadline
+                remaining = deadline - Continuation.now
+
+                if remaining <= 0
+                  @rejected += 1
+                  return false
+                end
+
+                @window_cond.wait(@mutex, remaining)
+              else
+                @window_cond.wait(@mutex)
+              end
+            end
+          end
+
+          # a closed registry shuts cntn down when it's pushed, no need to
+          # count it
+          return true if @closed
+
+          @outstanding += 1
+          cntn.admitted = true
+        ensure
+          @mutex.unlock rescue nil
+        end
+      end
+
+      # gives cntn's place in the window to the next caller
+      def release(cntn)
+        return unless cntn.admitted
+        cntn.admitted = false
+
+        @mutex.synchronize do
+          @outstanding -= 1
+          @window_cond.signal
+        end
+      end
+
+      # counters for the window, see CZookeeper#request_stats
+      #
+      # this method is synchronized
+      def stats
+        @mutex.synchronize do
+          queued = pending.length + state_check.length + @waiting.size
+
+          { :max_outstanding => @max_outstanding,
+            :outstanding     => @max_outstanding ? @outstanding : queued + in_flight.size + @following,
+            :queued          => queued,
+            :in_flight       => in_flight.size,
+            :coalesced       => @coalesced,
+            :rejected        => @rejected,
+            :blocked         => @blocked,
+            :timeouts        => @timeouts }
+        end
+      end
+
+      # the event thread submitted cntn, its response will come with req_id.
+      # unless it was turned down (or is a state check), then it's done with.
+      def sent(cntn)
+        # whatever is read from now on may see what cntn changes
+        @flights.clear if cntn.write? and not @flights.empty?
+
+        unless cntn.req_id and cntn.submitted?
+          release(cntn)
+          return
+        end
+
+        in_flight[cntn.req_id] = cntn
+        start_timer(cntn)
+
+        # a read sharing someone else's watch has no watch of its own for
+        # others to share
+        if @coalesce_reads and key = cntn.flight_key and not cntn.watch_dropped?
+          @flights[key] = cntn.req_id
+        end
+      end
+
+      # instead of sending cntn, the event thread can have it wait for the
+      # response to an identical read that's already been sent. returns true
+      # if it does.
+      def join(cntn)
+        return false if @flights.empty?
+        return false unless key = cntn.flight_key and req_id = @flights[key]
+
+        (@followers[req_id] ||= []) << cntn
+        @following += 1
+        @coalesced += 1
+        start_timer(cntn)
+        true
+      end
+
+      # the continuations that joined the read whose response came for
+      # req_id. the ones that timed out meanwhile are done, but still share
+      # the read's watch, if it asked for one.
+      def take_followers(req_id)
+        return [] if @followers.empty?
+        return [] unless followers = @followers.delete(req_id)
+
+        @following -= followers.length
+
+        followers.each do |cntn|
+          @timers.delete(cntn, cntn.timer) if cntn.timer
+          cntn.timer = nil
+          release(cntn)
+        end
+      end
+
+      # the event thread is holding on to cntn until we're connected
+      def wait_for_connection(cntn)
+        @waiting[cntn] = true
+        start_timer(cntn)
+      end
+
+      # returns the continuations held by #wait_for_connection, they keep
+      # their timers
+      def take_waiting
+        return [] if @waiting.empty?
+        @waiting.keys.tap { @waiting.clear }
+      end
+
+      # the continuation the response for req_id is for, if any. nil if the
+      # caller gave up waiting for it, check #abandoned? first.
+      def complete(req_id)
+        return nil unless cntn = in_flight.delete(req_id)
+        @timers.delete(cntn, cntn.timer) if cntn.timer
+        release(cntn)
+        end_flight(cntn)
+        cntn
+      end
+
+      # the response to req_id is for a call that has timed out
+      def abandoned?(req_id)
+        !@abandoned.empty? && !!@abandoned.delete(req_id)
+      end
+
+      # removes and returns the continuations whose deadline has passed.
+      # their callers are still waiting, see Continuation#timeout!
+      def expire(now = Continuation.now)
+        expired = @timers.expire(now)
+
+        expired.each do |cntn|
+          cntn.timer = nil
+          release(cntn)
+
+          # a continuation following someone else's read isn't in_flight,
+          # and the read's response is still wanted by any others
+          if @waiting.delete(cntn).nil? && in_flight.delete(cntn.req_id)
+            @abandoned[cntn.req_id] = true
+            end_flight(cntn)
+          end
+        end
+
+        @timeouts += expired.length
+        expired
+      end
+
+      # how long until the next deadline, nil if there are none
+      def time_to_next_deadline(now = Continuation.now)
+        return nil unless deadline = @timers.next_deadline
+        [deadline - now, 0].max
+      end
+
+      private
+        # nothing else can join cntn's read once its response has come, or
+        # it's been given up on
+        def end_flight(cntn)
+          return if @flights.empty? or not key = cntn.flight_key
+          @flights.delete(key) if @flights[key] == cntn.req_id
+        end
+
+        # async calls return as soon as they're submitted, nobody's waiting
+        # for those to time out
+        def start_timer(cntn)
+          return if cntn.timer || cntn.user_callback? || cntn.done?
+          cntn.timer = @timers.add(cntn, cntn.deadline)
+        end
     end # Registry
 
     # *sigh* what is the index in the *args array of the 'callback' param
@@ -61,7 +442,9 @@ module Zookeeper
       :set_acl => 3,
       :get_children => 2,
       :state => 0,
-      :add_auth => 2
+      :add_auth => 2,
+      :multi => 2,
+      :get_tree => 2
     }
 
     # maps the method name to the async return hash keys it should use to
@@ -75,13 +458,35 @@ module Zookeeper
       :get_acl      => [:rc, :acl, :stat],
       :set_acl      => [:rc],
       :get_children => [:rc, :strings, :stat],
-      :add_auth     => [:rc]
+      :add_auth     => [:rc],
+      :multi        => [:rc, :results],
+      :get_tree     => [:rc, :results]
     }
 
+    # the sync calls that may share one request, see Registry#join
+    COALESCED_READS = [:get, :exists, :get_children].freeze
+
+    # the calls that can't change anything on the server
+    READS = (COALESCED_READS + [:get_acl, :get_tree, :state]).freeze
+
     attr_accessor :meth, :block, :rval
 
     attr_reader :args
 
+    # seconds the caller is prepared to wait, and the Continuation.now by
+    # which it wants an answer
+    attr_reader :timeout, :deadline
+
+    # the event thread's handle on our entry in the Registry's timer wheel
+    #
+    # @private
+    attr_accessor :timer
+
+    # holds a place in the Registry's window
+    #
+    # @private
+    attr_accessor :admitted
+
     def initialize(meth, *args)
       @meth   = meth
       @args   = args.freeze
@@ -91,35 +496,34 @@ module Zookeeper
 
       # make this error reporting more robust if necessary, right now, just set to state
       @error  = nil
+
+      @timeout  = Continuation.current_timeout || OPERATION_TIMEOUT
+      @deadline = Continuation.now + @timeout
+      @timer    = nil
+      @admitted = false
+
+      @watch_dropped = false
     end
 
     # the caller calls this method and receives the response from the async loop
-    # this method has a hard-coded 30 second timeout as a safety feature. No
-    # call should take more than 20s (as the session timeout is set to 20s)
-    # so if any call takes longer than that, something has gone horribly wrong.
     #
-    # @raise [ContinuationTimeoutError] if a response is not received within 30s
+    # there's no timed wait here, the event thread times us out (see
+    # Registry#expire) if there's no response by our deadline, which is
+    # OPERATION_TIMEOUT unless the call was given a :timeout.
+    #
+    # @raise [ContinuationTimeoutError] if a response is not received in time
     #
     def value
-      time_to_stop = Time.now + OPERATION_TIMEOUT
-      now = nil
-
       @mutex.synchronize do
-        while true
-          now = Time.now
-          break if @rval or @error or (now > time_to_stop)
-
-          deadline = time_to_stop.to_f - now.to_f
-          @cond.wait(deadline)
-        end
-
-        if (now > time_to_stop) and !@rval and !@error
-          raise Exceptions::ContinuationTimeoutError, "response for meth: #{meth.inspect}, args: #{@args.inspect}, not received within #{OPERATION_TIMEOUT} seconds"
-        end
+        @cond.wait until @rval or @error
 
         case @error
         when nil
           # ok, nothing to see here, carry on
+        when :rejected
+          raise Exceptions::RequestRejected, "too many requests outstanding, meth: #{meth.inspect}, args: #{@args.inspect}"
+        when :timeout
+          raise Exceptions::ContinuationTimeoutError, "response for meth: #{meth.inspect}, args: #{@args.inspect}, not received within #{@timeout} seconds"
         when :shutdown
           raise Exceptions::NotConnected, "the connection is shutting down"
         when ZOO_EXPIRED_SESSION_STATE
@@ -145,6 +549,21 @@ module Zookeeper
       deliver!
     end
 
+    # like #call, for a continuation that joined another's read (see
+    # Registry#join): gets its own copies of the strings in the response, so
+    # one caller changing its result doesn't change anyone else's
+    def share(hash)
+      @rval = hash.values_at(*METH_TO_ASYNC_RESULT_KEYS.fetch(meth)).map do |v|
+        case v
+        when String then v.dup
+        when Array  then v.map { |s| s.kind_of?(String) ? s.dup : s }
+        else v
+        end
+      end
+
+      deliver!
+    end
+
     def user_callback?
       !!@args.at(callback_arg_idx)
     end
@@ -185,13 +604,62 @@ module Zookeeper
       @meth == :state
     end
 
+    def write?
+      !READS.include?(@meth)
+    end
+
+    # a sync or async read that sets a watch
+    def watch?
+      COALESCED_READS.include?(@meth) and !!@args[3]
+    end
+
+    # has the request go to the server without its watch, because it shares
+    # one that's already set, see WatchMultiplexer#prepare
+    def drop_watch!
+      @watch_dropped = true
+    end
+
+    def watch_dropped?
+      @watch_dropped
+    end
+
+    # what identifies the request of a sync read, so that identical ones can
+    # share it: [meth, path, watch?, packed?]. nil for anything else.
+    def flight_key
+      return @flight_key if defined?(@flight_key)
+
+      @flight_key = if COALESCED_READS.include?(@meth) and not user_callback?
+        [@meth, @args[1], !!@args[3], !!@args[4]]
+      end
+    end
+
     # interrupt the sleeping thread with a NotConnected error
     def shutdown!
-      @mutex.synchronize do
-        return if @rval or @error
-        @error = :shutdown
-        @cond.broadcast
-      end
+      fail_with(:shutdown)
+    end
+
+    # interrupt the sleeping thread with a ContinuationTimeoutError
+    def timeout!
+      fail_with(:timeout)
+    end
+
+    # the caller is turned away by the Registry's window, see
+    # Registry#admit. makes it raise RequestRejected.
+    def reject!
+      fail_with(:rejected)
+    end
+
+    # has the caller been given its answer (or error)
+    def done?
+      !!(@rval or @error)
+    end
+
+    # after #submit: did the request make it to the server, so that a
+    # response is on its way
+    def submitted?
+      return false if @error or state_call?
+      return true unless @rval
+      user_callback? and @rval.first == ZOK
     end
 
     protected
@@ -205,6 +673,7 @@ module Zookeeper
         logger.debug { "async_args, meth: #{meth} ary: #{ary.inspect}, #{callback_arg_idx}" }
 
         ary[callback_arg_idx] ||= self
+        ary[3] = nil if @watch_dropped
 
         ary
       end
@@ -218,6 +687,14 @@ module Zookeeper
           @cond.signal
         end
       end
+
+      def fail_with(error)
+        @mutex.synchronize do
+          return if @rval or @error
+          @error = error
+          @cond.broadcast
+        end
+      end
   end # Base
 end
 
@@ -88,6 +88,11 @@ stacktrace:
   # the thread should be awoken. (i.e. prevents a call that never returns)
   class ContinuationTimeoutError < ZookeeperException; end
 
+  # raised when a request is turned away because the connection already has
+  # as many outstanding as its :max_outstanding allows (see the
+  # :backpressure option)
+  class RequestRejected < ZookeeperException; end
+
   # raised when the user tries to use a connection after a fork()
   # without calling reopen() in the C client
   #
@@ -0,0 +1,72 @@
+module Zookeeper
+  # The eventual result of a request queued on a {Pipeline}.
+  #
+  # A future is resolved the first time its value is asked for, in the thread
+  # that asks: #value blocks until the server has answered and then returns
+  # exactly what the equivalent synchronous call would have returned (or
+  # raises what it would have raised). Asking again returns the same value.
+  #
+  # Futures are not thread safe, resolve them in the thread that created the
+  # pipeline.
+  class Future
+    # runs all the futures and returns their values, in order. takes any mix
+    # of futures and arrays of futures.
+    def self.wait_all(*futures)
+      futures.flatten.map { |f| f.value }
+    end
+
+    # the block produces the value, it's called at most once
+    def initialize(&resolver)
+      @resolver = resolver
+      @resolved = false
+      @value    = nil
+      @error    = nil
+    end
+
+    def value
+      resolve!
+      raise @error if @error
+      @value
+    end
+
+    # a new future whose value is the block's return value when called with
+    # this future's value. if this future raises, so does the new one.
+    #
+    #   data = pipeline.get(:path => '/config').then { |h| h[:data] }
+    #
+    def then
+      parent = self
+      Future.new { yield parent.value }
+    end
+
+    # has the value (or error) been obtained yet
+    def resolved?
+      @resolved
+    end
+
+    # the exception this future raises, once resolved. nil if it succeeded.
+    def error
+      resolve!
+      @error
+    end
+
+    def inspect
+      state = !@resolved ? 'pending' : (@error ? "error=#{@error.class}" : "value=#{@value.inspect}")
+      "#<#{self.class.name} #{state}>"
+    end
+
+    private
+      def resolve!
+        return if @resolved
+
+        begin
+          @value = @resolver.call
+        rescue StandardError => e
+          @error = e
+        ensure
+          @resolved = true
+          @resolver = nil
+        end
+      end
+  end
+end
@@ -0,0 +1,187 @@
+module Zookeeper
+  # Builds the list of operations for a {ClientMethods#multi} call. The ops
+  # are applied atomically by the server: either all of them succeed or none
+  # of them are applied.
+  #
+  # The op methods take the same options as their ClientMethods counterparts
+  # (minus the callbacks) and return self, so they can be chained:
+  #
+  #   ops = Zookeeper::Multi.new.
+  #     check(:path => '/config', :version => 3).
+  #     create(:path => '/config/a', :data => 'a').
+  #     set(:path => '/config', :data => 'v4').
+  #     delete(:path => '/config/old')
+  #
+  #   zk.multi(:ops => ops)
+  #
+  # or, equivalently, as a list of [op, options] pairs:
+  #
+  #   zk.multi(:ops => [[:check, {:path => '/config', :version => 3}], ...])
+  #
+  class Multi
+    include Constants
+    include ACLs
+
+    # The outcome of a single op in a multi.
+    #
+    # When the transaction is rejected the op that failed has its own error
+    # as #rc, the ops before it ZOK and the ones after it
+    # ZRUNTIMEINCONSISTENCY (none of them were applied, whatever their #rc).
+    # If no answer was received at all (e.g. connection loss) every op has
+    # the overall rc.
+    class Result
+      include Constants
+
+      # one of the ZOO_*_OP constants
+      attr_reader :type
+
+      # the return code for this op
+      attr_reader :rc
+
+      # the path of the node that was created, only set for successful creates
+      attr_reader :path
+
+      # the Stat of the node after the write, only set for successful sets
+      attr_reader :stat
+
+      OP_NAMES = {
+        ZOO_CREATE_OP  => :create,
+        ZOO_DELETE_OP  => :delete,
+        ZOO_SETDATA_OP => :set,
+        ZOO_CHECK_OP   => :check,
+      }.freeze
+
+      # converts the Array of result hashes the drivers hand back
+      def self.from(results)
+        results && results.map { |r| r.kind_of?(Result) ? r : new(r) }
+      end
+
+      def initialize(hash)
+        @type = hash[:type]
+        @rc   = hash[:rc]
+        @path = hash[:path]
+        @stat = hash[:stat] && Stat.from(hash[:stat])
+      end
+
+      # :create, :delete, :set or :check
+      def op
+        OP_NAMES[type]
+      end
+
+      def ok?
+        rc == ZOK
+      end
+
+      def to_hash
+        { :type => type, :rc => rc, :path => path, :stat => stat }
+      end
+
+      def inspect
+        "#<#{self.class.name} #{op} rc=#{rc}#{" path=#{path.inspect}" if path}>"
+      end
+    end
+
+    OPS = [:create, :delete, :set, :check].freeze
+
+    # returns ops if it's already a Multi, otherwise builds one from a list of
+    # [op, options] pairs
+    def self.from(ops)
+      return ops if ops.kind_of?(Multi)
+
+      new.tap do |m|
+        Array(ops).each do |op, options|
+          unless OPS.include?(op)
+            raise Zookeeper::Exceptions::BadArguments, "multi ops must be one of #{OPS.inspect}, not #{op.inspect}"
+          end
+          m.__send__(op, options || {})
+        end
+      end
+    end
+
+    def initialize
+      @ops = []
+      yield self if block_given?
+    end
+
+    def create(options = {})
+      assert_keys(options, [:path, :data, :acl, :ephemeral, :sequence])
+      assert_data(options[:data])
+
+      flags = 0
+      flags |= ZOO_EPHEMERAL if options[:ephemeral]
+      flags |= ZOO_SEQUENCE if options[:sequence]
+
+      @ops << [ZOO_CREATE_OP, options[:path], options[:data], options[:acl] || ZOO_OPEN_ACL_UNSAFE, flags]
+      self
+    end
+
+    def delete(options = {})
+      assert_keys(options, [:path, :version])
+      @ops << [ZOO_DELETE_OP, options[:path], version(options)]
+      self
+    end
+
+    def set(options = {})
+      assert_keys(options, [:path, :data, :version])
+      assert_data(options[:data])
+      @ops << [ZOO_SETDATA_OP, options[:path], options[:data], version(options)]
+      self
+    end
+
+    # fails the whole transaction unless the node at :path exists and (if
+    # given) is at :version
+    def check(options = {})
+      assert_keys(options, [:path, :version])
+      @ops << [ZOO_CHECK_OP, options[:path], version(options)]
+      self
+    end
+
+    # the ops in the form the drivers take them
+    #
+    # @private
+    def ops
+      @ops.dup
+    end
+
+    def size
+      @ops.size
+    end
+    alias length size
+
+    def empty?
+      @ops.empty?
+    end
+
+    # the ops are handed to the driver on the event thread, so anything it
+    # would choke on is caught here, in the caller
+    private
+      def assert_keys(options, supported)
+        unless (options.keys - supported).empty?
+          raise Zookeeper::Exceptions::BadArguments,
+                "Supported arguments are: #{supported.inspect}, but arguments #{options.keys.inspect} were supplied instead"
+        end
+
+        unless options[:path].kind_of?(String)
+          raise Zookeeper::Exceptions::BadArguments, "Required arguments are: [:path], but only the arguments #{options.keys.inspect} were supplied."
+        end
+      end
+
+      def assert_data(data)
+        return if data.nil?
+
+        unless data.kind_of?(String)
+          raise Zookeeper::Exceptions::BadArguments, ":data must be a String, not #{data.class}"
+        end
+
+        if data.length >= 1048576 # one megabyte
+          raise Zookeeper::Exceptions::DataTooLargeException, "data must be smaller than 1 MiB, your data starts with: #{data[0..32].inspect}"
+        end
+      end
+
+      def version(options)
+        v = options[:version] || -1
+        raise Zookeeper::Exceptions::BadArguments, ":version must be an Integer" unless v.kind_of?(Integer)
+        v
+      end
+  end
+end
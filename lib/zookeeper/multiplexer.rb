@@ -0,0 +1,76 @@
+module Zookeeper
+  # One session shared by the worker processes of a preforking server
+  # (Unicorn, Puma's cluster mode, ...), instead of one session each.
+  #
+  # The multiplexer is a process of its own that holds the session and
+  # listens on a Unix socket. A client created with the :multiplexer option
+  # makes its calls on that session by way of the socket, and gets their
+  # completions and its watch events back the same way, so nothing else
+  # about it changes. After a fork a worker's #reopen is a new connection to
+  # the socket, not a new session, and a deploy that restarts every worker
+  # doesn't reconnect anything to the ensemble.
+  #
+  #   # in the master, before the workers are forked
+  #   Zookeeper::Multiplexer.spawn('zk1:2181,zk2:2181/app', '/tmp/zk-app.sock')
+  #
+  #   # in each worker
+  #   zk = Zookeeper.new('zk1:2181,zk2:2181/app', 10, nil, :multiplexer => '/tmp/zk-app.sock')
+  #
+  # The workers must connect with the same connect string as the
+  # multiplexer. Since the session is shared, so is whatever add_auth gives
+  # it, and so is the order of the calls: one worker's write is seen by the
+  # reads the others send after it. Ephemeral nodes are kept for the worker
+  # that created them, and deleted when its connection closes, as they
+  # would have been with its session. If the shared session expires, or the
+  # multiplexer goes away, every worker sees its session expire and has to
+  # reopen, as with one of its own.
+  #
+  # The multiplexer needs the C extension, so do its clients.
+  module Multiplexer
+    # forks a process running a Server for host on the socket at path, and
+    # returns its pid once it's listening. raises if it exits before that,
+    # or isn't listening after opts[:timeout] seconds (10 by default), in
+    # which case it's killed. TERM or INT stop it. opts are the Server's.
+    def self.spawn(host, path, opts = {})
+      timeout = opts[:timeout] || Server::DEFAULT_TIMEOUT
+      reader, writer = IO.pipe
+
+      pid = fork do
+        begin
+          reader.close
+
+          server = Server.new(host, path, opts)
+          [:TERM, :INT].each { |sig| trap(sig) { server.stop } }
+          server.start
+
+          writer.write('1')    # listening
+          writer.close
+
+          server.join
+          exit!(0)
+        rescue Exception => e
+          Server.logger.error { "multiplexer for #{host} on #{path}: #{e.class}: #{e.message}" }
+          exit!(1)
+        end
+      end
+
+      writer.close
+      waited = IO.select([reader], nil, nil, timeout)
+      listening = waited && reader.read(1)
+      reader.close
+      return pid if listening
+
+      Process.kill(:KILL, pid) unless waited
+      _, status = Process.wait2(pid)
+
+      why = waited ? "exited (#{status.inspect})" : "was killed, it wasn't listening after #{timeout} seconds"
+      raise Exceptions::ZookeeperException, "the multiplexer for #{host} on #{path} #{why}"
+    end
+  end
+end
+
+Zookeeper.require_lib(
+  'zookeeper/multiplexer/protocol',
+  'zookeeper/multiplexer/server',
+  'zookeeper/multiplexer/connection'
+)
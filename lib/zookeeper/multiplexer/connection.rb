@@ -0,0 +1,452 @@
+require 'socket'
+
+module Zookeeper
+module Multiplexer
+  # Takes the place of a CZookeeper in a client given the :multiplexer
+  # option: the same methods, made on the multiplexer's session by way of
+  # its socket instead of on a session of our own.
+  #
+  # Sync calls are Continuations, as with CZookeeper, but they're sent by
+  # the calling thread and the reader thread delivers their completions, so
+  # there's no event thread to hand them to. Async completions, watch
+  # events and session events go to the client's event queue as usual.
+  #
+  # The state is the multiplexer's session's. If the multiplexer goes away
+  # the connection's watches and ephemeral nodes go with it, so that's an
+  # expired session, and the client has to #reopen like after any other.
+  class Connection
+    include Forked
+    include Constants
+    include Exceptions
+    include Logger
+
+    # how long to wait between attempts to connect to the socket
+    RETRY_INTERVAL = 0.1
+
+    # the longest the reader thread waits without looking at the timers, so
+    # that a call whose deadline is later than that needn't wake it
+    IDLE_WAIT = 1.0
+
+    attr_accessor :original_pid
+
+    %w[get set exists create delete get_acl set_acl get_children add_auth multi get_tree].each do |sym|
+      class_eval(<<-EOS, __FILE__, __LINE__+1)
+        def #{sym}(*args)
+          submit_and_block(:#{sym}, *args)
+        end
+
+        # @private
+        def zkrb_#{sym}(*args)
+          send_call(:#{sym}, args)
+        end
+      EOS
+    end
+
+    def initialize(path, host, event_queue, opts = {})
+      @path        = path
+      @host        = host
+      @event_queue = event_queue
+
+      update_pid!
+
+      @mutex      = Monitor.new
+      @state_cond = @mutex.new_cond
+      @write_lock = Monitor.new
+
+      @state          = ZOO_CONNECTING_STATE
+      @session_id     = nil
+      @passwd         = nil
+      @connected_host = nil
+      @refused        = nil
+
+      @stream  = nil
+      @batch   = nil    # frames being put together by #submit_all
+      @closed  = false
+      @pausing = false
+
+      @in_flight = {}   # req_id => Continuation, sync and async
+      @abandoned = {}   # req_ids of sync calls that timed out
+      @timers    = TimerWheel.new
+      @timeouts  = 0
+      @wait_till = nil  # when the reader thread will next look at the timers
+
+      @wake_r, @wake_w = IO.pipe
+
+      start_reader
+    end
+
+    # this method is *only* asynchronous, as with CZookeeper
+    def sync(req_id, path)
+      send_call(:sync, [req_id, path])
+    end
+
+    def state
+      @mutex.synchronize { (@closed or @refused) ? ZOO_CLOSED_STATE : @state }
+    end
+
+    # while we have the socket calls can be sent, the multiplexer's session
+    # holds on to them if it's reconnecting
+    #
+    # @private
+    def zkrb_state
+      @mutex.synchronize { sendable? ? ZOO_CONNECTED_STATE : @state }
+    end
+
+    def connected?
+      state == ZOO_CONNECTED_STATE
+    end
+
+    def connecting?
+      state == ZOO_CONNECTING_STATE
+    end
+
+    def associating?
+      state == ZOO_ASSOCIATING_STATE
+    end
+
+    def closed?
+      @mutex.synchronize { @closed or !!@refused }
+    end
+
+    def running?
+      @mutex.synchronize { !!@reader }
+    end
+
+    def shutting_down?
+      @mutex.synchronize { @closed }
+    end
+
+    def client_id
+      @mutex.synchronize do
+        return nil unless @session_id
+        CZookeeper::ClientId.new.tap do |cid|
+          cid.session_id = @session_id
+          cid.passwd     = @passwd
+        end
+      end
+    end
+
+    def connected_host
+      @mutex.synchronize { @connected_host }
+    end
+
+    # the same counters as CZookeeper#request_stats. nothing is held back
+    # or coalesced here, that's up to the multiplexer.
+    def request_stats
+      @mutex.synchronize do
+        { :max_outstanding => nil,
+          :outstanding     => @in_flight.size,
+          :queued          => 0,
+          :in_flight       => @in_flight.size,
+          :coalesced       => 0,
+          :rejected        => 0,
+          :blocked         => 0,
+          :timeouts        => @timeouts }
+      end
+    end
+
+    # the multiplexer shares the watches of all its workers
+    def watch_subscribers
+      {}
+    end
+
+    def wait_until_connected(timeout = 10)
+      deadline = timeout && Continuation.now + timeout
+
+      @mutex.synchronize do
+        until @state == ZOO_CONNECTED_STATE or @closed or @refused or @state == ZOO_EXPIRED_SESSION_STATE
+          if deadline
+            left = deadline - Continuation.now
+            break if left <= 0
+            @state_cond.wait(left)
+          else
+            @state_cond.wait
+          end
+        end
+      end
+
+      connected?
+    end
+
+    # after a fork this only closes our copy of the parent's socket
+    def close
+      return if @mutex.synchronize { @closed.tap { @closed = true } }
+
+      stop_reader unless forked?
+      drop_stream
+
+      @mutex.synchronize { @state_cond.broadcast }
+      fail_in_flight(:shutdown)
+      [@wake_r, @wake_w].each { |io| io.close unless io.closed? }
+
+      nil
+    end
+
+    def pause_before_fork_in_parent
+      @mutex.synchronize { @pausing = true }
+      stop_reader
+    end
+
+    def resume_after_fork_in_parent
+      @mutex.synchronize { @pausing = false }
+      start_reader
+    end
+
+    # sends cntns in one write, used by Pipeline#flush!
+    #
+    # @private
+    def submit_all(cntns)
+      @write_lock.synchronize do
+        @batch = ''.b
+
+        begin
+          cntns.each { |cntn| submit(cntn) }
+        ensure
+          batch, @batch = @batch, nil
+          write(batch) unless batch.empty?
+        end
+      end
+    end
+
+    private
+      def submit_and_block(meth, *args)
+        raise Exceptions::NotConnected if closed?
+
+        cntn = Continuation.new(meth, *args)
+
+        if pipeline = Pipeline.current
+          pipeline.defer(self, cntn)
+        else
+          submit(cntn)
+        end
+
+        cntn.value
+      end
+
+      # registers cntn before sending it, so the reader thread has it when
+      # the completion comes
+      def submit(cntn)
+        track(cntn)
+        cntn.submit(self)
+        untrack(cntn.req_id) unless cntn.submitted?
+      end
+
+      def track(cntn)
+        @mutex.synchronize do
+          @in_flight[cntn.req_id] = cntn
+          next if cntn.user_callback?
+
+          cntn.timer = @timers.add(cntn, cntn.deadline)
+          wake! if @wait_till and cntn.deadline < @wait_till
+        end
+      end
+
+      def untrack(req_id)
+        @mutex.synchronize do
+          cntn = @in_flight.delete(req_id) and cntn.timer and @timers.delete(cntn, cntn.timer)
+          cntn
+        end
+      end
+
+      def send_call(meth, args)
+        return ZCONNECTIONLOSS unless @mutex.synchronize { sendable? }
+
+        req_id, *args = args
+        idx = Continuation::CALLBACK_ARG_IDX[meth]
+
+        if idx
+          args[idx - 1] = nil                                             # the multiplexer always wants its completion
+          args[2] = !!args[2] if [:get, :exists, :get_children].include?(meth)  # the watcher
+          args[3] = false if meth == :get_children                        # no packed children
+        end
+
+        write(Protocol.call_frame(req_id, meth, args)) ? ZOK : ZCONNECTIONLOSS
+      end
+
+      def write(frame)
+        @write_lock.synchronize do
+          return (@batch << frame; true) if @batch
+          return false unless @stream
+
+          begin
+            @stream.io.write(frame)
+            true
+          rescue IOError, SystemCallError
+            false
+          end
+        end
+      end
+
+      # must hold @mutex
+      def sendable?
+        @stream && !@closed && !@refused && @state != ZOO_EXPIRED_SESSION_STATE
+      end
+
+      def drop_stream
+        @write_lock.synchronize do
+          @stream.close if @stream
+          @stream = nil
+        end
+      end
+
+      def wake!
+        @wake_w.write_nonblock('1', exception: false)
+      rescue IOError
+      end
+
+      def start_reader
+        @mutex.synchronize do
+          return if @reader
+          @reader = Thread.new(&method(:reader_body))
+        end
+      end
+
+      def stop_reader
+        reader = @mutex.synchronize { @reader }
+        return unless reader
+
+        wake!
+        reader.join unless reader == Thread.current
+        @mutex.synchronize { @reader = nil }
+      end
+
+      def stopping?
+        @mutex.synchronize { @closed or @pausing }
+      end
+
+      def reader_body
+        Thread.current.abort_on_exception = true
+
+        connect until @stream or stopping?
+
+        until stopping?
+          next expire_overdue_calls if read_frames
+
+          drop_stream    # the multiplexer's gone, or said no
+          break
+        end
+      ensure
+        @mutex.synchronize { @reader = nil unless @pausing }
+      end
+
+      def connect
+        sock = UNIXSocket.new(@path)
+
+        begin
+          sock.write(Protocol.value_frame(Protocol::HELLO, [Protocol::VERSION, Process.pid, @host]))
+        rescue IOError, SystemCallError
+          return sock.close
+        end
+
+        @write_lock.synchronize { @stream = Protocol::Stream.new(sock) }
+      rescue Errno::ENOENT, Errno::ECONNREFUSED, Errno::EAGAIN
+        IO.select([@wake_r], nil, nil, RETRY_INTERVAL) and @wake_r.read_nonblock(4096, exception: false)
+      end
+
+      # waits for something to read or a call's deadline, false once the
+      # multiplexer has gone
+      def read_frames
+        wait = @mutex.synchronize do
+          now = Continuation.now
+          @wait_till = [@timers.next_deadline || now + IDLE_WAIT, now + IDLE_WAIT].min
+          [@wait_till - now, 0].max
+        end
+
+        readable, = IO.select([@stream.io, @wake_r], nil, nil, wait)
+        return true unless readable
+
+        @wake_r.read_nonblock(4096, exception: false) if readable.include?(@wake_r)
+        return true unless readable.include?(@stream.io)
+
+        eof = !@stream.read
+        for_dispatch = []
+
+        @stream.each_frame do |type, body|
+          case type
+          when Protocol::COMPLETION
+            completed(body.int64, body.value, for_dispatch)
+          when Protocol::WATCH
+            req_id = body.int64
+            for_dispatch << body.value.merge(:req_id => req_id)
+          when Protocol::WELCOME
+            state, session_id, passwd, host = body.value
+            @mutex.synchronize { @session_id, @passwd = session_id, passwd }
+            set_state(state, host, for_dispatch)
+          when Protocol::STATE
+            state, _, host = body.value
+            set_state(state, host, for_dispatch)
+          when Protocol::REFUSED
+            refused = body.value
+            @mutex.synchronize { @refused = refused; @state_cond.broadcast }
+            logger.error { "the multiplexer at #{@path} refused us: #{@refused}" }
+            eof = true
+          end
+        end
+
+        if eof and not stopping?
+          set_state(ZOO_EXPIRED_SESSION_STATE, nil, for_dispatch) unless @refused or @state == ZOO_EXPIRED_SESSION_STATE
+          fail_in_flight(ZCONNECTIONLOSS, for_dispatch)
+        end
+
+        @event_queue.push_all(for_dispatch) unless for_dispatch.empty?
+        !eof
+      end
+
+      def completed(req_id, hash, for_dispatch)
+        hash[:req_id] = req_id
+
+        cntn = untrack(req_id)
+        return if cntn.nil? and @mutex.synchronize { @abandoned.delete(req_id) }
+
+        if cntn and not cntn.user_callback?
+          cntn.call(hash)
+        else
+          for_dispatch << hash
+        end
+      end
+
+      def set_state(state, host, for_dispatch)
+        @mutex.synchronize do
+          return if state == @state
+          @state = state
+          @connected_host = host if host
+          @state_cond.broadcast
+        end
+
+        for_dispatch << { :req_id => ZKRB_GLOBAL_CB_REQ, :type => ZOO_SESSION_EVENT, :state => state, :path => '' }
+      end
+
+      # the calls whose answer isn't coming: sync ones fail with error (an
+      # rc, or :shutdown), async ones get a completion with the rc
+      def fail_in_flight(error, for_dispatch = nil)
+        cntns = @mutex.synchronize do
+          @timers.clear
+          @in_flight.values.tap { @in_flight.clear }
+        end
+
+        cntns.each do |cntn|
+          if cntn.user_callback?
+            for_dispatch << { :req_id => cntn.req_id, :rc => error } if for_dispatch and error.kind_of?(Integer)
+          elsif error == :shutdown
+            cntn.shutdown!
+          else
+            cntn.call(:rc => error)
+          end
+        end
+      end
+
+      # the calls whose deadline has passed, a response that turns up later
+      # is dropped
+      def expire_overdue_calls
+        expired = @mutex.synchronize do
+          @timers.expire(Continuation.now).each do |cntn|
+            cntn.timer = nil
+            @abandoned[cntn.req_id] = true if @in_flight.delete(cntn.req_id)
+          end.tap { |e| @timeouts += e.length }
+        end
+
+        expired.each { |cntn| cntn.timeout! }
+      end
+  end
+end
+end
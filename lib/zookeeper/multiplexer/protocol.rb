@@ -0,0 +1,242 @@
+module Zookeeper
+module Multiplexer
+  # @private
+  #
+  # What workers and the multiplexer say to each other over the socket. Each
+  # frame is a u32 length (of what follows it), a u8 type, and a body:
+  #
+  #   HELLO       worker  [version, pid, host]
+  #   WELCOME     mux     [state, session_id, passwd, connected_host]
+  #   REFUSED     mux     why, the socket is closed after it
+  #   CALL        worker  i64 req_id, u8 method, [args]
+  #   COMPLETION  mux     i64 req_id, { the completion's fields }
+  #   WATCH       mux     i64 req_id, { the event's fields }
+  #   STATE       mux     [state, session_id, connected_host]
+  #
+  # The req_ids are the worker's own. The arguments of a CALL are those of
+  # the CZookeeper method, less the req_id, with the callback left out and
+  # the watcher given as true or false.
+  #
+  # Values are a tag byte and what it needs: nil, true and false are just
+  # the tag, integers are 4 or 8 bytes, strings and symbols a length and
+  # the bytes, arrays and hashes a count and their elements. The symbols
+  # in SYMBOLS are sent as their index, Stats as their 11 fields, and ACLs
+  # as the perms, scheme and id. All integers are big-endian.
+  module Protocol
+    include Constants
+
+    VERSION = 1
+
+    HELLO       = 1
+    WELCOME     = 2
+    REFUSED     = 3
+    CALL        = 4
+    COMPLETION  = 5
+    WATCH       = 6
+    STATE       = 7
+
+    METHODS = [:get, :set, :exists, :create, :delete, :get_acl, :set_acl,
+               :get_children, :add_auth, :multi, :get_tree, :sync].freeze
+
+    METHOD_CODES = Hash[METHODS.each_with_index.to_a].freeze
+
+    # the keys of completions and events, and of the hashes in them
+    SYMBOLS = [:req_id, :rc, :data, :stat, :string, :strings, :acl, :results,
+               :type, :state, :path, :perms, :id, :scheme].freeze
+
+    SYMBOL_CODES = Hash[SYMBOLS.each_with_index.to_a].freeze
+
+    STAT_FORMAT = 'q>q>q>q>l>l>l>q>l>l>q>'.freeze
+    STAT_SIZE   = 68
+
+    MAX_INT32 = 2**31 - 1
+    MIN_INT32 = -2**31
+
+    module_function
+
+    # body is a binary String, as #encode makes them
+    def frame(type, body = ''.b)
+      [body.bytesize + 1, type].pack('NC') << body
+    end
+
+    def value_frame(type, value)
+      frame(type, encode(value))
+    end
+
+    def call_frame(req_id, meth, args)
+      frame(CALL, encode(args, [req_id, METHOD_CODES.fetch(meth)].pack('q>C')))
+    end
+
+    # a COMPLETION or WATCH, the hash's :req_id is replaced by req_id
+    def event_frame(type, req_id, hash)
+      hash = hash.to_hash.dup
+      hash.delete(:req_id)
+      frame(type, encode(hash, [req_id].pack('q>')))
+    end
+
+    def encode(value, buf = ''.b)
+      case value
+      when nil    then buf << 'n'
+      when true   then buf << 't'
+      when false  then buf << 'f'
+      when Integer
+        if value >= MIN_INT32 and value <= MAX_INT32
+          buf << 'i' << [value].pack('l>')
+        else
+          buf << 'I' << [value].pack('q>')
+        end
+      when String
+        buf << (value.encoding == Encoding::UTF_8 ? 's' : 'b') << [value.bytesize].pack('N') << value.b
+      when Symbol
+        if code = SYMBOL_CODES[value]
+          buf << 'k' << code.chr
+        else
+          name = value.to_s
+          buf << 'y' << [name.bytesize].pack('C') << name.b
+        end
+      when Array
+        buf << 'a' << [value.length].pack('N')
+        value.each { |v| encode(v, buf) }
+        buf
+      when Hash
+        buf << 'h' << [value.size].pack('N')
+        value.each { |k, v| encode(k, buf); encode(v, buf) }
+        buf
+      when Stat
+        value.exists? ? (buf << 'S' << value.to_a.pack(STAT_FORMAT)) : (buf << 'n')
+      when ACLs::ACL
+        buf << 'A' << [value.perms].pack('l>')
+        encode(value.id.scheme, buf)
+        encode(value.id.id, buf)
+      else
+        raise ArgumentError, "can't send a #{value.class}" unless value.respond_to?(:to_hash)
+        encode(value.to_hash, buf)
+      end
+    end
+
+    # reads the values back out of a frame's body
+    class Reader
+      def initialize(buf, pos = 0)
+        @buf = buf
+        @pos = pos
+      end
+
+      def int64
+        take(8).unpack('q>').first
+      end
+
+      def byte
+        take(1).getbyte(0)
+      end
+
+      def value
+        case tag = take(1)
+        when 'n' then nil
+        when 't' then true
+        when 'f' then false
+        when 'i' then take(4).unpack('l>').first
+        when 'I' then int64
+        when 's' then take(take(4).unpack('N').first).force_encoding(Encoding::UTF_8)
+        when 'b' then take(take(4).unpack('N').first)
+        when 'k' then SYMBOLS.fetch(byte)
+        when 'y' then take(byte).to_sym
+        when 'a' then Array.new(take(4).unpack('N').first) { value }
+        when 'h'
+          h = {}
+          take(4).unpack('N').first.times { k = value; h[k] = value }
+          h
+        when 'S' then Stat.new(take(STAT_SIZE).unpack(STAT_FORMAT))
+        when 'A'
+          perms = take(4).unpack('l>').first
+          ACLs::ACL.new(:perms => perms, :id => { :scheme => value, :id => value })
+        else
+          raise Exceptions::ZookeeperException, "bad tag #{tag.inspect} at #{@pos - 1} of a multiplexer frame"
+        end
+      end
+
+      private
+        def take(n)
+          s = @buf.byteslice(@pos, n)
+          raise Exceptions::ZookeeperException, "truncated multiplexer frame" unless s and s.bytesize == n
+          @pos += n
+          s
+        end
+    end
+
+    # one end of the socket: what's been read and not made into frames yet,
+    # and what's waiting to be written
+    class Stream
+      READ_SIZE = 65536
+
+      attr_reader :io
+
+      def initialize(io)
+        @io  = io
+        @in  = ''.b
+        @out = ''.b
+      end
+
+      # reads what's there to be read, false at the end of the stream
+      def read
+        data = @io.read_nonblock(READ_SIZE, exception: false)
+        return false if data.nil?
+        @in << data unless data == :wait_readable
+        true
+      rescue IOError, SystemCallError
+        false
+      end
+
+      # yields the type and a Reader for the body of every complete frame
+      def each_frame
+        pos = 0
+
+        while @in.bytesize - pos >= 4
+          len = @in.byteslice(pos, 4).unpack('N').first
+          break if @in.bytesize - pos - 4 < len
+
+          body = @in.byteslice(pos + 5, len - 1)
+          type = @in.getbyte(pos + 4)
+          pos += 4 + len
+
+          yield type, Reader.new(body)
+        end
+
+        @in = @in.byteslice(pos, @in.bytesize - pos) if pos > 0
+      end
+
+      def <<(frame)
+        @out << frame
+        self
+      end
+
+      # writes what it can of everything queued with #<<, without waiting
+      # for the other end to read, and keeps the rest for the next call.
+      # false if the other end's gone.
+      def flush
+        until @out.empty?
+          n = @io.write_nonblock(@out, exception: false)
+          return true if n == :wait_writable
+          @out = @out.byteslice(n, @out.bytesize - n)
+        end
+
+        true
+      rescue IOError, SystemCallError
+        false
+      end
+
+      # whether there's something #flush couldn't write yet
+      def pending_output?
+        !@out.empty?
+      end
+
+      def close
+        @io.close unless @io.closed?
+      end
+
+      def closed?
+        @io.closed?
+      end
+    end
+  end
+end
+end
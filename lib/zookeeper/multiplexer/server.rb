@@ -0,0 +1,527 @@
+require 'socket'
+
+module Zookeeper
+module Multiplexer
+  # The multiplexer: one CZookeeper session, shared by the workers that
+  # connect to its Unix socket. See Multiplexer.
+  #
+  # Everything happens on the thread that calls #run: accepting workers,
+  # reading their calls and handing them to the session in one batch per
+  # turn of the loop, and sending each completion or watch event back to the
+  # worker whose call it was, under that worker's req_id. The session's
+  # event thread only puts what it has for us in the inbox and wakes the
+  # loop.
+  class Server
+    include Constants
+    include Logger
+
+    DEFAULT_TIMEOUT = 10
+
+    # a worker's call, made on the session with a req_id of ours. it lets
+    # the server know if it couldn't be sent, otherwise its completion comes
+    # as an event like any other.
+    #
+    # @private
+    class Call < Continuation
+      attr_reader :worker, :worker_req_id
+
+      def initialize(server, worker, worker_req_id, meth, *args)
+        @server        = server
+        @worker        = worker
+        @worker_req_id = worker_req_id
+        @reported      = false
+        super(meth, *args)
+      end
+
+      # the rc the worker gets for a call that wasn't sent, nil if it was
+      def failure_rc
+        case @error
+        when nil                        then (@rval and @rval.first != ZOK) ? @rval.first : nil
+        when :shutdown                  then ZCLOSING
+        when ZOO_EXPIRED_SESSION_STATE  then ZSESSIONEXPIRED
+        else ZCONNECTIONLOSS
+        end
+      end
+
+      # the session is the first to look at most of a worker's arguments,
+      # ones it won't take fail the call, not the session's event thread
+      def submit(czk)
+        super
+      rescue StandardError => e
+        logger.warn { "multiplexer: worker #{@worker && @worker.pid.inspect} made a bad #{meth} call: #{e.class}: #{e.message}" }
+        @rval = [ZBADARGUMENTS]
+        deliver!
+      end
+
+      protected
+        def deliver!
+          super
+          report
+        end
+
+        def fail_with(error)
+          super
+          report
+        end
+
+        def report
+          return if @reported or failure_rc.nil?
+          @reported = true
+          @server.inbox.push(self)
+        end
+    end
+
+    # a worker's end of the socket
+    #
+    # @private
+    class Worker < Protocol::Stream
+      attr_accessor :pid
+
+      # the ephemeral nodes it created and nobody has deleted since,
+      # path => true
+      attr_reader :ephemerals
+
+      def initialize(io)
+        super
+        @pid = nil
+        @ephemerals = {}
+      end
+
+      def ready?
+        !@pid.nil?
+      end
+    end
+
+    # the events the session's event thread has for us, and the calls it
+    # couldn't send. the first push after a #take writes to the pipe the
+    # loop selects on.
+    #
+    # @private
+    class Inbox
+      attr_reader :reader
+
+      def initialize
+        @mutex = Mutex.new
+        @items = []
+        @reader, @writer = IO.pipe
+        @wake_pending = false
+      end
+
+      def push(item)
+        push_all([item])
+      end
+
+      def push_all(items)
+        wake = @mutex.synchronize do
+          @items.concat(items)
+          !@wake_pending && (@wake_pending = true)
+        end
+
+        wake! if wake
+      end
+
+      def take
+        @reader.read_nonblock(4096, exception: false)
+
+        @mutex.synchronize do
+          @wake_pending = false
+          @items.slice!(0, @items.length)
+        end
+      end
+
+      # doesn't take the lock, so it can be used from a trap
+      def wake!
+        @writer.write_nonblock('1', exception: false)
+      rescue IOError
+      end
+
+      def close
+        [@reader, @writer].each { |io| io.close unless io.closed? }
+      end
+    end
+
+    attr_reader :host, :path, :inbox
+
+    # host is the connect string of the session, which the workers must
+    # connect with too. path is the socket's. opts:
+    #
+    #   :timeout  seconds to wait for the session to connect (10)
+    #   :mode     the socket's permissions (0600)
+    #
+    # anything else is passed to the CZookeeper.
+    def initialize(host, path, opts = {})
+      opts = opts.dup
+
+      @host     = host
+      @path     = path
+      @timeout  = opts.delete(:timeout) || DEFAULT_TIMEOUT
+      @mode     = opts.delete(:mode) || 0600
+      @czk_opts = opts
+      @chroot   = (i = host.index('/')) ? host[i..-1] : ''
+
+      @inbox    = Inbox.new
+      @workers  = {}      # io => Worker
+      @calls    = {}      # our req_id => Call, until its completion
+      @watches  = {}      # our req_id => Call, while its watch is set
+      @owners   = {}      # ephemeral node's path => the Worker that created it
+      @cleanups = {}      # our req_id => path, of a dropped worker's ephemeral node's exists
+      @req_id   = 0
+
+      @czk      = nil
+      @listener = nil
+      @state    = ZOO_CLOSED_STATE
+      @stopping = false
+
+      @mutex    = Mutex.new
+      @started  = ConditionVariable.new
+
+      @counts   = Hash.new(0)
+    end
+
+    # opens the session and the socket, and serves workers until #stop
+    def run
+      open_session
+      listen
+
+      @mutex.synchronize { @started.broadcast }
+
+      until @stopping
+        writing = @workers.values.select(&:pending_output?).map(&:io)
+        readable, = IO.select([@listener, @inbox.reader] + @workers.keys, writing)
+        calls = []
+
+        readable.each do |io|
+          if io == @listener
+            accept
+          elsif io == @inbox.reader
+            route(@inbox.take)
+          elsif worker = @workers[io]
+            serve(worker, calls)
+          end
+        end
+
+        @czk.submit_all(calls) unless calls.empty?
+        flush
+      end
+    ensure
+      shut_down
+      @mutex.synchronize { @started.broadcast }    # #start needn't wait any longer
+    end
+
+    # #run in a new thread, returns once the socket is listening
+    def start
+      @mutex.synchronize do
+        @thread = Thread.new { Thread.current.report_on_exception = false; run }
+        @started.wait(@mutex, @timeout) until @listener or !@thread.alive?
+      end
+
+      @thread.join unless @listener    # raises what #run raised
+      self
+    end
+
+    # waits for the thread #start started to return, raises what #run raised
+    def join
+      @thread.join if @thread
+      self
+    end
+
+    # has #run return. safe to call from a trap.
+    def stop
+      @stopping = true
+      @inbox.wake!
+      @thread.join if @thread and @thread != Thread.current
+    end
+
+    # +:workers+ connected, the +:calls+ they made, +:completions+ and
+    # +:watch_events+ sent to them, +:refused+ workers, how many times the
+    # session was +:reopened+ after it expired, and its +:state+ and
+    # +:session_id+
+    def stats
+      { :workers      => @workers.size,
+        :calls        => @counts[:calls],
+        :completions  => @counts[:completions],
+        :watch_events => @counts[:watch_events],
+        :refused      => @counts[:refused],
+        :reopened     => @counts[:reopened],
+        :state        => @state,
+        :session_id   => session_id }
+    end
+
+    private
+      def open_session
+        @czk = CZookeeper.new(@host, @inbox, @czk_opts)
+        @czk.wait_until_connected(@timeout)
+        @state = @czk.state
+      end
+
+      def session_id
+        cid = @czk && @czk.client_id and cid.session_id
+      end
+
+      def listen
+        if File.socket?(@path)
+          begin
+            UNIXSocket.new(@path).close
+            raise Exceptions::ZookeeperException, "a multiplexer is already listening on #{@path}"
+          rescue Errno::ECONNREFUSED, Errno::ENOENT
+            File.unlink(@path) rescue nil
+          end
+        end
+
+        @listener = UNIXServer.new(@path)
+        File.chmod(@mode, @path)
+      end
+
+      def accept
+        io = @listener.accept_nonblock(exception: false)
+        @workers[io] = Worker.new(io) unless io == :wait_readable
+      end
+
+      # the frames a worker sent, its calls are added to calls. a worker
+      # that sends something we can't make sense of is dropped, the others
+      # and the session carry on.
+      def serve(worker, calls)
+        eof = !worker.read
+
+        worker.each_frame do |type, body|
+          case type
+          when Protocol::HELLO
+            hello(worker, body.value)
+          when Protocol::CALL
+            next drop(worker) unless worker.ready?
+            call(worker, body, calls)
+          else
+            logger.warn { "multiplexer: unexpected frame type #{type} from worker #{worker.pid.inspect}" }
+          end
+        end
+
+        drop(worker) if eof
+      rescue StandardError => e
+        logger.error { "multiplexer: dropping worker #{worker.pid.inspect}, it sent something bad: #{e.class}: #{e.message}" }
+        drop(worker)
+      end
+
+      def hello(worker, msg)
+        version, pid, host = msg
+
+        why = if version != Protocol::VERSION
+          "protocol version #{version.inspect}, the multiplexer speaks #{Protocol::VERSION}"
+        elsif host != @host
+          "host #{host.inspect}, the multiplexer's session is to #{@host.inspect}"
+        end
+
+        if why
+          @counts[:refused] += 1
+          worker << Protocol.value_frame(Protocol::REFUSED, why)
+          worker.flush
+          return drop(worker)
+        end
+
+        worker.pid = pid
+        cid = @czk.client_id
+        worker << Protocol.value_frame(Protocol::WELCOME, [@state, cid && cid.session_id, cid && cid.passwd, connected_host])
+      end
+
+      def call(worker, body, calls)
+        worker_req_id = body.int64
+        meth = Protocol::METHODS.fetch(body.byte)
+        args = body.value
+
+        unless args.kind_of?(Array)
+          raise Exceptions::ZookeeperException, "the arguments of a #{meth} call are a #{args.class}, not an Array"
+        end
+
+        req_id = (@req_id += 1)
+        @counts[:calls] += 1
+
+        if meth == :sync
+          cntn = @calls[req_id] = Call.new(self, worker, worker_req_id, :sync, req_id, *args)
+          rc = @czk.sync(req_id, *args) rescue ZCLOSING
+          fail_call(cntn, rc) unless rc == ZOK
+          return
+        end
+
+        args[Continuation::CALLBACK_ARG_IDX.fetch(meth) - 1] = true   # we always get the completion
+        calls << (@calls[req_id] = Call.new(self, worker, worker_req_id, meth, req_id, *args))
+      end
+
+      # what the session's event thread put in the inbox
+      def route(items)
+        items.each do |item|
+          if item.kind_of?(Call)
+            fail_call(item, item.failure_rc) if @calls.has_key?(item.req_id)
+          elsif item[:req_id] == ZKRB_GLOBAL_CB_REQ and item[:type] == ZOO_SESSION_EVENT
+            state_changed(item[:state])
+          elsif item.has_key?(:rc)
+            complete(item)
+          else
+            fire(item)
+          end
+        end
+      end
+
+      def complete(hash)
+        return unless cntn = @calls.delete(hash[:req_id])
+
+        if path = @cleanups.delete(cntn.req_id)
+          return ephemeral_checked(path, hash)
+        end
+
+        worker = cntn.worker
+
+        track_ephemerals(cntn, hash) if hash[:rc] == ZOK and worker
+        return if worker.nil? or worker.closed?
+
+        @watches[cntn.req_id] = cntn if cntn.watch? and watch_set?(cntn.meth, hash[:rc])
+
+        @counts[:completions] += 1
+        worker << Protocol.event_frame(Protocol::COMPLETION, cntn.worker_req_id, hash)
+      end
+
+      def fail_call(cntn, rc)
+        @calls.delete(cntn.req_id)
+        @cleanups.delete(cntn.req_id)
+        return if cntn.worker.nil? or cntn.worker.closed?
+
+        @counts[:completions] += 1
+        cntn.worker << Protocol.event_frame(Protocol::COMPLETION, cntn.worker_req_id, :rc => rc)
+      end
+
+      # session events don't use a watch up, unless the session expired
+      def fire(hash)
+        req_id = hash[:req_id]
+
+        cntn = if hash[:type] == ZOO_SESSION_EVENT and hash[:state] != ZOO_EXPIRED_SESSION_STATE
+          @watches[req_id]
+        else
+          @watches.delete(req_id)
+        end
+
+        return if cntn.nil? or cntn.worker.closed?
+
+        @counts[:watch_events] += 1
+        cntn.worker << Protocol.event_frame(Protocol::WATCH, cntn.worker_req_id, hash)
+      end
+
+      def state_changed(state)
+        @state = state
+        frame = Protocol.value_frame(Protocol::STATE, [state, session_id, connected_host])
+        @workers.each_value { |w| w << frame if w.ready? }
+
+        reopen_session if state == ZOO_EXPIRED_SESSION_STATE
+      end
+
+      # the workers have been told the session expired, they go with it and
+      # reconnect (see Connection) to the new one
+      def reopen_session
+        flush
+        @workers.values.each { |w| drop(w) }
+        @calls.clear
+        @watches.clear
+        @owners.clear
+        @cleanups.clear
+
+        @czk.close rescue nil
+        @counts[:reopened] += 1
+        open_session
+      end
+
+      # an ephemeral node goes when the worker that created it does, as it
+      # would have with a session of its own
+      def track_ephemerals(cntn, hash)
+        worker = cntn.worker
+
+        case cntn.meth
+        when :create
+          ephemeral_created(worker, unchroot(hash[:string])) if cntn.args[5].to_i & ZOO_EPHEMERAL != 0
+        when :delete
+          ephemeral_deleted(cntn.args[1])
+        when :multi
+          cntn.args[1].zip(hash[:results] || []) do |(type, path, _, _, flags), result|
+            if type == ZOO_CREATE_OP and flags.to_i & ZOO_EPHEMERAL != 0
+              ephemeral_created(worker, unchroot(result[:path]))
+            elsif type == ZOO_DELETE_OP
+              ephemeral_deleted(path)
+            end
+          end
+        end
+
+        delete_ephemerals(worker) if worker.closed?
+      end
+
+      # the node at path is worker's, whichever worker's was there before
+      # has been deleted since
+      def ephemeral_created(worker, path)
+        ephemeral_deleted(path)
+        @owners[path] = worker
+        worker.ephemerals[path] = true
+      end
+
+      def ephemeral_deleted(path)
+        owner = @owners.delete(path) and owner.ephemerals.delete(path)
+      end
+
+      # the node may have been deleted and created again by someone else
+      # since the worker created it, and create doesn't tell us its stat to
+      # check the delete with. so each one's stat is read first, see
+      # #ephemeral_checked.
+      def delete_ephemerals(worker)
+        return if worker.ephemerals.empty?
+
+        checks = worker.ephemerals.keys.map do |path|
+          @owners.delete(path) if @owners[path] == worker
+
+          req_id = (@req_id += 1)
+          @cleanups[req_id] = path
+          @calls[req_id] = Call.new(self, nil, nil, :exists, req_id, path, true, nil)
+        end
+
+        worker.ephemerals.clear
+        @czk.submit_all(checks)
+      end
+
+      # deletes a dropped worker's ephemeral node, at the version it has
+      # now, if it's still one of the session's and no other worker has
+      # created it since
+      def ephemeral_checked(path, hash)
+        stat = hash[:stat]
+        return unless hash[:rc] == ZOK and stat and stat.ephemeral_owner == session_id
+        return if @owners.has_key?(path)
+
+        @czk.submit_all([Call.new(self, nil, nil, :delete, (@req_id += 1), path, stat.version, true)])
+      end
+
+      def drop(worker)
+        @workers.delete(worker.io)
+        worker.close
+        @watches.delete_if { |_, cntn| cntn.worker == worker }
+        delete_ephemerals(worker)
+      end
+
+      def flush
+        @workers.values.each { |w| drop(w) unless w.flush }
+      end
+
+      def unchroot(path)
+        (path and !@chroot.empty? and path.start_with?(@chroot)) ? (path[@chroot.length..-1].sub(/\A(?!\/)/, '/')) : path
+      end
+
+      def connected_host
+        @czk.connected_host rescue nil
+      end
+
+      def shut_down
+        @workers.values.each { |w| w.close }
+        @workers.clear
+
+        if @listener
+          @listener.close unless @listener.closed?
+          File.unlink(@path) rescue nil
+        end
+
+        @czk.close if @czk
+        @inbox.close
+      end
+  end
+end
+end
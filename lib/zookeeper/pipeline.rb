@@ -0,0 +1,124 @@
+module Zookeeper
+  # Queues up synchronous-style requests so they're sent together and their
+  # round trips overlap, instead of each caller paying one full round trip
+  # per call. See {ClientMethods#pipeline}.
+  #
+  # The op methods take the same options as their ClientMethods counterparts
+  # and return a {Future} for what that method would have returned:
+  #
+  #   get, children = zk.pipeline do |p|
+  #     p.get(:path => '/config')
+  #     p.get_children(:path => '/workers')
+  #   end
+  #
+  #   pipeline = zk.pipeline
+  #   futures = paths.map { |path| pipeline.stat(:path => path) }
+  #   pipeline.flush!
+  #   Zookeeper::Future.wait_all(futures)
+  #
+  # Nothing is sent until #flush! is called or one of the futures is asked for
+  # its value, at which point everything queued so far goes to the event
+  # thread in one batch (one wakeup).
+  #
+  # Each op is run as the plain sync call inside its own Fiber, which is
+  # parked when it's about to hand its request to the event thread and
+  # resumed when its value is wanted, so argument checks, chroot handling and
+  # the shape of the results are exactly those of the sync calls. Ops whose
+  # arguments are rejected return a future that raises. The JRuby driver
+  # doesn't go through the event thread, there each op runs when it's queued,
+  # which is correct but doesn't overlap anything.
+  #
+  # A pipeline belongs to the thread that created it.
+  class Pipeline
+    OPS = [:get, :set, :stat, :get_children, :create, :delete, :get_acl, :set_acl, :multi].freeze
+
+    # returned by a parked op's fiber
+    DEFERRED = Object.new.freeze
+
+    # the pipeline the current op fiber belongs to, if any
+    #
+    # @private
+    def self.current
+      Thread.current[:zookeeper_pipeline]
+    end
+
+    def initialize(zk)
+      @zk      = zk
+      @futures = []
+      @queued  = []
+    end
+
+    OPS.each do |op|
+      class_eval <<-EOS, __FILE__, __LINE__ + 1
+        def #{op}(options = {}, &block)
+          enqueue(:#{op}, options, block)
+        end
+      EOS
+    end
+
+    # the futures of all the ops queued so far, in order
+    def futures
+      @futures.dup
+    end
+
+    def size
+      @futures.size
+    end
+    alias length size
+
+    # sends everything that's been queued and not sent yet
+    def flush!
+      queued, @queued = @queued, []
+
+      queued.group_by { |czk, _| czk }.each do |czk, pairs|
+        czk.submit_all(pairs.map { |_, cntn| cntn })
+      end
+
+      nil
+    end
+
+    # sends anything still queued, then waits for every op and returns their
+    # values, in order
+    def wait_all
+      flush!
+      Future.wait_all(@futures)
+    end
+
+    # called by the driver in place of submitting cntn itself, parks the op
+    # until the pipeline has sent it
+    #
+    # @private
+    def defer(czk, cntn)
+      @queued << [czk, cntn]
+      Fiber.yield(DEFERRED)
+    end
+
+    private
+      def enqueue(op, options, block)
+        future = start(op, options, block)
+        @futures << future
+        future
+      end
+
+      # runs the op up to the point where it's parked, returns its future
+      def start(op, options, block)
+        fiber = Fiber.new do
+          Thread.current[:zookeeper_pipeline] = self
+          @zk.__send__(op, options, &block)
+        end
+
+        rv = begin
+          fiber.resume
+        rescue StandardError => e
+          return Future.new { raise e }
+        end
+
+        return Future.new { rv } unless rv.equal?(DEFERRED)
+
+        Future.new do
+          flush!
+          fiber.resume
+        end
+      end
+  end
+end
@@ -0,0 +1,271 @@
+module Zookeeper
+  # Several sessions to one ensemble, used like a single client, for
+  # workloads that read more than one session's connection and threads can
+  # keep up with.
+  #
+  # The first member is the primary. It connects with the whole connect
+  # string, and every call that changes something, sets a watch, or needs
+  # the order of its session goes to it: writes, multi, sync, pipeline,
+  # the tree methods that write, and reads given a :watcher. Reads without
+  # one go to whichever connected member has the fewest requests
+  # outstanding. With :pin_hosts (the default) each of the other members
+  # is given one host of the connect string, in turn, so reads are spread
+  # over the servers and not just over the sessions.
+  #
+  # A read that fails for want of a connection is tried once more on
+  # another member, if one is connected. A member other than the primary
+  # whose session expired is reopened in the background. The primary is
+  # left to the caller, as with a single client, since its watches go with
+  # its session.
+  #
+  # Sessions see each other's writes in the order they were made, but not
+  # necessarily at once: a read that has to see a write just made through
+  # the pool should be made on #primary, or after a #sync.
+  #
+  #   pool = Zookeeper::Pool.new('zk1:2181,zk2:2181,zk3:2181', :size => 4)
+  #   pool.get(:path => '/config')      # on the least busy member
+  #   pool.set(:path => '/config', :data => 'x')    # on the primary
+  #
+  class Pool
+    include Constants
+
+    # the calls that may go to any member, unless they set a watch
+    READS = [:get, :stat, :get_children, :get_acl, :get_tree, :export_tree].freeze
+
+    # the calls that go to the primary
+    PRIMARY = [:set, :create, :delete, :multi, :sync, :set_acl, :pipeline, :bulk_load, :delete_tree].freeze
+
+    # the rcs of a read worth trying on another member
+    RETRY_RCS = [ZCONNECTIONLOSS, ZOPERATIONTIMEOUT, ZSESSIONEXPIRED, ZINVALIDSTATE, ZCLOSING].freeze
+
+    DEFAULT_TIMEOUT = 10
+
+    class Member
+      include Constants
+      include Logger
+
+      attr_reader :index, :host, :client, :reads
+
+      def initialize(index, host, client)
+        @index   = index
+        @host    = host
+        @client  = client
+        @mutex   = Mutex.new
+        @calls   = 0    # in progress here, for clients without request_stats
+        @reads   = @writes = @errors = @reopens = 0
+        @reopening = nil
+      end
+
+      def primary?
+        @index == 0
+      end
+
+      def healthy?
+        !@reopening and @client.connected?
+      rescue Zookeeper::Exceptions::ZookeeperException
+        false
+      end
+
+      def expired?
+        !@reopening and @client.state == ZOO_EXPIRED_SESSION_STATE
+      rescue Zookeeper::Exceptions::ZookeeperException
+        false
+      end
+
+      # the number of requests waiting to be sent or answered
+      def load
+        @client.request_stats[:outstanding] || @calls
+      end
+
+      # runs the client's meth, keeping count
+      def call(meth, kind, args, &block)
+        @mutex.synchronize { @calls += 1 }
+
+        begin
+          rv = @client.__send__(meth, *args, &block)
+          count(kind, rv.kind_of?(Hash) && RETRY_RCS.include?(rv[:rc]))
+          rv
+        rescue Zookeeper::Exceptions::NotConnected, Zookeeper::Exceptions::ContinuationTimeoutError
+          count(kind, true)
+          raise
+        ensure
+          @mutex.synchronize { @calls -= 1 }
+        end
+      end
+
+      # reopens the session in the background, if it isn't already
+      def reopen!(timeout)
+        @mutex.synchronize do
+          return if @reopening
+          @reopens += 1
+          @reopening = Thread.new do
+            begin
+              @client.reopen(timeout)
+            rescue StandardError => e
+              logger.warn { "reopening pool member #{@index} failed: #{e.class}: #{e.message}" }
+            ensure
+              @mutex.synchronize { @reopening = nil }
+            end
+          end
+        end
+      end
+
+      def stats
+        connected = healthy?
+
+        { :index       => @index,
+          :host        => @host,
+          :primary     => primary?,
+          :connected   => connected,
+          :session_id  => (@client.session_id rescue nil),
+          :outstanding => (load rescue 0),
+          :reads       => @reads,
+          :writes      => @writes,
+          :errors      => @errors,
+          :reopens     => @reopens }
+      end
+
+      private
+        def count(kind, error)
+          @mutex.synchronize do
+            kind == :read ? @reads += 1 : @writes += 1
+            @errors += 1 if error
+          end
+        end
+    end
+
+    attr_reader :members
+
+    # host is a connect string, as for Zookeeper.new. opts:
+    #
+    #   :size       the number of sessions (3)
+    #   :timeout    their session timeout (10)
+    #   :watcher    the global watcher, for the primary only
+    #   :pin_hosts  give each member but the primary one host (true)
+    #
+    # anything else is passed on to each Client.
+    def initialize(host, opts = {})
+      opts     = opts.dup
+      size     = opts.delete(:size) || 3
+      @timeout = opts.delete(:timeout) || DEFAULT_TIMEOUT
+      watcher  = opts.delete(:watcher)
+      pin      = opts.has_key?(:pin_hosts) ? opts.delete(:pin_hosts) : true
+
+      unless size.kind_of?(Integer) and size > 0
+        raise Zookeeper::Exceptions::BadArguments, ":size must be a positive Integer, not #{size.inspect}"
+      end
+
+      servers, chroot = host.split('/', 2)
+      servers = servers.split(',')
+      chroot  = chroot ? "/#{chroot}" : ''
+
+      @members = []
+      size.times do |i|
+        member_host = (i == 0 or !pin) ? host : servers[(i - 1) % servers.length] + chroot
+        @members << Member.new(i, member_host, new_client(member_host, @timeout, i == 0 ? watcher : nil, opts))
+      end
+    rescue Exception
+      @members.each { |m| m.client.close rescue nil } if @members
+      raise
+    end
+
+    # the member that gets the writes and watches
+    def primary
+      @members.first.client
+    end
+
+    READS.each do |meth|
+      class_eval <<-EOS, __FILE__, __LINE__ + 1
+        def #{meth}(options = {}, &block)
+          read(:#{meth}, options, &block)
+        end
+      EOS
+    end
+
+    PRIMARY.each do |meth|
+      class_eval <<-EOS, __FILE__, __LINE__ + 1
+        def #{meth}(*args, &block)
+          @members.first.call(:#{meth}, :write, args, &block)
+        end
+      EOS
+    end
+
+    # every session needs the credentials, the primary's result is returned
+    def add_auth(options = {})
+      @members.map { |m| m.call(:add_auth, :write, [options]) }.first
+    end
+
+    # the primary's, the session the pool's watches and ephemeral nodes
+    # belong to
+    def session_id
+      primary.session_id
+    end
+
+    def session_passwd
+      primary.session_passwd
+    end
+
+    def connected?
+      primary.connected?
+    end
+
+    # true on any member's event dispatch thread, callbacks run on the
+    # member the call went to
+    def event_dispatch_thread?
+      @members.any? { |m| m.client.event_dispatch_thread? }
+    end
+
+    def closed?
+      @members.all? { |m| m.client.closed? }
+    end
+
+    def close
+      @members.each { |m| m.client.close }
+    end
+
+    # each member's :host, :connected, :session_id, :outstanding requests,
+    # and the :reads, :writes and :errors (calls that failed for want of a
+    # connection) it had, and how many times it was reopened
+    def stats
+      @members.map(&:stats)
+    end
+
+    protected
+      def new_client(host, timeout, watcher, opts)
+        Zookeeper::Client.new(host, timeout, watcher, opts)
+      end
+
+    private
+      def read(meth, options, &block)
+        return @members.first.call(meth, :read, [options], &block) if options[:watcher]
+
+        member = pick
+        return member.call(meth, :read, [options], &block) if options[:callback] or block
+
+        begin
+          rv = member.call(meth, :read, [options])
+        rescue Zookeeper::Exceptions::NotConnected, Zookeeper::Exceptions::ContinuationTimeoutError
+          other = pick(member)
+          raise if other == member
+          return other.call(meth, :read, [options])
+        end
+
+        return rv unless RETRY_RCS.include?(rv[:rc])
+
+        other = pick(member)
+        other == member ? rv : other.call(meth, :read, [options])
+      end
+
+      # the connected member with the least outstanding, other than
+      # excluded if there's another. the primary if none is connected. ties
+      # go to the one that has done fewer reads, the primary last.
+      def pick(excluded = nil)
+        @members.each { |m| m.reopen!(@timeout) if !m.primary? and m.expired? }
+
+        candidates = @members.select { |m| m != excluded and m.healthy? }
+        return (excluded || @members.first) if candidates.empty?
+
+        candidates.min_by { |m| [m.load, m.primary? ? 1 : 0, m.reads] }
+      end
+  end
+end
@@ -0,0 +1,240 @@
+module Zookeeper
+  # @private
+  #
+  # The results of sync get, stat and get_children calls, kept until a watch
+  # says they've changed. See ClientMethods#read_cache_stats.
+  #
+  # Every result has a stat, which changes with the node's data and with its
+  # children, so a result is only kept once both the data watch and the
+  # child watch are set on its path (just the data watch if the node doesn't
+  # exist, that one fires when it's created). A read that misses is sent
+  # with the cache's watch set unless an earlier one is still set, and the
+  # caller sends a read that sets the other watch, if that's missing, ahead
+  # of it (see ClientMethods#cached_read). Any watch event for a path drops
+  # everything kept for it, as does a write made through the same client,
+  # once it's done.
+  #
+  # Everything kept is dropped when the connection drops, since the results
+  # may be out of date by the time it's back. The watches are remembered
+  # though, the client sets them again when it reconnects and the server
+  # fires the ones that missed something. When the session is lost they're
+  # gone too.
+  #
+  # A response that was already on its way when its path was invalidated is
+  # not kept: #begin_fetch hands out a token that the invalidation takes
+  # away, and #store wants it back.
+  #
+  # Entries are evicted least recently used first, once there are more than
+  # :max_entries of them or they add up to more than :max_bytes (data, child
+  # names and path, plus ENTRY_OVERHEAD each).
+  #
+  # Thread safe, the callers store and look up, the dispatch thread
+  # invalidates.
+  class ReadCache
+    include Constants
+
+    DEFAULT_MAX_ENTRIES = 1024
+    DEFAULT_MAX_BYTES   = 16 * 1024 * 1024
+
+    # rough size of an entry's hash, stat and bookkeeping
+    ENTRY_OVERHEAD = 200
+
+    # every key a path may be kept under: [meth, path, packed?]
+    KINDS = [[:get, false], [:stat, false], [:get_children, false], [:get_children, true]].freeze
+
+    WATCHES = [:data, :child].freeze
+
+    # the watch each read sets
+    WATCH_OF = { :get => :data, :stat => :data, :get_children => :child }.freeze
+
+    # the read that sets each watch for a path that may not exist
+    WATCH_READS = { :data => :stat, :child => :get_children }.freeze
+
+    # the watches each watch event has used up
+    FIRED = {
+      ZOO_CREATED_EVENT => [:data],
+      ZOO_CHANGED_EVENT => [:data],
+      ZOO_CHILD_EVENT   => [:child],
+    }.freeze
+
+    # the cache's watcher, there's nothing left for it to do by the time it's
+    # called (see Common#dispatch_next_callback)
+    WATCHER = proc { |_| }
+
+    attr_reader :max_entries, :max_bytes
+
+    # opts is true for the defaults, or a Hash with :max_entries and/or
+    # :max_bytes
+    def initialize(opts = {})
+      opts = {} unless opts.kind_of?(Hash)
+
+      @max_entries = opts.fetch(:max_entries, DEFAULT_MAX_ENTRIES)
+      @max_bytes   = opts.fetch(:max_bytes, DEFAULT_MAX_BYTES)
+
+      [[:max_entries, @max_entries], [:max_bytes, @max_bytes]].each do |name, v|
+        unless v.kind_of?(Integer) and v > 0
+          raise ArgumentError, ":read_cache #{name.inspect} must be a positive Integer, not #{v.inspect}"
+        end
+      end
+
+      @mutex    = Mutex.new
+      @entries  = {}    # key => [rv, bytes], least recently used first
+      @bytes    = 0
+      @watched  = {}    # [path, watch] => true while the cache's watch is set
+      @fetching = {}    # key => token of the reads that may still store it
+
+      @hits = @misses = @invalidations = @evictions = @flushes = 0
+    end
+
+    def watcher
+      WATCHER
+    end
+
+    # a copy of the result kept for key, nil if there isn't one
+    def lookup(key)
+      @mutex.synchronize do
+        unless entry = @entries.delete(key)
+          @misses += 1
+          return nil
+        end
+
+        @entries[key] = entry
+        @hits += 1
+        copy(entry.first)
+      end
+    end
+
+    # a read for key is about to be sent: returns the token #store wants,
+    # and the watches (of WATCHES) that aren't set on key's path
+    def begin_fetch(key)
+      @mutex.synchronize do
+        [(@fetching[key] ||= Object.new), WATCHES.reject { |w| @watched[[key[1], w]] }]
+      end
+    end
+
+    # keeps the result of a read started with #begin_fetch, if the watches
+    # it needs are set and nothing has invalidated key since. reads are the
+    # [meth, rc] of the reads that were sent with the cache's watch.
+    def store(key, token, reads, rv)
+      path = key[1]
+
+      @mutex.synchronize do
+        return false unless token.equal?(@fetching[key])
+        @fetching.delete(key)
+
+        reads.each do |meth, rc|
+          @watched[[path, WATCH_OF[meth]]] = true if watch_set?(meth, rc)
+        end
+
+        return false unless watch_set?(key.first, rv[:rc])
+
+        needs = rv[:rc] == ZNONODE ? [:data] : WATCHES
+        return false unless needs.all? { |w| @watched[[path, w]] }
+
+        bytes = entry_size(key, rv)
+        return false if bytes > @max_bytes
+
+        if old = @entries.delete(key)
+          @bytes -= old.last
+        end
+
+        @entries[key] = [rv.reject { |k, _| k == :req_id }, bytes]
+        @bytes += bytes
+
+        evict
+        true
+      end
+    end
+
+    # drops everything kept for path, and has the reads already sent for it
+    # not keep their results. fired are the watches that are no longer set.
+    def invalidate(path, fired = WATCHES)
+      @mutex.synchronize do
+        fired.each { |w| @watched.delete([path, w]) }
+
+        KINDS.each do |meth, packed|
+          key = [meth, path, packed]
+
+          @fetching.delete(key)
+
+          if entry = @entries.delete(key)
+            @bytes -= entry.last
+            @invalidations += 1
+          end
+        end
+      end
+    end
+
+    # called with every watch event: drops what was kept for the event's
+    # path, or everything if the connection isn't usable anymore
+    def event(hash)
+      if hash[:type] == ZOO_SESSION_EVENT
+        case hash[:state]
+        when ZOO_CONNECTED_STATE
+        when ZOO_CONNECTING_STATE, ZOO_ASSOCIATING_STATE
+          flush(true)
+        else
+          flush
+        end
+      elsif hash[:path]
+        invalidate(hash[:path], FIRED.fetch(hash[:type], WATCHES))
+      end
+    end
+
+    # drops everything, and forgets the watches unless keep_watches
+    def flush(keep_watches = false)
+      @mutex.synchronize do
+        return if @entries.empty? and @fetching.empty? and (keep_watches or @watched.empty?)
+
+        @entries.clear
+        @watched.clear unless keep_watches
+        @fetching.clear
+        @bytes = 0
+        @flushes += 1
+      end
+    end
+
+    def stats
+      @mutex.synchronize do
+        { :entries       => @entries.size,
+          :bytes         => @bytes,
+          :max_entries   => @max_entries,
+          :max_bytes     => @max_bytes,
+          :hits          => @hits,
+          :misses        => @misses,
+          :invalidations => @invalidations,
+          :evictions     => @evictions,
+          :flushes       => @flushes }
+      end
+    end
+
+    private
+      # must hold @mutex
+      def evict
+        while @entries.size > @max_entries or @bytes > @max_bytes
+          _, entry = @entries.shift
+          @bytes -= entry.last
+          @evictions += 1
+        end
+      end
+
+      def entry_size(key, rv)
+        bytes = ENTRY_OVERHEAD + key[1].bytesize
+        bytes += rv[:data].bytesize if rv[:data]
+        rv[:children].each { |c| bytes += c.bytesize } if rv[:children]
+        bytes
+      end
+
+      # callers get their own strings, they may modify them. a packed
+      # Zookeeper::Children is read-only, it's shared
+      def copy(rv)
+        rv.each_with_object({}) do |(k, v), h|
+          h[k] = case v
+                 when String then v.dup
+                 when Array  then v.map { |s| s.kind_of?(String) ? s.dup : s }
+                 else v
+                 end
+        end
+      end
+  end
+end
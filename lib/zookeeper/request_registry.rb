@@ -64,6 +64,17 @@ module Zookeeper
       path[@chroot_path.length..-1]
     end
 
+    # same as strip_chroot_from, for the paths of the creates in a multi's
+    # results
+    def strip_chroot_from_results(results)
+      return results unless chrooted? and results
+
+      results.map do |r|
+        h = r.to_hash
+        h[:path] ? h.merge(:path => strip_chroot_from(h[:path])) : r
+      end
+    end
+
     private
       def get_completion(req_id, opts={})
         @mutex.synchronize do
@@ -126,7 +137,14 @@ module Zookeeper
       #       added to the callback hash
       #
       def maybe_wrap_callback(meth_name, cb)
-        return cb unless cb and chrooted? and (meth_name == :create)
+        return cb unless cb and chrooted? and [:create, :multi].include?(meth_name)
+
+        if meth_name == :multi
+          return lambda do |hash|
+            hash[:results] = Multi::Result.from(strip_chroot_from_results(hash[:results]))
+            cb.call(hash)
+          end
+        end
 
         lambda do |hash|
           # in this case the string will be the absolute zookeeper path (i.e.
@@ -0,0 +1,219 @@
+module Zookeeper
+  # A subtree as ClientMethods#export_tree wrote it to a file, answering
+  # #get, #stat and #get_children without a connection.
+  #
+  # The file is read with one read, and only the index is decoded up front:
+  # each lookup is a binary search of it for the record's offset, and only
+  # the fields asked for are unpacked from the record. The keys compared
+  # along the way are kept for the next search.
+  #
+  # The layout, all integers big-endian:
+  #
+  #   header   "ZKRBSNAP", u32 version, u32 count, u64 index offset,
+  #            i64 highest mzxid, u32 root length, root, padding to 8
+  #   records  i32 path length, i32 data length (-1 for nil),
+  #            the 11 Stat fields (68 bytes), path, data, padding to 8
+  #   index    u64 record offset for each node, ordered by parent path,
+  #            then name, so a node's children are next to each other
+  #            (comparing paths with the last "/" made a "\0" orders them
+  #            that way)
+  #
+  # Everything is 8-byte aligned, so the file can be mapped and read in
+  # place by a reader that can do that.
+  class Snapshot
+    include Constants
+
+    MAGIC   = "ZKRBSNAP".force_encoding('BINARY').freeze
+    VERSION = 1
+
+    HEADER_FORMAT = 'a8NNQ>q>N'.freeze
+    HEADER_SIZE   = 36    # before the root
+
+    STAT_FORMAT   = 'q>q>q>q>l>l>l>q>l>l>q>'.freeze
+    RECORD_FORMAT = "l>l>#{STAT_FORMAT}".freeze
+    RECORD_SIZE   = 76    # before the path and data
+
+    MZXID_OFFSET  = 16    # in the record
+
+    # write the nodes, [path, data, Stat] for each one under root (and root
+    # itself), to io. returns the number of bytes written.
+    def self.write(io, root, nodes)
+      nodes = nodes.sort_by { |path, _, _| key(path) }
+      zxid  = nodes.map { |_, _, stat| stat.mzxid }.max || 0
+
+      header = [MAGIC, VERSION, nodes.length, 0, zxid, root.bytesize].pack(HEADER_FORMAT) + binary(root)
+      header << padding(header.bytesize)
+
+      offsets = []
+      pos = header.bytesize
+      records = nodes.map do |path, data, stat|
+        offsets << pos
+        record = [path.bytesize, data ? data.bytesize : -1, *stat.to_a].pack(RECORD_FORMAT)
+        record << binary(path) << binary(data.to_s)
+        record << padding(record.bytesize)
+        pos += record.bytesize
+        record
+      end
+
+      header[16, 8] = [pos].pack('Q>')
+
+      io.write(header)
+      records.each { |record| io.write(record) }
+      io.write(offsets.pack('Q>*'))
+
+      pos + 8 * offsets.length
+    end
+
+    # read the snapshot in file (a path or an IO)
+    def self.load(file)
+      buf = file.respond_to?(:read) ? file.read : File.open(file, 'rb') { |f| f.read }
+      new(buf)
+    end
+
+    # what the index is ordered by: "/a/b" is "/a\0b", "/a" is "\0a" and
+    # "/" is ""
+    #
+    # @private
+    def self.key(path)
+      return '' if path == '/'
+
+      key = path.dup.force_encoding(Encoding::BINARY)
+      key[key.rindex('/')] = "\0"
+      key
+    end
+
+    # @private
+    def self.binary(str)
+      str.encoding == Encoding::BINARY ? str : str.dup.force_encoding(Encoding::BINARY)
+    end
+
+    # @private
+    def self.padding(len)
+      "\0" * (-len % 8)
+    end
+
+    # the path the snapshot was taken of
+    attr_reader :root
+
+    # the number of nodes
+    attr_reader :size
+    alias length size
+
+    # the highest mzxid of any node, nodes changed since have a higher one
+    attr_reader :zxid
+
+    def initialize(buf)
+      @buf = self.class.binary(buf)
+
+      magic, version, @size, @index, @zxid, root_len = @buf.byteslice(0, HEADER_SIZE).to_s.unpack(HEADER_FORMAT)
+
+      unless magic == MAGIC and version == VERSION and @index + 8 * @size == @buf.bytesize
+        raise Zookeeper::Exceptions::ZookeeperException, "not a snapshot, or a corrupt one"
+      end
+
+      @root    = @buf.byteslice(HEADER_SIZE, root_len)
+      @offsets = @buf.byteslice(@index, 8 * @size).unpack('Q>*')
+      @keys    = Array.new(@size)
+    end
+
+    def get(options = {})
+      return { :rc => ZNONODE } unless i = find(path_of(options))
+
+      { :rc => ZOK, :data => data_at(i), :stat => stat_at(i) }
+    end
+
+    def stat(options = {})
+      i = find(path_of(options))
+      { :rc => i ? ZOK : ZNONODE, :stat => i ? stat_at(i) : Stat.new(nil) }
+    end
+
+    def get_children(options = {})
+      path = path_of(options)
+      return { :rc => ZNONODE } unless i = find(path)
+
+      prefix = (path == '/' ? '' : self.class.binary(path)) + "\0"
+      first = bsearch { |j| key_at(j) >= prefix }
+      children = []
+      (first...@size).each do |j|
+        key = key_at(j)
+        break unless key.start_with?(prefix)
+        children << key.byteslice(prefix.bytesize, key.bytesize)
+      end
+
+      { :rc => ZOK, :children => children, :stat => stat_at(i) }
+    end
+
+    # the mzxid path had when the snapshot was taken, nil if it wasn't there
+    def mzxid(path)
+      i = find(path) and @buf.byteslice(offset(i) + MZXID_OFFSET, 8).unpack('q>').first
+    end
+
+    def include?(path)
+      !!find(path)
+    end
+
+    # yields each node's path, data and Stat, parents before children
+    def each
+      return enum_for(:each) unless block_given?
+
+      (0...@size).each do |i|
+        yield path_at(i), data_at(i), stat_at(i)
+      end
+    end
+
+    private
+      def path_of(options)
+        unless (options.keys - [:path]).empty? and options[:path].kind_of?(String)
+          raise Zookeeper::Exceptions::BadArguments, "a snapshot only takes a :path, not #{options.keys.inspect}"
+        end
+
+        options[:path]
+      end
+
+      # the index position of path, or nil
+      def find(path)
+        key = self.class.key(path)
+        i = bsearch { |j| key_at(j) >= key }
+        i if i < @size and key_at(i) == key
+      end
+
+      # the first index position for which the block is true, or @size
+      def bsearch
+        lo, hi = 0, @size
+        while lo < hi
+          mid = (lo + hi) / 2
+          if yield(mid)
+            hi = mid
+          else
+            lo = mid + 1
+          end
+        end
+        lo
+      end
+
+      def offset(i)
+        @offsets[i]
+      end
+
+      def path_length(i)
+        @buf.byteslice(offset(i), 4).unpack('l>').first
+      end
+
+      def path_at(i)
+        @buf.byteslice(offset(i) + RECORD_SIZE, path_length(i))
+      end
+
+      def data_at(i)
+        path_len, data_len = @buf.byteslice(offset(i), 8).unpack('l>l>')
+        @buf.byteslice(offset(i) + RECORD_SIZE + path_len, data_len) unless data_len < 0
+      end
+
+      def key_at(i)
+        @keys[i] ||= self.class.key(path_at(i)).freeze
+      end
+
+      def stat_at(i)
+        Stat.new(@buf.byteslice(offset(i) + 8, RECORD_SIZE - 8).unpack(STAT_FORMAT))
+      end
+  end
+end
@@ -1,12 +1,26 @@
 module Zookeeper
+# Under MRI, Zookeeper::Stat is defined by the C extension (ext/event_lib.c),
+# which keeps the raw struct and only converts the fields that are read. This
+# is the equivalent for JRuby, where stats arrive as hashes.
+if defined?(::JRUBY_VERSION)
 class Stat
+  include Comparable
+
+  MEMBERS = [:czxid, :mzxid, :ctime, :mtime, :version, :cversion, :aversion, :ephemeralOwner, :dataLength, :numChildren, :pzxid].freeze
+
   attr_reader :version, :exists, :czxid, :mzxid, :ctime, :mtime, :cversion, :aversion, :ephemeralOwner, :dataLength, :numChildren, :pzxid
 
   alias :ephemeral_owner :ephemeralOwner
   alias :num_children :numChildren
   alias :data_length :dataLength
 
-  def initialize(val)
+  # returns val if it's already a Stat, otherwise Stat.new(val)
+  def self.from(val)
+    val.kind_of?(self) ? val : new(val)
+  end
+
+  def initialize(val=nil)
+    val = val.to_a if val.kind_of?(Stat)
     @exists = !!val
     @czxid, @mzxid, @ctime, @mtime, @version, @cversion, @aversion,
         @ephemeralOwner, @dataLength, @numChildren, @pzxid = val if val.is_a?(Array)
@@ -17,5 +31,31 @@ class Stat
   def exists?
     @exists
   end
+
+  # stats of nodes that don't exist sort first, otherwise by mzxid, then version
+  def <=>(other)
+    return nil unless other.kind_of?(Stat)
+    return (exists? ? 1 : -1) if exists? != other.exists?
+    return 0 unless exists?
+    [mzxid, version] <=> [other.mzxid, other.version]
+  end
+
+  def ==(other)
+    other.kind_of?(Stat) && (to_a == other.to_a)
+  end
+  alias eql? ==
+
+  def hash
+    to_a.hash
+  end
+
+  def to_a
+    exists? ? MEMBERS.map { |m| __send__(m) } : nil
+  end
+
+  def to_hash
+    exists? ? Hash[MEMBERS.map { |m| [m, __send__(m)] }] : {}
+  end
+end
 end
 end
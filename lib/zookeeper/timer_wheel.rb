@@ -0,0 +1,120 @@
+module Zookeeper
+  # @private
+  #
+  # A hashed timer wheel: deadlines are rounded up to a tick and hashed into
+  # one of a fixed number of slots, so adding and removing an entry is O(1)
+  # and expiring costs a visit to the slots the clock has moved past, however
+  # many entries there are. Entries more than one turn of the wheel away share
+  # a slot with nearer ones and are skipped until their turn comes.
+  #
+  # Times are Floats in seconds, on whatever clock the caller uses (the
+  # continuations use Continuation.now). Not thread safe, the event thread
+  # owns the one in Continuation::Registry.
+  class TimerWheel
+    DEFAULT_TICK  = 0.01  # seconds
+    DEFAULT_SLOTS = 512   # power of two, ~5s per turn at the default tick
+
+    attr_reader :tick, :size
+
+    def initialize(tick = DEFAULT_TICK, slots = DEFAULT_SLOTS)
+      raise ArgumentError, "slots must be a power of two" unless slots > 0 && (slots & (slots - 1)) == 0
+
+      @tick  = tick.to_f
+      @mask  = slots - 1
+      @slots = Array.new(slots) { {} }
+      @size  = 0
+      @now   = nil    # the latest tick expired, nil until the first #expire
+      @next  = nil    # no entry is due before this tick
+    end
+
+    def empty?
+      @size == 0
+    end
+
+    # schedules item to expire at deadline, returns the handle #delete wants.
+    # a deadline that has already passed expires on the next #expire.
+    def add(item, deadline)
+      t = ticks(deadline)
+      t = @now + 1 if @now && t <= @now
+
+      slot = @slots[t & @mask]
+      @size += 1 unless slot.has_key?(item)
+      slot[item] = t
+
+      @next = t if @next.nil? || t < @next
+      t
+    end
+
+    # takes item out of the wheel, returns true if it was there
+    def delete(item, handle)
+      slot = @slots[handle & @mask]
+      return false unless slot.delete(item)
+
+      @size -= 1
+      @next = nil if @size == 0
+      true
+    end
+
+    # removes and returns the items whose deadline is at or before now
+    def expire(now)
+      expired = []
+      t = ticks_floor(now)
+
+      if @size > 0 && @next <= t
+        # nothing is due before @next, and a full turn visits every slot
+        from = (t - @next) > @mask ? t - @mask : @next
+
+        from.upto(t) do |i|
+          slot = @slots[i & @mask]
+          next if slot.empty?
+
+          slot.delete_if do |item, due|
+            next false if due > t
+            expired << item
+            true
+          end
+        end
+
+        @size -= expired.length
+        @next = @size > 0 ? first_due_after(t) : nil
+      end
+
+      @now = t if @now.nil? || t > @now
+      expired
+    end
+
+    # the earliest time anything could be due, nil when the wheel is empty.
+    # may be early (the slot's entries could be for a later turn), never late.
+    def next_deadline
+      @next && @next * @tick
+    end
+
+    # removes everything, returns the items
+    def clear
+      items = @slots.flat_map { |slot| slot.keys.tap { slot.clear } }
+      @size = 0
+      @next = nil
+      items
+    end
+
+    private
+      # deadlines are rounded up, an entry never expires early
+      def ticks(time)
+        (time / @tick).ceil
+      end
+
+      def ticks_floor(time)
+        (time / @tick).floor
+      end
+
+      # the first tick after t whose slot isn't empty. everything in that
+      # slot is due then or a whole number of turns later.
+      def first_due_after(t)
+        (t + 1).upto(t + @mask + 1) do |i|
+          return i unless @slots[i & @mask].empty?
+        end
+
+        nil
+      end
+  end
+end
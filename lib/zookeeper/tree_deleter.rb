@@ -0,0 +1,144 @@
+module Zookeeper
+  # @private
+  #
+  # Does the work of ClientMethods#delete_tree.
+  #
+  # Each pass walks what's left of the subtree with a stat-only #get_tree,
+  # and deletes the nodes deepest first in multis of :batch_size, sent
+  # through a Pipeline :concurrency at a time. The server applies a
+  # session's requests in order, so a multi never gets to a node before the
+  # one ahead of it has taken care of the node's children.
+  #
+  # A multi that fails isn't applied at all. If some of its nodes were gone
+  # already, it's sent again without them. If it failed because a node
+  # still has children (created behind our back, or in a multi that failed
+  # before it), it goes back in the queue for the ones ahead of it to sort
+  # out. When a round of multis gets nowhere the pass ends, and the next one
+  # walks the subtree again. Any other error ends the whole thing.
+  #
+  # JRuby has no multi, there every node is deleted on its own.
+  class TreeDeleter
+    include Constants
+
+    DEFAULT_BATCH_SIZE  = 500   # deletes per multi
+    DEFAULT_CONCURRENCY = 8     # multis in flight
+    DEFAULT_MAX_PASSES  = 5
+
+    # errors that may clear up on a retry or another pass
+    RETRIABLE = [ZNONODE, ZNOTEMPTY].freeze
+
+    def initialize(zk, path, opts = {}, &progress)
+      @zk          = zk
+      @path        = path
+      @batch_size  = opts[:batch_size]  || DEFAULT_BATCH_SIZE
+      @concurrency = opts[:concurrency] || DEFAULT_CONCURRENCY
+      @max_passes  = opts[:max_passes]  || DEFAULT_MAX_PASSES
+      @timeout     = opts[:timeout]
+      @progress    = progress
+
+      [[:batch_size, @batch_size], [:concurrency, @concurrency], [:max_passes, @max_passes]].each do |name, v|
+        unless v.kind_of?(Integer) and v > 0
+          raise Zookeeper::Exceptions::BadArguments, "#{name.inspect} must be a positive Integer, not #{v.inspect}"
+        end
+      end
+
+      @found = @deleted = @vanished = @passes = 0
+    end
+
+    # returns { :rc, :deleted, :vanished, :passes, :elapsed, :rate }
+    def run
+      @started = Continuation.now
+
+      while @passes < @max_passes
+        @passes += 1
+
+        paths = []
+        rv = @zk.get_tree(:path => @path, :data => false, :timeout => @timeout) { |path, _, _| paths << path }
+
+        # gone, either because we're done or because it never was there
+        return finish(@passes == 1 ? ZNONODE : ZOK) if rv[:rc] == ZNONODE
+        return finish(rv[:rc]) unless rv[:rc] == ZOK
+
+        @found = [@found, @deleted + paths.length].max
+
+        rc = delete_all(paths.reverse)
+        return finish(rc) unless rc == ZNOTEMPTY
+      end
+
+      finish(ZNOTEMPTY)
+    end
+
+    def progress
+      elapsed = Continuation.now - @started
+
+      { :found    => @found,
+        :deleted  => @deleted,
+        :vanished => @vanished,
+        :passes   => @passes,
+        :elapsed  => elapsed,
+        :rate     => elapsed > 0 ? @deleted / elapsed : 0.0 }
+    end
+
+    private
+      # deletes paths (deepest first), returns ZOK when they're all gone,
+      # ZNOTEMPTY if it's time for another pass, or the error that stopped us
+      def delete_all(paths)
+        queue = paths.each_slice(@batch_size).to_a
+
+        until queue.empty?
+          window = queue.shift(@concurrency)
+          results = @zk.pipeline { |p| window.each { |batch| send_batch(p, batch) } }
+
+          retry_paths = []
+          moved = false
+
+          window.zip(results).each do |batch, rv|
+            rc = rv[:rc]
+
+            if rc == ZOK
+              @deleted += batch.length
+              moved = true
+            elsif rc == ZUNIMPLEMENTED and batch.length > 1
+              @batch_size = 1     # no multi, delete them one at a time
+              retry_paths.concat(batch)
+              moved = true
+            elsif RETRIABLE.include?(rc)
+              gone = gone_paths(batch, rv)
+              @vanished += gone.length
+              moved ||= !gone.empty?
+              retry_paths.concat(batch - gone)
+            else
+              return rc
+            end
+          end
+
+          @progress.call(progress) if @progress
+
+          return ZNOTEMPTY unless moved
+          queue = retry_paths.each_slice(@batch_size).to_a + queue
+        end
+
+        ZOK
+      end
+
+      def send_batch(pipeline, batch)
+        if batch.length == 1
+          pipeline.delete(:path => batch.first, :timeout => @timeout)
+        else
+          ops = batch.map { |path| [:delete, { :path => path }] }
+          pipeline.multi(:ops => ops, :timeout => @timeout)
+        end
+      end
+
+      # the paths in a failed batch that didn't exist anymore
+      def gone_paths(batch, rv)
+        return (rv[:rc] == ZNONODE ? batch : []) unless rv[:results]
+
+        batch.zip(rv[:results]).select { |_, result| result.rc == ZNONODE }.map(&:first)
+      end
+
+      def finish(rc)
+        progress.merge(:rc => rc)
+      end
+  end
+end
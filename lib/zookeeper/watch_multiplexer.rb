@@ -0,0 +1,140 @@
+module Zookeeper
+  # @private
+  #
+  # Keeps one watch per node and kind (:data for get and exists, :child for
+  # get_children) set on the server, however many callers ask for it.
+  #
+  # The first watched read of a node is sent with its watch, and once its
+  # response says the server set it, the read's req_id is a registration of
+  # that watch. Watched reads that come along while it's set are subscribed
+  # to it and sent without one (#prepare), so the C side allocates no watcher
+  # context for them and the server sees no new watch. When the watch fires
+  # the event is delivered to the registration as usual, and to every
+  # subscriber along with it (#fire).
+  #
+  # A subscriber is added before its read is sent, so a change the read
+  # doesn't see is never missed; a change it does see may be reported too.
+  # A subscriber whose read fails the way that wouldn't have set a watch is
+  # dropped again when its response comes (#completed).
+  #
+  # Everything but #subscribers runs on the event thread, in the order
+  # requests are sent and events come in. The mutex is only there so
+  # #subscribers can be called from anywhere.
+  class WatchMultiplexer
+    include Constants
+
+    WATCH_TYPES = { :get => :data, :exists => :data, :get_children => :child }.freeze
+
+    # req_ids of the reads whose response set the watch, and of the ones
+    # sharing it
+    Entry = Struct.new(:registrations, :subscribers)
+
+    # number of watched reads that were sent without their watch
+    attr_reader :shared
+
+    def initialize
+      @mutex       = Mutex.new
+      @entries     = {}   # [type, path] => Entry, while the watch is set
+      @registered  = {}   # req_id => [type, path], for each registration
+      @pending     = {}   # req_id => [type, path, meth], sent with a watch
+      @subscribing = {}   # req_id => [type, path, meth], sent without
+      @shared      = 0
+    end
+
+    # cntn is about to be sent. if the watch it asks for is already set it
+    # gets subscribed to that one, and sent without its own.
+    def prepare(cntn)
+      return unless cntn.watch?
+
+      key = [WATCH_TYPES.fetch(cntn.meth), cntn.args[1]]
+
+      @mutex.synchronize do
+        if entry = @entries[key]
+          entry.subscribers << cntn.req_id
+          @subscribing[cntn.req_id] = key + [cntn.meth]
+          @shared += 1
+          cntn.drop_watch!
+        else
+          @pending[cntn.req_id] = key + [cntn.meth]
+        end
+      end
+    end
+
+    # cntn has been sent. if it didn't make it to the server there's no
+    # response to wait for.
+    def sent(cntn)
+      return unless cntn.watch? and not cntn.submitted?
+
+      @mutex.synchronize do
+        @pending.delete(cntn.req_id)
+        forget_subscriber(cntn.req_id)
+      end
+    end
+
+    # the response for req_id came with rc. followers are the continuations
+    # that joined the read (see Continuation::Registry#join), they share its
+    # watch if it set one.
+    def completed(req_id, rc, followers = [])
+      return if @pending.empty? and @subscribing.empty?
+
+      @mutex.synchronize do
+        if pending = @pending.delete(req_id)
+          type, path, meth = pending
+          return unless watch_set?(meth, rc)
+
+          key = [type, path]
+          entry = (@entries[key] ||= Entry.new([], []))
+          entry.registrations << req_id
+          @registered[req_id] = key
+
+          followers.each do |cntn|
+            next unless cntn.watch?
+            entry.subscribers << cntn.req_id
+            @shared += 1
+          end
+        elsif subscribing = @subscribing[req_id]
+          watch_set?(subscribing.last, rc) ? @subscribing.delete(req_id) : forget_subscriber(req_id)
+        end
+      end
+    end
+
+    # a watch event came for req_id, returns the req_ids it should also be
+    # delivered to. the server fires a watch once for every registration,
+    # the subscribers get the first of those events. session events don't
+    # use the watch up, unless the session has expired.
+    def fire(req_id, hash)
+      return [] if @registered.empty?
+
+      @mutex.synchronize do
+        return [] unless key = @registered[req_id]
+        entry = @entries[key]
+
+        if hash[:type] == ZOO_SESSION_EVENT and hash[:state] != ZOO_EXPIRED_SESSION_STATE
+          return entry.registrations.first == req_id ? entry.subscribers.dup : []
+        end
+
+        @entries.delete(key)
+        entry.registrations.each { |r| @registered.delete(r) }
+        entry.subscribers
+      end
+    end
+
+    # the number of local watchers on each node with a watch set:
+    # { path => { :data => n, :child => n } }
+    def subscribers
+      @mutex.synchronize do
+        @entries.each_with_object({}) do |((type, path), entry), h|
+          counts = (h[path] ||= { :data => 0, :child => 0 })
+          counts[type] += entry.registrations.length + entry.subscribers.length
+        end
+      end
+    end
+
+    private
+      # must hold @mutex
+      def forget_subscriber(req_id)
+        return unless subscribing = @subscribing.delete(req_id)
+        entry = @entries[subscribing.first(2)] and entry.subscribers.delete(req_id)
+      end
+  end
+end
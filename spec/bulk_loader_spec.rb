@@ -0,0 +1,152 @@
+require 'spec_helper'
+require 'shared/connection_examples'
+require 'stringio'
+
+describe Zookeeper::BulkLoader do
+  include Zookeeper::Constants
+
+  let(:zk) { Zookeeper::SpecHelpers::FakeClient.new }
+  let(:records) { (0...4).flat_map { |i| (0...5).map { |j| ["/t/a#{i}/b#{j}", "#{i}.#{j}"] } } }
+
+  def bulk_load(source, opts = {}, &block)
+    described_class.new(zk, source, { :concurrency => 3 }.merge(opts), &block).run
+  end
+
+  it %[should create the missing parents ahead of the nodes] do
+    rv = bulk_load(records)
+
+    expect(rv[:rc]).to eq(ZOK)
+    expect(rv[:records]).to eq(20)
+    expect(rv[:created]).to eq(20)
+    expect(rv[:parents]).to eq(5)    # /t and /t/a0 through /t/a3
+    expect(zk.nodes['/t/a2/b3']).to eq('2.3')
+    expect(zk.nodes['/t/a2']).to be_nil
+    expect(zk.calls.uniq).to eq([:create])
+  end
+
+  it %[should send the creates in multis of :batch_size] do
+    rv = bulk_load(records, :batch_size => 10)
+
+    expect(rv[:rc]).to eq(ZOK)
+    expect(zk.nodes.length).to eq(26)
+    expect(zk.calls).to eq([:multi] * 3)    # 25 creates
+  end
+
+  it %[should read the records a round at a time] do
+    seen = []
+    rv = bulk_load(records.each) { |progress| seen << progress[:records] }
+
+    expect(rv[:rc]).to eq(ZOK)
+    expect(seen.first).to be < 20
+    expect(seen.last).to eq(20)
+  end
+
+  it %[should read records from an IO] do
+    io = StringIO.new("/t/x\tx\n/t/y/z\n/t/y\ty\n")
+    rv = bulk_load(io)
+
+    expect(rv[:rc]).to eq(ZOK)
+    expect(rv[:created]).to eq(2)     # /t/y was created as a parent already
+    expect(rv[:skipped]).to eq(1)
+    expect(zk.nodes['/t/x']).to eq('x')
+    expect(zk.nodes['/t/y']).to be_nil
+  end
+
+  it %[should skip the blank lines of an IO] do
+    io = StringIO.new("\n/t/x\tx\n  \n\t\n/t/y\n\n")
+    rv = bulk_load(io)
+
+    expect(rv[:rc]).to eq(ZOK)
+    expect(rv[:records]).to eq(2)
+    expect(rv[:created]).to eq(2)
+    expect(zk.nodes.keys.sort).to eq(%w[/ /t /t/x /t/y])
+  end
+
+  it %[should overwrite the nodes that exist with :on_exists => :overwrite] do
+    zk.nodes.merge!('/t' => nil, '/t/a1' => nil, '/t/a1/b1' => 'old')
+
+    [1, 10].each do |batch_size|
+      rv = bulk_load(records, :on_exists => :overwrite, :batch_size => batch_size)
+
+      expect(rv[:rc]).to eq(ZOK)
+      expect(rv[:overwritten]).to eq(batch_size == 1 ? 1 : 20)
+      expect(zk.nodes['/t/a1/b1']).to eq('1.1')
+    end
+  end
+
+  it %[should skip the nodes that exist by default, in multis too] do
+    zk.nodes.merge!('/t' => nil, '/t/a3' => nil, '/t/a3/b0' => 'old')
+    rv = bulk_load(records, :batch_size => 10)
+
+    expect(rv[:rc]).to eq(ZOK)
+    expect(rv[:skipped]).to eq(1)
+    expect(rv[:created]).to eq(19)
+    expect(zk.nodes['/t/a3/b0']).to eq('old')
+    expect(zk.nodes.length).to eq(26)
+  end
+
+  it %[should create one node at a time if there's no multi] do
+    zk.multi_rc = ZUNIMPLEMENTED
+    rv = bulk_load(records, :batch_size => 10)
+
+    expect(rv[:rc]).to eq(ZOK)
+    expect(zk.nodes.length).to eq(26)
+    expect(zk.calls.count(:create)).to eq(25)
+  end
+
+  it %[should give up with ZNONODE if a parent goes away] do
+    zk.before_round = lambda { zk.nodes.delete('/t') }
+    expect(bulk_load(records)[:rc]).to eq(ZNONODE)
+  end
+
+  it %[should stop at any other error] do
+    zk.multi_rc = ZCONNECTIONLOSS
+    expect(bulk_load(records, :batch_size => 10)[:rc]).to eq(ZCONNECTIONLOSS)
+  end
+
+  it %[should raise BadArguments for a bad record or option] do
+    expect { bulk_load([['relative', 'x']]) }.to raise_error(Zookeeper::Exceptions::BadArguments)
+    expect { bulk_load(records, :on_exists => :replace) }.to raise_error(Zookeeper::Exceptions::BadArguments)
+  end
+end
+
+describe 'Zookeeper::BulkLoader against a server' do
+  let(:path) { "/_zktest_" }
+  let(:data) { "underpants" }
+  let(:connection_string) { Zookeeper.default_cnx_str }
+
+  before do
+    @zk = Zookeeper.new(connection_string)
+  end
+
+  after do
+    @zk and @zk.close
+  end
+
+  def zk
+    @zk
+  end
+
+  it_should_behave_like "connection"
+
+  describe 'in multis' do
+    before do
+      ensure_node(zk, path, data)
+    end
+
+    after do
+      rm_rf(zk, "#{path}/loaded")
+    end
+
+    it %[should create the nodes and their parents in multis of :batch_size] do
+      records = (0...10).map { |i| ["#{path}/loaded/#{i % 2}/n#{i}", i.to_s] }
+      rv = Zookeeper::BulkLoader.new(zk, records, :batch_size => 4, :concurrency => 2).run
+
+      expect(rv[:rc]).to eq(Zookeeper::ZOK)
+      expect(rv[:created]).to eq(10)
+      expect(rv[:parents]).to eq(3)
+      expect(zk.get_children(:path => "#{path}/loaded/1")[:children].sort).to eq(%w[n1 n3 n5 n7 n9])
+      expect(zk.get(:path => "#{path}/loaded/0/n4")[:data]).to eq('4')
+    end
+  end
+end
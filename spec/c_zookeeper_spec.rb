@@ -44,6 +44,151 @@ unless defined?(::JRUBY_VERSION)
           expect(event[:type]).to   eq(Zookeeper::Constants::ZOO_SESSION_EVENT)
           expect(event[:state]).to  eq(Zookeeper::Constants::ZOO_CONNECTED_STATE)
         end
+
+        it %[should deliver events as Zookeeper::Event objects that behave like the old hashes] do
+          event = wait_until(10) { @event_queue.pop }
+          expect(event).to be_kind_of(Zookeeper::Event)
+          expect(event.req_id).to eq(Zookeeper::Constants::ZKRB_GLOBAL_CB_REQ)
+          expect(event.to_hash).to eq(:req_id => event.req_id, :type => event.type, :state => event.state, :path => event.path)
+          expect(event).not_to have_key(:rc)
+          expect(event.completion?).to be(false)
+
+          event[:context] = :ctx
+          expect(event.values_at(:context, :state)).to eq([:ctx, Zookeeper::Constants::ZOO_CONNECTED_STATE])
+        end
+
+        it %[should dup and clone events like hashes] do
+          event = wait_until(10) { @event_queue.pop }
+          event[:context] = :ctx
+
+          copy = event.dup
+          expect(copy).to eq(event)
+          expect(copy.path).to eq(event.path)
+
+          copy[:context] = :other
+          expect(event[:context]).to eq(:ctx)
+
+          expect(event.freeze.clone).to be_frozen
+          expect { Zookeeper::Event.new }.to raise_error(NoMethodError)
+        end
+
+        it %[should write to the self-pipe once for the calls submitted while the event loop is busy] do
+          # the event thread hangs on to the first thing it delivers until
+          # the gate opens
+          gate, held = Queue.new, false
+          @event_queue.define_singleton_method(:push_all) do |objs|
+            gate.pop unless held
+            held = true
+            super(objs)
+          end
+
+          @czk.exists(0, '/', true, nil)
+          wait_until(5) { gate.num_waiting == 1 }
+
+          before = @czk.wakeup_stats
+          threads = 10.times.map { |n| Thread.new { @czk.exists(n + 1, '/', nil, nil) } }
+          wait_until(5) { @czk.wakeup_stats[:submits] - before[:submits] == 10 }
+          during = @czk.wakeup_stats
+
+          gate << true
+          expect(threads.map { |t| t.value.first }.uniq).to eq([Zookeeper::Constants::ZOK])
+
+          expect(during[:wake_writes] - before[:wake_writes]).to eq(1)
+          expect(@czk.wakeup_stats[:pipe_wakeups]).to be <= @czk.wakeup_stats[:wake_writes]
+        end
+
+        it %[should reuse the event slab's blocks once their events are delivered] do
+          skip "completions aren't queued without the IO thread" unless Zookeeper::CZookeeper::IO_THREAD
+
+          @czk.exists(0, '/', nil, nil)
+          before = @czk.event_slab_stats[:event_stat]
+
+          200.times { |n| @czk.exists(n, '/', nil, nil) }
+          after = @czk.event_slab_stats[:event_stat]
+
+          expect(after[:allocs] - before[:allocs]).to eq(200)
+          expect(after[:capacity]).to eq(before[:capacity])
+          expect(after[:in_use]).to eq(0)
+        end
+
+        it %[should not re-register with epoll on every iteration of the event loop] do
+          skip "select() event loop" unless @czk.wakeup_stats[:event_loop] == :epoll
+
+          before = @czk.wakeup_stats[:epoll_ctls]
+          50.times { |n| @czk.exists(n, '/', nil, nil) }
+
+          expect(@czk.wakeup_stats[:epoll_ctls] - before).to be <= 2
+        end
+
+        it %[should see a get_tree result waiting to be picked up] do
+          # pump the handle from here, with the event thread out of the way
+          @czk.pause_before_fork_in_parent
+          @czk.zkrb_get_next_event(false) while @czk.has_events
+
+          rc, = @czk.zkrb_get_tree(1234, '/', 1, nil, 8, true)
+          expect(rc).to eq(Zookeeper::Constants::ZOK)
+
+          wait_until(5) do
+            @czk.zkrb_iterate_event_loop(0.1)
+            @czk.has_events
+          end
+
+          expect(@czk.has_events).to be(true)
+          expect(@czk.zkrb_get_next_event(false)[:req_id]).to eq(1234)
+          expect(@czk.has_events).to be(false)
+
+          @czk.resume_after_fork_in_parent
+        end
+      end
+    end
+
+    describe 'with :event_loop => :select' do
+      before do
+        @event_queue = Zookeeper::Common::QueueWithPipe.new
+        @czk = Zookeeper::CZookeeper.new(Zookeeper.default_cnx_str, @event_queue, :event_loop => :select)
+      end
+
+      after do
+        @czk.close rescue Exception
+        @event_queue.close rescue Exception
+      end
+
+      it %[should use the select() event loop] do
+        expect(wait_until_connected).to be_truthy
+        expect(@czk.wakeup_stats[:event_loop]).to eq(:select)
+        expect(@czk.exists(0, '/', nil, nil).first).to eq(Zookeeper::Constants::ZOK)
+      end
+    end
+
+    describe 'while something else holds the GVL' do
+      before do
+        skip "built without the IO thread" unless Zookeeper::CZookeeper::IO_THREAD
+        skip "built without the test hooks (ZKRB_TEST_HOOKS)" unless Zookeeper::CZookeeper.respond_to?(:zkrb_hold_gvl)
+
+        @event_queue = Zookeeper::Common::QueueWithPipe.new
+        @czk = Zookeeper::CZookeeper.new(Zookeeper.default_cnx_str, @event_queue, :receive_timeout_msec => 4_000)
+        expect(wait_until_connected).to be_truthy
+        pop_all_events
+      end
+
+      after do
+        @czk.close rescue Exception if @czk
+        @event_queue.close rescue Exception if @event_queue
+      end
+
+      it %[should keep the session alive for longer than the session timeout] do
+        session_id = @czk.client_id.session_id
+        hold = (@czk.recv_timeout * 1.5) / 1000.0
+
+        Zookeeper::CZookeeper.zkrb_hold_gvl(hold)
+
+        # give anything that went wrong a moment to be noticed
+        sleep 1
+
+        expect(@czk.state).to eq(Zookeeper::Constants::ZOO_CONNECTED_STATE)
+        expect(@czk.client_id.session_id).to eq(session_id)
+        expect(pop_all_events.map { |e| e[:state] }).not_to include(Zookeeper::Constants::ZOO_EXPIRED_SESSION_STATE)
+        expect(@czk.wakeup_stats[:io_iterations]).to be > 0
       end
     end
   end
@@ -0,0 +1,191 @@
+require 'spec_helper'
+
+describe Zookeeper::Continuation do
+  def continuation(req_id, timeout = nil)
+    Zookeeper::Continuation.with_timeout(timeout) do
+      Zookeeper::Continuation.new(:get, req_id, '/path', nil, nil)
+    end
+  end
+
+  describe :with_timeout do
+    it %[should set the deadline of the continuations created in the block] do
+      cntn = continuation(1, 0.25)
+      expect(cntn.timeout).to eq(0.25)
+      expect(cntn.deadline).to be_within(0.1).of(Zookeeper::Continuation.now + 0.25)
+    end
+
+    it %[should default to OPERATION_TIMEOUT] do
+      expect(continuation(1).timeout).to eq(Zookeeper::Continuation::OPERATION_TIMEOUT)
+    end
+  end
+
+  describe :timeout! do
+    it %[should make the caller raise ContinuationTimeoutError] do
+      cntn = continuation(1, 0.1)
+      cntn.timeout!
+      expect { cntn.value }.to raise_error(Zookeeper::Exceptions::ContinuationTimeoutError)
+    end
+  end
+
+  describe Zookeeper::Continuation::Registry do
+    subject { described_class.new }
+
+    it %[should time out the overdue in-flight continuations together] do
+      overdue = [continuation(1, 0.01), continuation(2, 0.01)]
+      later = continuation(3, 30)
+
+      (overdue + [later]).each { |cntn| subject.sent(cntn) }
+
+      expired = subject.expire(Zookeeper::Continuation.now + 1)
+
+      expect(expired).to match_array(overdue)
+      expect(subject.in_flight.keys).to eq([3])
+      expect(subject.timeouts).to eq(2)
+    end
+
+    it %[should recognise the late response to a timed out call] do
+      subject.sent(continuation(1, 0.01))
+      subject.expire(Zookeeper::Continuation.now + 1)
+
+      expect(subject.complete(1)).to be_nil
+      expect(subject.abandoned?(1)).to be(true)
+      expect(subject.abandoned?(1)).to be(false)
+    end
+
+    it %[should not time out a call that has been answered] do
+      cntn = continuation(1, 0.01)
+      subject.sent(cntn)
+
+      expect(subject.complete(1)).to be(cntn)
+      expect(subject.expire(Zookeeper::Continuation.now + 1)).to eq([])
+    end
+
+    it %[should time out continuations waiting for the connection] do
+      cntn = continuation(1, 0.01)
+      subject.wait_for_connection(cntn)
+
+      expect(subject.expire(Zookeeper::Continuation.now + 1)).to eq([cntn])
+      expect(subject.take_waiting).to eq([])
+    end
+
+    describe 'coalescing reads' do
+      it %[should have an identical read wait for the one that was sent] do
+        leader, follower = continuation(1), continuation(2)
+
+        subject.sent(leader)
+        expect(subject.join(follower)).to be(true)
+        expect(subject.stats[:coalesced]).to eq(1)
+
+        subject.complete(1)
+        expect(subject.take_followers(1)).to eq([follower])
+        expect(subject.in_flight).to be_empty
+      end
+
+      it %[should not join a read sent before a write] do
+        subject.sent(continuation(1))
+        subject.sent(Zookeeper::Continuation.new(:set, 2, '/path', 'data', nil, -1))
+
+        expect(subject.join(continuation(3))).to be(false)
+      end
+
+      it %[should not join a read whose response has come] do
+        subject.sent(continuation(1))
+        subject.complete(1)
+
+        expect(subject.join(continuation(2))).to be(false)
+      end
+
+      it %[should still answer the followers of a read that timed out] do
+        follower = continuation(2, 30)
+
+        subject.sent(continuation(1, 0.01))
+        subject.join(follower)
+        subject.expire(Zookeeper::Continuation.now + 1)
+
+        expect(subject.take_followers(1)).to eq([follower])
+        expect(subject.abandoned?(1)).to be(true)
+      end
+
+      it %[should not let reads join one that shares someone else's watch] do
+        leader = Zookeeper::Continuation.new(:get, 1, '/path', nil, true)
+        leader.drop_watch!
+        subject.sent(leader)
+
+        expect(subject.join(Zookeeper::Continuation.new(:get, 2, '/path', nil, true))).to be(false)
+      end
+
+      it %[should keep watching and unwatched reads apart] do
+        subject.sent(continuation(1))
+        expect(subject.join(Zookeeper::Continuation.new(:get, 2, '/path', nil, true))).to be(false)
+      end
+
+      it %[should send every read with :coalesce_reads => false] do
+        reg = Zookeeper::Continuation::Registry.new(:coalesce_reads => false)
+        reg.sent(continuation(1))
+        expect(reg.join(continuation(2))).to be(false)
+      end
+    end
+
+    describe 'with a :max_outstanding window' do
+      def registry(backpressure)
+        Zookeeper::Continuation::Registry.new(:max_outstanding => 2, :backpressure => backpressure)
+      end
+
+      it %[should turn callers away once it's full, with :backpressure => :fail] do
+        reg = registry(:fail)
+
+        expect(reg.admit(continuation(1))).to be(true)
+        expect(reg.admit(continuation(2))).to be(true)
+        expect(reg.admit(continuation(3))).to be(false)
+        expect(reg.stats[:rejected]).to eq(1)
+      end
+
+      it %[should let the next caller in when a continuation is done with] do
+        reg = registry(:block)
+        first = continuation(1)
+
+        [first, continuation(2)].each { |cntn| reg.admit(cntn) }
+
+        waiter = Thread.new { reg.admit(continuation(3)) }
+        wait_until(2) { waiter.status == 'sleep' }
+
+        reg.release(first)
+        expect(waiter.value).to be(true)
+        expect(reg.stats[:blocked]).to eq(1)
+        expect(reg.stats[:outstanding]).to eq(2)
+      end
+
+      it %[should give up after the given number of seconds] do
+        reg = registry(0.05)
+        2.times { |n| reg.admit(continuation(n)) }
+
+        expect(reg.admit(continuation(3))).to be(false)
+        expect(reg.stats[:rejected]).to eq(1)
+      end
+
+      it %[should free the place of a continuation whose response has come] do
+        reg = registry(:fail)
+        cntn = continuation(1)
+
+        reg.admit(cntn)
+        reg.sent(cntn)
+        reg.complete(1)
+
+        expect(reg.stats[:outstanding]).to eq(0)
+      end
+
+      it %[should refuse a window that isn't a positive number] do
+        expect { Zookeeper::Continuation::Registry.new(:max_outstanding => 0) }.to raise_error(ArgumentError)
+        expect { registry(:sometimes) }.to raise_error(ArgumentError)
+      end
+    end
+
+    it %[should shut down continuations pushed after it was closed] do
+      subject.close!
+      cntn = continuation(1)
+
+      expect(subject.push(cntn)).to be(false)
+      expect { cntn.value }.to raise_error(Zookeeper::Exceptions::NotConnected)
+    end
+  end
+end
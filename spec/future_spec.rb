@@ -0,0 +1,43 @@
+require 'spec_helper'
+
+describe Zookeeper::Future do
+  it %[should call the resolver once, when the value is first asked for] do
+    calls = 0
+    future = described_class.new { calls += 1; :value }
+
+    expect(future).not_to be_resolved
+    expect(calls).to eq(0)
+
+    expect(future.value).to eq(:value)
+    expect(future.value).to eq(:value)
+    expect(future).to be_resolved
+    expect(calls).to eq(1)
+  end
+
+  it %[should raise what the resolver raised, every time] do
+    future = described_class.new { raise Zookeeper::Exceptions::BadArguments, 'nope' }
+
+    expect { future.value }.to raise_error(Zookeeper::Exceptions::BadArguments)
+    expect { future.value }.to raise_error(Zookeeper::Exceptions::BadArguments)
+    expect(future.error).to be_kind_of(Zookeeper::Exceptions::BadArguments)
+  end
+
+  describe :then do
+    it %[should chain on the value] do
+      future = described_class.new { 20 }.then { |v| v + 1 }.then { |v| v * 2 }
+      expect(future.value).to eq(42)
+    end
+
+    it %[should pass errors along] do
+      future = described_class.new { raise Zookeeper::Exceptions::NotConnected }.then { |v| :unreachable }
+      expect { future.value }.to raise_error(Zookeeper::Exceptions::NotConnected)
+    end
+  end
+
+  describe :wait_all do
+    it %[should return the values in order] do
+      futures = [described_class.new { 1 }, [described_class.new { 2 }, described_class.new { 3 }]]
+      expect(described_class.wait_all(*futures)).to eq([1, 2, 3])
+    end
+  end
+end
@@ -0,0 +1,211 @@
+require 'spec_helper'
+require 'socket'
+
+describe Zookeeper::Multiplexer::Protocol do
+  include Zookeeper::Constants
+
+  def round_trip(value)
+    Zookeeper::Multiplexer::Protocol::Reader.new(described_class.encode(value)).value
+  end
+
+  it 'round trips nil, booleans and integers of either size' do
+    [nil, true, false, 0, -1, 2**31 - 1, -2**31, 2**40, -2**63].each do |v|
+      expect(round_trip(v)).to eq(v)
+    end
+  end
+
+  it 'keeps the encoding of strings' do
+    utf8 = round_trip("café")
+    expect(utf8).to eq("café")
+    expect(utf8.encoding).to eq(Encoding::UTF_8)
+
+    bin = round_trip("\xff\x00".b)
+    expect(bin).to eq("\xff\x00".b)
+    expect(bin.encoding).to eq(Encoding::BINARY)
+  end
+
+  it 'round trips symbols, in the table or not' do
+    expect(round_trip([:rc, :stat, :something_else])).to eq([:rc, :stat, :something_else])
+  end
+
+  it 'round trips a completion with a stat and acls' do
+    stat = Zookeeper::Stat.new([1, 2, 3, 4, 5, 6, 7, 2**40, 9, 10, 11])
+    acl  = Zookeeper::ACLs::ACL.new(:perms => 31, :id => { :scheme => 'world', :id => 'anyone' })
+
+    hash = round_trip(:rc => ZOK, :stat => stat, :acl => [acl], :data => nil)
+
+    expect(hash[:rc]).to eq(ZOK)
+    expect(hash[:stat].to_a).to eq(stat.to_a)
+    expect(hash[:acl].first.perms).to eq(31)
+    expect(hash[:acl].first.id.scheme).to eq('world')
+    expect(hash[:acl].first.id.id).to eq('anyone')
+    expect(hash[:data]).to be_nil
+  end
+
+  it 'raises on a truncated value' do
+    buf = described_class.encode('abcdef')
+    expect { Zookeeper::Multiplexer::Protocol::Reader.new(buf[0, 4]).value }.to raise_error(Zookeeper::Exceptions::ZookeeperException)
+  end
+
+  describe 'Stream' do
+    let(:pair)     { UNIXSocket.pair }
+    let(:writer)   { Zookeeper::Multiplexer::Protocol::Stream.new(pair.first) }
+    let(:reader)   { Zookeeper::Multiplexer::Protocol::Stream.new(pair.last) }
+
+    after do
+      pair.each { |io| io.close unless io.closed? }
+    end
+
+    def frames_read
+      IO.select([pair.last])
+      reader.read
+
+      frames = []
+      reader.each_frame { |type, body| frames << [type, body.int64, body] }
+      frames
+    end
+
+    it 'yields only the frames that have all arrived' do
+      frame = described_class.call_frame(42, :get, ['/foo', true])
+      pair.first.write(frame + frame[0, 7])
+
+      frames = frames_read
+      expect(frames.map { |type, req_id, _| [type, req_id] }).to eq([[Zookeeper::Multiplexer::Protocol::CALL, 42]])
+      expect(frames.first.last.byte).to eq(Zookeeper::Multiplexer::Protocol::METHOD_CODES[:get])
+      expect(frames.first.last.value).to eq(['/foo', true])
+
+      pair.first.write(frame[7..-1])
+      expect(frames_read.map { |_, req_id, _| req_id }).to eq([42])
+    end
+
+    it 'sends its own req_id with an event, not the one in the hash' do
+      writer << described_class.event_frame(Zookeeper::Multiplexer::Protocol::WATCH, 7, :req_id => 99, :type => 1, :path => '/a')
+      expect(writer.flush).to be(true)
+
+      (type, req_id, body), = frames_read
+      expect(type).to eq(Zookeeper::Multiplexer::Protocol::WATCH)
+      expect(req_id).to eq(7)
+      expect(body.value).to eq(:type => 1, :path => '/a')
+    end
+
+    it "keeps what the other end isn't ready for until the next flush" do
+      frame = described_class.value_frame(Zookeeper::Multiplexer::Protocol::STATE, 'x' * (4 * 1024 * 1024))
+      writer << frame
+
+      expect(writer.flush).to be(true)
+      expect(writer).to be_pending_output
+
+      frames = []
+      until frames.any?
+        writer.flush
+        frames.concat(frames_read)
+      end
+
+      expect(writer).not_to be_pending_output
+      expect(frames.map(&:first)).to eq([Zookeeper::Multiplexer::Protocol::STATE])
+    end
+
+    it 'reads false once the other end has gone' do
+      writer.close
+      expect(reader.read).to be(false)
+    end
+  end
+end
+
+describe 'Zookeeper with a :multiplexer' do
+  include Zookeeper::Constants
+
+  let(:path) { "/_zktest_" }
+  let(:connection_string) { Zookeeper.default_cnx_str }
+  let(:socket) { File.join(Dir.tmpdir, "zkrb-spec-#{Process.pid}.sock") }
+
+  before do
+    @mux = Zookeeper::Multiplexer.spawn(connection_string, socket)
+    @zk = Zookeeper.new(connection_string, 10, nil, :multiplexer => socket)
+  end
+
+  after do
+    @zk and @zk.close
+    Process.kill(:TERM, @mux)
+    Process.wait(@mux)
+  end
+
+  def zk
+    @zk
+  end
+
+  it_should_behave_like "connection"
+
+  it %[should share the multiplexer's session with other workers] do
+    other = Zookeeper.new(connection_string, 10, nil, :multiplexer => socket)
+
+    begin
+      expect(other.session_id).to eq(zk.session_id)
+    ensure
+      other.close
+    end
+  end
+
+  it %[should delete a worker's ephemeral nodes when it closes] do
+    other = Zookeeper.new(connection_string, 10, nil, :multiplexer => socket)
+    expect(other.create(:path => path, :data => 'x', :ephemeral => true)[:rc]).to eq(ZOK)
+    other.close
+
+    wait_until { zk.stat(:path => path)[:rc] == ZNONODE }
+    expect(zk.stat(:path => path)[:rc]).to eq(ZNONODE)
+  end
+
+  it %[should not delete an ephemeral node another worker created after it] do
+    other = Zookeeper.new(connection_string, 10, nil, :multiplexer => socket)
+    expect(other.create(:path => path, :data => 'x', :ephemeral => true)[:rc]).to eq(ZOK)
+    expect(zk.delete(:path => path)[:rc]).to eq(ZOK)
+    expect(zk.create(:path => path, :data => 'y', :ephemeral => true)[:rc]).to eq(ZOK)
+    other.close
+
+    zk.sync(:path => path)
+    expect(zk.get(:path => path)[:data]).to eq('y')
+    zk.delete(:path => path)
+  end
+
+  it %[should drop a worker that sends something it can't read, and serve the others] do
+    sock = UNIXSocket.new(socket)
+
+    begin
+      sock.write(Zookeeper::Multiplexer::Protocol.value_frame(Zookeeper::Multiplexer::Protocol::HELLO, [Zookeeper::Multiplexer::Protocol::VERSION, Process.pid, connection_string]))
+      sock.write(Zookeeper::Multiplexer::Protocol.frame(Zookeeper::Multiplexer::Protocol::CALL, [1, 200].pack('q>C')))
+
+      wait_until { IO.select([sock], nil, nil, 0) and sock.read_nonblock(65536, exception: false).nil? }
+      expect(sock.read_nonblock(65536, exception: false)).to be_nil
+    ensure
+      sock.close
+    end
+
+    expect(zk.stat(:path => '/')[:rc]).to eq(ZOK)
+  end
+
+  it %[should be refused by a multiplexer for another host] do
+    other = Zookeeper.new('otherhost:2181', 10, nil, :multiplexer => socket)
+
+    begin
+      expect(other).to be_closed
+    ensure
+      other.close
+    end
+  end
+
+  it %[should not hand back the pid of a multiplexer that couldn't start] do
+    expect { Zookeeper::Multiplexer.spawn(connection_string, socket) }.to raise_error(Zookeeper::Exceptions::ZookeeperException, /exited/)
+  end
+
+  it %[should see its session expire when the multiplexer goes away] do
+    Process.kill(:TERM, @mux)
+    Process.wait(@mux)
+    @mux = Zookeeper::Multiplexer.spawn(connection_string, socket)
+
+    wait_until { zk.state == ZOO_EXPIRED_SESSION_STATE }
+    expect(zk.state).to eq(ZOO_EXPIRED_SESSION_STATE)
+
+    zk.reopen
+    expect(zk).to be_connected
+  end
+end
@@ -0,0 +1,150 @@
+require 'spec_helper'
+require 'shared/connection_examples'
+
+describe Zookeeper::Pool do
+  include Zookeeper::Constants
+
+  # a Pool of FakeClients that all have /x
+  def fake_pool(hosts, opts)
+    Class.new(Zookeeper::Pool) {
+      protected
+        def new_client(host, timeout, watcher, opts)
+          Zookeeper::SpecHelpers::FakeClient.new(host, '/' => nil, '/x' => nil)
+        end
+    }.new(hosts, opts)
+  end
+
+  let(:pool) { fake_pool('a:1,b:2,c:3/app', :size => 4) }
+  let(:clients) { pool.members.map(&:client) }
+
+  it %[should give the primary every host, the others one each] do
+    expect(clients.map(&:host)).to eq(['a:1,b:2,c:3/app', 'a:1/app', 'b:2/app', 'c:3/app'])
+    expect(fake_pool('a:1,b:2', :size => 2, :pin_hosts => false).members.map(&:host)).to eq(['a:1,b:2'] * 2)
+  end
+
+  it %[should send writes and watched reads to the primary] do
+    pool.set(:path => '/x', :data => 'y')
+    pool.create(:path => '/z')
+    pool.get(:path => '/x', :watcher => proc {})
+
+    expect(clients[0].calls).to eq([:set, :create, :get])
+    expect(clients[1..-1].map(&:calls).flatten).to be_empty
+  end
+
+  it %[should send reads to the member with the least outstanding] do
+    clients[0].outstanding = 0
+    clients[1].outstanding = 5
+    clients[2].outstanding = 1
+    clients[3].outstanding = 3
+
+    pool.get(:path => '/x')
+    expect(clients[0].calls).to eq([:get])
+
+    clients[0].outstanding = 2
+    pool.stat(:path => '/x')
+    expect(clients[2].calls).to eq([:stat])
+  end
+
+  it %[should spread idle reads over the members other than the primary] do
+    6.times { pool.get(:path => '/x') }
+    expect(clients.map { |c| c.calls.length }).to eq([0, 2, 2, 2])
+  end
+
+  it %[should skip the members that aren't connected] do
+    clients[1].connected = clients[2].connected = false
+    3.times { pool.get_children(:path => '/x') }
+
+    expect(clients[3].calls.length).to eq(3)
+    expect(pool.stats.map { |s| s[:connected] }).to eq([true, false, false, true])
+  end
+
+  it %[should try a read that lost its connection on another member] do
+    clients[1].rc = ZCONNECTIONLOSS
+    rv = pool.get(:path => '/x')
+
+    expect(rv[:rc]).to eq(ZOK)
+    expect(clients[1].calls).to eq([:get])
+    expect(pool.stats[1][:errors]).to eq(1)
+  end
+
+  it %[should try a read whose client raised for want of a connection on another member] do
+    clients[1].raises = Zookeeper::Exceptions::NotConnected
+    expect(pool.get(:path => '/x')[:rc]).to eq(ZOK)
+    expect(clients[1].calls).to eq([:get])
+    expect(clients[2].calls).to eq([:get])
+
+    clients[1].raises = nil
+    clients[3].raises = Zookeeper::Exceptions::ContinuationTimeoutError
+    expect(pool.get(:path => '/x')[:rc]).to eq(ZOK)
+    expect(clients[3].calls).to eq([:get])
+    expect(clients[1].calls).to eq([:get, :get])
+
+    expect(pool.stats.map { |s| s[:errors] }).to eq([0, 1, 0, 1])
+  end
+
+  it %[should raise from a read when no other member is connected] do
+    clients[1..-1].each { |c| c.connected = false }
+    clients[0].raises = Zookeeper::Exceptions::NotConnected
+
+    expect { pool.get(:path => '/x') }.to raise_error(Zookeeper::Exceptions::NotConnected)
+  end
+
+  it %[should reopen a member whose session expired] do
+    clients[2].state = ZOO_EXPIRED_SESSION_STATE
+    clients[2].connected = false
+    pool.get(:path => '/x')
+
+    wait_until(2) { clients[2].connected? }
+    expect(clients[2]).to be_connected
+    expect(pool.stats[2][:reopens]).to eq(1)
+  end
+
+  it %[should add auth to every member] do
+    pool.add_auth(:scheme => 'digest', :cert => 'u:p')
+    expect(clients.map(&:calls)).to eq([[:add_auth]] * 4)
+  end
+
+  it %[should count each member's reads and writes] do
+    pool.multi(:ops => [])
+    2.times { pool.get(:path => '/x') }
+
+    stats = pool.stats
+    expect(stats[0]).to include(:primary => true, :writes => 1, :reads => 0)
+    expect(stats.map { |s| s[:reads] }.inject(:+)).to eq(2)
+  end
+
+  it %[should raise BadArguments for a bad :size] do
+    expect { fake_pool('a:1', :size => 0) }.to raise_error(Zookeeper::Exceptions::BadArguments)
+  end
+end
+
+describe 'Zookeeper::Pool against a server' do
+  let(:path) { "/_zktest_" }
+  let(:data) { "underpants" }
+  let(:connection_string) { Zookeeper.default_cnx_str }
+
+  before do
+    @zk = Zookeeper::Pool.new(connection_string, :size => 3)
+  end
+
+  after do
+    @zk and @zk.close
+  end
+
+  def zk
+    @zk
+  end
+
+  it_should_behave_like "connection"
+
+  it %[should spread reads over sessions that see the primary's writes] do
+    ensure_node(zk, path, data)
+    zk.set(:path => path, :data => 'changed')
+
+    6.times { expect(zk.get(:path => path)[:data]).to eq('changed') }
+
+    stats = zk.stats
+    expect(stats.map { |s| s[:session_id] }.uniq.length).to eq(3)
+    expect(stats.count { |s| s[:reads] > 0 }).to be > 1
+  end
+end
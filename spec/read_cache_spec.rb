@@ -0,0 +1,184 @@
+require 'spec_helper'
+require 'shared/connection_examples'
+
+describe Zookeeper::ReadCache do
+  include Zookeeper::Constants
+
+  subject { described_class.new(:max_entries => 2) }
+
+  let(:key) { [:get, '/path', false] }
+  let(:rv)  { { :req_id => 1, :rc => ZOK, :data => 'data', :stat => nil } }
+
+  # what cached_read does on a miss: the read for key and, if the path's
+  # other watch is missing, the read that sets it, which gets other_rc
+  def fetch(key, rv, other_rc = ZOK, cache = subject)
+    token, unwatched = cache.begin_fetch(key)
+    cache.store(key, token, reads_for(key, unwatched, rv[:rc], other_rc), rv)
+  end
+
+  def reads_for(key, unwatched, rc, other_rc = ZOK)
+    unwatched.map do |w|
+      w == described_class::WATCH_OF[key.first] ? [key.first, rc] : [described_class::WATCH_READS[w], other_rc]
+    end
+  end
+
+  it %[should keep a result until its path is invalidated] do
+    expect(fetch(key, rv)).to be(true)
+    expect(subject.lookup(key)).to eq(:rc => ZOK, :data => 'data', :stat => nil)
+
+    subject.invalidate('/path')
+    expect(subject.lookup(key)).to be_nil
+    expect(subject.stats.values_at(:hits, :misses, :invalidations)).to eq([1, 1, 1])
+  end
+
+  it %[should hand out copies of the data] do
+    fetch(key, rv)
+    subject.lookup(key)[:data] << 'x'
+    expect(subject.lookup(key)[:data]).to eq('data')
+  end
+
+  it %[should not keep a response that was on its way when the path was invalidated] do
+    token, unwatched = subject.begin_fetch(key)
+    subject.event(:type => ZOO_CHANGED_EVENT, :path => '/path')
+
+    expect(subject.store(key, token, reads_for(key, unwatched, ZOK), rv)).to be(false)
+    expect(subject.lookup(key)).to be_nil
+  end
+
+  it %[should only ask for a watch if there isn't one set already] do
+    fetch(key, rv)
+    expect(subject.begin_fetch(key).last).to be_empty
+
+    subject.invalidate('/path')
+    expect(subject.begin_fetch(key).last).to eq([:data, :child])
+  end
+
+  it %[should only keep a result once both of its path's watches are set] do
+    expect(fetch(key, rv, ZNONODE)).to be(false)
+    expect(subject.lookup(key)).to be_nil
+    expect(subject.begin_fetch(key).last).to eq([:child])
+
+    expect(fetch([:get_children, '/path', false], rv.merge(:data => nil, :children => []))).to be(true)
+    expect(fetch(key, rv)).to be(true)
+  end
+
+  it %[should forget only the watches an event used up] do
+    fetch(key, rv)
+    subject.event(:type => ZOO_CHILD_EVENT, :path => '/path')
+
+    expect(subject.lookup(key)).to be_nil
+    expect(subject.begin_fetch(key).last).to eq([:child])
+
+    subject.event(:type => ZOO_DELETED_EVENT, :path => '/path')
+    expect(subject.begin_fetch(key).last).to eq([:data, :child])
+  end
+
+  it %[should only keep results that left a watch set] do
+    expect(fetch(key, rv.merge(:rc => ZNONODE))).to be(false)
+    expect(fetch([:stat, '/path', false], rv.merge(:rc => ZNONODE))).to be(true)
+  end
+
+  it %[should evict the least recently used entry] do
+    %w[/a /b].each { |path| fetch([:get, path, false], rv) }
+    subject.lookup([:get, '/a', false])
+    fetch([:get, '/c', false], rv)
+
+    expect(subject.lookup([:get, '/b', false])).to be_nil
+    expect(subject.lookup([:get, '/a', false])).not_to be_nil
+    expect(subject.stats[:evictions]).to eq(1)
+  end
+
+  it %[should stay within :max_bytes] do
+    cache = described_class.new(:max_bytes => 2 * described_class::ENTRY_OVERHEAD + 20)
+
+    %w[/a /b /c].each { |path| fetch([:get, path, false], rv, ZOK, cache) }
+
+    expect(cache.stats[:entries]).to eq(2)
+    expect(cache.stats[:bytes]).to be <= cache.max_bytes
+  end
+
+  it %[should drop everything when the connection is lost] do
+    fetch(key, rv)
+    subject.event(:type => ZOO_SESSION_EVENT, :state => ZOO_CONNECTED_STATE)
+    expect(subject.stats[:entries]).to eq(1)
+
+    subject.event(:type => ZOO_SESSION_EVENT, :state => ZOO_CONNECTING_STATE)
+    expect(subject.stats[:entries]).to eq(0)
+    expect(subject.stats[:flushes]).to eq(1)
+  end
+
+  it %[should remember its watches across a reconnect, but not a new session] do
+    fetch(key, rv)
+
+    subject.event(:type => ZOO_SESSION_EVENT, :state => ZOO_CONNECTING_STATE)
+    expect(subject.begin_fetch(key).last).to be_empty
+
+    subject.event(:type => ZOO_SESSION_EVENT, :state => ZOO_EXPIRED_SESSION_STATE)
+    expect(subject.begin_fetch(key).last).to eq([:data, :child])
+  end
+end
+
+describe 'Zookeeper with a :read_cache' do
+  let(:path) { "/_zktest_" }
+  let(:data) { "underpants" }
+  let(:connection_string) { Zookeeper.default_cnx_str }
+
+  before do
+    @zk = Zookeeper.new(connection_string, 10, nil, :read_cache => true)
+  end
+
+  after do
+    @zk and @zk.close
+  end
+
+  def zk
+    @zk
+  end
+
+  it_should_behave_like "connection"
+
+  describe 'reads' do
+    before do
+      zk.delete(:path => path)
+      zk.create(:path => path, :data => data)
+    end
+
+    after do
+      zk.delete(:path => path)
+    end
+
+    it %[should answer repeated reads without asking the server] do
+      3.times { expect(zk.get(:path => path)[:data]).to eq(data) }
+      expect(zk.read_cache_stats.values_at(:hits, :misses)).to eq([2, 1])
+    end
+
+    it %[should see its own writes straight away] do
+      zk.get(:path => path)
+      zk.set(:path => path, :data => 'changed')
+      expect(zk.get(:path => path)[:data]).to eq('changed')
+    end
+
+    it %[should see another client's writes once the watch fires] do
+      zk.get(:path => path)
+
+      other = Zookeeper.new(connection_string)
+      other.set(:path => path, :data => 'changed')
+      other.close
+
+      wait_until(2) { zk.get(:path => path)[:data] == 'changed' }
+      expect(zk.get(:path => path)[:data]).to eq('changed')
+      expect(zk.read_cache_stats[:invalidations]).to eq(1)
+    end
+
+    it %[should not hand out children with a stat from before the data changed] do
+      version = zk.get_children(:path => path)[:stat].version
+
+      other = Zookeeper.new(connection_string)
+      other.set(:path => path, :data => 'changed')
+      other.close
+
+      wait_until(2) { zk.get_children(:path => path)[:stat].version == version + 1 }
+      expect(zk.get_children(:path => path)[:stat].version).to eq(version + 1)
+    end
+  end
+end
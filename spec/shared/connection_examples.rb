@@ -1,4 +1,5 @@
 require 'shared/all_success_return_values'
+require 'tmpdir'
 
 shared_examples_for "connection" do
 
@@ -55,6 +56,22 @@ shared_examples_for "connection" do
         expect(@watcher).to be_completed
         expect(@watcher.type).to eq(Zookeeper::ZOO_CHANGED_EVENT)
       end
+
+      it %[should fire the watchers of later reads too, with their own contexts] do
+        others = 3.times.map do |n|
+          Zookeeper::Callbacks::WatcherCallback.new.tap do |w|
+            zk.get(:path => path, :watcher => w, :watcher_context => n)
+          end
+        end
+
+        expect(zk.set(:path => path, :data => 'blah')[:rc]).to be_zero
+
+        wait_until(1.0) { others.all?(&:completed?) }
+
+        expect(others.map(&:context)).to eq([0, 1, 2])
+        expect(others.map(&:type).uniq).to eq([Zookeeper::ZOO_CHANGED_EVENT])
+        expect(@watcher).to be_completed
+      end
     end
 
     describe :async, :async => true do
@@ -126,6 +143,39 @@ shared_examples_for "connection" do
         expect { zk.get(:bad_arg => 'what!?') }.to raise_error(Zookeeper::Exceptions::BadArguments)
       end
     end
+
+    describe 'with a :timeout', :sync => true do
+      it %[should return the data if the server answers in time] do
+        rv = zk.get(:path => path, :timeout => 5)
+        expect(rv[:rc]).to eq(Zookeeper::Constants::ZOK)
+        expect(rv[:data]).to eq(data)
+      end
+
+      it %[should barf with a BadArguments error unless it's a positive number] do
+        expect { zk.get(:path => path, :timeout => 0) }.to raise_error(Zookeeper::Exceptions::BadArguments)
+        expect { zk.get(:path => path, :timeout => '1') }.to raise_error(Zookeeper::Exceptions::BadArguments)
+      end
+    end
+
+    describe 'from many threads at once', :sync => true do
+      it %[should give every caller the data] do
+        rvs = 20.times.map { Thread.new { zk.get(:path => path) } }.map(&:value)
+
+        expect(rvs.map { |rv| rv[:rc] }.uniq).to eq([Zookeeper::Constants::ZOK])
+        expect(rvs.map { |rv| rv[:data] }.uniq).to eq([data])
+        expect(rvs.map { |rv| rv[:req_id] }.uniq.length).to eq(20)
+      end
+
+      it %[should set every caller's watcher] do
+        watchers = 10.times.map { Zookeeper::Callbacks::WatcherCallback.new }
+        watchers.map { |w| Thread.new { zk.get(:path => path, :watcher => w) } }.each(&:join)
+
+        zk.set(:path => path, :data => 'changed')
+
+        wait_until(2) { watchers.all?(&:completed?) }
+        expect(watchers.map(&:type).uniq).to eq([Zookeeper::ZOO_CHANGED_EVENT])
+      end
+    end
   end   # get
 
   describe :set do
@@ -315,6 +365,98 @@ shared_examples_for "connection" do
       end
     end
 
+    describe :sync_packed, :sync => true do
+      it_should_behave_like "all success return values"
+
+      before do
+        @rv = zk.get_children(:path => path, :packed => true)
+      end
+
+      it %[should have a collection of the names of the children] do
+        expect(@rv[:children].length).to eq(3)
+        expect(@rv[:children].sort).to eq(@children.sort)
+        expect(@rv[:children]).to include('child1')
+        expect(@rv[:children]).not_to include('child9')
+      end
+
+      # packed children are only implemented by the C extension
+      unless defined?(::JRUBY_VERSION)
+        it %[should behave like the Array of the same names] do
+          children = @rv[:children]
+          names = zk.get_children(:path => path)[:children]
+
+          expect(children).to be_kind_of(Zookeeper::Children)
+          expect(children).to eq(names)
+          expect(names).to eq(children)
+          expect(children).to eql(names)
+          expect(children.hash).to eq(names.hash)
+          expect({ names => true }[children]).to be(true)
+
+          expect(children.to_ary).to eq(names)
+          first, *rest = children
+          expect([first, *rest]).to eq(names)
+
+          expect(children).not_to be_empty
+          expect(children.last).to eq(names.last)
+          expect(children.last(2)).to eq(names.last(2))
+          expect(children.last(9)).to eq(names)
+        end
+
+        it %[should look names up by position and by name] do
+          children = @rv[:children]
+
+          expect(children[0]).to eq(children.first)
+          expect(children[-1]).to eq(children.last)
+          expect(children[3]).to be_nil
+          expect(children.index(children[1])).to eq(1)
+          expect(children.index('child9')).to be_nil
+        end
+
+        it %[should yield the names in sorted order from each_sorted] do
+          expect(@rv[:children].each_sorted.to_a).to eq(@children.sort)
+        end
+      end
+    end
+
+    unless defined?(::JRUBY_VERSION)
+      describe :async_packed, :async => true do
+        it_should_behave_like "all success return values"
+
+        before do
+          @cb = Zookeeper::Callbacks::StringsCallback.new
+          @rv = zk.get_children(:path => path, :packed => true, :callback => @cb, :callback_context => path)
+
+          wait_until { @cb.completed? }
+          expect(@cb).to be_completed
+        end
+
+        it %[should hand the callback the packed children] do
+          expect(@cb.return_code).to eq(Zookeeper::ZOK)
+          expect(@cb.children).to be_kind_of(Zookeeper::Children)
+          expect(@cb.children.sort).to eq(@children.sort)
+        end
+      end
+
+      describe :sync_packed_empty, :sync => true do
+        before do
+          @rv = zk.get_children(:path => "#{path}/child0", :packed => true)
+        end
+
+        it %[should have an empty collection for a node without children] do
+          children = @rv[:children]
+
+          expect(@rv[:rc]).to eq(Zookeeper::ZOK)
+          expect(children).to be_kind_of(Zookeeper::Children)
+          expect(children).to be_empty
+          expect(children.size).to eq(0)
+          expect(children).to eq([])
+          expect(children[0]).to be_nil
+          expect(children.last).to be_nil
+          expect(children.each_sorted.to_a).to eq([])
+        end
+      end
+    end
+
     describe :sync_watch, :sync => true do
       it_should_behave_like "all success return values"
 
@@ -913,6 +1055,313 @@ shared_examples_for "connection" do
     end # async
   end # delete
 
+  # the java client jar we ship predates multi
+  unless defined?(::JRUBY_VERSION)
+    describe :multi do
+      after do
+        rm_rf(zk, "#{path}/child")
+        zk.get_children(:path => path)[:children].grep(/^seq-/).each { |name| zk.delete(:path => "#{path}/#{name}") }
+      end
+
+      describe :sync, :sync => true do
+        describe 'when all ops succeed' do
+          it_should_behave_like "all success return values"
+
+          before do
+            @stat = zk.stat(:path => path)[:stat]
+
+            @rv = zk.multi do |m|
+              m.check(:path => path, :version => @stat.version)
+              m.create(:path => "#{path}/child", :data => 'child')
+              m.create(:path => "#{path}/seq-", :sequence => true)
+              m.set(:path => path, :data => 'updated')
+            end
+          end
+
+          it %[should return a result per op] do
+            expect(@rv[:results].map(&:op)).to eq([:check, :create, :create, :set])
+            expect(@rv[:results]).to all(be_ok)
+          end
+
+          it %[should return the created paths] do
+            expect(@rv[:results][1].path).to eq("#{path}/child")
+            expect(@rv[:results][2].path).to match(%r%^#{path}/seq-\d{10}$%)
+          end
+
+          it %[should return the stat of the set] do
+            expect(@rv[:results][3].stat.version).to eq(@stat.version + 1)
+          end
+
+          it %[should have applied all ops] do
+            expect(zk.get(:path => "#{path}/child")[:data]).to eq('child')
+            expect(zk.get(:path => path)[:data]).to eq('updated')
+          end
+        end
+
+        describe 'when an op fails' do
+          before do
+            @rv = zk.multi(:ops => [
+              [:create, {:path => "#{path}/child"}],
+              [:delete, {:path => "#{path}/nonexistent"}],
+              [:set,    {:path => path, :data => 'updated'}],
+            ])
+          end
+
+          it %[should have the return code of the failed op] do
+            expect(@rv[:rc]).to eq(Zookeeper::ZNONODE)
+          end
+
+          it %[should report the failed op and the ones that were rolled back] do
+            expect(@rv[:results].map(&:rc)).to eq([Zookeeper::ZOK, Zookeeper::ZNONODE, Zookeeper::ZRUNTIMEINCONSISTENCY])
+          end
+
+          it %[should not have applied any op] do
+            expect(zk.stat(:path => "#{path}/child")[:stat].exists).to be_falsey
+            expect(zk.get(:path => path)[:data]).to eq(data)
+          end
+        end
+
+        it %[should raise BadArguments for an unknown op] do
+          expect { zk.multi(:ops => [[:frob, {:path => path}]]) }.to raise_error(Zookeeper::Exceptions::BadArguments)
+        end
+      end # sync
+
+      describe :async, :async => true do
+        it_should_behave_like "all success return values"
+
+        before do
+          @cb = Zookeeper::Callbacks::MultiCallback.new
+
+          @rv = zk.multi(:ops => Zookeeper::Multi.new.create(:path => "#{path}/child"), :callback => @cb, :callback_context => path)
+          wait_until { @cb.completed? }
+          expect(@cb).to be_completed
+        end
+
+        it %[should have a success return_code] do
+          expect(@cb.return_code).to eq(Zookeeper::ZOK)
+        end
+
+        it %[should have the results] do
+          expect(@cb.results.length).to eq(1)
+          expect(@cb.results.first.path).to eq("#{path}/child")
+        end
+
+        it %[should have the callback context] do
+          expect(@cb.context).to eq(path)
+        end
+      end # async
+    end # multi
+  end
+
+  describe :pipeline do
+    after do
+      rm_rf(zk, "#{path}/child")
+    end
+
+    before do
+      @rv = zk.pipeline do |p|
+        p.set(:path => path, :data => 'pipelined')
+        p.get(:path => path)
+        p.stat(:path => "#{path}/nonexistent")
+        p.create(:path => "#{path}/child", :data => 'child')
+        p.get_children(:path => path)
+      end
+    end
+
+    it %[should return the results in order] do
+      expect(@rv.map { |h| h[:rc] }).to eq([Zookeeper::ZOK, Zookeeper::ZOK, Zookeeper::ZNONODE, Zookeeper::ZOK, Zookeeper::ZOK])
+    end
+
+    it %[should return what the sync calls return] do
+      expect(@rv[0][:stat]).to be_kind_of(Zookeeper::Stat)
+      expect(@rv[1][:data]).to eq('pipelined')
+      expect(@rv[2][:stat]).not_to be_exists
+      expect(@rv[3][:path]).to eq("#{path}/child")
+      expect(@rv[4][:children]).to eq(['child'])
+    end
+
+    describe 'without a block' do
+      before do
+        @pipeline = zk.pipeline
+      end
+
+      it %[should return futures that send the requests when asked for a value] do
+        data = @pipeline.get(:path => path).then { |h| h[:data] }
+        stat = @pipeline.stat(:path => path)
+
+        expect(data.value).to eq('pipelined')
+        expect(stat).not_to be_resolved
+        expect(stat.value[:stat].version).to eq(@rv[0][:stat].version)
+      end
+
+      it %[should return a future that raises for bad arguments] do
+        future = @pipeline.get(:bogus => true)
+        expect { future.value }.to raise_error(Zookeeper::Exceptions::BadArguments)
+      end
+    end
+  end
+
+  describe :get_tree, :sync => true do
+    before do
+      zk.create(:path => "#{path}/a", :data => 'a')
+      zk.create(:path => "#{path}/a/x", :data => 'x')
+      zk.create(:path => "#{path}/b")
+    end
+
+    after do
+      rm_rf(zk, "#{path}/a")
+      rm_rf(zk, "#{path}/b")
+    end
+
+    it %[should return the subtree as nested hashes] do
+      rv = zk.get_tree(:path => path)
+
+      expect(rv[:rc]).to eq(Zookeeper::ZOK)
+      expect(rv[:tree][:data]).to eq(data)
+      expect(rv[:tree][:children].keys.sort).to eq(%w[a b])
+      expect(rv[:tree][:children]['a'][:children]['x'][:data]).to eq('x')
+      expect(rv[:tree][:children]['a'][:stat].numChildren).to eq(1)
+      expect(rv[:tree][:children]['b'][:children]).to be_empty
+    end
+
+    it %[should yield each node breadth first when given a block] do
+      nodes = []
+      rv = zk.get_tree(:path => path, :concurrency => 1) { |p, d, st| nodes << [p, d, st] }
+
+      expect(rv[:rc]).to eq(Zookeeper::ZOK)
+      expect(rv).not_to have_key(:tree)
+      paths = nodes.map(&:first)
+      expect(paths.first).to eq(path)
+      expect(paths[1, 2]).to match_array(["#{path}/a", "#{path}/b"])
+      expect(paths.last).to eq("#{path}/a/x")
+      expect(nodes.last[1]).to eq('x')
+      expect(nodes.map(&:last)).to all(be_kind_of(Zookeeper::Stat))
+    end
+
+    it %[should stop at :depth] do
+      rv = zk.get_tree(:path => path, :depth => 1)
+      expect(rv[:tree][:children]['a'][:children]).to be_empty
+
+      rv = zk.get_tree(:path => path, :depth => 0)
+      expect(rv[:tree][:children]).to be_empty
+    end
+
+    it %[should return ZNONODE for a missing node] do
+      rv = zk.get_tree(:path => "#{path}/nonexistent")
+      expect(rv[:rc]).to eq(Zookeeper::ZNONODE)
+      expect(rv).not_to have_key(:tree)
+    end
+
+    it %[should raise BadArguments for a bad :depth or :concurrency] do
+      expect { zk.get_tree(:path => path, :depth => -1) }.to raise_error(Zookeeper::Exceptions::BadArguments)
+      expect { zk.get_tree(:path => path, :concurrency => 0) }.to raise_error(Zookeeper::Exceptions::BadArguments)
+    end
+  end
+
+  describe :delete_tree, :sync => true do
+    before do
+      zk.create(:path => "#{path}/gone")
+      3.times { |i| zk.create(:path => "#{path}/gone/#{i}") }
+      zk.create(:path => "#{path}/gone/0/x")
+    end
+
+    after do
+      rm_rf(zk, "#{path}/gone")
+    end
+
+    it %[should delete the node and everything below it] do
+      rv = zk.delete_tree(:path => "#{path}/gone", :batch_size => 2)
+
+      expect(rv[:rc]).to eq(Zookeeper::ZOK)
+      expect(rv[:deleted]).to eq(5)
+      expect(zk.stat(:path => "#{path}/gone")[:stat]).not_to be_exists
+      expect(zk.stat(:path => path)[:stat]).to be_exists
+    end
+
+    it %[should report its progress to the block] do
+      seen = []
+      zk.delete_tree(:path => "#{path}/gone", :batch_size => 1, :concurrency => 1) { |progress| seen << progress[:deleted] }
+      expect(seen).to eq([1, 2, 3, 4, 5])
+    end
+
+    it %[should return ZNONODE for a missing node] do
+      expect(zk.delete_tree(:path => "#{path}/nonexistent")[:rc]).to eq(Zookeeper::ZNONODE)
+    end
+  end
+
+  describe :bulk_load, :sync => true do
+    let(:records) { (0...3).map { |i| ["#{path}/loaded/#{i}/leaf", "data #{i}"] } }
+
+    after do
+      rm_rf(zk, "#{path}/loaded")
+    end
+
+    it %[should create the nodes and their missing parents] do
+      rv = zk.bulk_load(records, :concurrency => 2)
+
+      expect(rv[:rc]).to eq(Zookeeper::ZOK)
+      expect(rv[:created]).to eq(3)
+      expect(rv[:parents]).to eq(4)
+      expect(zk.get(:path => "#{path}/loaded/2/leaf")[:data]).to eq('data 2')
+    end
+
+    it %[should skip or overwrite the nodes that exist] do
+      zk.bulk_load(records)
+      zk.set(:path => "#{path}/loaded/1/leaf", :data => 'changed')
+
+      expect(zk.bulk_load(records)[:skipped]).to eq(3)
+      expect(zk.get(:path => "#{path}/loaded/1/leaf")[:data]).to eq('changed')
+
+      expect(zk.bulk_load(records, :on_exists => :overwrite)[:overwritten]).to eq(3)
+      expect(zk.get(:path => "#{path}/loaded/1/leaf")[:data]).to eq('data 1')
+    end
+  end
+
+  describe :export_tree, :sync => true do
+    let(:file) { File.join(Dir.tmpdir, "zk-snapshot-#{Process.pid}") }
+
+    before do
+      zk.create(:path => "#{path}/snap", :data => 'top')
+      zk.create(:path => "#{path}/snap/a", :data => 'a')
+      zk.create(:path => "#{path}/snap/b", :data => 'b')
+    end
+
+    after do
+      rm_rf(zk, "#{path}/snap")
+      File.unlink(file) if File.exist?(file)
+    end
+
+    it %[should write a snapshot that answers reads] do
+      rv = zk.export_tree(:path => "#{path}/snap", :file => file)
+      expect(rv[:rc]).to eq(Zookeeper::ZOK)
+      expect(rv[:nodes]).to eq(3)
+
+      snapshot = Zookeeper.load_snapshot(file)
+      expect(snapshot.get(:path => "#{path}/snap/b")[:data]).to eq('b')
+      expect(snapshot.get_children(:path => "#{path}/snap")[:children].sort).to eq(%w[a b])
+      expect(snapshot.mzxid("#{path}/snap/a")).to eq(zk.stat(:path => "#{path}/snap/a")[:stat].mzxid)
+    end
+
+    it %[should only read what changed since the last snapshot] do
+      zk.export_tree(:path => "#{path}/snap", :file => file)
+      zk.set(:path => "#{path}/snap/a", :data => 'changed')
+      zk.create(:path => "#{path}/snap/c", :data => 'c')
+
+      rv = zk.export_tree(:path => "#{path}/snap", :file => file, :since => Zookeeper.load_snapshot(file))
+      expect(rv[:fetched]).to eq(2)
+
+      snapshot = Zookeeper.load_snapshot(file)
+      expect(snapshot.get(:path => "#{path}/snap/a")[:data]).to eq('changed')
+      expect(snapshot.get(:path => "#{path}/snap/b")[:data]).to eq('b')
+      expect(snapshot.get(:path => "#{path}/snap/c")[:data]).to eq('c')
+    end
+
+    it %[should return ZNONODE for a missing node] do
+      expect(zk.export_tree(:path => "#{path}/nonexistent", :file => file)[:rc]).to eq(Zookeeper::ZNONODE)
+      expect(File.exist?(file)).to be(false)
+    end
+  end
+
   describe :get_acl do
     describe :sync, :sync => true do
       it_should_behave_like "all success return values"
@@ -0,0 +1,91 @@
+require 'spec_helper'
+require 'stringio'
+
+describe Zookeeper::Snapshot do
+  include Zookeeper::Constants
+
+  def stat_for(mzxid, num_children = 0)
+    Zookeeper::Stat.new([1, mzxid, 1000, 2000, 3, 4, 0, 0, 5, num_children, 6])
+  end
+
+  let(:nodes) do
+    [ ['/app',             'root', stat_for(10, 2)],
+      ['/app/b',           nil,    stat_for(12, 0)],
+      ['/app/a',           'a',    stat_for(11, 2)],
+      ['/app/a/y',         'y',    stat_for(14, 0)],
+      ['/app/a/x',         "\0\1", stat_for(13, 0)],
+      ['/app/a-sibling',   '',     stat_for(15, 0)] ]
+  end
+
+  let(:io) { StringIO.new(''.force_encoding('BINARY')) }
+
+  let(:snapshot) do
+    described_class.write(io, '/app', nodes)
+    io.rewind
+    described_class.load(io)
+  end
+
+  it %[should remember the root, the node count and the highest mzxid] do
+    expect(snapshot.root).to eq('/app')
+    expect(snapshot.size).to eq(6)
+    expect(snapshot.zxid).to eq(15)
+  end
+
+  it %[should return every node's data and stat] do
+    nodes.each do |path, data, stat|
+      rv = snapshot.get(:path => path)
+      expect(rv[:rc]).to eq(ZOK)
+      expect(rv[:data]).to eq(data)
+      expect(rv[:stat]).to eq(stat)
+      expect(rv[:stat].to_a).to eq(stat.to_a)
+    end
+  end
+
+  it %[should return a node's children, and only those] do
+    expect(snapshot.get_children(:path => '/app')[:children]).to eq(['a', 'a-sibling', 'b'])
+    expect(snapshot.get_children(:path => '/app/a')[:children]).to eq(['x', 'y'])
+    expect(snapshot.get_children(:path => '/app/a/x')[:children]).to eq([])
+    expect(snapshot.get_children(:path => '/app/a')[:stat].num_children).to eq(2)
+  end
+
+  it %[should return ZNONODE for paths it doesn't have] do
+    ['/', '/ap', '/app/c', '/app/a/x/z', '/other'].each do |path|
+      expect(snapshot.get(:path => path)[:rc]).to eq(ZNONODE)
+      expect(snapshot.get_children(:path => path)[:rc]).to eq(ZNONODE)
+      expect(snapshot.stat(:path => path)[:stat]).not_to be_exists
+    end
+  end
+
+  it %[should know each node's mzxid] do
+    expect(snapshot.mzxid('/app/a/y')).to eq(14)
+    expect(snapshot.mzxid('/app/nope')).to be_nil
+  end
+
+  it %[should yield the parents before their children] do
+    paths = snapshot.each.map { |path, _, _| path }
+
+    expect(paths.sort).to eq(nodes.map(&:first).sort)
+    expect(paths.index('/app')).to eq(0)
+    expect(paths.index('/app/a')).to be < paths.index('/app/a/x')
+  end
+
+  it %[should take a snapshot of the root] do
+    described_class.write(io, '/', [['/', nil, stat_for(0, 1)], ['/zookeeper', '', stat_for(0)]])
+    io.rewind
+    snapshot = described_class.load(io)
+
+    expect(snapshot.get_children(:path => '/')[:children]).to eq(['zookeeper'])
+    expect(snapshot.get(:path => '/')[:rc]).to eq(ZOK)
+  end
+
+  it %[should refuse what isn't a snapshot] do
+    expect { described_class.load(StringIO.new('ZKRBSNAP' + "\0" * 40)) }.to raise_error(Zookeeper::Exceptions::ZookeeperException)
+
+    described_class.write(io, '/app', nodes)
+    expect { described_class.new(io.string[0...-1]) }.to raise_error(Zookeeper::Exceptions::ZookeeperException)
+  end
+
+  it %[should raise BadArguments for anything but a :path] do
+    expect { snapshot.get(:path => '/app', :watcher => proc {}) }.to raise_error(Zookeeper::Exceptions::BadArguments)
+  end
+end
@@ -0,0 +1,45 @@
+require 'spec_helper'
+
+describe Zookeeper::Stat do
+  let(:fields) { [1, 7, 1000, 2000, 2, 4, 0, 0, 1, 2, 5] }
+
+  it %[should treat nil as a node that does not exist] do
+    stat = Zookeeper::Stat.new(nil)
+    expect(stat).not_to be_exists
+    expect(stat.version).to be_nil
+  end
+
+  it %[should build the same stat from the array and hash forms] do
+    stat = Zookeeper::Stat.new(fields)
+    expect(stat).to be_exists
+    expect(stat.mzxid).to eq(7)
+    expect(stat.num_children).to eq(2)
+    expect(Zookeeper::Stat.new(stat.to_hash)).to eq(stat)
+    expect(Zookeeper::Stat.new(stat.to_hash).hash).to eq(stat.hash)
+  end
+
+  it %[should leave the fields that were not given as nil] do
+    stat = Zookeeper::Stat.new(:version => 3)
+    expect(stat).to be_exists
+    expect(stat.version).to eq(3)
+    expect(stat.mzxid).to be_nil
+    expect(stat.to_hash[:czxid]).to be_nil
+    expect(stat).not_to eq(Zookeeper::Stat.new(:version => 3, :mzxid => 0))
+    expect(Zookeeper::Stat.new(fields.first(4)).version).to be_nil
+  end
+
+  it %[should order by mzxid, then version] do
+    a = Zookeeper::Stat.new(fields)
+    b = Zookeeper::Stat.new(fields.dup.tap { |f| f[4] = 3 })
+    c = Zookeeper::Stat.new(fields.dup.tap { |f| f[1] = 8 })
+
+    expect([c, b, a].sort).to eq([a, b, c])
+    expect(Zookeeper::Stat.new(nil)).to be < a
+  end
+
+  it %[should return the argument from Stat.from if it is already a Stat] do
+    stat = Zookeeper::Stat.new(fields)
+    expect(Zookeeper::Stat.from(stat)).to equal(stat)
+    expect(Zookeeper::Stat.from(fields)).to eq(stat)
+  end
+end
@@ -0,0 +1,145 @@
+module Zookeeper
+  module SpecHelpers
+    # just enough of a client for the specs of what's built on top of one
+    # (BulkLoader, TreeDeleter, Pool): a Hash of path => data that the ops
+    # read and write, multis all or nothing, and a log of the ops that were
+    # called, in order.
+    #
+    # rc and multi_rc, when set, are what every op or every multi answers
+    # with instead, raises is an exception every op raises, and before_round
+    # is called as a pipeline is sent.
+    class FakeClient
+      include Zookeeper::Constants
+
+      PIPELINE_OPS = [:get, :stat, :get_children, :set, :create, :delete, :multi].freeze
+
+      # what a pipeline block is handed, ops are run when it's sent
+      class Pipeline
+        def initialize
+          @ops = []
+        end
+
+        attr_reader :ops
+
+        PIPELINE_OPS.each do |op|
+          define_method(op) { |options| @ops << [op, options] }
+        end
+      end
+
+      attr_reader :host, :nodes, :calls
+      attr_accessor :rc, :multi_rc, :raises, :before_round, :connected, :outstanding, :state
+
+      def initialize(host = 'localhost:2181', nodes = { '/' => nil })
+        @host, @nodes, @calls = host, nodes.dup, []
+        @connected, @outstanding, @state = true, 0, ZOO_CONNECTED_STATE
+      end
+
+      def connected?;    @connected; end
+      def closed?;       false; end
+      def close;         @connected = false; end
+      def session_id;    object_id; end
+      def request_stats; { :outstanding => @outstanding }; end
+      def reopen(*);     @state = ZOO_CONNECTED_STATE; @connected = true; end
+
+      def add_auth(options)
+        @calls << :add_auth
+        { :rc => rc || ZOK }
+      end
+
+      PIPELINE_OPS.each do |op|
+        define_method(op) do |options|
+          @calls << op
+          raise raises if raises
+          rc ? { :rc => rc } : __send__("run_#{op}", options)
+        end
+      end
+
+      def pipeline
+        p = Pipeline.new
+        yield p
+
+        before_round.call if before_round
+        p.ops.map { |op, options| __send__(op, options) }
+      end
+
+      # yields the nodes under options[:path] breadth first, without data
+      def get_tree(options)
+        root = options[:path]
+        return { :rc => ZNONODE } unless @nodes.has_key?(root)
+
+        level = [root]
+        until level.empty?
+          level.each { |path| yield path, nil, nil }
+          level = level.flat_map { |path| children(path) }
+        end
+
+        { :rc => ZOK }
+      end
+
+      def children(path)
+        @nodes.keys.select { |n| n != path and File.dirname(n) == path }
+      end
+
+      private
+        def run_get(options)
+          return { :rc => ZNONODE } unless @nodes.has_key?(options[:path])
+          { :rc => ZOK, :data => @nodes[options[:path]], :stat => nil }
+        end
+
+        def run_stat(options)
+          { :rc => @nodes.has_key?(options[:path]) ? ZOK : ZNONODE, :stat => nil }
+        end
+
+        def run_get_children(options)
+          return { :rc => ZNONODE } unless @nodes.has_key?(options[:path])
+          { :rc => ZOK, :children => children(options[:path]).map { |n| File.basename(n) }, :stat => nil }
+        end
+
+        def run_set(options)
+          { :rc => write(:set, options) }
+        end
+
+        def run_create(options)
+          { :rc => write(:create, options) }
+        end
+
+        def run_delete(options)
+          { :rc => write(:delete, options) }
+        end
+
+        def run_multi(options)
+          return { :rc => multi_rc, :results => nil } if multi_rc
+
+          before = @nodes.dup
+          rcs = options[:ops].map { |op, o| write(op, o) }
+
+          failed = rcs.index { |rc| rc != ZOK }
+          return { :rc => ZOK, :results => rcs.map { |rc| Struct.new(:rc).new(rc) } } unless failed
+
+          @nodes = before
+          results = rcs.each_with_index.map { |rc, i| i < failed ? ZOK : (i == failed ? rc : ZRUNTIMEINCONSISTENCY) }
+          { :rc => rcs[failed], :results => results.map { |rc| Struct.new(:rc).new(rc) } }
+        end
+
+        def write(op, options)
+          path = options[:path]
+
+          case op
+          when :set
+            return ZNONODE unless @nodes.has_key?(path)
+          when :delete
+            return ZNONODE unless @nodes.has_key?(path)
+            return ZNOTEMPTY unless children(path).empty?
+            @nodes.delete(path)
+            return ZOK
+          else
+            return ZNODEEXISTS if @nodes.has_key?(path)
+            return ZNONODE unless @nodes.has_key?(File.dirname(path))
+          end
+
+          @nodes[path] = options[:data]
+          ZOK
+        end
+    end
+  end
+end
@@ -0,0 +1,60 @@
+require 'spec_helper'
+
+describe Zookeeper::TimerWheel do
+  subject { described_class.new(0.01, 8) }
+
+  it %[should expire an entry once its deadline has passed, not before] do
+    subject.add(:a, 1.0)
+
+    expect(subject.expire(0.99)).to eq([])
+    expect(subject.expire(1.0)).to eq([:a])
+    expect(subject.expire(2.0)).to eq([])
+    expect(subject).to be_empty
+  end
+
+  it %[should expire everything that's overdue in one call] do
+    subject.add(:a, 0.5)
+    subject.add(:b, 0.75)
+    subject.add(:c, 3.0)
+
+    expect(subject.expire(1.0)).to match_array([:a, :b])
+    expect(subject.size).to eq(1)
+  end
+
+  it %[should keep entries more than a turn away until their turn comes] do
+    # 8 slots of 10ms, so 0.05 and 0.13 share a slot
+    subject.add(:near, 0.05)
+    subject.add(:far, 0.13)
+
+    expect(subject.expire(0.06)).to eq([:near])
+    expect(subject.expire(0.12)).to eq([])
+    expect(subject.expire(0.13)).to eq([:far])
+  end
+
+  it %[should not expire deleted entries] do
+    handle = subject.add(:a, 1.0)
+    subject.add(:b, 1.0)
+
+    expect(subject.delete(:a, handle)).to be(true)
+    expect(subject.delete(:a, handle)).to be(false)
+    expect(subject.expire(1.0)).to eq([:b])
+  end
+
+  it %[should expire a deadline that has already passed on the next call] do
+    subject.expire(5.0)
+    subject.add(:a, 1.0)
+
+    expect(subject.expire(5.1)).to eq([:a])
+  end
+
+  it %[should never report the next deadline later than the first entry] do
+    expect(subject.next_deadline).to be_nil
+
+    subject.add(:a, 0.5)
+    subject.add(:b, 0.3)
+
+    expect(subject.next_deadline).to be <= 0.3
+    subject.expire(0.3)
+    expect(subject.next_deadline).to be <= 0.5
+  end
+end
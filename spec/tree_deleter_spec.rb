@@ -0,0 +1,130 @@
+require 'spec_helper'
+require 'shared/connection_examples'
+
+describe Zookeeper::TreeDeleter do
+  include Zookeeper::Constants
+
+  let(:paths) { ['/t'] + (0...4).flat_map { |i| ["/t/a#{i}"] + (0...5).map { |j| "/t/a#{i}/b#{j}" } } }
+  let(:zk) { Zookeeper::SpecHelpers::FakeClient.new('localhost:2181', Hash[paths.map { |path| [path, nil] }]) }
+
+  def delete_tree(opts = {}, &block)
+    described_class.new(zk, '/t', { :batch_size => 4, :concurrency => 2 }.merge(opts), &block).run
+  end
+
+  it %[should delete every node, deepest first, in multis] do
+    rv = delete_tree
+
+    expect(rv[:rc]).to eq(ZOK)
+    expect(rv[:deleted]).to eq(paths.length)
+    expect(rv[:found]).to eq(paths.length)
+    expect(rv[:passes]).to eq(1)
+    expect(zk.nodes).to be_empty
+    expect(zk.calls).to eq([:multi] * 6 + [:delete])    # the last one is just /t
+  end
+
+  it %[should report progress after every round] do
+    seen = []
+    delete_tree { |progress| seen << progress[:deleted] }
+
+    expect(seen.length).to eq(4)    # 25 nodes, 7 multis, 2 at a time
+    expect(seen.last).to eq(paths.length)
+  end
+
+  it %[should return ZNONODE if there's nothing to delete] do
+    zk.nodes.clear
+    expect(delete_tree[:rc]).to eq(ZNONODE)
+  end
+
+  it %[should skip the nodes someone else deleted] do
+    zk.before_round = lambda { zk.nodes.delete('/t/a3/b4'); zk.nodes.delete('/t/a0/b0') }
+    rv = delete_tree
+
+    expect(rv[:rc]).to eq(ZOK)
+    expect(rv[:vanished]).to eq(2)
+    expect(rv[:deleted]).to eq(paths.length - 2)
+    expect(zk.nodes).to be_empty
+  end
+
+  it %[should walk the tree again for nodes added while deleting] do
+    added = false
+    zk.before_round = lambda { zk.nodes['/t/a0/new'] = nil unless added; added = true }
+    rv = delete_tree
+
+    expect(rv[:rc]).to eq(ZOK)
+    expect(rv[:passes]).to eq(2)
+    expect(zk.nodes).to be_empty
+  end
+
+  it %[should give up with ZNOTEMPTY after :max_passes] do
+    n = 0
+    zk.before_round = lambda { zk.nodes["/t/a0/new#{n += 1}"] = nil }
+    rv = delete_tree(:max_passes => 2)
+
+    expect(rv[:rc]).to eq(ZNOTEMPTY)
+    expect(rv[:passes]).to eq(2)
+  end
+
+  it %[should delete one node at a time if there's no multi] do
+    zk.multi_rc = ZUNIMPLEMENTED
+    rv = delete_tree
+
+    expect(rv[:rc]).to eq(ZOK)
+    expect(zk.nodes).to be_empty
+    expect(zk.calls.count(:delete)).to eq(paths.length)
+  end
+
+  it %[should stop at any other error] do
+    zk.multi_rc = ZCONNECTIONLOSS
+    expect(delete_tree[:rc]).to eq(ZCONNECTIONLOSS)
+  end
+
+  it %[should raise BadArguments for a bad :batch_size] do
+    expect { delete_tree(:batch_size => 0) }.to raise_error(Zookeeper::Exceptions::BadArguments)
+  end
+end
+
+describe 'Zookeeper::TreeDeleter against a server' do
+  let(:path) { "/_zktest_" }
+  let(:data) { "underpants" }
+  let(:connection_string) { Zookeeper.default_cnx_str }
+
+  before do
+    @zk = Zookeeper.new(connection_string)
+  end
+
+  after do
+    @zk and @zk.close
+  end
+
+  def zk
+    @zk
+  end
+
+  it_should_behave_like "connection"
+
+  describe 'in multis' do
+    before do
+      ensure_node(zk, path, data)
+
+      zk.create(:path => "#{path}/gone")
+      4.times do |i|
+        zk.create(:path => "#{path}/gone/#{i}")
+        2.times { |j| zk.create(:path => "#{path}/gone/#{i}/#{j}") }
+      end
+    end
+
+    after do
+      rm_rf(zk, "#{path}/gone")
+    end
+
+    it %[should delete the tree, deepest first, in multis of :batch_size] do
+      rv = Zookeeper::TreeDeleter.new(zk, "#{path}/gone", :batch_size => 3, :concurrency => 2).run
+
+      expect(rv[:rc]).to eq(Zookeeper::ZOK)
+      expect(rv[:deleted]).to eq(13)
+      expect(rv[:passes]).to eq(1)
+      expect(zk.stat(:path => "#{path}/gone")[:stat]).not_to be_exists
+      expect(zk.stat(:path => path)[:stat]).to be_exists
+    end
+  end
+end
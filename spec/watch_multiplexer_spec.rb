@@ -0,0 +1,82 @@
+require 'spec_helper'
+
+describe Zookeeper::WatchMultiplexer do
+  include Zookeeper::Constants
+
+  subject { described_class.new }
+
+  def read(req_id, meth = :get, path = '/path')
+    Zookeeper::Continuation.new(meth, req_id, path, nil, true).tap do |cntn|
+      subject.prepare(cntn)
+    end
+  end
+
+  def changed(req_id)
+    subject.fire(req_id, :type => ZOO_CHANGED_EVENT, :state => ZOO_CONNECTED_STATE, :path => '/path')
+  end
+
+  it %[should send the first watched read with its watch] do
+    expect(read(1).watch_dropped?).to be(false)
+  end
+
+  it %[should have the reads that come once the watch is set share it] do
+    read(1)
+    subject.completed(1, ZOK)
+
+    expect(read(2).watch_dropped?).to be(true)
+    expect(read(3, :exists).watch_dropped?).to be(true)
+    expect(read(4, :get_children).watch_dropped?).to be(false)
+    expect(subject.subscribers).to eq('/path' => { :data => 3, :child => 0 })
+  end
+
+  it %[should deliver the event to every subscriber, once] do
+    read(1)
+    subject.completed(1, ZOK)
+    read(2)
+    read(3)
+
+    expect(changed(1)).to eq([2, 3])
+    expect(changed(1)).to eq([])
+    expect(subject.subscribers).to eq({})
+  end
+
+  it %[should not count a watch the server didn't set] do
+    read(1)
+    subject.completed(1, ZNONODE)
+
+    expect(read(2).watch_dropped?).to be(false)
+  end
+
+  it %[should count the watch an exists on a missing node sets] do
+    read(1, :exists)
+    subject.completed(1, ZNONODE)
+
+    expect(read(2, :exists).watch_dropped?).to be(true)
+  end
+
+  it %[should drop a subscriber whose read wouldn't have set a watch] do
+    read(1, :exists)
+    subject.completed(1, ZNONODE)
+    read(2)
+    subject.completed(2, ZNONODE)
+
+    expect(changed(1)).to eq([])
+  end
+
+  it %[should pass session events on without using the watch up] do
+    read(1)
+    subject.completed(1, ZOK)
+    read(2)
+
+    expect(subject.fire(1, :type => ZOO_SESSION_EVENT, :state => ZOO_CONNECTING_STATE)).to eq([2])
+    expect(changed(1)).to eq([2])
+  end
+
+  it %[should share the watch with the reads that joined the one that set it] do
+    read(1)
+    follower = Zookeeper::Continuation.new(:get, 2, '/path', nil, true)
+    subject.completed(1, ZOK, [follower])
+
+    expect(changed(1)).to eq([2])
+  end
+end